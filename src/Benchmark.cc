@@ -0,0 +1,554 @@
+/*
+    IIP Server: micro-benchmarks for our hot paths
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Standalone benchmark program built by "make bench". Each benchmark is run
+   repeatedly for a fixed time and one JSON object is printed per benchmark
+   on its own line, giving the number of operations, throughput and latency
+   percentiles per operation in microseconds. Very fast operations, such as
+   cache lookups, are timed in batches and the per operation time within each
+   batch used for the percentiles.
+
+   Usage: iipsrv_bench [-t seconds] [-m match] [image.tif|image.jp2|image.jpg ...]
+
+   -t   time to spend on each benchmark in seconds (default 1)
+   -m   only run benchmarks whose name contains this string
+
+   Image decoding and region benchmarks are only run for the images given.
+   JPEG2000 images are decoded with each JPEG2000 decoder built in, so that
+   Kakadu and OpenJPEG can be compared on the same files.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include "RawTile.h"
+#include "Cache.h"
+#include "TPTImage.h"
+#include "JPEGImage.h"
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
+#ifdef HAVE_OPENJPEG
+#include "OpenJPEGImage.h"
+#endif
+#include "JPEGCompressor.h"
+#include "TileManager.h"
+#include "Transforms.h"
+#include "Timer.h"
+
+
+using namespace std;
+
+
+// Needed by any image decoders which log directly
+ofstream logfile;
+
+
+// Benchmark settings
+static double bench_time = 1.0;
+static string bench_match;
+
+
+
+/// Simple xorshift random number generator so that runs are repeatable
+class Random {
+  unsigned int state;
+ public:
+  Random( unsigned int seed = 2463534242u ) : state( seed ) {};
+  unsigned int next(){
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  };
+  /// Uniform value in [0,1)
+  double uniform(){ return (next() >> 8) / 16777216.0; };
+};
+
+
+
+/// Zipf distributed key generator using an inverted cumulative distribution
+class Zipf {
+  vector<double> cdf;
+  Random& random;
+ public:
+  Zipf( unsigned int n, double s, Random& r ) : random( r ) {
+    cdf.resize( n );
+    double sum = 0;
+    for( unsigned int i = 0; i < n; i++ ){
+      sum += 1.0 / pow( (double)(i+1), s );
+      cdf[i] = sum;
+    }
+    for( unsigned int i = 0; i < n; i++ ) cdf[i] /= sum;
+  };
+  unsigned int next(){
+    return lower_bound( cdf.begin(), cdf.end(), random.uniform() ) - cdf.begin();
+  };
+};
+
+
+
+/// Collects timings for a benchmark and prints a summary
+class Result {
+
+  string name;
+  vector<double> samples;
+  double total;
+  unsigned long ops;
+  unsigned long long bytes;
+
+ public:
+
+  Result( const string& n ) : name( n ), total( 0 ), ops( 0 ), bytes( 0 ) {};
+
+  /// Record a batch of operations
+  /** @param microseconds time taken for the whole batch
+      @param n number of operations in the batch
+      @param b number of bytes processed by the batch
+   */
+  void add( long microseconds, unsigned int n = 1, unsigned long b = 0 ){
+    samples.push_back( (double) microseconds / n );
+    total += microseconds;
+    ops += n;
+    bytes += b;
+  };
+
+  /// Whether we have run for long enough
+  bool done(){ return total >= bench_time * 1000000.0 && samples.size() >= 5; };
+
+  double percentile( double p ){
+    if( samples.empty() ) return 0;
+    size_t i = (size_t)( p * (samples.size()-1) + 0.5 );
+    return samples[i];
+  };
+
+  /// Print our results as a single line of JSON
+  void print(){
+    sort( samples.begin(), samples.end() );
+    double seconds = total / 1000000.0;
+    printf( "{\"benchmark\":\"%s\",\"operations\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+	    "\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+	    name.c_str(), ops, seconds,
+	    (seconds > 0) ? ops / seconds : 0.0,
+	    (seconds > 0) ? bytes / seconds / 1048576.0 : 0.0,
+	    (ops > 0) ? total / ops : 0.0,
+	    percentile( 0.5 ), percentile( 0.9 ), percentile( 0.99 ),
+	    samples.empty() ? 0.0 : samples.back() );
+    fflush( stdout );
+  };
+
+};
+
+
+
+/// Whether a benchmark has been selected with -m
+static bool selected( const string& name ){
+  return bench_match.empty() || name.find( bench_match ) != string::npos;
+}
+
+
+
+/// Create a synthetic tile with smooth gradients and some noise so that it compresses realistically
+static RawTile makeTile( unsigned int w, unsigned int h, int channels, int bpc, SampleType type = FIXEDPOINT ){
+
+  RawTile tile( 0, 0, 0, 0, w, h, channels, bpc );
+  tile.sampleType = type;
+  unsigned long np = (unsigned long) w * h * channels;
+  tile.dataLength = np * bpc / 8;
+
+  Random random;
+  double max = (bpc == 8) ? 255.0 : (bpc == 16) ? 65535.0 : 1.0;
+
+  if( bpc == 8 ) tile.data = new unsigned char[np];
+  else if( bpc == 16 ) tile.data = new unsigned short[np];
+  else if( type == FLOATINGPOINT ) tile.data = new float[np];
+  else{
+    tile.data = new unsigned int[np];
+    max = 4294967295.0;
+  }
+
+  for( unsigned int j = 0; j < h; j++ ){
+    for( unsigned int i = 0; i < w; i++ ){
+      for( int k = 0; k < channels; k++ ){
+	double v = ( (double)(i+j*(k+1)) / (w+h*channels) ) * 0.9 + random.uniform() * 0.1;
+	unsigned long n = ((unsigned long) j*w + i)*channels + k;
+	if( bpc == 8 ) ((unsigned char*)tile.data)[n] = (unsigned char)( v * max );
+	else if( bpc == 16 ) ((unsigned short*)tile.data)[n] = (unsigned short)( v * max );
+	else if( type == FLOATINGPOINT ) ((float*)tile.data)[n] = (float) v;
+	else ((unsigned int*)tile.data)[n] = (unsigned int)( v * max );
+      }
+    }
+  }
+
+  return tile;
+}
+
+
+
+/// Convert a tile to normalized floating point as CVT does before applying its float filters
+static void normalize( RawTile& tile ){
+  double max = (tile.bpc == 8) ? 255.0 : (tile.bpc == 16) ? 65535.0 : (tile.sampleType == FLOATINGPOINT) ? 1.0 : 4294967295.0;
+  vector<float> maxs( tile.channels, (float) max ), mins( tile.channels, 0.0f );
+  filter_normalize( tile, maxs, mins );
+}
+
+
+
+/// Cache insertion and lookup with sequential, uniform and Zipf distributed keys
+static void benchCache(){
+
+  const unsigned int keys = 20000;
+  const unsigned int batch = 1000;
+  const char* distributions[] = { "sequential", "uniform", "zipf" };
+
+  // Encoded tile of a typical size
+  RawTile tile = makeTile( 64, 48, 1, 8 );
+  tile.compressionType = JPEG;
+  tile.quality = 75;
+  tile.filename = "/images/benchmark.tif";
+
+  for( int d = 0; d < 3; d++ ){
+
+    string dist = distributions[d];
+    Random random;
+    Zipf zipf( keys, 1.0, random );
+    unsigned int sequence = 0;
+
+    // Cache large enough for around a quarter of our keys
+    float size = keys * tile.dataLength / 4.0 / 1024000.0;
+
+    string name = "cache_insert/" + dist;
+    if( selected( name ) ){
+      Cache cache( size, 0 );
+      Result result( name );
+      Timer timer;
+      while( !result.done() ){
+	timer.start();
+	for( unsigned int i = 0; i < batch; i++ ){
+	  unsigned int k = (d == 0) ? sequence++ % keys : (d == 1) ? random.next() % keys : zipf.next();
+	  tile.tileNum = k;
+	  cache.insert( tile );
+	}
+	result.add( timer.getTime(), batch, (unsigned long) batch * tile.dataLength );
+      }
+      result.print();
+    }
+
+    name = "cache_lookup/" + dist;
+    if( selected( name ) ){
+      // Insert in reverse so that the most popular Zipf keys are the ones held
+      Cache cache( size, 0 );
+      for( unsigned int k = keys; k > 0; k-- ){
+	tile.tileNum = k-1;
+	cache.insert( tile );
+      }
+      Result result( name );
+      Timer timer;
+      RawTile out;
+      while( !result.done() ){
+	unsigned long bytes = 0;
+	timer.start();
+	for( unsigned int i = 0; i < batch; i++ ){
+	  unsigned int k = (d == 0) ? sequence++ % keys : (d == 1) ? random.next() % keys : zipf.next();
+	  if( cache.getTile( tile.filename, 0, k, 0, 0, JPEG, 75, out ) ) bytes += out.dataLength;
+	}
+	result.add( timer.getTime(), batch, bytes );
+      }
+      result.print();
+    }
+  }
+}
+
+
+
+/// JPEG compression of whole tiles and of CVT sized images in strips
+static void benchJPEG(){
+
+  JPEGCompressor jpeg( 75 );
+
+  const int channels[] = { 1, 3 };
+  for( int c = 0; c < 2; c++ ){
+
+    char name[64];
+    snprintf( name, 64, "jpeg_compress/256x256x%d", channels[c] );
+    if( selected( name ) ){
+      RawTile source = makeTile( 256, 256, channels[c], 8 );
+      Result result( name );
+      Timer timer;
+      while( !result.done() ){
+	RawTile tile( source );
+	timer.start();
+	jpeg.Compress( tile );
+	result.add( timer.getTime(), 1, source.dataLength );
+      }
+      result.print();
+    }
+
+    snprintf( name, 64, "jpeg_strips/1024x768x%d", channels[c] );
+    if( selected( name ) ){
+      RawTile image = makeTile( 1024, 768, channels[c], 8 );
+      unsigned int strip_height = 128;
+      unsigned char* output = new unsigned char[image.width*image.channels*strip_height+65636];
+      Result result( name );
+      Timer timer;
+      while( !result.done() ){
+	timer.start();
+	jpeg.InitCompression( image, image.height );
+	for( unsigned int y = 0; y < image.height; y += strip_height ){
+	  unsigned int h = ( y + strip_height > image.height ) ? image.height - y : strip_height;
+	  jpeg.CompressStrip( &((unsigned char*)image.data)[y*image.width*image.channels], output, h );
+	}
+	jpeg.Finish( output );
+	result.add( timer.getTime(), 1, image.dataLength );
+      }
+      delete[] output;
+      result.print();
+    }
+  }
+}
+
+
+
+/// Run a single filter benchmark on fresh copies of a source tile
+/** @param name benchmark name
+    @param source input tile
+    @param filter index of filter to apply
+    @param prepare whether to first convert to normalized float as CVT does, which is not timed
+ */
+static void runFilter( const string& name, const RawTile& source, int filter, bool prepare ){
+
+  if( !selected( name ) ) return;
+
+  vector< vector<float> > ctw( 3, vector<float>( 3, 0.2f ) );
+  Result result( name );
+  Timer timer;
+
+  while( !result.done() ){
+    RawTile tile( source );
+    if( prepare && filter != 0 ) normalize( tile );
+    timer.start();
+    switch( filter ){
+      case 0: normalize( tile ); break;
+      case 1: filter_gamma( tile, 0.8 ); break;
+      case 2: filter_inv( tile ); break;
+      case 3: filter_cmap( tile, JET ); break;
+      case 4: filter_contrast( tile, 1.5 ); break;
+      case 5: filter_twist( tile, ctw ); break;
+      case 6: filter_interpolate_nearestneighbour( tile, 384, 384 ); break;
+      case 7: filter_interpolate_bilinear( tile, 384, 384 ); break;
+      case 8: filter_rotate( tile, 90 ); break;
+      case 9: filter_greyscale( tile ); break;
+      case 10: filter_flip( tile, 2 ); break;
+      case 11: filter_flatten( tile, 1 ); break;
+      case 12: filter_LAB2sRGB( tile ); break;
+    }
+    result.add( timer.getTime(), 1, source.dataLength );
+  }
+  result.print();
+}
+
+
+
+/// Image processing filters at each input bit depth
+static void benchFilters(){
+
+  const unsigned int size = 512;
+
+  // Filters working on normalized float data, whatever the source bit depth
+  const char* float_filters[] = { "normalize", "gamma", "inv", "cmap", "contrast", "twist" };
+  const int bits[] = { 8, 16, 32 };
+
+  for( int b = 0; b < 3; b++ ){
+    SampleType type = (bits[b] == 32) ? FLOATINGPOINT : FIXEDPOINT;
+    for( int c = 1; c <= 3; c += 2 ){
+      RawTile source = makeTile( size, size, c, bits[b], type );
+      for( int f = 0; f < 6; f++ ){
+	// Colormaps only apply to single channel and colour twists to 3 channel images
+	if( (f == 3 && c != 1) || (f == 5 && c != 3) ) continue;
+	char name[64];
+	snprintf( name, 64, "filter_%s/%dbit/%dch", float_filters[f], bits[b], c );
+	runFilter( name, source, f, true );
+      }
+    }
+  }
+
+  // Filters applied after conversion to 8 bit output
+  const char* byte_filters[] = { "interpolate_nearestneighbour", "interpolate_bilinear", "rotate", "greyscale",
+				 "flip", "flatten", "lab2srgb" };
+  RawTile source = makeTile( size, size, 3, 8 );
+  for( int f = 0; f < 7; f++ ){
+    char name[64];
+    snprintf( name, 64, "filter_%s/8bit/3ch", byte_filters[f] );
+    runFilter( name, source, f+6, false );
+  }
+}
+
+
+
+/// Raw tile decoding and region assembly with a particular image decoder
+/** @param image opened image
+    @param label benchmark name for this image and decoder
+    @param prefix tile decoding benchmark prefix
+ */
+static void benchDecoder( IIPImage& image, const string& label, const string& prefix ){
+
+  unsigned int numResolutions = image.getNumResolutions();
+  unsigned int tw = image.getTileWidth();
+  unsigned int th = image.getTileHeight();
+
+  // Decode every tile in turn at the two highest resolutions stored in the image
+  unsigned int first = ( numResolutions > 2 ) ? numResolutions-2 : 0;
+  first = std::max( first, image.getSynthesizedLevels() );
+  for( unsigned int r = first; r < numResolutions; r++ ){
+    string name = prefix + "_getTile/" + label + "/r" + string( 1, '0' + (r % 10) );
+    if( !selected( name ) ) continue;
+    unsigned int w = image.getImageWidth( numResolutions-1-r );
+    unsigned int h = image.getImageHeight( numResolutions-1-r );
+    unsigned int ntiles = ( (w + tw - 1) / tw ) * ( (h + th - 1) / th );
+    Result result( name );
+    Timer timer;
+    unsigned int t = 0;
+    while( !result.done() ){
+      timer.start();
+      RawTile tile = image.getTile( 0, 0, r, -1, t );
+      result.add( timer.getTime(), 1, tile.dataLength );
+      t = (t + 1) % ntiles;
+    }
+    result.print();
+  }
+
+  // Typical CVT region sizes taken from the centre of the full resolution image,
+  // without a tile cache so that every tile is decoded
+  const unsigned int regions[][2] = { { 256, 256 }, { 512, 512 }, { 1024, 768 }, { 2048, 2048 } };
+  unsigned int r = numResolutions - 1;
+  unsigned int w = image.getImageWidth( 0 );
+  unsigned int h = image.getImageHeight( 0 );
+
+  Cache cache( 0 );
+  JPEGCompressor jpeg( 75 );
+  TileManager manager( &cache, &image, NULL, &jpeg, &logfile, 0 );
+
+  for( int n = 0; n < 4; n++ ){
+    unsigned int rw = regions[n][0], rh = regions[n][1];
+    if( rw > w || rh > h ) continue;
+    char name[128];
+    snprintf( name, 128, "getRegion/%s/%ux%u", label.c_str(), rw, rh );
+    if( !selected( name ) ) continue;
+    Result result( name );
+    Timer timer;
+    while( !result.done() ){
+      timer.start();
+      RawTile region = manager.getRegion( r, 0, 0, -1, (w-rw)/2, (h-rh)/2, rw, rh );
+      result.add( timer.getTime(), 1, region.dataLength );
+    }
+    result.print();
+  }
+}
+
+
+
+/// Benchmark an image with each decoder able to read it
+static void benchImage( const string& path ){
+
+  // Name benchmarks after the image file rather than the full path
+  string base = path.substr( path.find_last_of( '/' ) + 1 );
+
+  IIPImage test( path );
+  try{
+    test.Initialise();
+  }
+  catch( const file_error& e ){
+    fprintf( stderr, "iipsrv_bench: %s\n", e.what() );
+    return;
+  }
+
+  if( test.getImageFormat() == TIF ){
+    TPTImage image( test );
+    image.openImage();
+    benchDecoder( image, base, "tpt" );
+    image.closeImage();
+  }
+  else if( test.getImageFormat() == JPG ){
+    JPEGImage image( test );
+    image.openImage();
+    benchDecoder( image, base, "jpeg" );
+    image.closeImage();
+  }
+  else if( test.getImageFormat() == JPEG2000 ){
+#ifdef HAVE_KAKADU
+    KakaduImage kakadu( test );
+    kakadu.openImage();
+    benchDecoder( kakadu, "kakadu/" + base, "kakadu" );
+    kakadu.closeImage();
+#endif
+#ifdef HAVE_OPENJPEG
+    OpenJPEGImage openjpeg( test );
+    openjpeg.openImage();
+    benchDecoder( openjpeg, "openjpeg/" + base, "openjpeg" );
+    openjpeg.closeImage();
+#endif
+  }
+  else fprintf( stderr, "iipsrv_bench: no decoder available for %s\n", path.c_str() );
+}
+
+
+
+int main( int argc, char* argv[] ){
+
+  vector<string> images;
+
+  for( int i = 1; i < argc; i++ ){
+    string arg = argv[i];
+    if( arg == "-t" && i+1 < argc ) bench_time = atof( argv[++i] );
+    else if( arg == "-m" && i+1 < argc ) bench_match = argv[++i];
+    else if( arg == "-h" || arg == "--help" ){
+      fprintf( stderr, "Usage: %s [-t seconds] [-m match] [image.tif|image.jp2|image.jpg ...]\n", argv[0] );
+      return 0;
+    }
+    else images.push_back( arg );
+  }
+
+  if( bench_time <= 0 ) bench_time = 1.0;
+
+  try{
+    benchCache();
+    benchJPEG();
+    benchFilters();
+    for( vector<string>::const_iterator i = images.begin(); i != images.end(); ++i ) benchImage( *i );
+  }
+  catch( const string& error ){
+    fprintf( stderr, "iipsrv_bench: %s\n", error.c_str() );
+    return 1;
+  }
+  catch( const file_error& error ){
+    fprintf( stderr, "iipsrv_bench: %s\n", error.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -141,6 +141,7 @@ void CVT::send( Session* session ){
 	    "Server: iipsrv/%s\r\n"
 	    "X-Powered-By: IIPImage\r\n"
 	    "%s\r\n"
+	    "%s"
 	    "Last-Modified: %s\r\n"
 	    "Content-Type: image/jpeg\r\n"
 	    "Content-Disposition: inline;filename=\"%s.jpg\"\r\n"
@@ -148,7 +149,7 @@ void CVT::send( Session* session ){
 	    "Transfer-Encoding: chunked\r\n"
 #endif
 	    "\r\n",
-	    VERSION, session->response->getCacheControl().c_str(), (*session->image)->getTimestamp().c_str(), basename.c_str() );
+	    VERSION, session->response->getCacheControl().c_str(), session->response->getETag().c_str(), (*session->image)->getTimestamp().c_str(), basename.c_str() );
 
   session->out->printf( (const char*) str );
 #endif
@@ -156,11 +157,15 @@ void CVT::send( Session* session ){
 
   // Get our requested region from our TileManager
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setTrace( session->trace );
   RawTile complete_image = tilemanager.getRegion( requested_res,
 						  session->view->xangle, session->view->yangle,
 						  session->view->getLayers(),
 						  view_left, view_top, view_width, view_height );
 
+  // Time our image processing
+  Timer filter_timer;
+  filter_timer.start();
 
 
   // Convert CIELAB to sRGB
@@ -348,6 +353,17 @@ void CVT::send( Session* session ){
 
 
 
+  long filter_time = filter_timer.getTime();
+  metrics.observe( Metrics::FILTER, filter_time );
+  if( session->trace ) session->trace->add( "filter", session->trace->now() - filter_time, filter_time );
+
+
+  // Time our compression, excluding the time taken to send data
+  Timer encode_timer;
+  long encode_time = 0;
+  long encode_start = session->trace ? session->trace->now() : 0;
+  encode_timer.start();
+
   // Initialise our JPEG compression object
   session->jpeg->InitCompression( complete_image, resampled_height );
 
@@ -358,6 +374,7 @@ void CVT::send( Session* session ){
   }
 
   len = session->jpeg->getHeaderSize();
+  encode_time += encode_timer.getTime();
 
 #ifdef CHUNKED
   snprintf( str, 1024, "%X\r\n", len );
@@ -404,7 +421,9 @@ void CVT::send( Session* session ){
     }
 
     // Compress the strip
+    encode_timer.start();
     len = session->jpeg->CompressStrip( input, output, strip_height );
+    encode_time += encode_timer.getTime();
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
@@ -439,7 +458,11 @@ void CVT::send( Session* session ){
   }
 
   // Finish off the image compression
+  encode_timer.start();
   len = session->jpeg->Finish( output );
+  encode_time += encode_timer.getTime();
+  metrics.observe( Metrics::ENCODE, encode_time );
+  if( session->trace ) session->trace->add( "encode", encode_start, encode_time );
 
 #ifdef CHUNKED
   snprintf( str, 1024, "%X\r\n", len );
@@ -469,6 +492,9 @@ void CVT::send( Session* session ){
     }
   }
 
+  // Everything since we started encoding, other than the encoding itself, was spent sending
+  if( session->trace ) session->trace->add( "write", encode_start, session->trace->now() - encode_start - encode_time );
+
   // Inform our response object that we have sent something to the client
   session->response->setImageSent();
 
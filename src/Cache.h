@@ -79,29 +79,92 @@ namespace __gnu_cxx {
 
 
 
+#include <algorithm>
 #include <iostream>
 #include <list>
 #include <string>
+#include <vector>
 #include "RawTile.h"
+#include "Mutex.h"
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+#include <malloc.h>
+#endif
+#include "FrequencySketch.h"
+#include "Metrics.h"
+
+
+
+/// Interface to a second level tile store, which is consulted on cache misses
+class TileStore {
+
+ public:
+
+  virtual ~TileStore() {};
+
+  /// Get a tile from the store
+  /** @param key tile key as generated by Cache::getIndex()
+      @param tile empty RawTile into which the tile is read
+      @return true if found
+   */
+  virtual bool get( const std::string& key, RawTile& tile ) = 0;
+
+  /// Add a tile to the store
+  /** @param key tile key as generated by Cache::getIndex()
+      @param tile tile to be stored
+   */
+  virtual void put( const std::string& key, const RawTile& tile ) = 0;
+
+};
 
 
 
 /// Cache to store raw tile data
+/** All public functions are thread safe. Tiles are always copied in and out
+    of the cache, so that a tile obtained from the cache remains valid even if
+    it is subsequently evicted by another thread.
+
+    Encoded, uncompressed 8 bit and uncompressed high bit depth tiles are held in
+    separate pools, each with its own LRU list, byte budget and admission policy, so
+    that interactive tile requests and large analytical region requests do not evict
+    each other. A pool may grow beyond its budget into space left unused by the other
+    pools. Once the cache as a whole is full, tiles are evicted from whichever pool is
+    furthest over its budget, so a pool within its budget is never evicted by another.
+    Tiles decoded ahead of time by the prefetcher have their own byte budget until they
+    are first requested, beyond which the oldest of them are evicted first.
+    Sizes are calculated from the memory actually allocated, including allocator
+    overhead.
+ */
 
 class Cache {
 
 
+ public:
+
+  /// Tile pool types
+  enum PoolType { ENCODED = 0, RAW = 1, RAW_HIGH_BIT_DEPTH = 2, NUM_POOLS = 3 };
+
+
  private:
 
-  /// Basic object storage size
-  int tileSize;
+  /// Lock protecting our list and index
+  Mutex mutex;
+
+  /// Optional second level store
+  TileStore* store;
+
+  /// Whether TinyLFU admission is used by any pool
+  bool admission;
+
+  /// Access frequencies for admission
+  FrequencySketch sketch;
+
+  /// Statistics counters
+  unsigned long hits, misses, admitted, rejected;
 
   /// Max memory size in bytes
   unsigned long maxSize;
 
-  /// Current memory running total
-  unsigned long currentSize;
-
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
   typedef std::list < std::pair<const std::string,RawTile>,
@@ -125,12 +188,107 @@ class Cache {
 #endif
 
 
-  /// Main cache storage object
-  TileList tileList;
+  /// Tiles of one type, with their own LRU list, reserved byte budget and admission policy
+  struct Pool {
+    TileList tileList;
+    unsigned long maxSize;
+    unsigned long currentSize;
+    unsigned int numElements;
+    bool admission;
+  };
+
+  /// Our tile pools indexed by PoolType
+  Pool pools[NUM_POOLS];
 
-  /// Main Cache storage index object
+  /// Main Cache storage index object, shared by all pools
   TileMap tileMap;
 
+  /// Keys of prefetched tiles which have not yet been requested, most recent first
+  typedef std::list <std::string> PrefetchList;
+  PrefetchList prefetchList;
+
+  /// Index of our prefetched tiles
+  typedef HASHMAP < std::string, PrefetchList::iterator > PrefetchMap;
+  PrefetchMap prefetchMap;
+
+  /// Bytes used by unrequested prefetched tiles and the maximum they may use
+  unsigned long prefetchSize, prefetchMaxSize;
+
+
+  /// Get the pool in which a tile belongs
+  Pool& _pool( const RawTile& r ) {
+    if( r.compressionType != UNCOMPRESSED ) return pools[ENCODED];
+    return pools[ (r.bpc > 8) ? RAW_HIGH_BIT_DEPTH : RAW ];
+  }
+
+
+  /// Total size in bytes of all our pools
+  unsigned long _currentSize() {
+    unsigned long size = 0;
+    for( int i = 0; i < NUM_POOLS; i++ ) size += pools[i].currentSize;
+    return size;
+  }
+
+
+  /// Get the pool from which to evict: the one furthest over its budget
+  Pool& _victim() {
+    Pool* victim = &pools[0];
+    for( int i = 1; i < NUM_POOLS; i++ ){
+      if( pools[i].currentSize - std::min( pools[i].currentSize, pools[i].maxSize ) >
+	  victim->currentSize - std::min( victim->currentSize, victim->maxSize ) ) victim = &pools[i];
+    }
+    return *victim;
+  }
+
+
+  /// Size of the block actually reserved by the allocator for a request of n bytes
+  /** Assumes a dlmalloc style allocator, which adds a size word to each allocation,
+      aligns to two words and has a minimum chunk size of four words */
+  static unsigned long _allocated( unsigned long n ) {
+    const unsigned long word = sizeof(size_t);
+    unsigned long chunk = ( n + word + 2*word - 1 ) & ~( 2*word - 1 );
+    return ( chunk < 4*word ) ? 4*word : chunk;
+  }
+
+
+  /// Heap memory used by a string
+  static unsigned long _allocated( const std::string& s ) {
+#if defined(_GLIBCXX_USE_CXX11_ABI) && _GLIBCXX_USE_CXX11_ABI
+    // Short strings are stored within the string object itself
+    const char* object = reinterpret_cast<const char*>( &s );
+    bool local = ( s.data() >= object && s.data() < object + sizeof(std::string) );
+    return local ? 0 : _allocated( s.capacity() + 1 );
+#else
+    // Reference counted strings have a header of three words
+    return _allocated( s.capacity() + 1 + 3*sizeof(size_t) );
+#endif
+  }
+
+
+  /// Total memory used by a cache entry
+  /** Includes the tile data, the key and filename strings, the list node and the
+      index node with its own copy of the key, all including allocator overhead.
+      This must be calculated on the cached copy of the tile so that the same
+      value is obtained on insertion and removal.
+      @param key tile key as stored in the tile list
+      @param r cached tile
+      @param copy whether r is instead a tile about to be copied into the cache, in which
+             case its data will be reallocated with exactly dataLength bytes
+   */
+  static unsigned long _entrySize( const std::string& key, const RawTile& r, bool copy = false ) {
+    unsigned long size = _allocated( sizeof(std::pair<const std::string,RawTile>) + 2*sizeof(void*) ) +
+      _allocated( sizeof(std::pair<const std::string,List_Iter>) + 2*sizeof(void*) ) +
+      2*_allocated( key ) + _allocated( r.filename );
+    if( r.data && r.dataLength > 0 ){
+#ifdef HAVE_MALLOC_USABLE_SIZE
+      if( r.memoryManaged && !copy ) size += malloc_usable_size( r.data ) + sizeof(size_t);
+      else
+#endif
+      size += _allocated( r.dataLength );
+    }
+    return size;
+  }
+
 
   /// Internal touch function
   /** Touches a key in the Cache and makes it the most recently used
@@ -140,27 +298,110 @@ class Cache {
   TileMap::iterator _touch( const std::string &key ) {
     TileMap::iterator miter = tileMap.find( key );
     if( miter == tileMap.end() ) return miter;
-    // Move the found node to the head of the list.
+    // Move the found node to the head of its list.
+    TileList& tileList = this->_pool( miter->second->second ).tileList;
     tileList.splice( tileList.begin(), tileList, miter->second );
     return miter;
   }
 
 
+  /// Stop treating a tile as prefetched, as it has been requested or removed
+  /** @param miter Map_Iter that points to the tile */
+  void _promote( const TileMap::iterator &miter ) {
+    if( prefetchMap.empty() ) return;
+    PrefetchMap::iterator p = prefetchMap.find( miter->first );
+    if( p == prefetchMap.end() ) return;
+    prefetchSize -= _entrySize( miter->second->first, miter->second->second );
+    prefetchList.erase( p->second );
+    prefetchMap.erase( p );
+  }
+
+
   /// Interal remove function
   /**
    *  @param miter Map_Iter that points to the key to remove
    *  @warning miter is no longer usable after being passed to this function.
    */
   void _remove( const TileMap::iterator &miter ) {
+    this->_promote( miter );
+    Pool& pool = this->_pool( miter->second->second );
     // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
+    pool.currentSize -= _entrySize( miter->second->first, miter->second->second );
+    pool.numElements--;
+    pool.tileList.erase( miter->second );
     tileMap.erase( miter );
   }
 
 
+  /// Internal insert function. The cache must already be locked
+  /** @param key tile key
+      @param r tile to be inserted
+      @param admit whether to apply our pool's admission policy
+   */
+  void _insert( const std::string &key, const RawTile& r, bool admit = true ) {
+
+    // Touch the key, if it exists
+    TileMap::iterator miter = this->_touch( key );
+
+    // Check whether this tile exists in our cache
+    if( miter != tileMap.end() ){
+      // Check the timestamp and delete if necessary
+      if( miter->second->second.timestamp < r.timestamp ){
+	this->_remove( miter );
+      }
+      // If this index already exists and it is up to date, do nothing
+      else return;
+    }
+
+    Pool& pool = this->_pool( r );
+    TileList& tileList = pool.tileList;
+
+    // Don't flush the whole cache for a tile which could never fit
+    unsigned long size = _entrySize( key, r, true );
+    if( size > maxSize ) return;
+
+    // If this tile would take our pool over its budget and force an eviction, only admit it
+    // if it has been accessed more often than the tile which would be evicted first: the
+    // least recently used tile of whichever pool would then be furthest over its budget
+    if( admit && pool.admission && (pool.currentSize + size > pool.maxSize) &&
+	(this->_currentSize() + size > maxSize) ){
+      pool.currentSize += size;
+      TileList& victim = this->_victim().tileList;
+      pool.currentSize -= size;
+      if( !victim.empty() ){
+	if( sketch.frequency( key ) <= sketch.frequency( victim.back().first ) ){
+	  rejected++;
+	  return;
+	}
+	admitted++;
+      }
+    }
+
+    // Store the key if it doesn't already exist in our cache
+    // Ok, do the actual insert at the head of the list
+    tileList.push_front( std::make_pair(key,r) );
+
+    // And store this in our map
+    List_Iter liter = tileList.begin();
+    tileMap[ key ] = liter;
+
+    // Update our pool's running total using the copies we now hold
+    pool.currentSize += _entrySize( liter->first, liter->second );
+    pool.numElements++;
+
+    // Check to see if we need to remove elements due to exceeding our total size,
+    // taking them from the pools which have borrowed the most space
+    while( this->_currentSize() > maxSize ) {
+      // Remove the last element
+      TileList& victim = this->_victim().tileList;
+      liter = victim.end();
+      --liter;
+      this->_remove( liter->first );
+    }
+
+  }
+
+
   /// Interal remove function
   /** @param key to remove */
   void _remove( const std::string &key ) {
@@ -173,77 +414,238 @@ class Cache {
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
+  /** @param max Maximum cache size in MB
+      @param raw Size in MB of the part of the cache reserved for uncompressed tiles.
+             The remainder is reserved for encoded tiles. If negative, a quarter of the
+             cache is reserved for uncompressed tiles
+      @param high Size in MB of the part of the uncompressed budget reserved for
+             tiles of more than 8 bits per channel. If negative, none is reserved
+   */
+  Cache( float max, float raw = -1.0, float high = -1.0 ) {
+    maxSize = (unsigned long)(max*1024000);
+    unsigned long rawSize = (raw < 0) ? maxSize/4 : (unsigned long)(raw*1024000);
+    if( rawSize > maxSize ) rawSize = maxSize;
+    unsigned long highSize = (high < 0) ? 0 : (unsigned long)(high*1024000);
+    if( highSize > rawSize ) highSize = rawSize;
+    pools[ENCODED].maxSize = maxSize - rawSize;
+    pools[RAW].maxSize = rawSize - highSize;
+    pools[RAW_HIGH_BIT_DEPTH].maxSize = highSize;
+    for( int i = 0; i < NUM_POOLS; i++ ){
+      pools[i].currentSize = 0;
+      pools[i].numElements = 0;
+      pools[i].admission = false;
+    }
+    store = NULL;
+    admission = false;
+    hits = misses = admitted = rejected = 0;
+    prefetchSize = 0;
+    prefetchMaxSize = maxSize;
   };
 
 
   /// Destructor
   ~Cache() {
-    tileList.clear();
     tileMap.clear();
+    for( int i = 0; i < NUM_POOLS; i++ ) pools[i].tileList.clear();
+  }
+
+
+  /// Get the name of a pool type
+  static const char* getPoolName( PoolType p ) {
+    static const char* names[NUM_POOLS] = { "encoded", "raw", "raw16" };
+    return ( p >= 0 && p < NUM_POOLS ) ? names[p] : "";
   }
 
 
+  /// Get a pool type from its name
+  /** @param name pool name as returned by getPoolName()
+      @return pool type or NUM_POOLS if not recognised
+   */
+  static PoolType getPoolType( const std::string& name ) {
+    for( int i = 0; i < NUM_POOLS; i++ ){
+      if( name == getPoolName( (PoolType) i ) ) return (PoolType) i;
+    }
+    return NUM_POOLS;
+  }
+
+
+  /// Attach a second level store
+  /** Encoded tiles are written through to the store on insertion and the store
+      is consulted whenever a tile is not found in memory
+      @param s pointer to TileStore or NULL to disable
+   */
+  void setStore( TileStore* s ) { store = s; }
+
+
+  /// Enable or disable TinyLFU admission for a pool
+  /** When enabled, a new tile which would cause an eviction is only admitted if it has
+      recently been requested more often than the tile it would evict. This prevents
+      tiles which are only ever requested once, such as during a bulk crawl, from
+      flushing the working set.
+      @param p pool type
+      @param a true to enable
+   */
+  void setAdmission( PoolType p, bool a ) {
+    if( p < 0 || p >= NUM_POOLS ) return;
+    ScopedLock lock( mutex );
+    pools[p].admission = a;
+    bool any = false;
+    for( int i = 0; i < NUM_POOLS; i++ ) any = any || pools[i].admission;
+    // Size our sketch assuming a conservatively small average tile size
+    if( any && !admission ) sketch = FrequencySketch( maxSize / 4096 );
+    admission = any;
+  }
+
+
+  /// Set the share of the cache which unrequested prefetched tiles may use
+  /** @param fraction fraction of the maximum cache size, between 0 and 1 */
+  void setPrefetchLimit( float fraction ) {
+    ScopedLock lock( mutex );
+    prefetchMaxSize = (unsigned long)( fraction * maxSize );
+  }
+
+
+  /// Record the outcome of a tile request
+  /** @param hit whether the tile was found */
+  void countLookup( bool hit ) {
+    ScopedLock lock( mutex );
+    if( hit ) hits++;
+    else misses++;
+  }
+
+
+  /// Return the number of tile requests found in the cache
+  unsigned long getHits() { ScopedLock lock( mutex ); return hits; }
+
+  /// Return the number of tile requests not found in the cache
+  unsigned long getMisses() { ScopedLock lock( mutex ); return misses; }
+
+  /// Return the number of tiles which passed the admission test
+  unsigned long getAdmitted() { ScopedLock lock( mutex ); return admitted; }
+
+  /// Return the number of tiles refused admission to the cache
+  unsigned long getRejected() { ScopedLock lock( mutex ); return rejected; }
+
+
   /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
+  /** @param r Tile to be inserted
+      @param prefetched whether the tile has been decoded ahead of any request for it.
+             Such tiles bypass admission and are held within our prefetch budget
+             until requested. Tiles already in the cache are left untouched
+   */
+  void insert( const RawTile& r, bool prefetched = false ) {
 
-    if( maxSize == 0 ) return;
+    if( maxSize == 0 && !store ) return;
 
     std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
 				      r.hSequence, r.vSequence, r.compressionType, r.quality );
 
-    // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
-
-    // Check whether this tile exists in our cache
-    if( miter != tileMap.end() ){
-      // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
-	this->_remove( miter );
+    if( maxSize > 0 && !prefetched ){
+      ScopedLock lock( mutex );
+      this->_insert( key, r );
+    }
+    else if( maxSize > 0 ){
+      ScopedLock lock( mutex );
+      if( tileMap.find( key ) != tileMap.end() ) return;
+      this->_insert( key, r, false );
+      TileMap::iterator miter = tileMap.find( key );
+      if( miter != tileMap.end() ){
+	prefetchList.push_front( key );
+	prefetchMap[ key ] = prefetchList.begin();
+	prefetchSize += _entrySize( miter->second->first, miter->second->second );
+	// Make room by evicting our oldest unrequested prefetched tiles
+	while( prefetchSize > prefetchMaxSize ) this->_remove( prefetchList.back() );
       }
-      // If this index already exists and it is up to date, do nothing
-      else return;
     }
 
-    // Store the key if it doesn't already exist in our cache
-    // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
+    // Only encoded tiles are worth keeping in our second level store
+    if( store && r.compressionType == JPEG ) store->put( key, r );
+  }
 
-    // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
 
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements() {
+    ScopedLock lock( mutex );
+    unsigned int n = 0;
+    for( int i = 0; i < NUM_POOLS; i++ ) n += pools[i].numElements;
+    return n;
+  }
 
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
-    }
 
+  /// Return the number of MB stored
+  float getMemorySize() {
+    ScopedLock lock( mutex );
+    unsigned long size = 0;
+    for( int i = 0; i < NUM_POOLS; i++ ) size += pools[i].currentSize;
+    return (float) ( size / 1024000.0 );
   }
 
 
-  /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  /// Return the maximum cache size in MB
+  float getMaxSize() { return (float) ( maxSize / 1024000.0 ); }
 
 
-  /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  /// Return the number of tiles in a pool
+  unsigned int getNumElements( PoolType p ) {
+    ScopedLock lock( mutex );
+    return pools[p].numElements;
+  }
+
+
+  /// Return the number of MB stored in a pool
+  float getMemorySize( PoolType p ) {
+    ScopedLock lock( mutex );
+    return (float) ( pools[p].currentSize / 1024000.0 );
+  }
+
+
+  /// Return the size in MB reserved for a pool
+  float getMaxSize( PoolType p ) { return (float) ( pools[p].maxSize / 1024000.0 ); }
+
+
+  /// Check whether a tile is in the cache without affecting its LRU position
+  /** 
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return true if found, false otherwise
+   */
+  bool hasTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+    if( maxSize == 0 ) return false;
+    std::string key = this->getIndex( f, r, t, h, v, c, q );
+    ScopedLock lock( mutex );
+    return ( tileMap.find( key ) != tileMap.end() );
+  }
+
+
+  /// Get the keys of the most recently used tiles
+  /**
+   *  @param max maximum number of keys to return
+   *  @param keys vector to which keys are appended, most recently used first:
+   *              in pool order
+   *  @param wait if false, give up rather than block if the cache is locked
+   *  @return false if the cache was locked and wait was false
+   */
+  bool getKeys( unsigned int max, std::vector<std::string>& keys, bool wait = true ) {
+    if( wait ) mutex.lock();
+    else if( !mutex.tryLock() ) return false;
+    unsigned int n = 0;
+    for( int p = 0; p < NUM_POOLS; p++ ){
+      TileList& tileList = pools[p].tileList;
+      for( List_Iter i = tileList.begin(); i != tileList.end() && n < max; ++i, ++n ){
+	keys.push_back( i->first );
+      }
+    }
+    mutex.unlock();
+    return true;
+  }
 
 
-  /// Get a tile from the cache
+  /// Get a copy of a tile from the cache
   /** 
    *  @param f filename
    *  @param r resolution number
@@ -252,19 +654,48 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return pointer to data or NULL on error
+   *  @param tile empty RawTile into which the cached tile is copied
+   *  @param count whether this is a client request, which is counted in our access
+   *         frequencies and metrics and makes the tile the most recently used.
+   *         Background lookups by the prefetcher leave these untouched
+   *  @return true if found, false otherwise
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  bool getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile,
+		bool count = true ) {
 
-    if( maxSize == 0 ) return NULL;
+    if( maxSize == 0 && !store ) return false;
 
     std::string key = this->getIndex( f, r, t, h, v, c, q );
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
+    if( maxSize > 0 ){
+      ScopedLock lock( mutex );
+      if( admission && count ) sketch.increment( key );
+      TileMap::iterator miter = count ? this->_touch( key ) : tileMap.find( key );
+      if( miter != tileMap.end() ){
+	tile = miter->second->second;
+	if( count ){
+	  this->_promote( miter );
+	  metrics.increment( Metrics::MEMORY_HITS );
+	}
+	return true;
+      }
+      if( count ) metrics.increment( Metrics::MEMORY_MISSES );
+    }
+
+    // Fall back to our second level store and promote any tile found there
+    if( store ){
+      if( store->get( key, tile ) ){
+	if( count ) metrics.increment( Metrics::DISK_HITS );
+	if( maxSize > 0 ){
+	  ScopedLock lock( mutex );
+	  this->_insert( key, tile, count );
+	}
+	return true;
+      }
+      if( count ) metrics.increment( Metrics::DISK_MISSES );
+    }
 
-    return &(miter->second->second);
+    return false;
   }
 
 
@@ -0,0 +1,228 @@
+// Cache warming from tile lists and hot tile dumps
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "CacheWarmer.h"
+#include "Environment.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+
+
+using namespace std;
+
+
+
+/// Tiles from a single image and view to be warmed together
+struct WarmGroup {
+  string image;
+  int xangle;
+  int yangle;
+  CompressionType compression;
+  int quality;
+  list < pair<int,int> > tiles;
+};
+
+
+
+unsigned int CacheWarmer::load( const string& file ){
+
+  ifstream in( file.c_str() );
+  if( !in ){
+    if( loglevel >= 1 ) *logfile << "CacheWarmer :: Unable to open tile list '" << file << "'" << endl;
+    return 0;
+  }
+
+  string filesystem_prefix = Environment::getFileSystemPrefix();
+  string filename_pattern = Environment::getFileNamePattern();
+  int default_quality = Environment::getJPEGQuality();
+
+  vector <WarmGroup> groups;
+  map <string, unsigned int> groupIndex;
+  vector <string> images;
+  set <string> seen;
+
+  string line;
+  unsigned int lineNumber = 0;
+
+
+  // Parse our tile list, grouping tiles by image and view
+  while( getline( in, line ) ){
+
+    lineNumber++;
+
+    if( !line.empty() && line[line.size()-1] == '\r' ) line.erase( line.size()-1 );
+    size_t start = line.find_first_not_of( " \t" );
+    if( start == string::npos || line[start] == '#' ) continue;
+    line = line.substr( start );
+
+    WarmGroup group;
+    group.xangle = 0;
+    group.yangle = 90;
+    group.compression = JPEG;
+    group.quality = default_quality;
+    int resolution = -1, tile = -1;
+    bool valid = true;
+
+    istringstream tokens( line );
+    string first;
+    tokens >> first;
+
+    if( first == "JPEG" || first == "UNCOMPRESSED" ){
+      if( first == "UNCOMPRESSED" ) group.compression = UNCOMPRESSED;
+      valid = !( tokens >> group.quality >> resolution >> tile >> group.xangle >> group.yangle ).fail();
+      if( group.compression != JPEG ) group.quality = 0;
+    }
+    else if( first.find_first_not_of( "0123456789" ) == string::npos ){
+      resolution = atoi( first.c_str() );
+      valid = !( tokens >> tile ).fail();
+    }
+    else group.image = line;
+
+    // The image path is the remainder of the line and may contain spaces
+    if( valid && resolution >= 0 ){
+      getline( tokens, group.image );
+      start = group.image.find_first_not_of( " \t" );
+      group.image = ( start == string::npos ) ? string() : group.image.substr( start );
+    }
+
+    if( !valid || group.image.empty() || (resolution >= 0 && tile < 0) ){
+      if( loglevel >= 1 ) *logfile << "CacheWarmer :: Skipping malformed line " << lineNumber
+				   << " in '" << file << "'" << endl;
+      continue;
+    }
+
+    if( seen.insert( group.image ).second ) images.push_back( group.image );
+    if( resolution < 0 ) continue;
+
+    ostringstream key;
+    key << group.xangle << ":" << group.yangle << ":" << group.compression << ":"
+	<< group.quality << ":" << group.image;
+
+    map <string, unsigned int>::iterator g = groupIndex.find( key.str() );
+    if( g == groupIndex.end() ){
+      groupIndex[ key.str() ] = groups.size();
+      groups.push_back( group );
+      g = groupIndex.find( key.str() );
+    }
+    groups[ g->second ].tiles.push_back( make_pair( resolution, tile ) );
+  }
+
+
+  // Load the metadata for each image into our image cache
+  unsigned int loaded = 0;
+  for( vector<string>::iterator i = images.begin(); i != images.end(); ++i ){
+
+    if( imageCache->find( *i ) != imageCache->end() ) continue;
+    if( imageCache->size() >= MAXIMAGECACHE ) break;
+
+    IIPImage* image = NULL;
+    try{
+      IIPImage test( *i );
+      test.setFileNamePattern( filename_pattern );
+      test.setFileSystemPrefix( filesystem_prefix );
+      test.Initialise();
+
+      image = Prefetcher::createDecoder( test );
+      if( !image ) throw file_error( "Unsupported image type: " + *i );
+
+      image->openImage();
+      (*imageCache)[ *i ] = *image;
+      image->closeImage();
+      loaded++;
+    }
+    catch( const file_error& error ){
+      if( loglevel >= 1 ) *logfile << "CacheWarmer :: " << error.what() << endl;
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) *logfile << "CacheWarmer :: " << error << endl;
+    }
+    delete image;
+  }
+
+
+  // Hand our tiles to the background thread in the order they were listed
+  unsigned int queued = 0;
+  if( prefetcher ){
+    for( vector<WarmGroup>::iterator g = groups.begin(); g != groups.end(); ++g ){
+      imageCacheMapType::iterator im = imageCache->find( g->image );
+      if( im == imageCache->end() ) continue;
+      prefetcher->warm( im->second, g->xangle, g->yangle, 0, g->compression, g->quality, g->tiles );
+      queued += g->tiles.size();
+    }
+  }
+
+  if( loglevel >= 1 ){
+    *logfile << "CacheWarmer :: Loaded metadata for " << loaded << " images and queued "
+	     << queued << " tiles from '" << file << "'" << endl;
+  }
+
+  return queued;
+}
+
+
+
+int CacheWarmer::dump( Cache* tileCache, const string& file, unsigned int max, bool wait ){
+
+  vector <string> keys;
+  if( !tileCache->getKeys( max, keys, wait ) ) return -1;
+
+  ofstream out( file.c_str() );
+  if( !out ) return -1;
+
+  out << "# iipsrv tile list: format quality resolution tile hseq vseq image" << endl;
+
+  int n = 0;
+  for( vector<string>::iterator k = keys.begin(); k != keys.end(); ++k ){
+
+    // Keys have the form image:resolution:tile:hseq:vseq:compression:quality
+    // and the image path may itself contain colons, so parse from the right
+    int fields[6];
+    size_t end = k->size();
+    bool valid = true;
+    for( int i = 5; i >= 0; i-- ){
+      size_t p = ( end > 0 ) ? k->rfind( ':', end-1 ) : string::npos;
+      if( p == string::npos ){
+	valid = false;
+	break;
+      }
+      fields[i] = atoi( k->substr( p+1, end-p-1 ).c_str() );
+      end = p;
+    }
+    if( !valid || end == 0 ) continue;
+
+    const char* format;
+    if( fields[4] == JPEG ) format = "JPEG";
+    else if( fields[4] == UNCOMPRESSED ) format = "UNCOMPRESSED";
+    else continue;
+
+    out << format << " " << fields[5] << " " << fields[0] << " " << fields[1] << " "
+	<< fields[2] << " " << fields[3] << " " << k->substr( 0, end ) << "\n";
+    n++;
+  }
+
+  out.close();
+  return n;
+}
@@ -0,0 +1,97 @@
+// Cache warming from tile lists and hot tile dumps
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHEWARMER_H
+#define _CACHEWARMER_H
+
+
+#include <string>
+#include <fstream>
+
+#include "Task.h"
+#include "Cache.h"
+#include "Prefetcher.h"
+
+
+
+/// Class to pre-populate the image metadata and tile caches at startup
+/** Reads a list of tiles, one per line, in one of the following forms:
+
+    - \<image\>: load the image metadata only
+    - \<resolution\> \<tile\> \<image\>: JPEG tile at the default quality
+    - \<format\> \<quality\> \<resolution\> \<tile\> \<hseq\> \<vseq\> \<image\>: as written by dump(),
+      where format is JPEG or UNCOMPRESSED
+
+    Empty lines and lines beginning with # are ignored. The image path is the same as
+    that given to the FIF command. Image metadata is loaded immediately, whereas tiles
+    are decoded in the background by the Prefetcher worker thread.
+*/
+class CacheWarmer {
+
+ private:
+
+  imageCacheMapType* imageCache;
+  Prefetcher* prefetcher;
+  std::ofstream* logfile;
+  int loglevel;
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param ic pointer to image metadata cache
+   * @param p pointer to a running Prefetcher or NULL to load metadata only
+   * @param s pointer to output file stream
+   * @param l logging level
+   */
+  CacheWarmer( imageCacheMapType* ic, Prefetcher* p, std::ofstream* s, int l ){
+    imageCache = ic;
+    prefetcher = p;
+    logfile = s;
+    loglevel = l;
+  };
+
+
+  /// Load a tile list and queue its contents
+  /**
+   * @param file path of tile list
+   * @return number of tiles queued
+   */
+  unsigned int load( const std::string& file );
+
+
+  /// Write the keys of the most recently used tiles to a file in a format readable by load()
+  /**
+   * @param tileCache tile cache
+   * @param file path of file to write
+   * @param max maximum number of tiles to write
+   * @param wait if false, give up rather than wait if the cache is locked.
+   *             Use this when called from a signal handler
+   * @return number of tiles written or -1 on error
+   */
+  static int dump( Cache* tileCache, const std::string& file, unsigned int max, bool wait = true );
+
+};
+
+
+#endif
@@ -65,6 +65,9 @@ void DeepZoom::run( Session* session, const std::string& argument ){
     prefix = argument.substr( 0, argument.rfind( "_files/" ) );
 
 
+  // Our DZI is sent from our descriptor cache if we have already generated it for this image
+  if( suffix == "dzi" && sendDescriptor( session ) ) return;
+
 
   // As we don't have an independent FIF request, we need to run it now
   FIF fif;
@@ -111,16 +114,16 @@ void DeepZoom::run( Session* session, const std::string& argument ){
 	      "Content-Type: application/xml\r\n"
 	      "Last-Modified: %s\r\n"
 	      "%s\r\n"
+	      "%s"
 	      "\r\n"
 	      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
 	      "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\r\n"
 	      "TileSize=\"%d\" Overlap=\"0\" Format=\"jpg\">"
 	      "<Size Width=\"%d\" Height=\"%d\"/>"
 	      "</Image>",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), tw, width, height );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str(), tw, width, height );
 
-    session->out->printf( (const char*) str );
-    session->response->setImageSent();
+    storeDescriptor( session, str );
 
     return;
   }
@@ -0,0 +1,501 @@
+// Persistent on-disk second level tile cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "DiskCache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+
+using namespace std;
+
+
+// Identifies each tile record: "IIPT"
+#define DISKCACHE_MAGIC 0x49495054
+
+// Maximum number of per-process sub-directories
+#define DISKCACHE_MAX_SLOTS 256
+
+
+
+/// Header written before each tile record, followed by the key and then the tile data.
+/// The tile's filename is the first filenameLength characters of the key
+struct RecordHeader {
+  unsigned int magic;
+  unsigned int keyLength;
+  unsigned int filenameLength;
+  unsigned int dataLength;
+  int tileNum;
+  int resolution;
+  int hSequence;
+  int vSequence;
+  int compressionType;
+  int quality;
+  unsigned int width;
+  unsigned int height;
+  int channels;
+  int bpc;
+  int sampleType;
+  int padded;
+  time_t timestamp;
+};
+
+
+
+/// Read from an absolute position without moving any shared file position
+static bool readAt( int fd, void* buffer, size_t length, long offset ){
+#ifdef WIN32
+  return false;
+#else
+  char* p = (char*) buffer;
+  while( length > 0 ){
+    ssize_t n = pread( fd, p, length, offset );
+    if( n < 0 && errno == EINTR ) continue;
+    if( n <= 0 ) return false;
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+#endif
+}
+
+
+
+/// Write to an absolute position without moving any shared file position
+static bool writeAt( int fd, const void* buffer, size_t length, long offset ){
+#ifdef WIN32
+  return false;
+#else
+  const char* p = (const char*) buffer;
+  while( length > 0 ){
+    ssize_t n = pwrite( fd, p, length, offset );
+    if( n < 0 && errno == EINTR ) continue;
+    if( n <= 0 ) return false;
+    p += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+#endif
+}
+
+
+
+DiskCache::DiskCache( const string& dir, float max, float segment ){
+  directory = dir;
+  lockfd = -1;
+  maxSize = (unsigned long)(max*1024000);
+  segmentSize = (unsigned long)(segment*1024000);
+  // Keep segments small enough that reclaiming one does not empty most of the cache
+  if( segmentSize > maxSize/4 ) segmentSize = maxSize/4;
+  if( segmentSize == 0 ) segmentSize = 1024000;
+  currentSize = 0;
+  hand = 0;
+}
+
+
+
+DiskCache::~DiskCache(){
+#ifndef WIN32
+  for( map<unsigned int,Segment>::iterator i = segments.begin(); i != segments.end(); ++i ){
+    close( i->second.fd );
+  }
+  if( lockfd >= 0 ) close( lockfd );
+#endif
+}
+
+
+
+string DiskCache::segmentName( unsigned int id ){
+  char name[32];
+  snprintf( name, 32, "/%08u.seg", id );
+  return path + name;
+}
+
+
+
+void DiskCache::open(){
+
+#ifdef WIN32
+  throw file_error( "DiskCache :: Disk cache is not supported on this platform" );
+#else
+
+  if( directory.empty() ) throw file_error( "DiskCache :: No cache directory specified" );
+
+  if( mkdir( directory.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw file_error( "DiskCache :: Unable to create cache directory " + directory );
+  }
+
+  // Lock the first sub-directory not in use by another process
+  for( unsigned int n = 0; n < DISKCACHE_MAX_SLOTS && lockfd < 0; n++ ){
+    char slot[16];
+    snprintf( slot, 16, "/%u", n );
+    string dir = directory + slot;
+    if( mkdir( dir.c_str(), 0755 ) != 0 && errno != EEXIST ) continue;
+    int fd = ::open( (dir + "/lock").c_str(), O_RDWR | O_CREAT, 0644 );
+    if( fd < 0 ) continue;
+    if( flock( fd, LOCK_EX | LOCK_NB ) == 0 ){
+      lockfd = fd;
+      path = dir;
+    }
+    else close( fd );
+  }
+
+  if( lockfd < 0 ) throw file_error( "DiskCache :: Unable to lock a sub-directory of " + directory );
+
+
+  // Find our existing segments and index them in order of age
+  vector <unsigned int> ids;
+  DIR* d = opendir( path.c_str() );
+  if( d ){
+    struct dirent* entry;
+    while( (entry = readdir( d )) != NULL ){
+      char* end = NULL;
+      unsigned long id = strtoul( entry->d_name, &end, 10 );
+      if( end != entry->d_name && strcmp( end, ".seg" ) == 0 ) ids.push_back( id );
+    }
+    closedir( d );
+  }
+  sort( ids.begin(), ids.end() );
+
+  for( vector<unsigned int>::iterator i = ids.begin(); i != ids.end(); ++i ){
+    Segment segment;
+    segment.fd = ::open( segmentName( *i ).c_str(), O_RDONLY );
+    if( segment.fd < 0 ) continue;
+    segment.size = 0;
+    segment.referenced = false;
+    segment.users = 0;
+    this->scan( *i, segment );
+    if( segment.size == 0 ){
+      close( segment.fd );
+      remove( segmentName( *i ).c_str() );
+      continue;
+    }
+    segments[ *i ] = segment;
+    currentSize += segment.size;
+  }
+
+  // Always start writing to a fresh segment
+  this->newSegment();
+  hand = segments.begin()->first;
+
+  ScopedLock lock( mutex );
+  this->reclaim();
+
+#endif
+}
+
+
+
+void DiskCache::scan( unsigned int id, Segment& segment ){
+
+#ifndef WIN32
+  struct stat st;
+  if( fstat( segment.fd, &st ) != 0 ) return;
+  long fileSize = st.st_size;
+#else
+  long fileSize = 0;
+#endif
+
+  long offset = 0;
+  RecordHeader header;
+
+  while( offset + (long) sizeof(RecordHeader) <= fileSize ){
+
+    if( !readAt( segment.fd, &header, sizeof(RecordHeader), offset ) ) break;
+
+    if( header.magic != DISKCACHE_MAGIC || header.keyLength == 0 || header.keyLength > 4096 ||
+	header.filenameLength > header.keyLength ) break;
+
+    long length = sizeof(RecordHeader) + header.keyLength + header.dataLength;
+    if( offset + length > fileSize ) break;
+
+    string key( header.keyLength, '\0' );
+    if( !readAt( segment.fd, &key[0], header.keyLength, offset + sizeof(RecordHeader) ) ) break;
+
+    // Newer versions of a tile replace older ones
+    HASHMAP <string,Entry>::iterator i = index.find( key );
+    if( i == index.end() || i->second.timestamp <= header.timestamp ){
+      Entry e;
+      e.segment = id;
+      e.offset = offset;
+      e.timestamp = header.timestamp;
+      index[ key ] = e;
+    }
+    segment.keys.push_back( key );
+    offset += length;
+  }
+
+  // Anything after the last complete record was interrupted during writing, but
+  // still takes up space until the segment is reclaimed
+  segment.size = fileSize;
+}
+
+
+
+void DiskCache::newSegment(){
+
+  unsigned int id = segments.empty() ? 0 : segments.rbegin()->first + 1;
+
+  Segment segment;
+#ifndef WIN32
+  segment.fd = ::open( segmentName( id ).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+#else
+  segment.fd = -1;
+#endif
+  if( segment.fd < 0 ) throw file_error( "DiskCache :: Unable to create segment " + segmentName( id ) );
+  segment.size = 0;
+  segment.referenced = false;
+  segment.users = 0;
+  segments[ id ] = segment;
+}
+
+
+
+map<unsigned int,DiskCache::Segment>::iterator DiskCache::release( unsigned int id ){
+  map <unsigned int,Segment>::iterator s = segments.find( id );
+  if( s != segments.end() && s->second.users > 0 ) s->second.users--;
+  return s;
+}
+
+
+
+void DiskCache::reclaim(){
+
+  // Segments being read or written are passed over, so stop once we have gone all the
+  // way round without being able to reclaim any
+  unsigned int busy = 0;
+
+  while( currentSize > maxSize && segments.size() > 1 && busy < segments.size() ){
+
+    unsigned int active = segments.rbegin()->first;
+    map <unsigned int,Segment>::iterator s = segments.lower_bound( hand );
+    if( s == segments.end() || s->first == active ) s = segments.begin();
+
+    map <unsigned int,Segment>::iterator next = s;
+    ++next;
+    hand = ( next == segments.end() ) ? 0 : next->first;
+
+    // Give recently read segments a second chance
+    if( s->second.referenced ){
+      s->second.referenced = false;
+      continue;
+    }
+
+    if( s->second.users > 0 ){
+      busy++;
+      continue;
+    }
+    busy = 0;
+
+    for( vector<string>::iterator k = s->second.keys.begin(); k != s->second.keys.end(); ++k ){
+      HASHMAP <string,Entry>::iterator e = index.find( *k );
+      if( e != index.end() && e->second.segment == s->first ) index.erase( e );
+    }
+
+#ifndef WIN32
+    close( s->second.fd );
+#endif
+    remove( segmentName( s->first ).c_str() );
+    currentSize -= s->second.size;
+    segments.erase( s );
+  }
+}
+
+
+
+bool DiskCache::get( const string& key, RawTile& tile ){
+
+  unsigned int id;
+  long offset;
+  int fd;
+
+  {
+    ScopedLock lock( mutex );
+
+    HASHMAP <string,Entry>::iterator i = index.find( key );
+    if( i == index.end() ) return false;
+
+    map <unsigned int,Segment>::iterator s = segments.find( i->second.segment );
+    if( s == segments.end() ){
+      index.erase( i );
+      return false;
+    }
+
+    // Keep the segment open while we read from it
+    id = s->first;
+    offset = i->second.offset;
+    fd = s->second.fd;
+    s->second.users++;
+    s->second.referenced = true;
+  }
+
+  // Read the header and key together and verify that the record really is the tile we want
+  vector <char> buffer( sizeof(RecordHeader) + key.size() );
+  RecordHeader header;
+  bool valid = readAt( fd, &buffer[0], buffer.size(), offset );
+
+  if( valid ){
+    memcpy( &header, &buffer[0], sizeof(RecordHeader) );
+    valid = ( header.magic == DISKCACHE_MAGIC && header.keyLength == key.size() &&
+	      key.compare( 0, string::npos, &buffer[sizeof(RecordHeader)], key.size() ) == 0 );
+  }
+
+  unsigned char* data = NULL;
+  if( valid ){
+    data = new unsigned char[ header.dataLength ];
+    valid = readAt( fd, data, header.dataLength, offset + buffer.size() );
+  }
+
+  {
+    ScopedLock lock( mutex );
+    this->release( id );
+    if( !valid ){
+      HASHMAP <string,Entry>::iterator i = index.find( key );
+      if( i != index.end() && i->second.segment == id && i->second.offset == offset ) index.erase( i );
+    }
+  }
+
+  if( !valid ){
+    delete[] data;
+    return false;
+  }
+
+  tile.tileNum = header.tileNum;
+  tile.resolution = header.resolution;
+  tile.hSequence = header.hSequence;
+  tile.vSequence = header.vSequence;
+  tile.compressionType = (CompressionType) header.compressionType;
+  tile.quality = header.quality;
+  tile.filename = key.substr( 0, header.filenameLength );
+  tile.timestamp = header.timestamp;
+  tile.data = data;
+  tile.memoryManaged = 1;
+  tile.dataLength = header.dataLength;
+  tile.width = header.width;
+  tile.height = header.height;
+  tile.channels = header.channels;
+  tile.bpc = header.bpc;
+  tile.sampleType = (SampleType) header.sampleType;
+  tile.padded = header.padded;
+
+  return true;
+}
+
+
+
+void DiskCache::put( const string& key, const RawTile& tile ){
+
+  // We only store byte data
+  if( !tile.data || tile.dataLength <= 0 || tile.bpc != 8 ) return;
+
+  RecordHeader header;
+  memset( &header, 0, sizeof(RecordHeader) );
+  header.magic = DISKCACHE_MAGIC;
+  header.keyLength = key.size();
+  header.filenameLength = tile.filename.size();
+  header.dataLength = tile.dataLength;
+  header.tileNum = tile.tileNum;
+  header.resolution = tile.resolution;
+  header.hSequence = tile.hSequence;
+  header.vSequence = tile.vSequence;
+  header.compressionType = tile.compressionType;
+  header.quality = tile.quality;
+  header.width = tile.width;
+  header.height = tile.height;
+  header.channels = tile.channels;
+  header.bpc = tile.bpc;
+  header.sampleType = tile.sampleType;
+  header.padded = tile.padded;
+  header.timestamp = tile.timestamp;
+
+  unsigned long length = sizeof(RecordHeader) + key.size() + tile.dataLength;
+
+  // Reserve space for the record in the current segment, starting a new segment if it is full
+  unsigned int id;
+  long offset;
+  int fd;
+
+  {
+    ScopedLock lock( mutex );
+
+    if( segments.empty() ) return;
+
+    // Don't rewrite tiles we already have
+    HASHMAP <string,Entry>::iterator i = index.find( key );
+    if( i != index.end() && i->second.timestamp >= tile.timestamp ) return;
+
+    if( segments.rbegin()->second.size > 0 && segments.rbegin()->second.size + length > segmentSize ){
+      try{
+	this->newSegment();
+      }
+      catch( const file_error& ){
+	return;
+      }
+    }
+
+    id = segments.rbegin()->first;
+    Segment& segment = segments.rbegin()->second;
+    offset = segment.size;
+    fd = segment.fd;
+    segment.size += length;
+    segment.users++;
+    currentSize += length;
+  }
+
+  // Write the header and key together, then the tile data. A failed write leaves a gap,
+  // which ends the scan of this segment at startup
+  string record( (const char*) &header, sizeof(RecordHeader) );
+  record += key;
+  bool written = writeAt( fd, record.data(), record.size(), offset ) &&
+    writeAt( fd, tile.data, tile.dataLength, offset + record.size() );
+
+  ScopedLock lock( mutex );
+
+  map <unsigned int,Segment>::iterator s = this->release( id );
+  if( written && s != segments.end() ){
+    // Another thread may have stored a newer version in the meantime
+    HASHMAP <string,Entry>::iterator i = index.find( key );
+    if( i == index.end() || i->second.timestamp <= tile.timestamp ){
+      Entry e;
+      e.segment = id;
+      e.offset = offset;
+      e.timestamp = tile.timestamp;
+      index[ key ] = e;
+    }
+    s->second.keys.push_back( key );
+  }
+
+  this->reclaim();
+}
@@ -0,0 +1,161 @@
+// Persistent on-disk second level tile cache
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "Cache.h"
+#include "IIPImage.h"
+
+
+
+/// Disk backed tile store for encoded tiles
+/** Tiles are appended to segment files within a cache directory and located through
+    an in-memory index, which is rebuilt at startup by scanning the segments. When the
+    total size exceeds the limit, whole segments are reclaimed using the CLOCK algorithm:
+    segments from which a tile has been read since the hand last passed are spared once.
+
+    As several server processes may be configured with the same directory, each
+    process locks and uses its own numbered sub-directory, which is picked up again by
+    a process started later. Segment files are in native byte order and are not
+    portable between architectures.
+
+    Tiles are read and written with positioned I/O outside of the lock, which only
+    guards the index and segment list. Writers reserve their space in the current
+    segment under the lock, and segments in use are not reclaimed until released.
+*/
+class DiskCache : public TileStore {
+
+ private:
+
+  /// Location of a tile within a segment
+  struct Entry {
+    unsigned int segment;
+    long offset;
+    time_t timestamp;
+  };
+
+  /// An individual segment file
+  struct Segment {
+    int fd;
+    unsigned long size;
+    bool referenced;
+    unsigned int users;
+    std::vector <std::string> keys;
+  };
+
+  /// Our base directory and the sub-directory we have locked
+  std::string directory, path;
+
+  /// Lock file descriptor
+  int lockfd;
+
+  /// Maximum total size and maximum size of each segment in bytes
+  unsigned long maxSize, segmentSize;
+
+  /// Current total size of all segments in bytes
+  unsigned long currentSize;
+
+  /// Segments ordered by age. The last is the one being written
+  std::map <unsigned int, Segment> segments;
+
+  /// Position of our CLOCK hand
+  unsigned int hand;
+
+  /// Tile index
+  HASHMAP <std::string, Entry> index;
+
+  Mutex mutex;
+
+
+  /// Get the file name for a segment
+  std::string segmentName( unsigned int id );
+
+  /// Read the contents of an existing segment into our index
+  void scan( unsigned int id, Segment& segment );
+
+  /// Start a new segment for writing
+  void newSegment();
+
+  /// Release a segment used outside of the lock
+  /** @param id segment id
+      @return iterator to the segment or the end of our list if it no longer exists
+   */
+  std::map<unsigned int,Segment>::iterator release( unsigned int id );
+
+  /// Reclaim segments until we are within our size limit
+  void reclaim();
+
+  DiskCache( const DiskCache& );
+  DiskCache& operator = ( const DiskCache& );
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param dir cache directory
+   * @param max maximum cache size in MB
+   * @param segment maximum segment size in MB
+   */
+  DiskCache( const std::string& dir, float max, float segment );
+
+  /// Destructor
+  ~DiskCache();
+
+  /// Lock a sub-directory for this process and index any existing segments
+  /** @throw file_error if the cache directory cannot be used */
+  void open();
+
+  /// Get a tile from disk
+  /** The stored key is compared against the requested key before the tile is returned
+      @param key tile key
+      @param tile empty RawTile into which the tile is read
+      @return true if found
+   */
+  bool get( const std::string& key, RawTile& tile );
+
+  /// Append a tile to the current segment
+  /** @param key tile key
+      @param tile tile to be stored
+   */
+  void put( const std::string& key, const RawTile& tile );
+
+  /// Return the number of tiles on disk
+  unsigned int getNumElements(){ ScopedLock lock( mutex ); return index.size(); };
+
+  /// Return the size of our segments in MB
+  float getMemorySize(){ ScopedLock lock( mutex ); return (float) ( currentSize / 1024000.0 ); };
+
+  /// Return the sub-directory in use
+  const std::string& getPath(){ return path; };
+
+};
+
+
+#endif
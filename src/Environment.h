@@ -27,6 +27,8 @@
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
 #define MAX_IMAGE_CACHE_SIZE 10.0
+#define MAX_UNCOMPRESSED_CACHE_SIZE -1.0
+#define MAX_HIGH_BIT_DEPTH_CACHE_SIZE -1.0
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
 #define MAX_CVT 5000
@@ -41,6 +43,31 @@
 #define CORS "";
 #define BASE_URL "";
 #define CACHE_CONTROL "max-age=86400"; // 24 hours
+#define PREFETCH 0
+#define PREFETCH_QUEUE 32
+#define PREFETCH_RATE 50
+#define PREFETCH_CACHE_FILL 0.2
+#define CACHE_WARM_FILE ""
+#define CACHE_DUMP_FILE ""
+#define CACHE_DUMP_SIZE 10000
+#define CACHE_ADMISSION "0"
+#define DISK_CACHE_DIR ""
+#define DISK_CACHE_SIZE 1000.0
+#define DISK_CACHE_SEGMENT_SIZE 64.0
+#define METRICS_ENABLED 0
+#define TRACE_FILE ""
+#define TRACE_SAMPLE_RATE 0.01
+#define TRACE_SLOW 0
+#define TRACE_BUFFER 1024
+#define LOG_BUFFER_SIZE 1024
+#define HTTP_KEEPALIVE_TIMEOUT 15
+#define WORKER_THREADS 1
+#define KAKADU_THREADS 0
+#define KAKADU_CODESTREAMS 8
+#define OPENJPEG_THREADS 0
+#define OPENJPEG_CODESTREAMS 8
+#define JPEG_LEVEL_CACHE_SIZE 64.0
+#define STRIPED_CACHE_SIZE 64.0
 
 
 #include <string>
@@ -81,6 +108,26 @@ class Environment {
   }
 
 
+  static float getMaxUncompressedCacheSize(){
+    float max_uncompressed_cache_size = MAX_UNCOMPRESSED_CACHE_SIZE;
+    char* envpara = getenv( "MAX_UNCOMPRESSED_CACHE_SIZE" );
+    if( envpara ){
+      max_uncompressed_cache_size = atof( envpara );
+    }
+    return max_uncompressed_cache_size;
+  }
+
+
+  static float getMaxHighBitDepthCacheSize(){
+    float max_high_bit_depth_cache_size = MAX_HIGH_BIT_DEPTH_CACHE_SIZE;
+    char* envpara = getenv( "MAX_HIGH_BIT_DEPTH_CACHE_SIZE" );
+    if( envpara ){
+      max_high_bit_depth_cache_size = atof( envpara );
+    }
+    return max_high_bit_depth_cache_size;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -240,6 +287,237 @@ class Environment {
     return cache_control;
   }
 
+
+  static bool getPrefetch(){
+    char* envpara = getenv( "PREFETCH" );
+    int prefetch = PREFETCH;
+    if( envpara ) prefetch = atoi( envpara );
+    return ( prefetch > 0 );
+  }
+
+
+  static unsigned int getPrefetchQueue(){
+    char* envpara = getenv( "PREFETCH_QUEUE" );
+    int queue = PREFETCH_QUEUE;
+    if( envpara ) queue = atoi( envpara );
+    if( queue < 1 ) queue = 1;
+    return queue;
+  }
+
+
+  static unsigned int getPrefetchRate(){
+    char* envpara = getenv( "PREFETCH_RATE" );
+    int rate = PREFETCH_RATE;
+    if( envpara ) rate = atoi( envpara );
+    if( rate < 0 ) rate = 0;
+    return rate;
+  }
+
+
+  static float getPrefetchCacheFill(){
+    char* envpara = getenv( "PREFETCH_CACHE_FILL" );
+    float fill = PREFETCH_CACHE_FILL;
+    if( envpara ){
+      fill = atof( envpara );
+      if( fill > 1.0 ) fill = 1.0;
+      if( fill < 0.0 ) fill = 0.0;
+    }
+    return fill;
+  }
+
+
+  static std::string getCacheWarmFile(){
+    char* envpara = getenv( "CACHE_WARM_FILE" );
+    std::string file;
+    if( envpara ) file = std::string( envpara );
+    else file = CACHE_WARM_FILE;
+    return file;
+  }
+
+
+  static std::string getCacheDumpFile(){
+    char* envpara = getenv( "CACHE_DUMP_FILE" );
+    std::string file;
+    if( envpara ) file = std::string( envpara );
+    else file = CACHE_DUMP_FILE;
+    return file;
+  }
+
+
+  static unsigned int getCacheDumpSize(){
+    char* envpara = getenv( "CACHE_DUMP_SIZE" );
+    int size = CACHE_DUMP_SIZE;
+    if( envpara ) size = atoi( envpara );
+    if( size < 0 ) size = 0;
+    return size;
+  }
+
+
+  static std::string getCacheAdmission(){
+    char* envpara = getenv( "CACHE_ADMISSION" );
+    std::string admission;
+    if( envpara ) admission = std::string( envpara );
+    else admission = CACHE_ADMISSION;
+    return admission;
+  }
+
+
+  static std::string getDiskCacheDir(){
+    char* envpara = getenv( "DISK_CACHE_DIR" );
+    std::string dir;
+    if( envpara ) dir = std::string( envpara );
+    else dir = DISK_CACHE_DIR;
+    return dir;
+  }
+
+
+  static float getDiskCacheSize(){
+    float size = DISK_CACHE_SIZE;
+    char* envpara = getenv( "DISK_CACHE_SIZE" );
+    if( envpara ) size = atof( envpara );
+    if( size < 0 ) size = 0;
+    return size;
+  }
+
+
+  static float getDiskCacheSegmentSize(){
+    float size = DISK_CACHE_SEGMENT_SIZE;
+    char* envpara = getenv( "DISK_CACHE_SEGMENT_SIZE" );
+    if( envpara ) size = atof( envpara );
+    if( size < 1 ) size = 1;
+    return size;
+  }
+
+
+  static bool getMetrics(){
+    char* envpara = getenv( "METRICS_ENABLED" );
+    int enabled = METRICS_ENABLED;
+    if( envpara ) enabled = atoi( envpara );
+    return ( enabled > 0 );
+  }
+
+
+  static std::string getTraceFile(){
+    char* envpara = getenv( "TRACE_FILE" );
+    std::string file;
+    if( envpara ) file = std::string( envpara );
+    else file = TRACE_FILE;
+    return file;
+  }
+
+
+  static float getTraceSampleRate(){
+    float rate = TRACE_SAMPLE_RATE;
+    char* envpara = getenv( "TRACE_SAMPLE_RATE" );
+    if( envpara ) rate = atof( envpara );
+    if( rate < 0 ) rate = 0;
+    if( rate > 1 ) rate = 1;
+    return rate;
+  }
+
+
+  static unsigned int getTraceSlow(){
+    char* envpara = getenv( "TRACE_SLOW" );
+    int slow = TRACE_SLOW;
+    if( envpara ) slow = atoi( envpara );
+    if( slow < 0 ) slow = 0;
+    return slow;
+  }
+
+
+  static unsigned int getTraceBuffer(){
+    char* envpara = getenv( "TRACE_BUFFER" );
+    int size = TRACE_BUFFER;
+    if( envpara ) size = atoi( envpara );
+    if( size < 1 ) size = 1;
+    return size;
+  }
+
+
+  static unsigned int getLogBufferSize(){
+    char* envpara = getenv( "LOG_BUFFER_SIZE" );
+    int size = LOG_BUFFER_SIZE;
+    if( envpara ) size = atoi( envpara );
+    if( size < 0 ) size = 0;
+    return size;
+  }
+
+
+  static int getHTTPKeepAliveTimeout(){
+    char* envpara = getenv( "HTTP_KEEPALIVE_TIMEOUT" );
+    int timeout = HTTP_KEEPALIVE_TIMEOUT;
+    if( envpara ) timeout = atoi( envpara );
+    if( timeout < 0 ) timeout = 0;
+    return timeout;
+  }
+
+
+  static unsigned int getWorkerThreads(){
+    char* envpara = getenv( "WORKER_THREADS" );
+    int workers = WORKER_THREADS;
+    if( envpara ) workers = atoi( envpara );
+    if( workers < 0 ) workers = 1;
+    return workers;
+  }
+
+
+  static unsigned int getKakaduThreads(){
+    char* envpara = getenv( "KAKADU_THREADS" );
+    int threads = KAKADU_THREADS;
+    if( envpara ) threads = atoi( envpara );
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static unsigned int getKakaduCodestreams(){
+    char* envpara = getenv( "KAKADU_CODESTREAMS" );
+    int codestreams = KAKADU_CODESTREAMS;
+    if( envpara ) codestreams = atoi( envpara );
+    if( codestreams < 0 ) codestreams = 0;
+    return codestreams;
+  }
+
+
+  static unsigned int getOpenJPEGThreads(){
+    char* envpara = getenv( "OPENJPEG_THREADS" );
+    int threads = OPENJPEG_THREADS;
+    if( envpara ) threads = atoi( envpara );
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static unsigned int getOpenJPEGCodestreams(){
+    char* envpara = getenv( "OPENJPEG_CODESTREAMS" );
+    int codestreams = OPENJPEG_CODESTREAMS;
+    if( envpara ) codestreams = atoi( envpara );
+    if( codestreams < 0 ) codestreams = 0;
+    return codestreams;
+  }
+
+
+  static float getJPEGLevelCacheSize(){
+    float jpeg_level_cache_size = JPEG_LEVEL_CACHE_SIZE;
+    char* envpara = getenv( "JPEG_LEVEL_CACHE_SIZE" );
+    if( envpara ){
+      jpeg_level_cache_size = atof( envpara );
+    }
+    if( jpeg_level_cache_size < 0 ) jpeg_level_cache_size = 0;
+    return jpeg_level_cache_size;
+  }
+
+
+  static float getStripedCacheSize(){
+    float striped_cache_size = STRIPED_CACHE_SIZE;
+    char* envpara = getenv( "STRIPED_CACHE_SIZE" );
+    if( envpara ){
+      striped_cache_size = atof( envpara );
+    }
+    if( striped_cache_size < 0 ) striped_cache_size = 0;
+    return striped_cache_size;
+  }
+
 };
 
 
@@ -20,16 +20,21 @@
 
 
 #include <algorithm>
+#include <vector>
 #include "Task.h"
 #include "URL.h"
 #include "Environment.h"
 #include "TPTImage.h"
+#include "JPEGImage.h"
+#include "Tokenizer.h"
 
 #ifdef HAVE_KAKADU
 #include "KakaduImage.h"
 #endif
 
-#define MAXIMAGECACHE 1000  // Max number of items in image cache
+#ifdef HAVE_OPENJPEG
+#include "OpenJPEGImage.h"
+#endif
 
 
 
@@ -37,6 +42,129 @@ using namespace std;
 
 
 
+/// Commands which only set parameters for the commands that follow them
+static const char* parameters[] = { "qlt", "sds", "minmax", "cnt", "gam", "wid", "hei", "rgn", "rot",
+				    "shd", "cmp", "inv", "lyr", "ctw", NULL };
+
+static bool isParameter( const pair<string,string>& command ){
+  for( unsigned int i=0; parameters[i]; i++ ) if( command.first == parameters[i] ) return true;
+  return false;
+}
+
+static bool byCommand( const pair<string,string>& a, const pair<string,string>& b ){
+  return a.first < b.first;
+}
+
+
+
+/// Put a query into a canonical form, in which the commands setting parameters for each of
+/// our other commands are lower case and in alphabetical order. Repeated commands are kept
+/// in their original order, as the last one wins
+static string canonicalOperation( const string& query ){
+
+  vector < pair<string,string> > commands;
+  Tokenizer izer( query, "&" );
+  while( izer.hasMoreTokens() ){
+    string token = izer.nextToken();
+    size_t n = token.find_first_of( "=" );
+    if( n == string::npos ) continue;
+    pair <string,string> p( token.substr( 0, n ), token.substr( n+1 ) );
+    if( p.first.empty() || p.second.empty() ) continue;
+    transform( p.first.begin(), p.first.end(), p.first.begin(), ::tolower );
+    commands.push_back( p );
+  }
+
+  vector < pair<string,string> >::iterator start = commands.begin();
+  while( start != commands.end() ){
+    vector < pair<string,string> >::iterator end = start;
+    while( end != commands.end() && isParameter( *end ) ) ++end;
+    stable_sort( start, end, byCommand );
+    start = ( end == commands.end() ) ? end : end + 1;
+  }
+
+  string operation;
+  for( vector < pair<string,string> >::const_iterator i = commands.begin(); i != commands.end(); ++i ){
+    operation += i->first + "=" + i->second + "&";
+  }
+  return operation;
+}
+
+
+
+string FIF::entityTag( time_t timestamp, const string& query, bool weak ){
+
+  string operation = canonicalOperation( query );
+
+  // 32 bit FNV-1a hash of our operation
+  unsigned int hash = 2166136261U;
+  for( unsigned int i=0; i<operation.length(); i++ ){
+    hash ^= (unsigned char) operation[i];
+    hash *= 16777619U;
+  }
+
+  char tag[64];
+  snprintf( tag, 64, "%s\"%lx-%lx-%08x\"", weak ? "W/" : "", (unsigned long) timestamp, (unsigned long) operation.length(), hash );
+  return string( tag );
+}
+
+
+
+/// Return the value of a request header or an empty string if it was not given
+static string getHeader( Session* session, const string& name ){
+  map<const string,string>::const_iterator it = session->headers.find( name );
+  return (it == session->headers.end()) ? string() : it->second;
+}
+
+
+
+bool FIF::notModified( Session* session, time_t timestamp, const string& etag ){
+
+  // As in RFC 7232, If-None-Match takes precedence over If-Modified-Since
+
+  string match = getHeader( session, "HTTP_IF_NONE_MATCH" );
+
+  if( !match.empty() ){
+    string ours = ( etag.substr(0,2) == "W/" ) ? etag.substr( 2 ) : etag;
+    // Compare against each tag in the list, using weak comparison as required for If-None-Match
+    Tokenizer izer( match, "," );
+    while( izer.hasMoreTokens() ){
+      string tag = izer.nextToken();
+      size_t start = tag.find_first_not_of( " \t" );
+      size_t end = tag.find_last_not_of( " \t" );
+      if( start == string::npos ) continue;
+      tag = tag.substr( start, end-start+1 );
+      if( tag.substr(0,2) == "W/" ) tag.erase( 0, 2 );
+      if( tag == "*" || tag == ours ) return true;
+    }
+    return false;
+  }
+
+  // Otherwise check whether we have had an if_modified_since header. If so, compare to our image timestamp
+  string since = getHeader( session, "HTTP_IF_MODIFIED_SINCE" );
+
+  if( !since.empty() ){
+
+    tm mod_t;
+    time_t t;
+
+    strptime( since.c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t );
+
+    // Use POSIX cross-platform mktime() function to generate a timestamp.
+    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
+    t = mktime(&mod_t);
+    if( (session->loglevel >= 1) && (t == -1) ) *(session->logfile) << "FIF :: Error creating timestamp" << endl;
+
+    if( timestamp <= t ) return true;
+    else if( session->loglevel >= 2 ){
+      *(session->logfile) << "FIF :: Content modified since requested time" << endl;
+    }
+  }
+
+  return false;
+}
+
+
+
 void FIF::run( Session* session, const string& src ){
 
   if( session->loglevel >= 3 ) *(session->logfile) << "FIF handler reached" << endl;
@@ -109,6 +237,25 @@ void FIF::run( Session* session, const string& src ){
     }
 
 
+    // We can answer conditional requests for cached images without opening the image at all:
+    // a stat() of the file is enough to check that our cached metadata is still current
+    if( timestamp > 0 && ( !getHeader( session, "HTTP_IF_NONE_MATCH" ).empty() ||
+			   !getHeader( session, "HTTP_IF_MODIFIED_SINCE" ).empty() ) ){
+      test.updateTimestamp( test.getFileName( test.currentX, test.currentY ) );
+      if( test.timestamp == timestamp ){
+	string etag = entityTag( timestamp, session->headers["QUERY_STRING"], session->watermark && session->watermark->isSet() );
+	session->response->setETag( etag );
+	if( notModified( session, timestamp, etag ) ){
+	  if( session->loglevel >= 2 ){
+	    *(session->logfile) << "FIF :: Unmodified content: answered from image cache" << endl;
+	    *(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+	  }
+	  throw( 304 );
+	}
+      }
+    }
+
+
 
     /***************************************************************
       Test for different image types - only TIFF is native for now
@@ -120,11 +267,20 @@ void FIF::run( Session* session, const string& src ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
       *session->image = new TPTImage( test );
     }
+    else if( format == JPG ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG image detected" << endl;
+      *session->image = new JPEGImage( test );
+    }
 #ifdef HAVE_KAKADU
     else if( format == JPEG2000 ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
       *session->image = new KakaduImage( test );
     }
+#elif defined(HAVE_OPENJPEG)
+    else if( format == JPEG2000 ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
+      *session->image = new OpenJPEGImage( test );
+    }
 #endif
     else throw string( "Unsupported image type: " + argument );
 
@@ -191,10 +347,7 @@ void FIF::run( Session* session, const string& src ){
 			  << "FIF :: Image contains " << (*session->image)->channels
 			  << " channel" << (((*session->image)->channels>1)?"s":"") << " with "
 			  << (*session->image)->bpc << " bit" << (((*session->image)->bpc>1)?"s":"") << " per channel" << endl;
-      tm *t = gmtime( &(*session->image)->timestamp );
-      char strt[64];
-      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
-      *(session->logfile) << "FIF :: Image timestamp: " << strt << endl;
+      *(session->logfile) << "FIF :: Image timestamp: " << (*session->image)->getTimestamp() << endl;
     }
 
   }
@@ -205,31 +358,19 @@ void FIF::run( Session* session, const string& src ){
   }
 
 
-  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
-  if( session->headers.find("HTTP_IF_MODIFIED_SINCE") != session->headers.end() ){
-
-    tm mod_t;
-    time_t t;
-
-    strptime( (session->headers)["HTTP_IF_MODIFIED_SINCE"].c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t );
-
-    // Use POSIX cross-platform mktime() function to generate a timestamp.
-    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
-    t = mktime(&mod_t);
-    if( (session->loglevel >= 1) && (t == -1) ) *(session->logfile) << "FIF :: Error creating timestamp" << endl;
+  // Our entity tag depends on the image timestamp and our full request. Randomly placed
+  // watermarks make responses differ, so our tag is then only weak
+  string etag = entityTag( (*session->image)->timestamp, session->headers["QUERY_STRING"],
+			   session->watermark && session->watermark->isSet() );
+  session->response->setETag( etag );
 
-    if( (*session->image)->timestamp <= t ){
-      if( session->loglevel >= 2 ){
-	*(session->logfile) << "FIF :: Unmodified content" << endl;
-	*(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-      }
-      throw( 304 );
-    }
-    else{
-      if( session->loglevel >= 2 ){
-	*(session->logfile) << "FIF :: Content modified since requested time" << endl;
-      }
+  // Check whether we have had a conditional request for content which is unchanged
+  if( notModified( session, (*session->image)->timestamp, etag ) ){
+    if( session->loglevel >= 2 ){
+      *(session->logfile) << "FIF :: Unmodified content" << endl;
+      *(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
     }
+    throw( 304 );
   }
 
   // Reset our angle values
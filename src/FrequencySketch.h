@@ -0,0 +1,130 @@
+// Approximate access frequency counter for cache admission
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _FREQUENCYSKETCH_H
+#define _FREQUENCYSKETCH_H
+
+
+#include <string>
+#include <vector>
+
+
+
+/// Count-min sketch of 4 bit counters as used by the TinyLFU cache admission policy
+/** Each key is counted in one counter in each of 4 rows and its frequency estimated
+    as the minimum of these. Once the number of increments reaches 10 times the
+    width of the sketch, all counters are halved so that old popularity decays.
+    Counters are packed 8 to an unsigned int. Not thread safe.
+ */
+class FrequencySketch {
+
+ private:
+
+  /// Number of rows
+  static const unsigned int depth = 4;
+
+  /// Counters per row: always a power of two
+  unsigned int width;
+
+  /// Packed counters: depth rows of width/8 words
+  std::vector <unsigned int> table;
+
+  /// Increments since the last reset and the number at which to reset
+  unsigned int additions, sampleSize;
+
+
+  /// FNV-1a hash of a key
+  unsigned int hash( const std::string& key ) const {
+    unsigned int h = 2166136261u;
+    for( std::string::const_iterator c = key.begin(); c != key.end(); ++c ){
+      h ^= (unsigned char) *c;
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+
+  /// Counter index within row i for a given hash, using double hashing
+  unsigned int slot( unsigned int h, unsigned int i ) const {
+    unsigned int h2 = (h >> 16) | (h << 16);
+    return ( h + i*(h2|1) ) & (width-1);
+  }
+
+
+  /// Get a counter
+  unsigned int get( unsigned int row, unsigned int n ) const {
+    return ( table[ row*(width/8) + n/8 ] >> ( (n%8)*4 ) ) & 0xF;
+  }
+
+
+  /// Halve all counters
+  void reset() {
+    for( std::vector<unsigned int>::iterator i = table.begin(); i != table.end(); ++i ){
+      *i = (*i >> 1) & 0x77777777u;
+    }
+    additions /= 2;
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param entries expected number of entries in the cache */
+  FrequencySketch( unsigned int entries = 1024 ) {
+    width = 8;
+    while( width < entries && width < (1u<<28) ) width <<= 1;
+    table.assign( depth*(width/8), 0 );
+    additions = 0;
+    sampleSize = 10*width;
+  };
+
+
+  /// Record an access to a key
+  void increment( const std::string& key ) {
+    unsigned int h = hash( key );
+    bool added = false;
+    for( unsigned int i = 0; i < depth; i++ ){
+      unsigned int n = slot( h, i );
+      if( get( i, n ) < 15 ){
+	table[ i*(width/8) + n/8 ] += ( 1u << ( (n%8)*4 ) );
+	added = true;
+      }
+    }
+    if( added && ++additions >= sampleSize ) reset();
+  }
+
+
+  /// Estimate the number of recent accesses to a key
+  unsigned int frequency( const std::string& key ) const {
+    unsigned int h = hash( key );
+    unsigned int f = 15;
+    for( unsigned int i = 0; i < depth; i++ ){
+      unsigned int c = get( i, slot( h, i ) );
+      if( c < f ) f = c;
+    }
+    return f;
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,925 @@
+// Built-in HTTP/1.1 server
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "HTTPServer.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_PTHREAD)
+#define HTTP_SERVER_SUPPORTED
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+// Maximum size of a request's headers
+#define HTTP_MAX_HEADER_SIZE 16384
+
+// Maximum request body we are prepared to read and discard
+#define HTTP_MAX_BODY_SIZE 1048576
+
+// Maximum number of events handled per epoll_wait() call
+#define HTTP_MAX_EVENTS 64
+
+// Reserved event identifiers for our listening socket and wake up pipe
+#define HTTP_LISTEN_ID 0
+#define HTTP_WAKE_ID 1
+
+
+
+/// Return the reason phrase for the status codes we generate ourselves
+static const char* reasonPhrase( int code ){
+  switch( code ){
+  case 200: return "OK";
+  case 302: return "Found";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 413: return "Payload Too Large";
+  case 431: return "Request Header Fields Too Large";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 505: return "HTTP Version Not Supported";
+  default: return "Unknown";
+  }
+}
+
+
+
+/// Case insensitive comparison of a header name
+static bool headerIs( const string& name, const char* match ){
+  size_t len = strlen( match );
+  if( name.length() != len ) return false;
+  for( size_t i = 0; i < len; i++ ){
+    if( tolower( name[i] ) != tolower( match[i] ) ) return false;
+  }
+  return true;
+}
+
+
+
+/// Remove leading and trailing white space
+static string trim( const string& s ){
+  size_t start = s.find_first_not_of( " \t" );
+  if( start == string::npos ) return string();
+  size_t end = s.find_last_not_of( " \t\r" );
+  return s.substr( start, end - start + 1 );
+}
+
+
+
+/// Return the current date formatted for the Date header
+static string httpDate(){
+  char buf[64];
+  time_t now = time( NULL );
+  struct tm t;
+#ifdef WIN32
+  t = *gmtime( &now );
+#else
+  gmtime_r( &now, &t );
+#endif
+  strftime( buf, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
+  return string( buf );
+}
+
+
+
+/// Build a complete plain text response for errors detected by the server itself
+static string errorResponse( int code, const string& reason, bool close ){
+
+  char status[64];
+  snprintf( status, 64, "%d %s", code, reasonPhrase(code) );
+
+  string body = string( status ) + ": " + reason + "\r\n";
+  char length[32];
+  snprintf( length, 32, "%lu", (unsigned long) body.size() );
+
+  return "HTTP/1.1 " + string( status ) + "\r\n"
+    + "Server: iipsrv/" + VERSION + "\r\n"
+    + "Date: " + httpDate() + "\r\n"
+    + "Content-Type: text/plain\r\n"
+    + "Content-Length: " + length + "\r\n"
+    + (code == 405 ? "Allow: GET, HEAD\r\n" : "")
+    + (close ? "Connection: close\r\n" : "")
+    + "\r\n" + body;
+}
+
+
+
+HTTPServer::HTTPServer( int t, ofstream* l, int level ){
+  timeout = t;
+  logfile = l;
+  loglevel = level;
+  listen_fd = -1;
+  epoll_fd = -1;
+  wake_fd[0] = wake_fd[1] = -1;
+  next_id = HTTP_WAKE_ID + 1;
+  last_sweep = 0;
+  stop = false;
+  running = false;
+}
+
+
+
+HTTPServer::~HTTPServer(){
+  this->shutdown();
+  while( !connections.empty() ) this->closeConnection( connections.begin()->second );
+  while( !requests.empty() ){ delete requests.front(); requests.pop_front(); }
+  while( !responses.empty() ){ delete responses.front(); responses.pop_front(); }
+#ifdef HTTP_SERVER_SUPPORTED
+  if( epoll_fd >= 0 ) ::close( epoll_fd );
+  if( listen_fd >= 0 ) ::close( listen_fd );
+  if( wake_fd[0] >= 0 ) ::close( wake_fd[0] );
+  if( wake_fd[1] >= 0 ) ::close( wake_fd[1] );
+#endif
+}
+
+
+
+HTTPRequest* HTTPServer::accept(){
+  ScopedLock lock( mutex );
+  while( requests.empty() && !stop ) condition.wait( mutex );
+  if( stop ) return NULL;
+  HTTPRequest* request = requests.front();
+  requests.pop_front();
+  return request;
+}
+
+
+
+void HTTPServer::finish( HTTPRequest* request ){
+
+  const char* data = request->writer.buffer;
+  size_t len = data ? request->writer.sz : 0;
+
+  // Find the end of the CGI headers written by our handler
+  size_t end = 0, body = 0;
+  bool found = false;
+  for( size_t i = 0; i < len; i++ ){
+    if( data[i] != '\n' ) continue;
+    if( i + 1 < len && data[i+1] == '\n' ){ end = i; body = i + 2; found = true; break; }
+    if( i + 2 < len && data[i+1] == '\r' && data[i+2] == '\n' ){ end = i; body = i + 3; found = true; break; }
+  }
+
+  if( !found ){
+    request->keep_alive = false;
+    request->header = errorResponse( 500, "no valid response generated", true );
+    request->body = NULL;
+    request->length = 0;
+  }
+  else{
+
+    // Turn our CGI headers into HTTP ones
+    string status = "200 OK";
+    bool has_status = false, has_location = false, has_encoding = false;
+    string headers;
+
+    size_t pos = 0;
+    while( pos <= end ){
+      const char* eol = (const char*) memchr( data + pos, '\n', end + 1 - pos );
+      size_t next = eol ? (eol - data) : end + 1;
+      string line( data + pos, next - pos );
+      pos = next + 1;
+      if( !line.empty() && line[line.length()-1] == '\r' ) line.erase( line.length() - 1 );
+
+      size_t colon = line.find( ':' );
+      if( colon == string::npos ) continue;
+      string name = line.substr( 0, colon );
+
+      if( headerIs( name, "Status" ) ){
+	status = trim( line.substr( colon + 1 ) );
+	has_status = true;
+	continue;
+      }
+      // We set our own Content-Length and Connection headers
+      if( headerIs( name, "Content-Length" ) || headerIs( name, "Connection" ) ) continue;
+      if( headerIs( name, "Location" ) ) has_location = true;
+      if( headerIs( name, "Transfer-Encoding" ) ) has_encoding = true;
+
+      headers += line + "\r\n";
+    }
+
+    // As in CGI, a Location header without a status is a redirect
+    if( !has_status && has_location ) status = "302 Found";
+
+    // HTTP/1.0 clients do not understand chunked responses, so mark the end by closing
+    if( has_encoding && request->protocol == "HTTP/1.0" ) request->keep_alive = false;
+
+    int code = atoi( status.c_str() );
+    size_t length = len - body;
+    bool no_body = request->head || code == 304 || code == 204 || (code >= 100 && code < 200);
+
+    string& header = request->header;
+    header = request->protocol + " " + status + "\r\n" + "Date: " + httpDate() + "\r\n" + headers;
+    if( !has_encoding && code != 304 && code != 204 ){
+      char tmp[32];
+      snprintf( tmp, 32, "%lu", (unsigned long) length );
+      header += string( "Content-Length: " ) + tmp + "\r\n";
+    }
+    if( !request->keep_alive ) header += "Connection: close\r\n";
+    else if( request->protocol == "HTTP/1.0" ) header += "Connection: keep-alive\r\n";
+    header += "\r\n";
+
+    request->body = no_body ? NULL : data + body;
+    request->length = no_body ? 0 : length;
+  }
+
+  // Hand our response to the I/O thread
+  {
+    ScopedLock lock( mutex );
+    responses.push_back( request );
+  }
+#ifdef HTTP_SERVER_SUPPORTED
+  char c = 0;
+  while( ::write( wake_fd[1], &c, 1 ) < 0 && errno == EINTR );
+#endif
+}
+
+
+
+#ifdef HTTP_SERVER_SUPPORTED
+
+
+bool HTTPServer::open( const string& address, int backlog ){
+
+  // Split our address into host and port, listening on all interfaces if no host is given
+  string host;
+  size_t colon = address.rfind( ':' );
+  if( colon == string::npos ) port = address;
+  else{
+    host = address.substr( 0, colon );
+    port = address.substr( colon + 1 );
+  }
+  // Allow IPv6 addresses in square brackets
+  if( host.length() > 1 && host[0] == '[' && host[host.length()-1] == ']' ){
+    host = host.substr( 1, host.length() - 2 );
+  }
+
+  if( port.empty() ){
+    error = "no port specified";
+    return false;
+  }
+
+  struct addrinfo hints, *res = NULL;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int status = getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res );
+  if( status != 0 ){
+    error = gai_strerror( status );
+    return false;
+  }
+
+  for( struct addrinfo *r = res; r; r = r->ai_next ){
+    listen_fd = socket( r->ai_family, r->ai_socktype, r->ai_protocol );
+    if( listen_fd < 0 ) continue;
+    int on = 1;
+    setsockopt( listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+    if( bind( listen_fd, r->ai_addr, r->ai_addrlen ) == 0 && listen( listen_fd, backlog ) == 0 ) break;
+    ::close( listen_fd );
+    listen_fd = -1;
+  }
+  freeaddrinfo( res );
+
+  if( listen_fd < 0 ){
+    error = strerror( errno );
+    return false;
+  }
+
+  fcntl( listen_fd, F_SETFL, fcntl( listen_fd, F_GETFL, 0 ) | O_NONBLOCK );
+
+  // Our workers wake the I/O thread through this pipe when they have a response
+  if( pipe( wake_fd ) < 0 ){
+    error = strerror( errno );
+    return false;
+  }
+  fcntl( wake_fd[0], F_SETFL, fcntl( wake_fd[0], F_GETFL, 0 ) | O_NONBLOCK );
+
+  epoll_fd = epoll_create( HTTP_MAX_EVENTS );
+  if( epoll_fd < 0 ){
+    error = strerror( errno );
+    return false;
+  }
+
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = EPOLLIN;
+  event.data.u64 = HTTP_LISTEN_ID;
+  if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, listen_fd, &event ) < 0 ){
+    error = strerror( errno );
+    return false;
+  }
+  event.data.u64 = HTTP_WAKE_ID;
+  if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, wake_fd[0], &event ) < 0 ){
+    error = strerror( errno );
+    return false;
+  }
+
+  return true;
+}
+
+
+
+bool HTTPServer::start(){
+  if( epoll_fd < 0 ){
+    error = "not listening";
+    return false;
+  }
+  if( !running ){
+    if( pthread_create( &thread, NULL, HTTPServer::worker, this ) != 0 ){
+      error = strerror( errno );
+      return false;
+    }
+    running = true;
+  }
+  return true;
+}
+
+
+
+void HTTPServer::shutdown(){
+  {
+    ScopedLock lock( mutex );
+    stop = true;
+    condition.broadcast();
+  }
+  if( running ){
+    char c = 0;
+    while( ::write( wake_fd[1], &c, 1 ) < 0 && errno == EINTR );
+    pthread_join( thread, NULL );
+    running = false;
+  }
+}
+
+
+
+void* HTTPServer::worker( void* s ){
+  ((HTTPServer*) s)->run();
+  return NULL;
+}
+
+
+
+void HTTPServer::run(){
+
+  struct epoll_event events[HTTP_MAX_EVENTS];
+
+  while( !stop ){
+
+    int n = epoll_wait( epoll_fd, events, HTTP_MAX_EVENTS, 1000 );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      if( loglevel >= 1 ) *logfile << "HTTPServer :: epoll_wait failed: " << strerror( errno ) << endl;
+      break;
+    }
+
+    for( int i = 0; i < n; i++ ){
+
+      unsigned long id = events[i].data.u64;
+
+      if( id == HTTP_LISTEN_ID ){
+	this->acceptConnections();
+	continue;
+      }
+
+      if( id == HTTP_WAKE_ID ){
+	char buf[256];
+	while( ::read( wake_fd[0], buf, sizeof(buf) ) > 0 );
+	this->sendResponses();
+	continue;
+      }
+
+      map<unsigned long,Connection*>::iterator it = connections.find( id );
+      if( it == connections.end() ) continue;
+      Connection* c = it->second;
+
+      if( events[i].events & EPOLLOUT ) this->transmit( c );
+      if( connections.find( id ) == connections.end() ) continue;
+
+      if( events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP) ) this->receive( c );
+    }
+
+    this->sweep();
+  }
+
+  // Make sure no worker is left waiting for a request
+  ScopedLock lock( mutex );
+  stop = true;
+  condition.broadcast();
+}
+
+
+
+void HTTPServer::acceptConnections(){
+
+  while( true ){
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int fd = ::accept( listen_fd, (struct sockaddr*) &addr, &len );
+    if( fd < 0 ){
+      if( errno == EINTR ) continue;
+      // EAGAIN means there are no more connections waiting
+      return;
+    }
+
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL, 0 ) | O_NONBLOCK );
+    fcntl( fd, F_SETFD, FD_CLOEXEC );
+    int on = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+    char ip[INET6_ADDRSTRLEN] = "";
+    if( addr.ss_family == AF_INET ){
+      inet_ntop( AF_INET, &((struct sockaddr_in*) &addr)->sin_addr, ip, sizeof(ip) );
+    }
+    else if( addr.ss_family == AF_INET6 ){
+      inet_ntop( AF_INET6, &((struct sockaddr_in6*) &addr)->sin6_addr, ip, sizeof(ip) );
+    }
+
+    Connection* c = new Connection;
+    c->id = next_id++;
+    c->fd = fd;
+    c->address = ip;
+    c->sent = 0;
+    c->last = time( NULL );
+    c->busy = false;
+    c->close = false;
+
+    struct epoll_event event;
+    memset( &event, 0, sizeof(event) );
+    event.events = EPOLLIN;
+    event.data.u64 = c->id;
+    if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event ) < 0 ){
+      ::close( fd );
+      delete c;
+      continue;
+    }
+
+    connections[c->id] = c;
+
+    if( loglevel >= 3 ){
+      *logfile << "HTTPServer :: connection from " << c->address << endl;
+    }
+  }
+}
+
+
+
+void HTTPServer::receive( Connection* c ){
+
+  char buf[16384];
+
+  while( true ){
+    ssize_t n = ::recv( c->fd, buf, sizeof(buf), 0 );
+    if( n > 0 ){
+      c->in.append( buf, n );
+      c->last = time( NULL );
+      // Stop reading once we have more than a maximal request's worth of data, leaving
+      //  the remainder in the socket until earlier requests have been handled
+      if( c->in.size() > HTTP_MAX_HEADER_SIZE + HTTP_MAX_BODY_SIZE ) break;
+      continue;
+    }
+    if( n < 0 && errno == EINTR ) continue;
+    if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+    // The client has closed the connection or there has been an error. If a worker is
+    //  still handling a request, its response will simply be discarded
+    this->closeConnection( c );
+    return;
+  }
+
+  this->dispatch( c );
+}
+
+
+
+void HTTPServer::dispatch( Connection* c ){
+
+  unsigned long id = c->id;
+
+  // Only one request per connection is handled at a time, so that pipelined responses
+  //  go out in order. Errors we detect ourselves are answered immediately, so keep
+  //  going until we have a request for a worker or need more data
+  while( !c->busy && !c->close && !c->in.empty() ){
+
+    size_t available = c->in.size();
+    HTTPRequest* request = this->parse( c );
+
+    // Our connection may have been closed after responding to an invalid request
+    if( connections.find( id ) == connections.end() ) return;
+
+    if( request ){
+      c->busy = true;
+      ScopedLock lock( mutex );
+      requests.push_back( request );
+      condition.signal();
+      break;
+    }
+
+    // Nothing was consumed, so we must wait for the rest of the request
+    if( c->in.size() == available ) break;
+  }
+
+  this->watch( c );
+}
+
+
+
+void HTTPServer::sendResponses(){
+
+  deque<HTTPRequest*> ready;
+  {
+    ScopedLock lock( mutex );
+    ready.swap( responses );
+  }
+
+  for( deque<HTTPRequest*>::iterator i = ready.begin(); i != ready.end(); ++i ){
+
+    HTTPRequest* request = *i;
+    map<unsigned long,Connection*>::iterator it = connections.find( request->connection );
+
+    // The client may have gone away in the meantime
+    if( it != connections.end() ){
+      Connection* c = it->second;
+      unsigned long id = c->id;
+      c->busy = false;
+      if( !request->keep_alive ) c->close = true;
+      this->respond( c, request->header, request->body, request->length );
+      // Look for any pipelined request already received
+      if( connections.find( id ) != connections.end() ) this->dispatch( c );
+    }
+
+    delete request;
+  }
+}
+
+
+
+void HTTPServer::watch( Connection* c ){
+
+  // Only ask to be told when we can write if we still have something to send and
+  //  stop reading once our input buffer is full until earlier requests are handled
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = 0;
+  if( c->out.size() > c->sent ) event.events |= EPOLLOUT;
+  if( c->in.size() <= HTTP_MAX_HEADER_SIZE + HTTP_MAX_BODY_SIZE ) event.events |= EPOLLIN;
+  event.data.u64 = c->id;
+  epoll_ctl( epoll_fd, EPOLL_CTL_MOD, c->fd, &event );
+}
+
+
+
+void HTTPServer::transmit( Connection* c ){
+
+  while( c->out.size() > c->sent ){
+    ssize_t n = ::send( c->fd, c->out.data() + c->sent, c->out.size() - c->sent, MSG_NOSIGNAL );
+    if( n < 0 && errno == EINTR ) continue;
+    if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+    if( n <= 0 ){
+      this->closeConnection( c );
+      return;
+    }
+    c->sent += n;
+    c->last = time( NULL );
+  }
+
+  if( c->sent == c->out.size() ){
+    c->out.clear();
+    c->sent = 0;
+    if( c->close && !c->busy ){
+      this->closeConnection( c );
+      return;
+    }
+  }
+
+  this->watch( c );
+}
+
+
+
+void HTTPServer::respond( Connection* c, const string& header, const char* body, size_t len ){
+
+  // If nothing is queued, send directly from the response buffers and only
+  //  copy whatever the socket would not take
+  if( c->out.empty() ){
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void*) header.data();
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = (void*) body;
+    iov[1].iov_len = body ? len : 0;
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n;
+    do{ n = sendmsg( c->fd, &msg, MSG_NOSIGNAL ); }
+    while( n < 0 && errno == EINTR );
+
+    if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ){
+      this->closeConnection( c );
+      return;
+    }
+    if( n < 0 ) n = 0;
+
+    size_t sent = n;
+    if( sent < header.size() ){
+      c->out.append( header, sent, string::npos );
+      sent = 0;
+    }
+    else sent -= header.size();
+    if( body && sent < len ) c->out.append( body + sent, len - sent );
+    c->last = time( NULL );
+  }
+  else{
+    c->out.append( header );
+    if( body ) c->out.append( body, len );
+  }
+
+  this->transmit( c );
+}
+
+
+
+void HTTPServer::respondError( Connection* c, int code, const string& reason, bool close ){
+
+  if( loglevel >= 2 ){
+    *logfile << "HTTPServer :: " << code << " " << reason << " for request from " << c->address << endl;
+  }
+
+  if( close ) c->close = true;
+  this->respond( c, errorResponse( code, reason, c->close ), NULL, 0 );
+}
+
+
+
+void HTTPServer::closeConnection( Connection* c ){
+  if( loglevel >= 3 ){
+    *logfile << "HTTPServer :: closing connection from " << c->address << endl;
+  }
+  epoll_ctl( epoll_fd, EPOLL_CTL_DEL, c->fd, NULL );
+  ::close( c->fd );
+  connections.erase( c->id );
+  delete c;
+}
+
+
+
+void HTTPServer::sweep(){
+
+  time_t now = time( NULL );
+  if( now == last_sweep ) return;
+  last_sweep = now;
+
+  vector<Connection*> idle;
+  for( map<unsigned long,Connection*>::iterator i = connections.begin(); i != connections.end(); ++i ){
+    Connection* c = i->second;
+    if( !c->busy && now - c->last > timeout ) idle.push_back( c );
+  }
+  for( vector<Connection*>::iterator i = idle.begin(); i != idle.end(); ++i ){
+    this->closeConnection( *i );
+  }
+}
+
+
+
+HTTPRequest* HTTPServer::parse( Connection* c ){
+
+  string& in = c->in;
+
+  // Ignore any empty lines preceding the request
+  size_t start = in.find_first_not_of( "\r\n" );
+  if( start == string::npos ){
+    in.clear();
+    return NULL;
+  }
+  if( start > 0 ) in.erase( 0, start );
+
+  // Find the blank line ending our headers, allowing for bare LF line endings
+  size_t end = string::npos, body = 0;
+  for( size_t i = in.find( '\n' ); i != string::npos; i = in.find( '\n', i + 1 ) ){
+    if( i + 1 < in.size() && in[i+1] == '\n' ){ end = i; body = i + 2; break; }
+    if( i + 2 < in.size() && in[i+1] == '\r' && in[i+2] == '\n' ){ end = i; body = i + 3; break; }
+  }
+
+  if( (end == string::npos && in.size() > HTTP_MAX_HEADER_SIZE) ||
+      (end != string::npos && end > HTTP_MAX_HEADER_SIZE) ){
+    this->respondError( c, 431, "request headers too large", true );
+    return NULL;
+  }
+  if( end == string::npos ) return NULL;
+
+  // Split our headers into lines
+  vector<string> lines;
+  size_t pos = 0;
+  while( pos <= end ){
+    size_t eol = in.find( '\n', pos );
+    string line = in.substr( pos, eol - pos );
+    if( !line.empty() && line[line.length()-1] == '\r' ) line.erase( line.length() - 1 );
+    lines.push_back( line );
+    pos = eol + 1;
+  }
+
+  // Parse our request line
+  string& line = lines[0];
+  size_t s1 = line.find( ' ' );
+  size_t s2 = (s1 == string::npos) ? string::npos : line.find( ' ', s1 + 1 );
+  if( s2 == string::npos ){
+    this->respondError( c, 400, "malformed request line", true );
+    return NULL;
+  }
+  string method = line.substr( 0, s1 );
+  string uri = line.substr( s1 + 1, s2 - s1 - 1 );
+  string protocol = line.substr( s2 + 1 );
+
+  if( protocol.compare( 0, 7, "HTTP/1." ) != 0 ){
+    this->respondError( c, 505, "unsupported protocol " + protocol, true );
+    return NULL;
+  }
+
+  HTTPRequest* request = new HTTPRequest;
+  request->connection = c->id;
+  request->protocol = protocol;
+
+  // HTTP/1.1 connections persist by default, HTTP/1.0 ones only if asked
+  request->keep_alive = (protocol != "HTTP/1.0");
+
+  vector<string>& environment = request->environment;
+  environment.push_back( "GATEWAY_INTERFACE=CGI/1.1" );
+  environment.push_back( string( "SERVER_SOFTWARE=iipsrv/" ) + VERSION );
+  environment.push_back( "SERVER_PROTOCOL=" + protocol );
+  environment.push_back( "SERVER_PORT=" + port );
+  environment.push_back( "REQUEST_METHOD=" + method );
+  environment.push_back( "REMOTE_ADDR=" + c->address );
+
+  unsigned long content_length = 0;
+  bool chunked = false;
+
+  for( unsigned int i = 1; i < lines.size(); i++ ){
+
+    size_t colon = lines[i].find( ':' );
+    if( colon == string::npos || colon == 0 ) continue;
+    string name = lines[i].substr( 0, colon );
+    string value = trim( lines[i].substr( colon + 1 ) );
+
+    if( headerIs( name, "Content-Length" ) ){
+      content_length = strtoul( value.c_str(), NULL, 10 );
+      environment.push_back( "CONTENT_LENGTH=" + value );
+      continue;
+    }
+    if( headerIs( name, "Content-Type" ) ){
+      environment.push_back( "CONTENT_TYPE=" + value );
+      continue;
+    }
+    if( headerIs( name, "Transfer-Encoding" ) ) chunked = true;
+    if( headerIs( name, "Connection" ) ){
+      string v = value;
+      for( unsigned int j = 0; j < v.length(); j++ ) v[j] = tolower( v[j] );
+      if( v.find( "close" ) != string::npos ) request->keep_alive = false;
+      else if( v.find( "keep-alive" ) != string::npos ) request->keep_alive = true;
+    }
+
+    // Other headers become HTTP_ variables as in CGI
+    string variable = "HTTP_";
+    for( unsigned int j = 0; j < name.length(); j++ ){
+      variable += ( name[j] == '-' ) ? '_' : toupper( name[j] );
+    }
+    environment.push_back( variable + "=" + value );
+  }
+
+  // A zero timeout disables persistent connections
+  if( timeout == 0 ) request->keep_alive = false;
+
+  // We have no use for request bodies, but must read past them to find the next request
+  if( chunked ){
+    delete request;
+    this->respondError( c, 501, "chunked request bodies are not supported", true );
+    return NULL;
+  }
+  if( content_length > HTTP_MAX_BODY_SIZE ){
+    delete request;
+    this->respondError( c, 413, "request body too large", true );
+    return NULL;
+  }
+  if( in.size() < body + content_length ){
+    delete request;
+    return NULL;
+  }
+  in.erase( 0, body + content_length );
+
+  if( method != "GET" && method != "HEAD" ){
+    bool close = !request->keep_alive;
+    delete request;
+    this->respondError( c, 405, "method " + method + " not allowed", close );
+    return NULL;
+  }
+  request->head = ( method == "HEAD" );
+
+  // Split off our query string
+  string path = uri;
+  string query;
+  if( path.compare( 0, 7, "http://" ) == 0 || path.compare( 0, 8, "https://" ) == 0 ){
+    size_t slash = path.find( '/', path.find( "//" ) + 2 );
+    path = (slash == string::npos) ? "/" : path.substr( slash );
+  }
+  size_t q = path.find( '?' );
+  if( q != string::npos ){
+    query = path.substr( q + 1 );
+    path = path.substr( 0, q );
+  }
+
+  // Map our protocol paths onto the equivalent queries
+  string script = path;
+  const char* prefixes[][2] = { { "/iiif/", "IIIF=" }, { "/deepzoom/", "DeepZoom=" }, { "/zoomify/", "Zoomify=" } };
+  for( unsigned int i = 0; i < 3; i++ ){
+    size_t len = strlen( prefixes[i][0] );
+    if( path.compare( 0, len, prefixes[i][0] ) == 0 ){
+      script = path.substr( 0, len - 1 );
+      query = prefixes[i][1] + path.substr( len );
+      break;
+    }
+  }
+
+  environment.push_back( "REQUEST_URI=" + uri );
+  environment.push_back( "SCRIPT_NAME=" + script );
+  environment.push_back( "QUERY_STRING=" + query );
+
+  request->envp.clear();
+  for( unsigned int i = 0; i < environment.size(); i++ ){
+    request->envp.push_back( const_cast<char*>( environment[i].c_str() ) );
+  }
+  request->envp.push_back( NULL );
+
+  if( loglevel >= 3 ){
+    *logfile << "HTTPServer :: " << method << " " << uri << " " << protocol << " from " << c->address << endl;
+  }
+
+  return request;
+}
+
+
+#else
+
+
+// Without epoll and pthreads we cannot run our own server
+
+bool HTTPServer::open( const string& address, int backlog ){
+  error = "not supported on this platform";
+  return false;
+}
+
+bool HTTPServer::start(){
+  error = "not supported on this platform";
+  return false;
+}
+
+void HTTPServer::shutdown(){
+  ScopedLock lock( mutex );
+  stop = true;
+  condition.broadcast();
+}
+
+void HTTPServer::closeConnection( Connection* c ){
+  connections.erase( c->id );
+  delete c;
+}
+
+
+#endif
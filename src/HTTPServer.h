@@ -0,0 +1,239 @@
+// Built-in HTTP/1.1 server
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <fstream>
+#include <ctime>
+
+#include "Writer.h"
+#include "Mutex.h"
+
+
+
+/// A request received by our HTTP server
+/** Handed to a worker thread by HTTPServer::accept() and returned with its response
+    to HTTPServer::finish(). Provides a CGI style environment, so that the rest of the
+    server can read it exactly as it does a FastCGI request, and a writer which holds
+    the complete response.
+ */
+class HTTPRequest {
+
+  friend class HTTPServer;
+
+ private:
+
+  /// Identifier of the connection on which the request arrived
+  unsigned long connection;
+
+  bool head;
+  bool keep_alive;
+  std::string protocol;
+
+  /// CGI style environment
+  std::vector <std::string> environment;
+  std::vector <char*> envp;
+
+  HTTPWriter writer;
+
+  /// Our HTTP response status line and headers and the body to follow them
+  std::string header;
+  const char* body;
+  size_t length;
+
+
+ public:
+
+  /// Constructor
+  HTTPRequest(){
+    connection = 0;
+    head = keep_alive = false;
+    body = NULL;
+    length = 0;
+    envp.push_back( NULL );
+  };
+
+  /// Return our environment for use with FCGX_GetParam()
+  char** getEnvironment(){ return &envp[0]; };
+
+  /// Return the writer for our response
+  Writer& getWriter(){ return writer; };
+
+};
+
+
+
+/// Minimal event driven HTTP/1.1 server allowing iipsrv to be reached without FastCGI
+/** A single I/O thread owns the listening socket and all client connections, which
+    are multiplexed with epoll. It reads and parses requests without blocking, queues
+    complete requests for any number of worker threads to take with accept(), and
+    sends the responses that the workers return with finish(), so that slow clients
+    never hold up a worker. Persistent connections and pipelined requests are
+    supported: requests on the same connection are handled one at a time so that
+    responses go out in order. URL paths of the form /iiif/..., /deepzoom/... and
+    /zoomify/... are mapped onto the corresponding protocol queries, while any other
+    path uses its query string as is. Only GET and HEAD are supported. Requires epoll
+    and pthreads: open() fails on systems without them.
+ */
+class HTTPServer {
+
+ private:
+
+  /// A client connection
+  struct Connection {
+    unsigned long id;
+    int fd;
+    std::string address;   ///< Client IP address
+    std::string in;        ///< Data received but not yet parsed
+    std::string out;       ///< Response data not yet sent
+    size_t sent;           ///< Amount of out already sent
+    time_t last;           ///< Time of last activity
+    bool busy;             ///< Whether a worker is handling a request from this connection
+    bool close;            ///< Whether to close once our output is sent
+  };
+
+  int listen_fd;
+  int epoll_fd;
+  int wake_fd[2];
+  int timeout;
+  std::string port;
+
+  /// Our connections indexed by identifier, which unlike socket numbers are never reused
+  std::map <unsigned long, Connection*> connections;
+  unsigned long next_id;
+
+  /// Requests waiting for a worker and responses waiting to be sent
+  std::deque <HTTPRequest*> requests;
+  std::deque <HTTPRequest*> responses;
+  Mutex mutex;
+  Condition condition;
+
+  time_t last_sweep;
+  volatile bool stop;
+  bool running;
+
+  std::ofstream* logfile;
+  int loglevel;
+
+  std::string error;
+
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+
+  /// pthread entry point
+  static void* worker( void* s );
+#endif
+
+  /// Our event loop
+  void run();
+
+  /// Accept any pending connections on our listening socket
+  void acceptConnections();
+
+  /// Read whatever is available from a connection
+  void receive( Connection* c );
+
+  /// Hand the next request on a connection to our workers unless one is already being handled
+  void dispatch( Connection* c );
+
+  /// Try to parse a request buffered on a connection, answering invalid requests directly
+  /** @return request if a complete one was available, otherwise NULL */
+  HTTPRequest* parse( Connection* c );
+
+  /// Send responses returned by our workers
+  void sendResponses();
+
+  /// Send as much pending output as possible, closing the connection if done with
+  void transmit( Connection* c );
+
+  /// Queue response data on a connection and try to send it
+  /** @param header response status line and headers
+      @param body response body or NULL
+      @param len body length
+   */
+  void respond( Connection* c, const std::string& header, const char* body, size_t len );
+
+  /// Send an error response generated by ourselves rather than by iipsrv
+  void respondError( Connection* c, int code, const std::string& reason, bool close );
+
+  /// Close and remove a connection
+  void closeConnection( Connection* c );
+
+  /// Close connections idle for longer than our timeout
+  void sweep();
+
+  /// Update the events we wait for on a connection
+  void watch( Connection* c );
+
+  HTTPServer( const HTTPServer& );
+  HTTPServer& operator = ( const HTTPServer& );
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param t keep-alive timeout in seconds
+   * @param l log stream for use by our I/O thread
+   * @param level log level
+   */
+  HTTPServer( int t, std::ofstream* l, int level );
+
+  /// Destructor: stops our I/O thread and closes all connections
+  ~HTTPServer();
+
+  /// Start listening
+  /** @param address host:port or :port to listen on
+      @param backlog listen backlog
+      @return false on failure, with the reason available from getError()
+   */
+  bool open( const std::string& address, int backlog );
+
+  /// Start our I/O thread
+  /** @return false on failure, with the reason available from getError() */
+  bool start();
+
+  /// Stop our I/O thread and wake up any workers waiting in accept()
+  void shutdown();
+
+  /// Wait for the next request. May be called by several threads at once
+  /** @return request, which must be passed to finish() once handled, or NULL if we are shutting down */
+  HTTPRequest* accept();
+
+  /// Send the response written for a request and release the request
+  /** The CGI style response is converted to HTTP in the calling thread before
+      being handed to our I/O thread for sending */
+  void finish( HTTPRequest* request );
+
+  /// Return a description of our last error
+  std::string getError(){ return error; };
+
+};
+
+
+#endif
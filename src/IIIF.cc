@@ -123,6 +123,10 @@ void IIIF::run( Session* session, const string& src ){
   }
 
 
+  // Our info.json is sent from our descriptor cache if we have already generated it for this image
+  if( suffix == "info.json" && sendDescriptor( session ) ) return;
+
+
   // Check whether requested image exists
   FIF fif;
   fif.run( session, filename );
@@ -142,6 +146,13 @@ void IIIF::run( Session* session, const string& src ){
   session->view->setImageSize( width, height );
   session->view->setMaxResolutions( numResolutions );
 
+  // Our requested region in full resolution pixels if given in pixels rather than percent
+  bool pixel_region = true;
+  unsigned int region_x = 0, region_y = 0, region_w = width, region_h = height;
+
+  // Whether our requested width or height was calculated by us rather than given
+  bool derived_width = false, derived_height = false;
+
 
   // PARSE INPUT PARAMETERS
 
@@ -226,13 +237,13 @@ void IIIF::run( Session* session, const string& src ){
     header << "Server: iipsrv/" << VERSION << eof
 	   << "Content-Type: application/ld+json" << eof
 	   << "Last-Modified: " << (*session->image)->getTimestamp() << eof
-	   << session->response->getCacheControl() << eof;
+	   << session->response->getCacheControl() << eof
+	   << session->response->getETag();
 
     if( !cors.empty() ) header << cors << eof;
     header << eof << infoStringStream.str();
 
-    session->out->printf( (const char*) header.str().c_str() );
-    session->response->setImageSent();
+    storeDescriptor( session, header.str() );
 
     return;
 
@@ -306,6 +317,19 @@ void IIIF::run( Session* session, const string& src ){
 	  throw invalid_argument( "IIIF: incorrect region format: " + regionString );
         }
 
+	// Note whole pixel regions, clipped to the image, for our tile alignment check below
+	if( isPCT || region[0] < 0.0 || region[1] < 0.0 || region[0] >= wd || region[1] >= hd ||
+	    region[0] != floor(region[0]) || region[1] != floor(region[1]) ||
+	    region[2] != floor(region[2]) || region[3] != floor(region[3]) ){
+	  pixel_region = false;
+	}
+	else{
+	  region_x = (unsigned int) region[0];
+	  region_y = (unsigned int) region[1];
+	  region_w = ( region[2] < wd - region[0] ) ? (unsigned int) region[2] : width - region_x;
+	  region_h = ( region[3] < hd - region[1] ) ? (unsigned int) region[3] : height - region_y;
+	}
+
       } // end of else - end of parsing x,y,w,h
 
       numOfTokens++;
@@ -343,6 +367,7 @@ void IIIF::run( Session* session, const string& src ){
 
 	requested_width = round( requested_width * scale / 100.0 );
 	requested_height = round( requested_height * scale / 100.0 );
+	derived_width = derived_height = true;
       }
 
       // "w,h", "w,", ",h", "!w,h" requests
@@ -365,6 +390,7 @@ void IIIF::run( Session* session, const string& src ){
 	  istringstream i( sizeString.substr( 1, string::npos ) );
 	  if( !(i >> requested_height) ) throw invalid_argument( "invalid height" );
 	  requested_width = round( (float)requested_height*session->view->getViewWidth()/session->view->getViewHeight() );
+	  derived_width = true;
 	}
 
 	// If comma is not at the beginning, we must have a "width,height" or "width," request
@@ -373,6 +399,7 @@ void IIIF::run( Session* session, const string& src ){
 	  istringstream i( sizeString.substr( 0, string::npos - 1 ) );
 	  if( !(i >> requested_width ) ) throw invalid_argument( "invalid width" );
 	  requested_height = round( (float)requested_width*session->view->getViewHeight()/session->view->getViewWidth() );
+	  derived_height = true;
 	}
 
 	// Remaining case is "width,height"
@@ -520,39 +547,51 @@ void IIIF::run( Session* session, const string& src ){
   unsigned int im_width = (*session->image)->image_widths[numResolutions-requested_res-1];
   unsigned int im_height = (*session->image)->image_heights[numResolutions-requested_res-1];
 
-  unsigned int view_left, view_top;
-
-  if( session->view->viewPortSet() ){
-    // Set the absolute viewport size and extract the co-ordinates
-    view_left = session->view->getViewLeft();
-    view_top = session->view->getViewTop();
-  }
-  else{
-    view_left = 0;
-    view_top = 0;
+  // Determine whether this is a tile request which coincides with one of the tiles of our
+  // pyramid, including the smaller tiles along the right and bottom edges. IIIF tile requests
+  // are given in full resolution pixels, so our tiles cover tw and th times this scale factor.
+  // Such requests are passed to JTL, which can send the tile straight from our tile cache
+  unsigned int scale = 1 << (numResolutions-requested_res-1);
+  bool tile_request = false;
+  unsigned int tile = 0;
+
+  if( pixel_region && session->view->getRotation() == 0 &&
+      (region_x % (tw*scale) == 0) && (region_y % (th*scale) == 0) ){
+
+    // Tile column and row
+    unsigned int i = region_x / (tw*scale);
+    unsigned int j = region_y / (th*scale);
+
+    if( i*tw < im_width && j*th < im_height ){
+
+      // Size of this tile, which is smaller along the right and bottom edges, and the region it covers
+      unsigned int tile_w = ( (i+1)*tw > im_width ) ? im_width - i*tw : tw;
+      unsigned int tile_h = ( (j+1)*th > im_height ) ? im_height - j*th : th;
+      unsigned int region_tw = ( region_x + tw*scale > width ) ? width - region_x : tw*scale;
+      unsigned int region_th = ( region_y + th*scale > height ) ? height - region_y : th*scale;
+
+      // Any size we have calculated ourselves may differ by a pixel through rounding
+      unsigned int dw = ( requested_width > tile_w ) ? requested_width - tile_w : tile_w - requested_width;
+      unsigned int dh = ( requested_height > tile_h ) ? requested_height - tile_h : tile_h - requested_height;
+
+      if( region_w == region_tw && region_h == region_th &&
+	  ( dw == 0 || (derived_width && dw == 1) ) &&
+	  ( dh == 0 || (derived_height && dh == 1) ) ){
+
+	// Calculate the number of tiles in each direction and our tile index
+	unsigned int ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
+	tile = (j*ntlx) + i;
+	tile_request = true;
+      }
+    }
   }
 
 
-  // Determine whether this is a tile request which coincides with our tile boundaries
-  if( ( session->view->maintain_aspect && (requested_res>0) &&
-	(requested_width == tw) && (requested_height == th) &&
-	(view_left%tw == 0) && (view_top%th == 0) &&
- 	(session->view->getViewWidth()<im_width) && (session->view->getViewHeight()<im_height) )
-      ||
-      ( session->view->maintain_aspect && (requested_res==0) &&
-	(requested_width==im_width) && (requested_height==im_height) )
-      ){
-
-    // Get the width and height for last row and column tiles
-    unsigned int rem_x = im_width % tw;
+  if( tile_request ){
 
-    // Calculate the number of tiles in each direction
-    unsigned int ntlx = (im_width / tw) + (rem_x == 0 ? 0 : 1);
-
-    // Calculate tile index
-    unsigned int i = view_left/tw;
-    unsigned int j = view_top/th;
-    unsigned int tile = (j*ntlx) + i;
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "IIIF :: Tile aligned request: resolution " << requested_res << ", tile " << tile << endl;
+    }
 
     // Simply pass this on to our JTL send command
     JTL jtl;
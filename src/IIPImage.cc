@@ -113,8 +113,12 @@ void IIPImage::testImageType() throw(file_error)
     isFile = true;
     timestamp = sb.st_mtime;
 
-    // Magic file signature for JPEG2000
+    // Magic file signatures for JPEG2000 (JP2, JPX and JPH files) and raw JPEG2000 or HTJ2K codestreams
     static const unsigned char j2k[10] = {0x00,0x00,0x00,0x0C,0x6A,0x50,0x20,0x20,0x0D,0x0A};
+    static const unsigned char j2c[4] = {0xFF,0x4F,0xFF,0x51};
+
+    // Magic file signature for JPEG (JFIF, EXIF and raw JPEG files all start with SOI and another marker)
+    static const unsigned char jpg[3] = {0xFF,0xD8,0xFF};
 
     // Magic file signatures for TIFF (See http://www.garykessler.net/library/file_sigs.html)
     static const unsigned char stdtiff[3] = {0x49,0x20,0x49};       // TIFF
@@ -124,12 +128,13 @@ void IIPImage::testImageType() throw(file_error)
     static const unsigned char bbigtiff[4] = {0x49,0x49,0x2B,0x00}; // Big Endian BigTIFF
 
     // Compare our header sequence to our magic byte signatures
-    if( memcmp( header, j2k, 10 ) == 0 ) format = JPEG2000;
+    if( memcmp( header, j2k, 10 ) == 0 || memcmp( header, j2c, 4 ) == 0 ) format = JPEG2000;
     else if( memcmp( header, stdtiff, 3 ) == 0
 	     || memcmp( header, lsbtiff, 4 ) == 0 || memcmp( header, msbtiff, 4 ) == 0
 	     || memcmp( header, lbigtiff, 4 ) == 0 || memcmp( header, bbigtiff, 4 ) == 0 ){
       format = TIF;
     }
+    else if( memcmp( header, jpg, 3 ) == 0 ) format = JPG;
     else format = UNSUPPORTED;
 
   }
@@ -161,8 +166,9 @@ void IIPImage::testImageType() throw(file_error)
     int len = tmp.length();
 
     suffix = tmp.substr( dot + 1, len );
-    if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" ) format = JPEG2000;
+    if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" || suffix == "jph" || suffix == "j2c" || suffix == "jhc" ) format = JPEG2000;
     else if( suffix == "tif" || suffix == "tiff" ) format = TIF;
+    else if( suffix == "jpg" || suffix == "jpeg" ) format = JPG;
     else format = UNSUPPORTED;
 
     updateTimestamp( tmp );
@@ -194,11 +200,16 @@ void IIPImage::updateTimestamp( const string& path ) throw(file_error)
 
 const std::string IIPImage::getTimestamp()
 {
-  tm *t;
+  tm t;
   const time_t tm1 = timestamp;
-  t = gmtime( &tm1 );
+  // gmtime() is not thread safe on POSIX systems, but is on Windows
+#ifdef WIN32
+  t = *gmtime( &tm1 );
+#else
+  gmtime_r( &tm1, &t );
+#endif
   char strt[64];
-  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
 
   return string(strt);
 }
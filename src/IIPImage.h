@@ -46,8 +46,8 @@ class file_error : public std::runtime_error {
 };
 
 
-// Supported image formats
-enum ImageFormat { TIF, JPEG2000, UNSUPPORTED };
+// Supported image formats: plain JPEG is JPG as JPEG names a tile compression type
+enum ImageFormat { TIF, JPEG2000, JPG, UNSUPPORTED };
 
 
 
@@ -55,7 +55,7 @@ enum ImageFormat { TIF, JPEG2000, UNSUPPORTED };
 /** Provides functions to open, get various information from an image source
     and get individual tiles. This class is the base class for specific image
     file formats such as Tiled Pyramidal TIFF images via TPTImage.h and
-    JPEG2000 via Kakadu.h
+    JPEG2000 via KakaduImage.h or OpenJPEGImage.h and plain JPEG via JPEGImage.h
  */
 
 class IIPImage {
@@ -318,6 +318,14 @@ class IIPImage {
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return the number of smallest resolutions whose tiles must be generated from the resolution above
+  /** These resolutions are missing from the image file and are not available via getTile().
+      Instead, TileManager builds each of their tiles from the tiles of the next resolution
+      up, which are cached in turn. Image types which generate missing resolutions
+      themselves return 0
+   */
+  virtual unsigned int getSynthesizedLevels(){ return 0; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -46,6 +46,7 @@ class IIPResponse{
   std::string powered;             // Powered By header
   std::string modified;            // Last modified header
   std::string cacheControl;        // Cache control header
+  std::string etag;                // Entity tag
   std::string mimeType;            // Mime type header
   std::string eof;                 // End of response delimitter eg "\r\n"
   std::string protocol;            // IIP protocol version
@@ -53,6 +54,7 @@ class IIPResponse{
   std::string error;               // Error message
   std::string cors;                // CORS (Cross-Origin Resource Sharing) setting
   bool sent;                       // Indicate whether a response has been sent
+  bool complete;                   // Indicate whether everything requested was sent
 
 
  public:
@@ -128,6 +130,19 @@ class IIPResponse{
   std::string getCacheControl(){ return cacheControl; };
 
 
+  /// Set the ETag header
+  /** @param e entity tag including its quotes and any weak prefix */
+  void setETag( const std::string& e ){ etag = e; };
+
+
+  /// Get ETag header including its end of line or an empty string if none has been set
+  std::string getETag(){ return etag.empty() ? etag : "ETag: " + etag + eof; };
+
+
+  /// Get the entity tag itself or an empty string if none has been set
+  std::string getEntityTag(){ return etag; };
+
+
   /// Get a formatted string to send back
   std::string formatResponse();
 
@@ -154,6 +169,15 @@ class IIPResponse{
   bool imageSent() { return sent; };
 
 
+  /// Set the incomplete flag indicating that part of a response which has been sent failed
+  /** Such responses must not be cached */
+  void setIncomplete() { complete = false; };
+
+
+  /// Indicate whether everything requested was sent
+  bool isComplete() { return complete; };
+
+
   /// Display our advertising banner ;-)
   /** @param version server version */
   std::string getAdvert( const std::string& version );
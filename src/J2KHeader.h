@@ -0,0 +1,105 @@
+/*
+    Simple JPEG2000 Codestream Header Inspection Class
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _J2KHEADER_H
+#define _J2KHEADER_H
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+
+/// Simple utility class to inspect the main header of a JPEG2000 codestream without decoding it
+
+class J2KHeader{
+
+ private:
+
+  /// Read a big endian 32 bit value
+  static unsigned long get32( const unsigned char* b ){
+    return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16) | ((unsigned long)b[2] << 8) | b[3];
+  };
+
+
+ public:
+
+  /// Return whether a file holds a High Throughput JPEG2000 (HTJ2K, JPEG 2000 Part 15) codestream
+  /** Finds the first codestream, either at the start of the file or within the
+      contiguous codestream box of a JP2, JPX or JPH file, and looks for a CAP
+      marker signalling Part 15 capabilities in its main header
+      @param path file path
+      @return true if HTJ2K, false otherwise or if the file cannot be read
+   */
+  static bool isHighThroughput( const std::string& path ){
+
+    FILE* f = fopen( path.c_str(), "rb" );
+    if( !f ) return false;
+
+    unsigned char b[16];
+    bool ht = false;
+    bool codestream = false;
+
+    if( fread( b, 1, 2, f ) == 2 && b[0] == 0xFF && b[1] == 0x4F ){
+      // Raw codestream starting with an SOC marker
+      codestream = true;
+    }
+    else{
+      // Walk through the top level boxes of the JP2 family file to the codestream box
+      fseek( f, 0, SEEK_SET );
+      while( fread( b, 1, 8, f ) == 8 ){
+	unsigned long long length = get32( b );
+	unsigned long long header = 8;
+	if( length == 1 ){
+	  if( fread( b+8, 1, 8, f ) != 8 ) break;
+	  length = ((unsigned long long)get32( b+8 ) << 32) | get32( b+12 );
+	  header = 16;
+	}
+	if( memcmp( b+4, "jp2c", 4 ) == 0 ){
+	  codestream = ( fread( b, 1, 2, f ) == 2 && b[0] == 0xFF && b[1] == 0x4F );
+	  break;
+	}
+	// A length of 0 means the box extends to the end of the file
+	if( length < header ) break;
+	if( fseek( f, (long)( length - header ), SEEK_CUR ) != 0 ) break;
+      }
+    }
+
+    // Go through the marker segments of our main header up to the first tile-part
+    while( codestream && fread( b, 1, 4, f ) == 4 && b[0] == 0xFF ){
+      unsigned int marker = b[1];
+      unsigned int length = (b[2] << 8) | b[3];
+      if( marker == 0x90 || length < 2 ) break;     // SOT
+      if( marker == 0x50 ){                         // CAP
+	// Part 15 is signalled by bit 15 of Pcap counting from the most significant bit
+	if( length >= 6 && fread( b, 1, 4, f ) == 4 ) ht = ( get32( b ) & 0x00020000 ) != 0;
+	break;
+      }
+      if( fseek( f, length - 2, SEEK_CUR ) != 0 ) break;
+    }
+
+    fclose( f );
+    return ht;
+  };
+
+};
+
+
+#endif
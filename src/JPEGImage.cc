@@ -0,0 +1,474 @@
+/*  IIP Server: JPEG source image handler
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "JPEGImage.h"
+#include "Mutex.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <list>
+#include <vector>
+
+extern "C"{
+/* Undefine this to prevent compiler warning
+ */
+#undef HAVE_STDLIB_H
+#include <jpeglib.h>
+}
+
+
+using namespace std;
+
+
+size_t JPEGImage::cache_size = 64*1024*1024;
+
+
+
+/* Our libjpeg error_exit function: simply throw an exception rather than
+   print out a message and exit. The caller cleans up.
+*/
+METHODDEF(void) jpeg_source_error_exit( j_common_ptr cinfo )
+{
+  char buffer[ JMSG_LENGTH_MAX ];
+  (*cinfo->err->format_message) ( cinfo, buffer );
+  throw string( buffer );
+}
+
+
+
+/// A resolution level or, for large levels, a horizontal band of one decoded and kept in our level cache
+struct JPEGLevel {
+  string filename;
+  time_t timestamp;
+  unsigned int resolution;   ///< Resolution level with 0 as full size
+  unsigned int row;          ///< First row of a band or 0 for a whole level
+  unsigned int width;
+  unsigned int height;       ///< Number of rows held
+  unsigned int channels;
+  unsigned char* data;
+};
+
+/// Our decoded levels shared by all threads, most recently used first
+static list<JPEGLevel*> levels;
+static size_t cached = 0;
+static Mutex levels_mutex;
+
+
+/// Copy a region out of a decoded level or band, with y relative to its first row
+static void copyRegion( const JPEGLevel* level, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char* d ){
+  unsigned int c = level->channels;
+  for( unsigned int j=0; j<h; j++ ){
+    memcpy( &d[j*w*c], &level->data[((y+j)*level->width + x)*c], w*c );
+  }
+}
+
+
+/// Get pointers to each row of a contiguous buffer
+static vector<unsigned char*> rowPointers( unsigned char* d, size_t stride, unsigned int h ){
+  vector <unsigned char*> rows( h );
+  for( unsigned int j=0; j<h; j++ ) rows[j] = &d[j*stride];
+  return rows;
+}
+
+
+/// Find a level or band in our cache and make it our most recently used. Must be called with our lock held
+static JPEGLevel* findLevel( const string& filename, time_t timestamp, unsigned int resolution, unsigned int row ){
+  for( list<JPEGLevel*>::iterator i = levels.begin(); i != levels.end(); ++i ){
+    JPEGLevel* level = *i;
+    if( level->resolution == resolution && level->row == row && level->timestamp == timestamp && level->filename == filename ){
+      levels.splice( levels.begin(), levels, i );
+      return level;
+    }
+  }
+  return NULL;
+}
+
+
+/// Add a level or band to our cache, dropping any older version of it and our least recently used levels if we are full
+static void cacheLevel( JPEGLevel* level, size_t max ){
+  size_t size = (size_t) level->width * level->height * level->channels;
+  ScopedLock lock( levels_mutex );
+  for( list<JPEGLevel*>::iterator i = levels.begin(); i != levels.end(); ){
+    if( (*i)->resolution == level->resolution && (*i)->filename == level->filename &&
+	( (*i)->row == level->row || (*i)->timestamp != level->timestamp ) ){
+      cached -= (size_t) (*i)->width * (*i)->height * (*i)->channels;
+      delete[] (*i)->data;
+      delete *i;
+      i = levels.erase( i );
+    }
+    else ++i;
+  }
+  while( !levels.empty() && cached + size > max ){
+    JPEGLevel* last = levels.back();
+    cached -= (size_t) last->width * last->height * last->channels;
+    delete[] last->data;
+    delete last;
+    levels.pop_back();
+  }
+  levels.push_front( level );
+  cached += size;
+}
+
+
+
+void JPEGImage::openImage() throw (file_error)
+{
+  string filename = getFileName( currentX, currentY );
+
+  // Update our timestamp
+  updateTimestamp( filename );
+
+  // Load our metadata if not already loaded
+  if( bpc == 0 ) loadImageInfo( currentX, currentY );
+}
+
+
+
+void JPEGImage::loadImageInfo( int seq, int ang ) throw(file_error)
+{
+  string filename = getFileName( seq, ang );
+
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if( !file ) throw file_error( "JPEGImage :: Unable to open '" + filename + "'" );
+
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error( &jerr );
+  jerr.error_exit = jpeg_source_error_exit;
+
+  try{
+    jpeg_create_decompress( &cinfo );
+    jpeg_stdio_src( &cinfo, file );
+    jpeg_read_header( &cinfo, TRUE );
+  }
+  catch( const string& error ){
+    jpeg_destroy_decompress( &cinfo );
+    fclose( file );
+    throw file_error( "JPEGImage :: Unable to read header of '" + filename + "': " + error );
+  }
+
+  unsigned int w = cinfo.image_width;
+  unsigned int h = cinfo.image_height;
+  J_COLOR_SPACE space = cinfo.jpeg_color_space;
+  int components = cinfo.num_components;
+
+  jpeg_destroy_decompress( &cinfo );
+  fclose( file );
+
+  if( space == JCS_CMYK || space == JCS_YCCK || (components != 1 && components != 3) ){
+    throw file_error( "JPEGImage :: Only greyscale and RGB JPEG images are supported: '" + filename + "'" );
+  }
+
+  channels = components;
+  bpc = 8;
+  colourspace = ( channels == 1 ) ? GREYSCALE : sRGB;
+
+  // Create our virtual resolution levels, halving until our image fits into a single tile
+  image_widths.push_back( w );
+  image_heights.push_back( h );
+  while( (w>tile_width) || (h>tile_height) ){
+    w = w/2;
+    h = h/2;
+    image_widths.push_back( w );
+    image_heights.push_back( h );
+  }
+  numResolutions = image_widths.size();
+
+  for( unsigned int i=0; i<channels; i++ ){
+    min.push_back( 0.0 );
+    max.push_back( 255.0 );
+  }
+
+  isSet = true;
+}
+
+
+
+// Get an individual tile
+RawTile JPEGImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+{
+  if( res >= numResolutions ){
+    ostringstream tile_no;
+    tile_no << "JPEGImage :: Asked for non-existent resolution: " << res;
+    throw file_error( tile_no.str() );
+  }
+
+  int vipsres = ( numResolutions - 1 ) - res;
+
+  unsigned int tw = tile_width;
+  unsigned int th = tile_height;
+
+  // Get the width and height for last row and column tiles
+  unsigned int rem_x = image_widths[vipsres] % tile_width;
+  unsigned int rem_y = image_heights[vipsres] % tile_height;
+
+  // Calculate the number of tiles in each direction
+  unsigned int ntlx = (image_widths[vipsres] / tw) + (rem_x == 0 ? 0 : 1);
+  unsigned int ntly = (image_heights[vipsres] / th) + (rem_y == 0 ? 0 : 1);
+
+  if( tile >= ntlx*ntly ){
+    ostringstream tile_no;
+    tile_no << "JPEGImage :: Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+
+  // Alter the tile size if it's in the last column or bottom row
+  if( ( tile % ntlx == ntlx - 1 ) && ( rem_x != 0 ) ) tw = rem_x;
+  if( ( tile / ntlx == ntly - 1 ) && ( rem_y != 0 ) ) th = rem_y;
+
+  // Calculate the pixel offsets for this tile
+  unsigned int xoffset = (tile % ntlx) * tile_width;
+  unsigned int yoffset = (tile / ntlx) * tile_height;
+
+  RawTile rawtile( tile, res, seq, ang, tw, th, channels, 8 );
+  rawtile.data = new unsigned char[tw*th*channels];
+  rawtile.dataLength = tw*th*channels;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  process( res, xoffset, yoffset, tw, th, (unsigned char*) rawtile.data );
+
+  return rawtile;
+}
+
+
+
+// Get an entire region and not just a tile
+RawTile JPEGImage::getRegion( int seq, int ang, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h ) throw (file_error)
+{
+  if( res >= numResolutions ){
+    ostringstream error;
+    error << "JPEGImage :: Asked for non-existent resolution: " << res;
+    throw file_error( error.str() );
+  }
+
+  RawTile rawtile( 0, res, seq, ang, w, h, channels, 8 );
+  rawtile.data = new unsigned char[w*h*channels];
+  rawtile.dataLength = w*h*channels;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  process( res, x, y, w, h, (unsigned char*) rawtile.data );
+
+  return rawtile;
+}
+
+
+
+void JPEGImage::process( unsigned int res, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char* d ) throw (file_error)
+{
+  unsigned int vipsres = ( numResolutions - 1 ) - res;
+  unsigned int width = image_widths[vipsres];
+  unsigned int height = image_heights[vipsres];
+
+  if( w == 0 || h == 0 ) return;
+
+  if( x + w > width || y + h > height ){
+    throw file_error( "JPEGImage :: Requested region lies outside the image" );
+  }
+
+  // libjpeg can scale down by up to 8 in the DCT domain. Smaller levels are subsampled
+  unsigned int scale = ( vipsres < 3 ) ? vipsres : 3;
+  unsigned int factor = 1 << ( vipsres - scale );
+  size_t size = (size_t) width * height * channels;
+  string filename = getFileName( currentX, currentY );
+
+  // Regions of levels small enough are cut out of a single decode of the whole level
+  if( size <= cache_size / 4 ){
+
+    {
+      ScopedLock lock( levels_mutex );
+      JPEGLevel* level = findLevel( filename, timestamp, vipsres, 0 );
+      if( level ){
+	copyRegion( level, x, y, w, h, d );
+	return;
+      }
+    }
+
+    // Decode our level without holding our lock
+    JPEGLevel* level = new JPEGLevel;
+    level->filename = filename;
+    level->timestamp = timestamp;
+    level->resolution = vipsres;
+    level->row = 0;
+    level->width = width;
+    level->height = height;
+    level->channels = channels;
+    level->data = new unsigned char[size];
+
+    try{
+      decode( scale, factor, 0, 0, width, height, rowPointers( level->data, width*channels, height ) );
+    }
+    catch( const file_error& ){
+      delete[] level->data;
+      delete level;
+      throw;
+    }
+
+    copyRegion( level, x, y, w, h, d );
+    cacheLevel( level, cache_size );
+    return;
+  }
+
+  // Larger levels are cached in bands of a tile's height, so that each tile is not decoded from
+  // the top of the image again. Regions spanning several bands, such as for CVT, are decoded directly
+  unsigned int band = y / tile_height;
+  size_t band_size = (size_t) width * tile_height * channels;
+  if( (y + h - 1) / tile_height != band || band_size > cache_size / 4 ){
+    decode( scale, factor, x, y, w, h, rowPointers( d, w*channels, h ) );
+    return;
+  }
+
+  // Decode any bands directly above ours which are not yet cached in the same pass, as we
+  // have to read through them anyway, but no more than our cache could hold
+  unsigned int first = band;
+  {
+    ScopedLock lock( levels_mutex );
+    JPEGLevel* level = findLevel( filename, timestamp, vipsres, band * tile_height );
+    if( level ){
+      copyRegion( level, x, y - level->row, w, h, d );
+      return;
+    }
+    while( first > 0 && (size_t) (band - first + 2) * band_size <= cache_size &&
+	   !findLevel( filename, timestamp, vipsres, (first-1) * tile_height ) ) first--;
+  }
+
+  unsigned int start = first * tile_height;
+  unsigned int end = ( (band+1) * tile_height < height ) ? (band+1) * tile_height : height;
+
+  // Decode straight into our new bands
+  vector <JPEGLevel*> bands;
+  vector <unsigned char*> rows;
+  for( unsigned int b = first; b <= band; b++ ){
+    JPEGLevel* level = new JPEGLevel;
+    level->filename = filename;
+    level->timestamp = timestamp;
+    level->resolution = vipsres;
+    level->row = b * tile_height;
+    level->width = width;
+    level->height = ( b < band ) ? tile_height : end - level->row;
+    level->channels = channels;
+    level->data = new unsigned char[ (size_t) width * level->height * channels ];
+    vector <unsigned char*> r = rowPointers( level->data, width*channels, level->height );
+    rows.insert( rows.end(), r.begin(), r.end() );
+    bands.push_back( level );
+  }
+
+  try{
+    decode( scale, factor, 0, start, width, end - start, rows );
+  }
+  catch( const file_error& ){
+    for( unsigned int b = 0; b < bands.size(); b++ ){
+      delete[] bands[b]->data;
+      delete bands[b];
+    }
+    throw;
+  }
+
+  // Cache our own band last so that it is the most recently used
+  copyRegion( bands.back(), x, y - bands.back()->row, w, h, d );
+  for( unsigned int b = 0; b < bands.size(); b++ ) cacheLevel( bands[b], cache_size );
+}
+
+
+
+void JPEGImage::decode( unsigned int scale, unsigned int factor, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const vector<unsigned char*>& rows ) throw (file_error)
+{
+  string filename = getFileName( currentX, currentY );
+
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if( !file ) throw file_error( "JPEGImage :: Unable to open '" + filename + "'" );
+
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error( &jerr );
+  jerr.error_exit = jpeg_source_error_exit;
+
+  unsigned char* row = NULL;
+
+  try{
+
+    jpeg_create_decompress( &cinfo );
+    jpeg_stdio_src( &cinfo, file );
+    jpeg_read_header( &cinfo, TRUE );
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << scale;
+    cinfo.out_color_space = ( channels == 1 ) ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_start_decompress( &cinfo );
+
+    // Our region in scaled pixels, up to and including the last pixel we sample
+    JDIMENSION sx = x * factor;
+    JDIMENSION sy = y * factor;
+    JDIMENSION xoffset = sx;
+    JDIMENSION width = (w-1) * factor + 1;
+
+    if( sx + width > cinfo.output_width || sy + (h-1)*factor >= cinfo.output_height ){
+      throw string( "region lies outside the scaled image" );
+    }
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+    // Only decode the columns we need and skip the rows above us without running the IDCT on them.
+    // Pad our columns by a pixel on either side, so that chroma upsampling at the edges of the
+    // cropped area, which libjpeg rounds out to whole iMCUs, never affects the pixels we keep
+    if( width < cinfo.output_width ){
+      if( xoffset > 0 ){ xoffset--; width++; }
+      if( xoffset + width < cinfo.output_width ) width++;
+      jpeg_crop_scanline( &cinfo, &xoffset, &width );
+    }
+    if( sy > 0 ) jpeg_skip_scanlines( &cinfo, sy );
+#else
+    xoffset = 0;
+    width = cinfo.output_width;
+#endif
+
+    row = new unsigned char[width * cinfo.output_components];
+
+    for( unsigned int j=0; j<h; j++ ){
+
+      // Read up to our next row, discarding any in between
+      while( cinfo.output_scanline <= sy + j*factor ){
+	if( jpeg_read_scanlines( &cinfo, &row, 1 ) != 1 ) throw string( "premature end of image data" );
+      }
+
+      unsigned char* src = &row[(sx-xoffset)*channels];
+      unsigned char* dst = rows[j];
+      if( factor == 1 ) memcpy( dst, src, w*channels );
+      else{
+	for( unsigned int i=0; i<w; i++ ){
+	  for( unsigned int k=0; k<channels; k++ ) dst[i*channels+k] = src[i*factor*channels+k];
+	}
+      }
+    }
+
+  }
+  catch( const string& error ){
+    if( row ) delete[] row;
+    jpeg_destroy_decompress( &cinfo );
+    fclose( file );
+    throw file_error( "JPEGImage :: Unable to decode '" + filename + "': " + error );
+  }
+
+  delete[] row;
+  jpeg_destroy_decompress( &cinfo );
+  fclose( file );
+}
@@ -0,0 +1,149 @@
+// JPEG Image class Interface
+
+/*  IIP JPEG Source Image Class
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _JPEGIMAGE_H
+#define _JPEGIMAGE_H
+
+
+#include "IIPImage.h"
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#define TILESIZE 256
+
+
+
+/// Image class for plain, untiled JPEG source images: Inherits from IIPImage. Uses libjpeg.
+/** JPEG images have no internal pyramid, so resolution levels are generated on the
+    fly. The first three levels below full resolution are decoded directly at 1/2,
+    1/4 and 1/8 scale in the DCT domain, which is many times faster than a full
+    decode, and smaller levels are subsampled from the 1/8 scale decode. Levels
+    small enough are decoded once in full and kept in a level cache shared by all
+    threads, from which their tiles are then cut. Larger levels are cached in bands
+    of a tile's height, filled in by a single pass through any uncached bands above.
+    Regions spanning several bands are decoded directly, skipping the rows above
+    and, with libjpeg-turbo, the columns outside each region.
+ */
+class JPEGImage : public IIPImage {
+
+ private:
+
+  /// Maximum size in bytes of our decoded level cache
+  static size_t cache_size;
+
+  /// Decode part of our image at a given DCT scale
+  /** @param scale decode at 1/2^scale: 0, 1, 2 or 3
+      @param factor sample every factor-th pixel and row of the scaled decode
+      @param x left edge of the region in sampled pixels
+      @param y top edge of the region in sampled pixels
+      @param w width of the region
+      @param h height of the region
+      @param rows h buffers to fill with w*channels bytes each
+   */
+  void decode( unsigned int scale, unsigned int factor, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const std::vector<unsigned char*>& rows ) throw (file_error);
+
+  /// Get a region of a resolution, through our level cache where possible
+  /** @param r resolution
+      @param x x coordinate
+      @param y y coordinate
+      @param w width of region
+      @param h height of region
+      @param d buffer to fill
+   */
+  void process( unsigned int r, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char* d ) throw (file_error);
+
+
+ public:
+
+  /// Constructor
+  JPEGImage(): IIPImage(){
+    tile_width = TILESIZE; tile_height = TILESIZE;
+  };
+
+  /// Constructor
+  /** @param path image path
+   */
+  JPEGImage( const std::string& path ): IIPImage( path ){
+    tile_width = TILESIZE; tile_height = TILESIZE;
+  };
+
+  /// Copy Constructor
+  /** @param image JPEGImage object
+   */
+  JPEGImage( const JPEGImage& image ): IIPImage( image ) {};
+
+  /// Constructor from IIPImage object
+  /** @param image IIPImage object
+   */
+  JPEGImage( const IIPImage& image ): IIPImage( image ){
+    tile_width = TILESIZE; tile_height = TILESIZE;
+  };
+
+  /// Destructor
+  ~JPEGImage() { closeImage(); };
+
+  /// Overloaded function for opening a JPEG image
+  void openImage() throw (file_error);
+
+  /// Overloaded function for loading JPEG image information
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+   */
+  void loadImageInfo( int x, int y ) throw (file_error);
+
+  /// Overloaded function for closing a JPEG image. Nothing is kept open between decodes
+  void closeImage(){};
+
+  /// Set the maximum size of the decoded level cache shared by all JPEG images
+  /** @param size size in bytes: 0 disables the cache */
+  static void setCacheSize( size_t size ){ cache_size = size; };
+
+  /// Return whether this image type directly handles region decoding
+  bool regionDecoding(){ return true; };
+
+  /// Overloaded function for getting a particular tile
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param l number of quality layers to decode (unused)
+      @param t tile number
+   */
+  RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (file_error);
+
+  /// Overloaded function for returning a region for a given angle and resolution
+  /** @param ha horizontal angle
+      @param va vertical angle
+      @param r resolution
+      @param l number of quality layers to decode (unused)
+      @param x x coordinate
+      @param y y coordinate
+      @param w width of region
+      @param h height of region
+   */
+  RawTile getRegion( int ha, int va, unsigned int r, int l, int x, int y, unsigned int w, unsigned int h ) throw (file_error);
+
+};
+
+
+#endif
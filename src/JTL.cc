@@ -31,12 +31,72 @@ void JTL::send( Session* session, int resolution, int tile ){
 
   if( session->loglevel >= 3 ) (*session->logfile) << "JTL handler reached" << endl;
 
-  Timer function_timer;
-
-
   // Time this command
   if( session->loglevel >= 2 ) command_timer.start();
 
+  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setPrefetcher( session->prefetcher );
+  tilemanager.setTrace( session->trace );
+
+  RawTile rawtile = this->getTile( session, tilemanager, resolution, tile, true );
+  int len = rawtile.dataLength;
+
+
+  long write_start = session->trace ? session->trace->now() : 0;
+
+#ifndef DEBUG
+  char str[1024];
+
+  snprintf( str, 1024,
+	    "Server: iipsrv/%s\r\n"
+	    "X-Powered-By: IIPImage\r\n"
+	    "Content-Type: image/jpeg\r\n"
+            "Content-Length: %d\r\n"
+	    "Last-Modified: %s\r\n"
+	    "%s\r\n"
+	    "%s"
+	    "\r\n",
+	    VERSION, len,(*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str() );
+
+  const char* header = str;
+#else
+  const char* header = "";
+#endif
+
+  // Send our header and tile together
+  int hlen = strlen( header );
+  if( session->out->putV( header, hlen, static_cast<const char*>(rawtile.data), len ) != hlen + len ){
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "JTL :: Error writing jpeg tile" << endl;
+    }
+  }
+
+
+  if( session->out->flush() == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "JTL :: Error flushing jpeg tile" << endl;
+    }
+  }
+
+  if( session->trace ) session->trace->end( "write", write_start );
+
+
+  // Inform our response object that we have sent something to the client
+  session->response->setImageSent();
+
+  // Total JTL response time
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "JTL :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+}
+
+
+
+RawTile JTL::getTile( Session* session, TileManager& tilemanager, int resolution, int tile, bool prefetch ){
+
+  Timer function_timer;
+
 
   // If we have requested a rotation, remap the tile index to rotated coordinates
   if( (int)((session->view)->getRotation()) % 360 == 90 ){
@@ -63,24 +123,33 @@ void JTL::send( Session* session, int resolution, int tile ){
     throw error.str();
   }
 
-  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
-
   CompressionType ct;
   if( (*session->image)->getNumBitsPerPixel() > 8 || (*session->image)->getColourSpace() == CIELAB
       || (*session->image)->getNumChannels() == 2 || (*session->image)->getNumChannels() > 3
       || session->view->getContrast() != 1.0 || session->view->getGamma() != 1.0
       || session->view->getRotation() != 0.0 || session->view->shaded
       || session->view->cmapped || session->view->inverted
-      || session->view->ctw.size() ) ct = UNCOMPRESSED;
+      || session->view->ctw.size() || session->view->flip != 0
+      || ( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ) ) ct = UNCOMPRESSED;
   else ct = JPEG;
 
 
   RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Queue up the tiles the client is likely to want next
+  if( prefetch ){
+    tilemanager.prefetch( resolution, tile, session->view->xangle,
+			  session->view->yangle, session->view->getLayers(), ct );
+  }
+
 
   int len = rawtile.dataLength;
 
+  // Time our image processing
+  Timer filter_timer;
+  filter_timer.start();
+
   if( session->loglevel >= 2 ){
     *(session->logfile) << "JTL :: Tile size: " << rawtile.width << " x " << rawtile.height << endl
 			<< "JTL :: Channels per sample: " << rawtile.channels << endl
@@ -256,13 +325,23 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
+  if( ct == UNCOMPRESSED ){
+    long filter_time = filter_timer.getTime();
+    metrics.observe( Metrics::FILTER, filter_time );
+    if( session->trace ) session->trace->add( "filter", session->trace->now() - filter_time, filter_time );
+  }
+
+
   // Compress to JPEG
   if( rawtile.compressionType == UNCOMPRESSED ){
     if( session->loglevel >= 4 ){
       *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
-      function_timer.start();
     }
+    function_timer.start();
     len = session->jpeg->Compress( rawtile );
+    long encode_time = function_timer.getTime();
+    metrics.observe( Metrics::ENCODE, encode_time );
+    if( session->trace ) session->trace->add( "encode", session->trace->now() - encode_time, encode_time );
     if( session->loglevel >= 4 ){
       *(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
                           << rawtile.dataLength << " bytes" << endl;
@@ -271,43 +350,7 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-#ifndef DEBUG
-  char str[1024];
-
-  snprintf( str, 1024,
-	    "Server: iipsrv/%s\r\n"
-	    "X-Powered-By: IIPImage\r\n"
-	    "Content-Type: image/jpeg\r\n"
-            "Content-Length: %d\r\n"
-	    "Last-Modified: %s\r\n"
-	    "%s\r\n"
-	    "\r\n",
-	    VERSION, len,(*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
-
-  session->out->printf( str );
-#endif
-
-
-  if( session->out->putStr( static_cast<const char*>(rawtile.data), len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "JTL :: Error writing jpeg tile" << endl;
-    }
-  }
-
-
-  if( session->out->flush() == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "JTL :: Error flushing jpeg tile" << endl;
-    }
-  }
-
-
-  // Inform our response object that we have sent something to the client
-  session->response->setImageSent();
-
-  // Total JTL response time
-  if( session->loglevel >= 2 ){
-    *(session->logfile) << "JTL :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-  }
+  return rawtile;
 
 }
+
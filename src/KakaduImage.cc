@@ -27,27 +27,14 @@
 
 
 #include "KakaduImage.h"
+#include "J2KHeader.h"
 #include <kdu_compressed.h>
 #include <cmath>
 #include <sstream>
+#include <list>
 
-// Required for get_nprocs_conf() on Linux
-#ifdef NPROCS
-#include <sys/sysinfo.h>
-#endif
-
-// On Mac OS X, define our own get_nprocs_conf()
-#if defined (__APPLE__) || defined(__FreeBSD__)
+#ifdef HAVE_PTHREAD
 #include <pthread.h>
-#include <sys/sysctl.h>
-unsigned int get_nprocs_conf(){
-  int numProcessors = 0;
-  size_t size = sizeof(numProcessors);
-  int returnCode = sysctlbyname("hw.ncpu", &numProcessors, &size, NULL, 0);
-  if( returnCode != 0 ) return 1;
-  else return (unsigned int)numProcessors;
-}
-#define NPROCS
 #endif
 
 
@@ -63,49 +50,184 @@ extern std::ofstream logfile;
 #endif
 
 
-void KakaduImage::openImage() throw (file_error)
-{
-  string filename = getFileName( currentX, currentY );
+unsigned int KakaduImage::threads = 0;
+unsigned int KakaduImage::codestreams = 1;
 
-  // Update our timestamp
-  updateTimestamp( filename );
 
-  // Set our error handlers
-  kdu_customize_warnings(&pretty_cout);
-  kdu_customize_errors(&pretty_cerr);
 
-#ifdef DEBUG
-  Timer timer;
-  timer.start();
+/// Kakadu state kept by each thread between requests: a thread environment for
+/// multi-threaded decoding and our most recently used codestreams, most recent first
+struct KakaduThreadState {
+
+  kdu_thread_env env;
+  list<KakaduSource*> sources;
+
+  /// Close and delete an open source
+  void close( KakaduSource* source ){
+    // Close our codestream - need to make sure it exists or it'll crash
+    if( source->codestream.exists() ){
+      if( env.exists() ) env.cs_terminate( source->codestream );
+      source->codestream.destroy();
+    }
+    // Close our JP2 family and JPX files
+    source->src.close();
+    source->jpx_input.close();
+    delete source;
+  };
+
+  /// Close all our sources and destroy our threads
+  void clear(){
+    for( list<KakaduSource*>::iterator i = sources.begin(); i != sources.end(); ++i ) close( *i );
+    sources.clear();
+    if( env.exists() ) env.destroy();
+  };
+
+  ~KakaduThreadState(){ clear(); };
+
+};
+
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+static void deleteState( void* state ){ delete (KakaduThreadState*) state; }
+static void createStateKey(){ pthread_key_create( &state_key, deleteState ); }
 #endif
 
+
+/// Return the Kakadu state of the calling thread
+static KakaduThreadState* getThreadState(){
+#ifdef HAVE_PTHREAD
+  pthread_once( &state_once, createStateKey );
+  KakaduThreadState* state = (KakaduThreadState*) pthread_getspecific( state_key );
+  if( !state ){
+    state = new KakaduThreadState;
+    pthread_setspecific( state_key, state );
+  }
+  return state;
+#else
+  static KakaduThreadState state;
+  return &state;
+#endif
+}
+
+
+
+kdu_thread_env* KakaduImage::getThreadEnvironment()
+{
+  if( threads <= 1 ) return NULL;
+
+  KakaduThreadState* state = getThreadState();
+
+  // Create our worker threads the first time we need them
+  if( !state->env.exists() ){
+    state->env.create();
+    for( unsigned int nt=1; nt < threads; nt++ ){
+      // Unable to create all the threads requested
+      if( !state->env.add_thread() ) break;
+    }
+  }
+
+  return &state->env;
+}
+
+
+
+KakaduSource* KakaduImage::getSource( const string& filename, time_t timestamp ) throw (file_error)
+{
+  KakaduThreadState* state = getThreadState();
+
+  // Look for an open codestream for this file, reopening it if the file has since changed
+  for( list<KakaduSource*>::iterator i = state->sources.begin(); i != state->sources.end(); ++i ){
+    if( (*i)->filename == filename ){
+      KakaduSource* source = *i;
+      state->sources.erase( i );
+      if( source->timestamp == timestamp ){
+	state->sources.push_front( source );
+	return source;
+      }
+      state->close( source );
+      break;
+    }
+  }
+
+  KakaduSource* source = new KakaduSource;
+  source->filename = filename;
+  source->timestamp = timestamp;
+  source->input = NULL;
+
   // Open the JPX or JP2 file
   try{
-    src.open( filename.c_str(), true );
-    if( jpx_input.open( &src, false ) != 1 ) throw 1;
+    source->src.open( filename.c_str(), true );
+    if( source->jpx_input.open( &source->src, false ) != 1 ) throw 1;
   }
   catch (...){
+    state->close( source );
     throw file_error( "Kakadu :: Unable to open '"+filename+"'"); // Rethrow the exception
   }
 
   // Get our JPX codestream
-  jpx_stream = jpx_input.access_codestream(0);
-  if( !jpx_stream.exists() ) throw file_error( "Kakadu :: No codestream in file '"+filename+"'"); // Throw exception
+  source->jpx_stream = source->jpx_input.access_codestream(0);
+  if( !source->jpx_stream.exists() ){
+    state->close( source );
+    throw file_error( "Kakadu :: No codestream in file '"+filename+"'"); // Throw exception
+  }
 
   // Open the underlying JPEG2000 codestream
-  input = NULL;
-  input = jpx_stream.open_stream();
+  source->input = source->jpx_stream.open_stream();
 
   // Create codestream
-  codestream.create(input);
-  if( !codestream.exists() ) throw file_error( "Kakadu :: Unable to create codestream for '"+filename+"'"); // Throw exception
+  source->codestream.create( source->input );
+  if( !source->codestream.exists() ){
+    state->close( source );
+    throw file_error( "Kakadu :: Unable to create codestream for '"+filename+"'"); // Throw exception
+  }
 
-  // Set up the cache size and allow restarting
+  // Set up the cache size and allow restarting. Our codestream is persistent, so that it can
+  // be used for any number of regions of the image
   //codestream.augment_cache_threshold(1024);
-  codestream.set_fast();
-  codestream.set_persistent();
+  source->codestream.set_fast();
+  source->codestream.set_persistent();
   //  codestream.enable_restart();
 
+  // Close our least recently used codestreams if we have too many
+  while( !state->sources.empty() && state->sources.size() >= (codestreams > 0 ? codestreams : 1) ){
+    state->close( state->sources.back() );
+    state->sources.pop_back();
+  }
+
+  state->sources.push_front( source );
+  return source;
+}
+
+
+
+void KakaduImage::resetThread()
+{
+  getThreadState()->clear();
+}
+
+
+
+void KakaduImage::openImage() throw (file_error)
+{
+  string filename = getFileName( currentX, currentY );
+
+  // Update our timestamp
+  updateTimestamp( filename );
+
+  // Set our error handlers
+  kdu_customize_warnings(&pretty_cout);
+  kdu_customize_errors(&pretty_cerr);
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  // Get our codestream, which is only opened if our thread does not already have it open
+  source = getSource( filename, timestamp );
+
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
@@ -118,6 +240,22 @@ void KakaduImage::openImage() throw (file_error)
 
 void KakaduImage::loadImageInfo( int seq, int ang ) throw(file_error)
 {
+  if( !source ) throw file_error( "Kakadu :: loadImageInfo: image not open" );
+
+  // High Throughput codestreams can only be decoded from Kakadu 8
+  if( J2KHeader::isHighThroughput( source->filename ) ){
+#if KDU_MAJOR_VERSION < 8
+    throw file_error( "Kakadu :: '" + source->filename + "' is HTJ2K, which requires Kakadu 8 or later" );
+#endif
+#ifdef DEBUG
+    logfile << "Kakadu :: HTJ2K codestream" << endl;
+#endif
+  }
+
+  kdu_codestream& codestream = source->codestream;
+  jpx_source& jpx_input = source->jpx_input;
+  jpx_codestream_source& jpx_stream = source->jpx_stream;
+
   jp2_channels j2k_channels;
   jp2_palette j2k_palette;
   jp2_resolution j2k_resolution;
@@ -276,12 +414,13 @@ void KakaduImage::closeImage()
   timer.start();
 #endif
 
-  // Close our codestream - need to make sure it exists or it'll crash
-  if( codestream.exists() ) codestream.destroy();
-
-  // Close our JP2 family and JPX files
-  src.close();
-  jpx_input.close();
+  // Our codestream is normally left open for later requests, unless we have been asked to keep none
+  if( source && codestreams == 0 ){
+    KakaduThreadState* state = getThreadState();
+    state->sources.remove( source );
+    state->close( source );
+  }
+  source = NULL;
 
 #ifdef DEBUG
   logfile << "Kakadu :: closeImage() :: " << timer.getTime() << " microseconds" << endl;
@@ -368,7 +507,7 @@ RawTile KakaduImage::getTile( int seq, int ang, unsigned int res, int layers, un
 
 
 #ifdef DEBUG
-  logfile << "Kakadu :: bytes parsed: " << codestream.get_total_bytes(true) << endl;
+  logfile << "Kakadu :: bytes parsed: " << source->codestream.get_total_bytes(true) << endl;
   logfile << "Kakadu :: getTile() :: " << timer.getTime() << " microseconds" << endl;
 #endif
 
@@ -449,7 +588,8 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   canvas_dims.size = kdu_coords( tw, th );
 
   // Check our codestream status - throw exception for malformed codestreams
-  if( !codestream.exists() ) throw file_error( "Kakadu :: Malformed JPEG2000 - unable to access codestream");
+  if( !source || !source->codestream.exists() ) throw file_error( "Kakadu :: Malformed JPEG2000 - unable to access codestream");
+  kdu_codestream& codestream = source->codestream;
 
   // Apply our resolution restrictions to calculate the rendering zone on the highest resolution
   // canvas
@@ -457,28 +597,12 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
   codestream.map_region( 0, canvas_dims, image_dims, true );
 
 
-  // Create some worker threads
-#ifdef NPROCS
-  int num_threads = get_nprocs_conf();
-#else
-  int num_threads = 0;
-#endif
-
-
-  kdu_thread_env env, *env_ref = NULL;
-  if( num_threads > 0 ){
-    env.create();
-    for (int nt=0; nt < num_threads; nt++){
-      // Unable to create all the threads requested
-      if( !env.add_thread() ) num_threads = nt;
-    }
-    env_ref = &env;
-  }
-
+  // Use the worker threads of our thread's long lived Kakadu thread environment if we have one
+  kdu_thread_env *env_ref = getThreadEnvironment();
 
 
 #ifdef DEBUG
-  logfile << "Kakadu :: decompressor init with " << num_threads << " threads" << endl;
+  logfile << "Kakadu :: decompressor init with " << (env_ref ? env_ref->get_num_threads() : 1) << " threads" << endl;
   logfile << "Kakadu :: decoding " << layers << " quality layers" << endl;
 #endif
 
@@ -662,19 +786,18 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 
   }
   catch (...){
-    // Shut down our decompressor, delete our buffers, destroy our threads and codestream before rethrowing the exception
+    // Shut down our decompressor and delete our buffers. Our threads and codestreams may be left
+    // in an inconsistent state, so destroy them before rethrowing the exception
     decompressor.finish();
-    if( env.exists() ) env.destroy();
     delete_buffer( stripe_buffer );
     delete_buffer( buffer );
     if( stripe_heights ) delete[] stripe_heights;
+    resetThread();
+    source = NULL;
     throw file_error( "Kakadu :: Core Exception Caught"); // Rethrow the exception
   }
 
 
-  // Destroy our threads
-  if( env.exists() ) env.destroy();
-
   // Delete our stripe buffer
   delete_buffer( stripe_buffer );
   if( stripe_heights ) delete[] stripe_heights;
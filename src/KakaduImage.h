@@ -38,6 +38,8 @@
 #include <jp2.h>
 #include <kdu_stripe_decompressor.h>
 #include <fstream>
+#include <string>
+#include <ctime>
 
 #define TILESIZE 256
 
@@ -78,27 +80,32 @@ static kdu_message_formatter pretty_cerr(&cerr_message);
 
 
 
+/// An open JPEG2000 file and its codestream, kept open between requests
+struct KakaduSource {
+  std::string filename;              ///< File name
+  time_t timestamp;                  ///< File timestamp when opened
+  jp2_family_src src;                ///< JP2 file format object
+  jpx_source jpx_input;              ///< JPX format object
+  jpx_codestream_source jpx_stream;  ///< JPX codestream source
+  kdu_compressed_source *input;      ///< Codestream source
+  kdu_codestream codestream;         ///< Kakadu codestream object
+};
 
 
-/// Image class for Kakadu JPEG2000 Images: Inherits from IIPImage. Uses the Kakadu library.
-class KakaduImage : public IIPImage {
 
- private:
 
-  /// Kakadu codestream object
-  kdu_codestream codestream;
 
-  /// Codestream source
-  kdu_compressed_source *input;
+/// Image class for Kakadu JPEG2000 Images: Inherits from IIPImage. Uses the Kakadu library.
+class KakaduImage : public IIPImage {
 
-  /// JPX format object
-  jpx_source jpx_input;
+ private:
 
-  /// JP2 file format object
-  jp2_family_src src;
+  /// Our open file and codestream, which belongs to the open codestream cache of our thread
+  KakaduSource *source;
 
-  /// JPX codestream source
-  jpx_codestream_source jpx_stream;
+  /// Number of threads with which each of our threads decodes and the number of codestreams it keeps open
+  static unsigned int threads;
+  static unsigned int codestreams;
 
   /// Kakadu decompressor object
   kdu_stripe_decompressor decompressor;
@@ -122,31 +129,44 @@ class KakaduImage : public IIPImage {
    */
   void delete_buffer( void* b );
 
+  /// Return the Kakadu thread environment of the calling thread, or NULL if we decode single threaded
+  static kdu_thread_env* getThreadEnvironment();
+
+  /// Get an open codestream for a file from the cache of the calling thread, opening it if necessary
+  /** @param filename file name
+      @param timestamp current file timestamp: cached codestreams opened before this are reopened
+      @return open source
+   */
+  static KakaduSource* getSource( const std::string& filename, time_t timestamp ) throw (file_error);
+
+  /// Discard the thread environment and open codestreams of the calling thread after a decoding error
+  static void resetThread();
+
 
  public:
 
   /// Constructor
   KakaduImage(): IIPImage(){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
   };
 
   /// Constructor
   /** @param path image path
    */
   KakaduImage( const std::string& path ): IIPImage( path ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
   };
 
   /// Copy Constructor
   /** @param image Kakadu object
    */
-  KakaduImage( const KakaduImage& image ): IIPImage( image ) {};
+  KakaduImage( const KakaduImage& image ): IIPImage( image ) { source = NULL; };
 
   /// Constructor from IIPImage object
   /** @param image IIPImage object
    */
   KakaduImage( const IIPImage& image ): IIPImage( image ){
-    tile_width = TILESIZE; tile_height = TILESIZE; input = NULL;
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
   };
 
   /// Assignment Operator
@@ -175,8 +195,19 @@ class KakaduImage : public IIPImage {
   void loadImageInfo( int x, int y ) throw (file_error);
 
   /// Overloaded function for closing a JPEG2000 image
+  /** Our codestream is left open in the cache of our thread for use by later requests */
   void closeImage();
 
+  /// Set up our decoding threads and open codestream cache
+  /** Each thread calling the Kakadu decoder creates its own Kakadu thread environment
+      the first time it decodes and keeps it for the life of the thread, along with its
+      most recently used codestreams
+      @param t number of threads with which to decode, including the calling thread.
+               Values of 0 or 1 decode in the calling thread only
+      @param c number of open codestreams to keep per thread
+   */
+  static void configure( unsigned int t, unsigned int c ){ threads = t; codestreams = c; };
+
   /// Return whether this image type directly handles region decoding
   bool regionDecoding(){ return true; };
 
@@ -0,0 +1,227 @@
+// Asynchronous log writer
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "LogWriter.h"
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#ifdef HAVE_PTHREAD
+#include <fcntl.h>
+#include <unistd.h>
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+#define MEMORY_BARRIER()
+#endif
+
+
+using namespace std;
+
+
+// How long our writer thread sleeps when there is nothing to write in microseconds
+#define LOG_WRITER_INTERVAL 20000
+
+
+
+LogWriter::LogWriter( const string& f, unsigned int size ){
+  filename = f;
+  ring.resize( size > 0 ? size : 1 );
+  produced = consumed = 0;
+  dropped = unreported = 0;
+  fd = -1;
+  stop = false;
+  running = false;
+}
+
+
+
+LogWriter::~LogWriter(){
+  this->finish();
+#ifdef HAVE_PTHREAD
+  if( fd >= 0 ) close( fd );
+#endif
+}
+
+
+
+bool LogWriter::start(){
+#ifdef HAVE_PTHREAD
+  if( fd < 0 ) fd = open( filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644 );
+  if( fd < 0 ) return false;
+  if( !running && pthread_create( &thread, NULL, LogWriter::worker, this ) == 0 ){
+    running = true;
+  }
+#endif
+  return running;
+}
+
+
+
+void LogWriter::finish(){
+  this->commit();
+#ifdef HAVE_PTHREAD
+  if( running ){
+    stop = true;
+    pthread_join( thread, NULL );
+    running = false;
+  }
+#endif
+}
+
+
+
+#ifdef HAVE_PTHREAD
+void* LogWriter::worker( void* w ){
+  ((LogWriter*) w)->run();
+  return NULL;
+}
+#endif
+
+
+
+LogWriter::int_type LogWriter::overflow( int_type c ){
+  if( c != traits_type::eof() ) pending += traits_type::to_char_type( c );
+  return traits_type::not_eof( c );
+}
+
+
+
+streamsize LogWriter::xsputn( const char* s, streamsize n ){
+  pending.append( s, n );
+  return n;
+}
+
+
+
+int LogWriter::sync(){
+  this->commit();
+  return 0;
+}
+
+
+
+bool LogWriter::push( const char* data, size_t n ){
+
+  size_t size = ring.size();
+  MEMORY_BARRIER();
+  if( n > size - ( produced - consumed ) ) return false;
+
+  // Copy in, wrapping around the end of the ring if necessary
+  size_t offset = produced % size;
+  size_t first = ( n < size - offset ) ? n : size - offset;
+  memcpy( &ring[offset], data, first );
+  if( first < n ) memcpy( &ring[0], data + first, n - first );
+
+  // Make sure the data is in place before the writer can see it
+  MEMORY_BARRIER();
+  produced += n;
+  return true;
+}
+
+
+
+void LogWriter::commit(){
+
+  if( pending.empty() ) return;
+
+  // Precede our message with a note of anything we have had to drop
+  if( unreported > 0 ){
+    char note[64];
+    snprintf( note, 64, "[%lu log messages dropped]\n", unreported );
+    pending.insert( 0, note );
+  }
+
+  if( this->push( pending.data(), pending.size() ) ) unreported = 0;
+  else{
+    dropped++;
+    unreported++;
+  }
+
+  pending.clear();
+}
+
+
+
+void LogWriter::run(){
+#ifdef HAVE_PTHREAD
+
+  size_t size = ring.size();
+
+  while( true ){
+
+    MEMORY_BARRIER();
+    unsigned long end = produced;
+
+    if( end == consumed ){
+      if( stop ) break;
+      usleep( LOG_WRITER_INTERVAL );
+      continue;
+    }
+
+    // Write out everything available in at most two contiguous blocks
+    while( consumed != end ){
+      size_t offset = consumed % size;
+      size_t n = end - consumed;
+      if( n > size - offset ) n = size - offset;
+      ssize_t w = ::write( fd, &ring[offset], n );
+      if( w < 0 && errno == EINTR ) continue;
+      // On a write error discard the data rather than blocking the logging thread forever
+      if( w <= 0 ) w = n;
+      MEMORY_BARRIER();
+      consumed += w;
+    }
+  }
+
+#endif
+}
+
+
+
+Mutex LogBuffer::mutex;
+
+
+
+LogBuffer::int_type LogBuffer::overflow( int_type c ){
+  if( c != traits_type::eof() ) pending += traits_type::to_char_type( c );
+  return traits_type::not_eof( c );
+}
+
+
+
+streamsize LogBuffer::xsputn( const char* s, streamsize n ){
+  pending.append( s, n );
+  return n;
+}
+
+
+
+int LogBuffer::sync(){
+  if( pending.empty() || !target ) return 0;
+  {
+    ScopedLock lock( mutex );
+    target->sputn( pending.data(), pending.size() );
+    target->pubsync();
+  }
+  pending.clear();
+  return 0;
+}
@@ -0,0 +1,168 @@
+// Asynchronous log writer
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _LOGWRITER_H
+#define _LOGWRITER_H
+
+
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "Mutex.h"
+
+
+
+/// Stream buffer which hands log output to a background thread for writing
+/** Installed as the stream buffer of our log file stream, so that existing logging
+    code is unchanged. Each flush of the stream, such as by endl, appends the message
+    built up so far to a byte ring buffer, which a writer thread empties in batches.
+    The ring is a single producer, single consumer queue synchronized only by memory
+    barriers, so logging never takes a lock or makes a system call. If the ring is full
+    the message is dropped and a note of the number of dropped messages is logged once
+    there is room again. Only one thread may log at a time, as was already the case for
+    our log file stream. Requires pthread support: start() fails without it.
+ */
+class LogWriter : public std::streambuf {
+
+ private:
+
+  /// Our ring buffer
+  std::vector <char> ring;
+
+  /// Total bytes ever added by the logging thread and written by the writer thread
+  volatile unsigned long produced, consumed;
+
+  /// Message being built up until the next flush
+  std::string pending;
+
+  /// Messages dropped in total and since we last logged a note of this
+  unsigned long dropped, unreported;
+
+  std::string filename;
+  int fd;
+
+  volatile bool stop;
+  bool running;
+
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+
+  /// pthread entry point
+  static void* worker( void* w );
+#endif
+
+  /// Write out data from our ring until asked to stop
+  void run();
+
+  /// Add a block of data to our ring
+  /** @return false if there was not enough room */
+  bool push( const char* data, size_t n );
+
+  /// Move our pending message onto the ring
+  void commit();
+
+  LogWriter( const LogWriter& );
+  LogWriter& operator = ( const LogWriter& );
+
+
+ protected:
+
+  /// streambuf interface: we are unbuffered and accumulate into our pending message
+  virtual int_type overflow( int_type c );
+  virtual std::streamsize xsputn( const char* s, std::streamsize n );
+  virtual int sync();
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param f log file path, which is appended to
+   * @param size size of ring buffer in bytes
+   */
+  LogWriter( const std::string& f, unsigned int size );
+
+  /// Destructor: writes out anything remaining
+  ~LogWriter();
+
+  /// Open our file and start the writer thread
+  /** @return false if the file could not be opened or the thread not started */
+  bool start();
+
+  /// Write out everything queued so far and stop the writer thread
+  void finish();
+
+  /// Return the number of messages dropped because the ring was full
+  unsigned long getDropped(){ return dropped; };
+
+};
+
+
+
+/// Stream buffer for one of several threads writing to a shared log
+/** Each thread logging concurrently has its own stream using one of these. Messages
+    are built up separately and handed whole to the shared stream buffer, such as a
+    LogWriter, under a lock on each flush, so that output from different threads is
+    never interleaved within a message.
+ */
+class LogBuffer : public std::streambuf {
+
+ private:
+
+  /// Stream buffer of our shared log
+  std::streambuf* target;
+
+  /// Message being built up until the next flush
+  std::string pending;
+
+  /// Lock shared by all threads writing to the log
+  static Mutex mutex;
+
+  LogBuffer( const LogBuffer& );
+  LogBuffer& operator = ( const LogBuffer& );
+
+
+ protected:
+
+  virtual int_type overflow( int_type c );
+  virtual std::streamsize xsputn( const char* s, std::streamsize n );
+  virtual int sync();
+
+
+ public:
+
+  /// Constructor
+  /** @param t stream buffer of the shared log */
+  LogBuffer( std::streambuf* t ){ target = t; };
+
+  /// Destructor: writes out any unflushed message
+  ~LogBuffer(){ this->sync(); };
+
+};
+
+
+#endif
@@ -0,0 +1,55 @@
+/*
+    IIP METRICS Command Handler Class Member Function
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Task.h"
+
+using namespace std;
+
+
+
+void METRICS::run( Session* session, const std::string& argument ){
+
+  // Only export our internals if this has been explicitly enabled
+  if( !metrics.isEnabled() ){
+    if( session->loglevel >= 1 ) *(session->logfile) << "METRICS :: Metrics export is disabled" << endl;
+    session->response->setError( "2 2", "METRICS" );
+    return;
+  }
+
+  if( session->loglevel >= 3 ) *(session->logfile) << "METRICS handler reached" << endl;
+
+  string body = metrics.format( session->tileCache );
+
+  char str[1024];
+  snprintf( str, 1024,
+	    "Server: iipsrv/%s\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %d\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "\r\n",
+	    VERSION, (int) body.size() );
+
+  session->out->printf( str );
+  session->out->putStr( body.c_str(), body.size() );
+  session->out->flush();
+
+  session->response->setImageSent();
+}
@@ -0,0 +1,208 @@
+/*
+    IIP MTL Command Handler Class Member Function
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Task.h"
+#include "Tokenizer.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+
+// Separator between the parts of our multipart response
+#define MTL_BOUNDARY "IIPImage-MTL-Boundary"
+
+
+
+void MTL::run( Session* session, const string& argument ){
+
+  /* The argument is a semicolon separated list of resolution,tile pairs
+     for example MTL=3,0;3,1;4,12
+  */
+
+  this->session = session;
+  this->argument = argument;
+
+  if( session->loglevel >= 3 ) *(session->logfile) << "MTL handler reached" << endl;
+
+  checkImage();
+
+  // Time this command
+  if( session->loglevel >= 2 ) command_timer.start();
+
+
+  // Parse and check all our tiles before we send anything, so that we can still report errors
+  int num_res = (*session->image)->getNumResolutions();
+  unsigned int tw = (*session->image)->getTileWidth();
+  unsigned int th = (*session->image)->getTileHeight();
+
+  vector< pair<int,int> > tiles;
+  Tokenizer izer( argument, ";" );
+
+  while( izer.hasMoreTokens() ){
+
+    string token = izer.nextToken();
+    if( token.empty() ) continue;
+
+    size_t delimitter = token.find( "," );
+    if( delimitter == string::npos ){
+      throw invalid_argument( "MTL :: Invalid tile: " + token + ". Tiles must be given as resolution,tile" );
+    }
+
+    int resolution = atoi( token.substr( 0, delimitter ).c_str() );
+    int tile = atoi( token.substr( delimitter + 1, string::npos ).c_str() );
+
+    if( resolution < 0 || resolution >= num_res || tile < 0 ){
+      throw invalid_argument( "MTL :: Invalid resolution/tile number: " + token );
+    }
+
+    unsigned int im_width = (*session->image)->image_widths[num_res-resolution-1];
+    unsigned int im_height = (*session->image)->image_heights[num_res-resolution-1];
+    unsigned int ntlx = (im_width / tw) + (im_width % tw == 0 ? 0 : 1);
+    unsigned int ntly = (im_height / th) + (im_height % th == 0 ? 0 : 1);
+
+    if( (unsigned int) tile >= ntlx*ntly ){
+      throw invalid_argument( "MTL :: Tile out of range: " + token );
+    }
+
+    tiles.push_back( make_pair( resolution, tile ) );
+  }
+
+  if( tiles.empty() ) throw invalid_argument( "MTL :: No tiles requested" );
+
+  if( tiles.size() > MAX_BATCH_TILES ){
+    ostringstream error;
+    error << "MTL :: Too many tiles requested: the maximum is " << MAX_BATCH_TILES;
+    throw invalid_argument( error.str() );
+  }
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "MTL :: " << tiles.size() << " tiles requested" << endl;
+  }
+
+
+  // Our tiles share a single tile manager
+  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setPrefetcher( session->prefetcher );
+  tilemanager.setTrace( session->trace );
+
+
+  char str[1024];
+  snprintf( str, 1024,
+	    "Server: iipsrv/%s\r\n"
+	    "X-Powered-By: IIPImage\r\n"
+	    "Content-Type: multipart/mixed; boundary=" MTL_BOUNDARY "\r\n"
+	    "Last-Modified: %s\r\n"
+	    "%s\r\n"
+	    "%s"
+	    "\r\n",
+	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str() );
+
+  session->out->printf( str );
+  session->response->setImageSent();
+
+
+  // Send each tile as a separate part as soon as it is ready. As our headers have already been
+  // sent, any tile we fail to get is logged and sent as an empty part with an X-IIP-Error header
+  JTL jtl;
+  unsigned int sent = 0;
+
+  for( vector< pair<int,int> >::const_iterator it = tiles.begin(); it != tiles.end(); ++it ){
+
+    RawTile rawtile;
+    string message;
+    try{
+      rawtile = jtl.getTile( session, tilemanager, it->first, it->second, false );
+    }
+    catch( const file_error& error ){
+      message = error.what();
+    }
+    catch( const string& error ){
+      message = error;
+    }
+
+    if( !message.empty() ){
+      if( session->loglevel >= 1 ) *(session->logfile) << "MTL :: Unable to get tile " << it->first << "," << it->second << ": " << message << endl;
+      // Keep our error on a single header line
+      replace( message.begin(), message.end(), '\r', ' ' );
+      replace( message.begin(), message.end(), '\n', ' ' );
+      snprintf( str, 1024,
+		"--" MTL_BOUNDARY "\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 0\r\n"
+		"X-IIP-Tile: %d,%d\r\n"
+		"X-IIP-Error: %.900s\r\n"
+		"\r\n"
+		"\r\n",
+		it->first, it->second, message.c_str() );
+      session->out->printf( str );
+      session->response->setIncomplete();
+      continue;
+    }
+
+    int len = rawtile.dataLength;
+
+    snprintf( str, 1024,
+	      "--" MTL_BOUNDARY "\r\n"
+	      "Content-Type: image/jpeg\r\n"
+	      "Content-Length: %d\r\n"
+	      "X-IIP-Tile: %d,%d\r\n"
+	      "\r\n",
+	      len, it->first, it->second );
+
+    int hlen = strlen( str );
+    if( session->out->putV( str, hlen, static_cast<const char*>(rawtile.data), len ) != hlen + len ){
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "MTL :: Error writing jpeg tile" << endl;
+      }
+    }
+    session->out->printf( "\r\n" );
+
+    if( session->out->flush() == -1 ){
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "MTL :: Error flushing jpeg tile" << endl;
+      }
+    }
+
+    sent++;
+  }
+
+  session->out->printf( "--" MTL_BOUNDARY "--\r\n" );
+
+  if( session->out->flush() == -1 ){
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "MTL :: Error flushing jpeg tiles" << endl;
+    }
+  }
+
+
+  // Total MTL response time
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "MTL :: Sent " << sent << " of " << tiles.size() << " tiles" << endl
+			<< "MTL :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+}
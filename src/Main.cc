@@ -26,11 +26,19 @@
 
 #include <ctime>
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <utility>
 #include <map>
+#include <algorithm>
+#include <vector>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -42,6 +50,10 @@
 #include "Task.h"
 #include "Environment.h"
 #include "Writer.h"
+#include "CacheWarmer.h"
+#include "DiskCache.h"
+#include "LogWriter.h"
+#include "HTTPServer.h"
 
 #ifdef HAVE_MEMCACHED
 #ifdef WIN32
@@ -55,6 +67,16 @@
 #include "DSOImage.h"
 #endif
 
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
+
+#ifdef HAVE_OPENJPEG
+#include "OpenJPEGImage.h"
+#endif
+
+#include "JPEGImage.h"
+
 
 // If necessary, define missing setenv and unsetenv functions
 #ifndef HAVE_SETENV
@@ -89,687 +111,1278 @@ using namespace std;
 */
 int loglevel;
 ofstream logfile;
+LogWriter* log_writer = NULL;
 unsigned long IIPcount;
 char *tz = NULL;
+string cache_dump_file;
+unsigned int cache_dump_size;
+Mutex count_mutex;
+volatile sig_atomic_t terminate_signal = 0;
+
+
+
+/* Settings and objects shared by all of our request handling threads
+ */
+struct ServerContext {
+  HTTPServer* http;                 // Our HTTP server or NULL in FastCGI mode
+  int listen_socket;                // FastCGI socket
+  imageCacheMapType* imageCache;    // Initial contents of each thread's image cache
+  Cache* tileCache;
+  Watermark* watermark;
+  Prefetcher* prefetcher;
+  bool prefetch;
+  Tracer* tracer;
+  bool tracing;
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  string cors;
+  string cache_control;
+  string base_url;
+  string version;
+  bool shared_log;                  // Whether each thread needs its own log stream
+  streambuf* log;                   // Stream buffer of our shared log
+#ifdef HAVE_MEMCACHED
+  string memcached_servers;
+  unsigned int memcached_timeout;
+#endif
+  char* query;                      // Command line query in debug mode
+};
 
 
 
-/* Handle a signal - print out some stats and exit
+/* Handle a signal. Very little is safe to do within a signal handler, so we only
+   note which signal we caught and stop accepting requests. Our main thread then
+   waits for our workers, dumps our hot tiles, prints out some stats and exits
  */
 void IIPSignalHandler( int signal )
 {
-  if( loglevel >= 1 ){
+  terminate_signal = signal;
+#ifndef DEBUG
+  FCGX_ShutdownPending();
+#endif
+}
 
-    // Reset our time zone environment
-    if(tz) setenv("TZ", tz, 1);
-    else unsetenv("TZ");
-    tzset();
 
-    time_t current_time = time( NULL );
-    char *date = ctime( &current_time );
 
-    // No strsignal on Windows
-#ifdef WIN32
-    int sigstr = signal;
-#else
-    char *sigstr = strsignal( signal );
-#endif
 
-    logfile << endl << "Caught " << sigstr << " signal. "
-	    << "Terminating after " << IIPcount << " accesses" << endl
-	    << date
-	    << "<----------------------------------->" << endl << endl;
-    logfile.close();
-  }
 
-  exit( 1 );
+/* Accept the next FastCGI request. Only one thread may wait in FCGX_Accept_r() at a
+   time, but we finish our previous request outside of the lock so that flushing its
+   output does not hold up the other threads
+ */
+static Mutex accept_mutex;
+
+static bool acceptFCGI( FCGX_Request* request )
+{
+  FCGX_Finish_r( request );
+  ScopedLock lock( accept_mutex );
+  return ( FCGX_Accept_r( request ) >= 0 );
 }
 
 
 
+#ifdef HAVE_MEMCACHED
+/* Check whether a response may be stored in memcached. Responses whose headers ask
+   for them not to be cached, such as our metrics, must always be generated afresh
+ */
+static bool cacheable( const char* response, size_t length )
+{
+  const char* end = response + length;
+  const char separator[] = "\r\n\r\n";
+  const char* headers = search( response, end, separator, separator + 4 );
+  const char* directives[] = { "no-cache", "no-store", NULL };
+  for( unsigned int i = 0; directives[i]; i++ ){
+    if( search( response, headers, directives[i], directives[i] + strlen( directives[i] ) ) != headers ) return false;
+  }
+  return true;
+}
+#endif
+
 
 
-int main( int argc, char *argv[] )
+/* Handle requests until our server shuts down. Run by each of our worker threads
+ */
+static void* serve( void* c )
 {
+  ServerContext& context = *((ServerContext*) c);
+
+  // When several threads are logging, each writes through its own stream
+  LogBuffer log_buffer( context.log );
+  ofstream thread_log;
+  if( context.shared_log ) static_cast<ostream&>( thread_log ).rdbuf( &log_buffer );
+  ofstream& logfile = context.shared_log ? thread_log : ::logfile;
+
+  Cache& tileCache = *context.tileCache;
+  Watermark& watermark = *context.watermark;
+  Prefetcher& prefetcher = *context.prefetcher;
+  Tracer& tracer = *context.tracer;
+  bool prefetch = context.prefetch;
+  bool tracing = context.tracing;
+  int jpeg_quality = context.jpeg_quality;
+  int max_CVT = context.max_CVT;
+  int max_layers = context.max_layers;
+  const string& cors = context.cors;
+  const string& cache_control = context.cache_control;
+  const string& base_url = context.base_url;
+  const string& version = context.version;
+
+  // Each thread has its own image metadata cache, starting with any warmed entries
+  imageCacheMapType imageCache( *context.imageCache );
+
+  // And its own cache of image descriptors such as IIIF info.json
+  descriptorCacheMapType descriptorCache;
 
-  IIPcount = 0;
+#ifdef HAVE_MEMCACHED
+  // As well as its own connection to our memcached servers
+  Memcache memcached( context.memcached_servers, context.memcached_timeout );
+#endif
+
+  Timer request_timer;
+  Task* task = NULL;
   int i;
 
+#ifndef DEBUG
+  HTTPServer* http = context.http;
+  HTTPRequest* http_request = NULL;
+  FCGX_Request request;
+  if( !http ) FCGX_InitRequest( &request, context.listen_socket, 0 );
+#endif
 
-  // Define ourselves a version
-  string version = string( VERSION );
 
 
+#ifdef DEBUG
+  int status = true;
+  while( status ){
 
-  /*************************************************
-    Initialise some variables from our environment
-  *************************************************/
+    FILE *f = fopen( "test.jpg", "w" );
+    FileWriter writer( f );
+    char** envp = NULL;
+    status = false;
 
+#else
 
-  //  Check for a verbosity env variable and open an appendable logfile
-  //  if we want logging ie loglevel >= 0
+  while( http ? ( (http_request = http->accept()) != NULL ) : acceptFCGI( &request ) ){
 
-  loglevel = Environment::getVerbosity();
+    // In HTTP mode our response is buffered and sent once the request is complete.
+    // In FastCGI mode we only keep a copy of our output if it is to be stored in memcached
+#ifdef HAVE_MEMCACHED
+    FCGIWriter fcgi_writer( http ? NULL : request.out, memcached.connected() );
+#else
+    FCGIWriter fcgi_writer( http ? NULL : request.out );
+#endif
+    Writer& writer = http ? http_request->getWriter() : static_cast<Writer&>( fcgi_writer );
+    char** envp = http ? http_request->getEnvironment() : request.envp;
 
-  if( loglevel >= 1 ){
+#endif
 
-    // Check for the requested log file path
-    string lf = Environment::getLogFile();
 
-    logfile.open( lf.c_str(), ios::app );
-    // If we cannot open this, set the loglevel to 0
-    if( !logfile ){
-      loglevel = 0;
-    }
+    // Time each request
+    request_timer.start();
 
-    // Put a header marker and credit in the file
-    else{
+    // Record the stages of this request if we are tracing
+    Trace trace;
+    bool sampled = tracing && tracer.sample();
 
-      // Get current time
-      time_t current_time = time( NULL );
-      char *date = ctime( &current_time );
+    // Prefetching only uses workers which are not handling a request
+    prefetcher.busy();
 
-      logfile << "<----------------------------------->" << endl
-	      << date << endl
-	      << "IIPImage Server. Version " << version << endl
-	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
-	      << "Verbosity level set to " << loglevel << endl;
-    }
 
-  }
+    // Declare our image pointer here outside of the try scope
+    //  so that we can close the image on exceptions
+    IIPImage *image = NULL;
+    JPEGCompressor jpeg( jpeg_quality );
 
 
-  // Set our environment to UTC as all file modification times are GMT,
-  // but save our current state to allow us to reset before quitting
-  tz = getenv("TZ");
-  setenv("TZ","",1);
-  tzset();
+    // View object for use with the CVT command etc
+    View view;
+    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
+    if( max_layers != 0 ) view.setMaxLayers( max_layers );
 
 
 
-  // Set up some FCGI items and make sure we are in FCGI mode
+    // Create an IIPResponse object - we use this for the OBJ requests.
+    // As the commands return images etc, they handle their own responses.
+    IIPResponse response;
+    response.setCORS( cors );
+    response.setCacheControl( cache_control );
 
-#ifndef DEBUG
+    try{
 
-  FCGX_Request request;
-  int listen_socket = 0;
-  bool standalone = false;
+      // Set up our session data object
+      Session session;
+      session.image = &image;
+      session.response = &response;
+      session.view = &view;
+      session.jpeg = &jpeg;
+      session.loglevel = loglevel;
+      session.logfile = &logfile;
+      session.imageCache = &imageCache;
+      session.descriptorCache = &descriptorCache;
+      session.tileCache = &tileCache;
+      session.prefetcher = prefetch ? &prefetcher : NULL;
+      session.trace = tracing ? &trace : NULL;
+      session.out = &writer;
+      session.watermark = &watermark;
+      session.headers.clear();
 
-  if( argv[1] && (string(argv[1]) == "--bind") ){
-    string socket = argv[2];
-    if( !socket.length() ){
-      logfile << "No socket specified" << endl << endl;
-      exit(1);
-    }
-    int backlog = DEFAULT_BACKLOG;
-    if( argv[3] && (string(argv[3]) == "--backlog") ){
-      string bklg = argv[4];
-      if( bklg.length() ) backlog = atoi( bklg.c_str() );
-    }
-    listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
-    if( listen_socket < 0 ){
-      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
-      exit(1);
-    }
-    standalone = true;
-    logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
-  }
+      char* header = NULL;
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+      // Get the query into a string
+#ifdef DEBUG
+      header = context.query;
+#else
+      header = FCGX_GetParam( "QUERY_STRING", envp );
+#endif
 
-  // Check whether we are really in FCGI mode - only if we are not in standalone mode
-  if( FCGX_IsCGI() ){
-    if( !standalone ){
-      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
-      return( 1 );
-    }
-  }
-  else{
-    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
-  }
+      const string request_string = (header!=NULL)? header : "";
 
-#endif
+      // Check that we actually have a request string
+      if( request_string.empty() ){
+	throw string( "QUERY_STRING not set" );
+      }
 
+      if( loglevel >=2 ){
+	logfile << "Full Request is " << request_string << endl;
+      }
 
-  // Set our maximum image cache size
-  float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
 
+      if( tracing ) trace.setQuery( request_string );
 
-  // Get our image pattern variable
-  string filename_pattern = Environment::getFileNamePattern();
+      // Store some headers
+      session.headers["QUERY_STRING"] = request_string;
+      session.headers["BASE_URL"] = base_url;
 
+      // Get several other HTTP headers
+      if( (header = FCGX_GetParam("SERVER_PROTOCOL", envp)) ){
+        session.headers["SERVER_PROTOCOL"] = string(header);
+      }
+      if( (header = FCGX_GetParam("HTTP_HOST", envp)) ){
+        session.headers["HTTP_HOST"] = string(header);
+      }
+      if( (header = FCGX_GetParam("REQUEST_URI", envp)) ){
+        session.headers["REQUEST_URI"] = string(header);
+      }
+      if ( (header = FCGX_GetParam("HTTPS", envp)) ) {
+        session.headers["HTTPS"] = string(header);
+      }
 
-  // Get our default quality variable
-  int jpeg_quality = Environment::getJPEGQuality();
+      // Check for IF_MODIFIED_SINCE
+      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", envp)) ){
+	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+	if( loglevel >= 2 ){
+	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
+	}
+      }
 
+      // And for IF_NONE_MATCH
+      if( (header = FCGX_GetParam("HTTP_IF_NONE_MATCH", envp)) ){
+	session.headers["HTTP_IF_NONE_MATCH"] = string(header);
+	if( loglevel >= 2 ){
+	  logfile << "HTTP Header: If-None-Match: " << header << endl;
+	}
+      }
 
-  // Get our max CVT size
-  int max_CVT = Environment::getMaxCVT();
 
+#ifdef HAVE_MEMCACHED
+      // Check whether this exists in memcached, but only if we haven't had a conditional
+      // request, which is answered from our image metadata and should always be faster to send
+      if( !FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", envp) && !FCGX_GetParam("HTTP_IF_NONE_MATCH", envp) ){
+	char* memcached_response = NULL;
+	if( (memcached_response = memcached.retrieve( request_string )) ){
+	  metrics.increment( Metrics::MEMCACHED_HITS );
+	  writer.putStr( memcached_response, memcached.length() );
+	  writer.flush();
+	  free( memcached_response );
+	  throw( 100 );
+	}
+	if( memcached.connected() ) metrics.increment( Metrics::MEMCACHED_MISSES );
+      }
+#endif
 
-  // Get the default number of quality layers to decode
-  int max_layers = Environment::getMaxLayers();
 
+      // Parse up the command list
 
-  // Get the filesystem prefix if any
-  string filesystem_prefix = Environment::getFileSystemPrefix();
+      list < pair<string,string> > requests;
+      list < pair<string,string> > :: const_iterator commands;
 
+      Tokenizer izer( request_string, "&" );
+      while( izer.hasMoreTokens() ){
+	pair <string,string> p;
+	string token = izer.nextToken();
+	int n = token.find_first_of( "=" );
+	p.first = token.substr( 0, n );
+	p.second = token.substr( n+1, token.length() );
+	if( p.first.length() && p.second.length() ) requests.push_back( p );
+      }
 
-  // Set up our watermark object
-  Watermark watermark( Environment::getWatermark(),
-		       Environment::getWatermarkOpacity(),
-		       Environment::getWatermarkProbability() );
 
+      if( tracing ) trace.end( "parse", 0 );
 
-  // Get the CORS setting
-  string cors = Environment::getCORS();
+      i = 0;
+      for( commands = requests.begin(); commands != requests.end(); commands++ ){
 
+	string command = (*commands).first;
+	string argument = (*commands).second;
 
-  // Get any Base URL setting
-  string base_url = Environment::getBaseURL();
+	if( loglevel >= 2 ){
+	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
+	  i++;
+	}
 
+	metrics.countCommand( command );
+	long command_start = tracing ? trace.now() : 0;
+	task = Task::factory( command );
+	if( task ) task->run( &session, argument );
+	if( tracing ){
+	  string name = command;
+	  transform( name.begin(), name.end(), name.begin(), ::tolower );
+	  trace.end( name.c_str(), command_start );
+	}
 
-  // Get requested HTTP Cache-Control setting
-  string cache_control = Environment::getCacheControl();
+	if( !task ){
+	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
+	  // Unsupported command error code is 2 2
+	  response.setError( "2 2", command );
+	}
 
 
-  // Print out some information
-  if( loglevel >= 1 ){
-    logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
-    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
-    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
-    logfile << "Setting maximum CVT size to " << max_CVT << endl;
-    logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
-    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
-    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
-    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
-    if( max_layers != 0 ){
-      logfile << "Setting max quality layers (for supported file formats) to ";
-      if( max_layers < 0 ) logfile << "all layers" << endl;
-      else logfile << max_layers << endl;
-    }
-#ifdef HAVE_KAKADU
-    logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
-#endif
-  }
+	// Delete our task
+	if( task ){
+	  delete task;
+	  task = NULL;
+	}
 
+      }
 
-  // Try to load our watermark
-  if( watermark.getImage().length() > 0 ){
-    watermark.init();
-    if( loglevel >= 1 ){
-      if( watermark.isSet() ){
-	logfile << "Loaded watermark image '" << watermark.getImage()
-		<< "': setting probability to " << watermark.getProbability()
-		<< " and opacity to " << watermark.getOpacity() << endl;
+
+
+      ////////////////////////////////////////////////////////
+      ////////// Send out our Errors if necessary ////////////
+      ////////////////////////////////////////////////////////
+
+      /* Make sure something has actually been sent to the client
+	 If no response has been sent by now, we must have a malformed command
+       */
+      if( (!response.imageSent()) && (!response.isSet()) ){
+	// Malformed command syntax error code is 2 1
+	response.setError( "2 1", request_string );
       }
-      else{
-	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
+
+
+      /* Once we have finished parsing all our OBJ and COMMAND requests
+	 send out our response.
+       */
+      if( response.isSet() ){
+	if( loglevel >= 4 ){
+	  logfile << "---" << endl <<
+	    response.formatResponse() <<
+	    endl << "---" << endl;
+	}
+	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+	}
       }
-    }
-  }
 
 
+      ////////////////////////////////////////////////////////
+      ////////// Insert the result into Memcached  ///////////
+      ////////// - Note that we never store errors ///////////
+      //////////   304 replies, uncacheable ones or   ///////////
+      //////////   those with parts missing         ///////////
+      ////////////////////////////////////////////////////////
+
 #ifdef HAVE_MEMCACHED
+      if( memcached.connected() && response.isComplete() && cacheable( writer.buffer, writer.sz ) ){
+	Timer memcached_timer;
+	memcached_timer.start();
+	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
+	if( loglevel >= 3 ){
+	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
+		  << memcached_timer.getTime() << " microseconds" << endl;
+	}
+      }
+#endif
 
-  // Get our list of memcached servers if we have any and the timeout
-  string memcached_servers = Environment::getMemcachedServers();
-  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
-  if( loglevel >= 1 ){
-    if( memcached.connected() ){
-      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
-	      << "' with timeout " << memcached_timeout << endl;
+
+      //////////////////////////////////////////////////////
+      //////////////// End of try block ////////////////////
+      //////////////////////////////////////////////////////
     }
-    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
-  }
 
-#endif
+    /* Use this for sending various HTTP status codes
+     */
+    catch( const int& code ){
 
+      string status;
 
+      switch( code ){
 
-  // Add a new line
-  if( loglevel >= 1 ) logfile << endl;
+        case 304:
+	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n";
+	  status += response.getETag();
+	  status += "\r\n";
+	  writer.printf( status.c_str() );
+	  writer.flush();
+          if( loglevel >= 2 ){
+	    logfile << "Sending HTTP 304 Not Modified" << endl;
+	  }
+	  break;
 
+        case 100:
+	  if( loglevel >= 2 ){
+	    logfile << "Memcached hit" << endl;
+	  }
+	  break;
 
-  /***********************************************************
-    Check for loadable modules - only if enabled by configure
-  ***********************************************************/
+        default:
+          if( loglevel >= 1 ){
+	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
+	  }
+       }
+    }
 
-#ifdef ENABLE_DL
+    /* Catch any errors
+     */
+    catch( const string& error ){
 
-  map <string, string> moduleList;
-  string modulePath;
-  envpara = getenv( "DECODER_MODULES" );
+      metrics.increment( Metrics::ERRORS );
+      trace.setError();
 
-  if( envpara ){
+      if( loglevel >= 1 ){
+	logfile << endl << error << endl << endl;
+      }
 
-    modulePath = string( envpara );
+      if( response.errorIsSet() ){
+	if( loglevel >= 4 ){
+	  logfile << "---" << endl <<
+	    response.formatResponse() <<
+	    endl << "---" << endl;
+	}
+	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+	}
+      }
+      else{
+	/* Display our advertising banner ;-)
+	 */
+	writer.printf( response.getAdvert( version ).c_str() );
+      }
 
-    // Try to open the module
+    }
 
-    Tokenizer izer( modulePath, "," );
-  
-    while( izer.hasMoreTokens() ){
-      
-      try{
-	string token = izer.nextToken();
-	DSOImage module;
-	module.Load( token );
-	string type = module.getImageType();
-	if( loglevel >= 1 ){
-	  logfile << "Loading external module: " << module.getDescription() << endl;
-	}
-	moduleList[ type ] = token;
+    // Image file errors
+    catch( const file_error& error ){
+      metrics.increment( Metrics::ERRORS );
+      trace.setError();
+      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+      writer.printf( status.c_str() );
+      writer.flush();
+      if( loglevel >= 2 ){
+	logfile << error.what() << endl;
+	logfile << "Sending HTTP 404 Not Found" << endl;
       }
-      catch( const string& error ){
-	if( loglevel >= 1 ) logfile << error << endl;
+    }
+
+    // Parameter errors
+    catch( const invalid_argument& error ){
+      metrics.increment( Metrics::ERRORS );
+      trace.setError();
+      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+      writer.printf( status.c_str() );
+      writer.flush();
+      if( loglevel >= 2 ){
+	logfile << error.what() << endl;
+	logfile << "Sending HTTP 400 Bad Request" << endl;
       }
+    }
+
+    /* Default catch
+     */
+    catch( ... ){
+
+      metrics.increment( Metrics::ERRORS );
+      trace.setError();
+
+      if( loglevel >= 1 ){
+	logfile << "Error: Default Catch: " << endl << endl;
+      }
+
+      /* Display our advertising banner ;-)
+       */
+      writer.printf( response.getAdvert( version ).c_str() );
 
     }
-    
-    // Tell us what's happened
-    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
 
-  }
 
+    /* Do some cleaning up etc. here after all the potential exceptions
+       have been handled
+     */
+    if( task ){
+      delete task;
+      task = NULL;
+    }
+    delete image;
+    image = NULL;
+    unsigned long count;
+    {
+      ScopedLock lock( count_mutex );
+      count = ++IIPcount;
+    }
+
+    // Allow prefetching to resume
+    prefetcher.idle();
+
+    // Our writer belongs to an HTTP request only until we hand it back
+    size_t bytes_sent = writer.written;
+
+#ifdef DEBUG
+    fclose( f );
+#else
+    if( http ) http->finish( http_request );
 #endif
 
 
 
-  /***********************************************************
-    Set up a signal handler for USR1, TERM, HUP and INT signals
-    - to simplify things, they can all just shutdown the
-      server. We can rely on mod_fastcgi to restart us.
-    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
-  ***********************************************************/
+    // How long did this request take?
+    metrics.observe( Metrics::REQUEST, request_timer.getTime() );
+    metrics.increment( Metrics::BYTES_SENT, bytes_sent );
+    if( tracing ){
+      trace.finish();
+      tracer.submit( trace, sampled );
+    }
+    if( loglevel >= 2 ){
+      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
+    }
 
-#ifndef WIN32
-  signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
-#endif
 
-  signal( SIGTERM, IIPSignalHandler );
-  signal( SIGINT, IIPSignalHandler );
+    if( loglevel >= 2 ){
+      logfile << "image closed and deleted" << endl
+	      << "Server count is " << count << endl << endl;
+    }
 
 
 
-  if( loglevel >= 1 ){
-    logfile << endl << "Initialisation Complete." << endl
-	    << "<----------------------------------->"
-	    << endl << endl;
+    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
+  return NULL;
+}
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
 
-  // Create our tile cache
-  Cache tileCache( max_image_cache_size );
-  Task* task = NULL;
 
+#ifdef HAVE_PTHREAD
+/* Run by each of our worker threads: keep count of those still serving requests
+ */
+static Mutex worker_mutex;
+static unsigned int active_workers = 0;
 
+static void* work( void* c )
+{
+  serve( c );
+  ScopedLock lock( worker_mutex );
+  active_workers--;
+  return NULL;
+}
+#endif
 
-  /****************
-    Main FCGI loop
-  ****************/
 
-#ifdef DEBUG
-  int status = true;
-  while( status ){
 
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-    status = false;
+int main( int argc, char *argv[] )
+{
 
-#else
+  IIPcount = 0;
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
 
-    FCGIWriter writer( request.out );
+  // Define ourselves a version
+  string version = string( VERSION );
 
-#endif
 
 
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
+  /*************************************************
+    Initialise some variables from our environment
+  *************************************************/
 
 
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-    IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
+  //  Check for a verbosity env variable and open an appendable logfile
+  //  if we want logging ie loglevel >= 0
 
+  loglevel = Environment::getVerbosity();
 
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
+  if( loglevel >= 1 ){
 
+    // Check for the requested log file path
+    string lf = Environment::getLogFile();
 
+    logfile.open( lf.c_str(), ios::app );
+    // If we cannot open this, set the loglevel to 0
+    if( !logfile ){
+      loglevel = 0;
+    }
 
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
-    response.setCORS( cors );
-    response.setCacheControl( cache_control );
+    else{
 
-    try{
+      // Hand our log output to a background thread so that a slow disk never stalls requests
+      if( Environment::getLogBufferSize() > 0 ){
+	log_writer = new LogWriter( lf, Environment::getLogBufferSize() * 1024 );
+	if( log_writer->start() ) static_cast<ostream&>( logfile ).rdbuf( log_writer );
+	else{
+	  delete log_writer;
+	  log_writer = NULL;
+	}
+      }
 
-      // Set up our session data object
-      Session session;
-      session.image = &image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.clear();
+      // Put a header marker and credit in the file. Get current time
+      time_t current_time = time( NULL );
+      char *date = ctime( &current_time );
 
-      char* header = NULL;
+      logfile << "<----------------------------------->" << endl
+	      << date << endl
+	      << "IIPImage Server. Version " << version << endl
+	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
+	      << "Verbosity level set to " << loglevel << endl;
+    }
 
-      // Get the query into a string
-#ifdef DEBUG
-      header = argv[1];
-#else
-      header = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
+  }
 
-      const string request_string = (header!=NULL)? header : "";
 
-      // Check that we actually have a request string
-      if( request_string.empty() ){
-	throw string( "QUERY_STRING not set" );
-      }
+  // Set our environment to UTC as all file modification times are GMT,
+  // but save our current state to allow us to reset before quitting
+  tz = getenv("TZ");
+  setenv("TZ","",1);
+  tzset();
 
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
 
 
-      // Store some headers
-      session.headers["QUERY_STRING"] = request_string;
-      session.headers["BASE_URL"] = base_url;
+  // Set up some FCGI items and make sure we are in FCGI mode
 
-      // Get several other HTTP headers
-      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
-        session.headers["SERVER_PROTOCOL"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
-        session.headers["HTTP_HOST"] = string(header);
+#ifndef DEBUG
+
+  int listen_socket = 0;
+  bool standalone = false;
+  HTTPServer* http = NULL;
+
+  // Our HTTP I/O thread logs through its own stream
+  LogBuffer http_log_buffer( static_cast<ostream&>( logfile ).rdbuf() );
+  ofstream http_log;
+  static_cast<ostream&>( http_log ).rdbuf( &http_log_buffer );
+
+  if( argv[1] && (string(argv[1]) == "--http") ){
+    string address = argv[2] ? argv[2] : "";
+    if( !address.length() ){
+      logfile << "No address specified" << endl << endl;
+      if( log_writer ) log_writer->finish();
+      exit(1);
+    }
+    int backlog = DEFAULT_BACKLOG;
+    if( argv[3] && (string(argv[3]) == "--backlog") ){
+      string bklg = argv[4] ? argv[4] : "";
+      if( bklg.length() ) backlog = atoi( bklg.c_str() );
+    }
+    http = new HTTPServer( Environment::getHTTPKeepAliveTimeout(), &http_log, loglevel );
+    if( !http->open( address, backlog ) ){
+      logfile << "Unable to listen for HTTP on '" << address << "': " << http->getError() << endl << endl;
+      if( log_writer ) log_writer->finish();
+      exit(1);
+    }
+    logfile << "Running in HTTP mode on: " << address << " with backlog: " << backlog
+	    << " and keep-alive timeout: " << Environment::getHTTPKeepAliveTimeout() << "s" << endl << endl;
+  }
+  else{
+
+    if( argv[1] && (string(argv[1]) == "--bind") ){
+      string socket = argv[2];
+      if( !socket.length() ){
+	logfile << "No socket specified" << endl << endl;
+	if( log_writer ) log_writer->finish();
+	exit(1);
       }
-      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
-        session.headers["REQUEST_URI"] = string(header);
+      int backlog = DEFAULT_BACKLOG;
+      if( argv[3] && (string(argv[3]) == "--backlog") ){
+	string bklg = argv[4];
+	if( bklg.length() ) backlog = atoi( bklg.c_str() );
       }
-      if ( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
-        session.headers["HTTPS"] = string(header);
+      listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
+      if( listen_socket < 0 ){
+	logfile << "Unable to open socket '" << socket << "'" << endl << endl;
+	if( log_writer ) log_writer->finish();
+	exit(1);
       }
+      standalone = true;
+      logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
+    }
 
-      // Check for IF_MODIFIED_SINCE
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
-	}
+    // Check whether we are really in FCGI mode - only if we are not in standalone mode
+    if( FCGX_IsCGI() ){
+      if( !standalone ){
+	if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
+	return( 1 );
       }
+    }
+    else{
+      if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
+    }
+  }
 
+#endif
 
-#ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
-	char* memcached_response = NULL;
-	if( (memcached_response = memcached.retrieve( request_string )) ){
-	  writer.putStr( memcached_response, memcached.length() );
-	  writer.flush();
-	  free( memcached_response );
-	  throw( 100 );
-	}
-      }
+
+  // Set our maximum image cache size
+  float max_image_cache_size = Environment::getMaxImageCacheSize();
+  float max_uncompressed_cache_size = Environment::getMaxUncompressedCacheSize();
+  float max_high_bit_depth_cache_size = Environment::getMaxHighBitDepthCacheSize();
+  imageCacheMapType imageCache;
+
+
+  // Get our image pattern variable
+  string filename_pattern = Environment::getFileNamePattern();
+
+
+  // Get our default quality variable
+  int jpeg_quality = Environment::getJPEGQuality();
+
+
+  // Get our max CVT size
+  int max_CVT = Environment::getMaxCVT();
+
+
+  // Get the default number of quality layers to decode
+  int max_layers = Environment::getMaxLayers();
+
+
+  // Get the filesystem prefix if any
+  string filesystem_prefix = Environment::getFileSystemPrefix();
+
+
+  // Set up our watermark object
+  Watermark watermark( Environment::getWatermark(),
+		       Environment::getWatermarkOpacity(),
+		       Environment::getWatermarkProbability() );
+
+
+  // Get the CORS setting
+  string cors = Environment::getCORS();
+
+
+  // Get any Base URL setting
+  string base_url = Environment::getBaseURL();
+
+
+  // Get requested HTTP Cache-Control setting
+  string cache_control = Environment::getCacheControl();
+
+
+  // Get the number of threads handling requests, with 0 meaning one per processor
+  unsigned int workers = Environment::getWorkerThreads();
+#ifdef HAVE_PTHREAD
+#ifndef WIN32
+  if( workers == 0 ){
+    long processors = sysconf( _SC_NPROCESSORS_ONLN );
+    workers = ( processors > 0 ) ? processors : 1;
+  }
+#endif
+#else
+  workers = 1;
 #endif
+  if( workers == 0 ) workers = 1;
 
 
-      // Parse up the command list
+#ifdef HAVE_KAKADU
+  // Get the number of threads each worker decodes JPEG2000 with. By default, share our
+  // processors between our workers
+  unsigned int kakadu_threads = Environment::getKakaduThreads();
+  unsigned int kakadu_codestreams = Environment::getKakaduCodestreams();
+#ifndef WIN32
+  if( kakadu_threads == 0 ){
+    long processors = sysconf( _SC_NPROCESSORS_ONLN );
+    kakadu_threads = ( processors > (long) workers ) ? processors / workers : 1;
+  }
+#endif
+  if( kakadu_threads == 0 ) kakadu_threads = 1;
+  KakaduImage::configure( kakadu_threads, kakadu_codestreams );
+#endif
 
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
 
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
+#ifdef HAVE_OPENJPEG
+  // Likewise for OpenJPEG
+  unsigned int openjpeg_threads = Environment::getOpenJPEGThreads();
+  unsigned int openjpeg_codestreams = Environment::getOpenJPEGCodestreams();
+#ifndef WIN32
+  if( openjpeg_threads == 0 ){
+    long processors = sysconf( _SC_NPROCESSORS_ONLN );
+    openjpeg_threads = ( processors > (long) workers ) ? processors / workers : 1;
+  }
+#endif
+  if( openjpeg_threads == 0 ) openjpeg_threads = 1;
+  OpenJPEGImage::configure( openjpeg_threads, openjpeg_codestreams );
+#endif
+
+
+  // Get the size of the cache of decoded resolution levels of JPEG source images
+  float jpeg_level_cache_size = Environment::getJPEGLevelCacheSize();
+  JPEGImage::setCacheSize( (size_t) ( jpeg_level_cache_size * 1024 * 1024 ) );
+
+
+  // And of the cache of decoded bands of striped TIFF images
+  float striped_cache_size = Environment::getStripedCacheSize();
+  TPTImage::setCacheSize( (size_t) ( striped_cache_size * 1024 * 1024 ) );
+
+
+  // Get our tile prefetching settings
+  bool prefetch = Environment::getPrefetch();
+  unsigned int prefetch_queue = Environment::getPrefetchQueue();
+  unsigned int prefetch_rate = Environment::getPrefetchRate();
+  float prefetch_cache_fill = Environment::getPrefetchCacheFill();
+
+
+  // Get whether our metrics can be exported
+  bool metrics_enabled = Environment::getMetrics();
+  metrics.setEnabled( metrics_enabled );
+
+
+  // Get our request tracing settings
+  string trace_file = Environment::getTraceFile();
+  float trace_sample_rate = Environment::getTraceSampleRate();
+  unsigned int trace_slow = Environment::getTraceSlow();
+  unsigned int trace_buffer = Environment::getTraceBuffer();
+
+
+  // Get the tile cache pools which should use admission
+  string cache_admission = Environment::getCacheAdmission();
+
+
+  // Get our on-disk tile cache settings
+  string disk_cache_dir = Environment::getDiskCacheDir();
+  float disk_cache_size = Environment::getDiskCacheSize();
+  float disk_cache_segment_size = Environment::getDiskCacheSegmentSize();
+
+
+  // Get our cache warming and hot tile dump files
+  string cache_warm_file = Environment::getCacheWarmFile();
+  cache_dump_file = Environment::getCacheDumpFile();
+  cache_dump_size = Environment::getCacheDumpSize();
+
+
+  // Print out some information
+  if( loglevel >= 1 ){
+    logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    if( max_uncompressed_cache_size >= 0 ){
+      logfile << "Setting maximum uncompressed tile cache size to " << max_uncompressed_cache_size << "MB" << endl;
+    }
+    if( max_high_bit_depth_cache_size >= 0 ){
+      logfile << "Setting maximum high bit depth tile cache size to " << max_high_bit_depth_cache_size << "MB" << endl;
+    }
+    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
+    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
+    logfile << "Setting maximum CVT size to " << max_CVT << endl;
+    logfile << "Setting JPEG source image level cache size to " << jpeg_level_cache_size << "MB" << endl;
+    logfile << "Setting striped TIFF band cache size to " << striped_cache_size << "MB" << endl;
+    logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
+    if( workers > 1 ) logfile << "Setting number of worker threads to " << workers << endl;
+    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
+    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
+    if( !cache_warm_file.empty() ) logfile << "Warming caches from '" << cache_warm_file << "'" << endl;
+    if( metrics_enabled ) logfile << "Metrics export via the METRICS command enabled" << endl;
+    if( log_writer ) logfile << "Writing log asynchronously with a " << Environment::getLogBufferSize() << "kB buffer" << endl;
+    if( !cache_dump_file.empty() ) logfile << "Dumping up to " << cache_dump_size << " hot tiles on exit to '"
+					    << cache_dump_file << "'" << endl;
+    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
+    if( max_layers != 0 ){
+      logfile << "Setting max quality layers (for supported file formats) to ";
+      if( max_layers < 0 ) logfile << "all layers" << endl;
+      else logfile << max_layers << endl;
+    }
+#ifdef HAVE_KAKADU
+    logfile << "Setting up JPEG2000 support via Kakadu SDK with " << kakadu_threads << " decoding thread"
+	    << ( kakadu_threads > 1 ? "s" : "" ) << " and up to " << kakadu_codestreams
+	    << " open codestreams per worker" << endl;
+#endif
+#ifdef HAVE_OPENJPEG
+#ifdef HAVE_KAKADU
+    logfile << "OpenJPEG also available: JPEG2000 images will be decoded via Kakadu" << endl;
+#else
+    logfile << "Setting up JPEG2000 support via OpenJPEG " << opj_version() << " with " << openjpeg_threads
+	    << " decoding thread" << ( openjpeg_threads > 1 ? "s" : "" ) << " and up to " << openjpeg_codestreams
+	    << " open files per worker" << endl;
+#endif
+#endif
+  }
+
+
+  // Try to load our watermark
+  if( watermark.getImage().length() > 0 ){
+    watermark.init();
+    if( loglevel >= 1 ){
+      if( watermark.isSet() ){
+	logfile << "Loaded watermark image '" << watermark.getImage()
+		<< "': setting probability to " << watermark.getProbability()
+		<< " and opacity to " << watermark.getOpacity() << endl;
+      }
+      else{
+	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
       }
+    }
+  }
 
 
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
+#ifdef HAVE_MEMCACHED
 
-	string command = (*commands).first;
-	string argument = (*commands).second;
+  // Get our list of memcached servers if we have any and the timeout
+  string memcached_servers = Environment::getMemcachedServers();
+  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
 
-	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
-	}
+  // Create our memcached object
+  Memcache memcached( memcached_servers, memcached_timeout );
+  if( loglevel >= 1 ){
+    if( memcached.connected() ){
+      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
+	      << "' with timeout " << memcached_timeout << endl;
+    }
+    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
+  }
 
-	task = Task::factory( command );
-	if( task ) task->run( &session, argument );
+#endif
 
-	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
-	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
-	}
 
 
-	// Delete our task
-	if( task ){
-	  delete task;
-	  task = NULL;
-	}
+  // Add a new line
+  if( loglevel >= 1 ) logfile << endl;
 
-      }
 
+  /***********************************************************
+    Check for loadable modules - only if enabled by configure
+  ***********************************************************/
+
+#ifdef ENABLE_DL
 
+  map <string, string> moduleList;
+  string modulePath;
+  envpara = getenv( "DECODER_MODULES" );
 
-      ////////////////////////////////////////////////////////
-      ////////// Send out our Errors if necessary ////////////
-      ////////////////////////////////////////////////////////
+  if( envpara ){
 
-      /* Make sure something has actually been sent to the client
-	 If no response has been sent by now, we must have a malformed command
-       */
-      if( (!response.imageSent()) && (!response.isSet()) ){
-	// Malformed command syntax error code is 2 1
-	response.setError( "2 1", request_string );
-      }
+    modulePath = string( envpara );
 
+    // Try to open the module
 
-      /* Once we have finished parsing all our OBJ and COMMAND requests
-	 send out our response.
-       */
-      if( response.isSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+    Tokenizer izer( modulePath, "," );
+  
+    while( izer.hasMoreTokens() ){
+      
+      try{
+	string token = izer.nextToken();
+	DSOImage module;
+	module.Load( token );
+	string type = module.getImageType();
+	if( loglevel >= 1 ){
+	  logfile << "Loading external module: " << module.getDescription() << endl;
 	}
+	moduleList[ type ] = token;
+      }
+      catch( const string& error ){
+	if( loglevel >= 1 ) logfile << error << endl;
       }
 
+    }
+    
+    // Tell us what's happened
+    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
 
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
+  }
 
-#ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
-      }
 #endif
 
 
 
-      //////////////////////////////////////////////////////
-      //////////////// End of try block ////////////////////
-      //////////////////////////////////////////////////////
-    }
-
-    /* Use this for sending various HTTP status codes
-     */
-    catch( const int& code ){
+  /***********************************************************
+    Set up a signal handler for USR1, TERM, HUP and INT signals
+    - to simplify things, they can all just shutdown the
+      server. We can rely on mod_fastcgi to restart us.
+    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
+    - system calls are not restarted, so that a single
+      threaded server waiting for a request notices at once
+  ***********************************************************/
 
-      string status;
+#ifndef WIN32
+  struct sigaction action;
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = IIPSignalHandler;
+  sigemptyset( &action.sa_mask );
+  action.sa_flags = 0;
+  sigaction( SIGUSR1, &action, NULL );
+  sigaction( SIGHUP, &action, NULL );
+  sigaction( SIGTERM, &action, NULL );
+  sigaction( SIGINT, &action, NULL );
+#else
+  signal( SIGTERM, IIPSignalHandler );
+  signal( SIGINT, IIPSignalHandler );
+#endif
 
-      switch( code ){
 
-        case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-	  writer.printf( status.c_str() );
-	  writer.flush();
-          if( loglevel >= 2 ){
-	    logfile << "Sending HTTP 304 Not Modified" << endl;
-	  }
-	  break;
 
-        case 100:
-	  if( loglevel >= 2 ){
-	    logfile << "Memcached hit" << endl;
-	  }
-	  break;
+  if( loglevel >= 1 ){
+    logfile << endl << "Initialisation Complete." << endl
+	    << "<----------------------------------->"
+	    << endl << endl;
+  }
 
-        default:
-          if( loglevel >= 1 ){
-	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
-	  }
-       }
-    }
 
-    /* Catch any errors
-     */
-    catch( const string& error ){
+  // Set up our request timers and seed our random number generator with the millisecond count from it
+  Timer request_timer;
+  srand( request_timer.getTime() );
 
+  // Create our on-disk tile cache. This must outlive our tile cache
+  DiskCache diskCache( disk_cache_dir, disk_cache_size, disk_cache_segment_size );
+  bool disk_cache = false;
+  if( !disk_cache_dir.empty() ){
+    try{
+      diskCache.open();
+      disk_cache = true;
       if( loglevel >= 1 ){
-	logfile << endl << error << endl << endl;
-      }
-
-      if( response.errorIsSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
-      else{
-	/* Display our advertising banner ;-)
-	 */
-	writer.printf( response.getAdvert( version ).c_str() );
+	logfile << "Disk tile cache enabled in '" << diskCache.getPath() << "' with maximum size "
+		<< disk_cache_size << "MB: " << diskCache.getNumElements() << " tiles, "
+		<< diskCache.getMemorySize() << "MB loaded" << endl << endl;
       }
-
     }
-
-    // Image file errors
     catch( const file_error& error ){
-      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 404 Not Found" << endl;
-      }
+      if( loglevel >= 1 ) logfile << error.what() << ": disabling disk tile cache" << endl << endl;
     }
+  }
 
-    // Parameter errors
-    catch( const invalid_argument& error ){
-      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 400 Bad Request" << endl;
+  // Create our tile cache
+  Cache tileCache( max_image_cache_size, max_uncompressed_cache_size, max_high_bit_depth_cache_size );
+  if( disk_cache ) tileCache.setStore( &diskCache );
+
+  // Enable frequency based admission if requested, either for all pools with "1"
+  // or for a comma separated list of pool names
+  if( !cache_admission.empty() && cache_admission != "0" ){
+    string pools = ( cache_admission == "1" ) ? "encoded,raw,raw16" : cache_admission;
+    size_t start = 0;
+    while( start <= pools.size() ){
+      size_t end = pools.find( ',', start );
+      if( end == string::npos ) end = pools.size();
+      string name = pools.substr( start, end-start );
+      Cache::PoolType pool = Cache::getPoolType( name );
+      if( pool != Cache::NUM_POOLS ){
+	tileCache.setAdmission( pool, true );
+	if( loglevel >= 1 ) logfile << "TinyLFU admission enabled for " << name << " tile cache pool" << endl;
       }
+      else if( loglevel >= 1 ) logfile << "Unknown tile cache pool '" << name << "' in CACHE_ADMISSION" << endl;
+      start = end + 1;
     }
+    if( loglevel >= 1 ) logfile << endl;
+  }
 
-    /* Default catch
-     */
-    catch( ... ){
+  // Create and start our background tile prefetcher if requested. This is also
+  // used to warm the tile cache
+  Prefetcher prefetcher( &tileCache, &watermark, prefetch_queue, prefetch_rate, workers );
+  tileCache.setPrefetchLimit( prefetch_cache_fill );
 
-      if( loglevel >= 1 ){
-	logfile << "Error: Default Catch: " << endl << endl;
+
+  // Start our request tracer if requested
+  Tracer tracer( trace_file, trace_sample_rate, trace_slow, trace_buffer );
+  bool tracing = false;
+  if( !trace_file.empty() ){
+    tracing = tracer.start();
+    if( loglevel >= 1 ){
+      if( tracing ){
+	logfile << "Tracing " << trace_sample_rate*100 << "% of requests";
+	if( trace_slow > 0 ) logfile << " and all requests taking over " << trace_slow << "ms";
+	logfile << " to '" << trace_file << "'" << endl << endl;
+      }
+      else logfile << "Unable to open trace file '" << trace_file << "'" << endl << endl;
+    }
+  }
+  bool prefetcher_running = false;
+  if( prefetch || !cache_warm_file.empty() ){
+    prefetcher_running = prefetcher.start();
+    if( prefetch ){
+      if( prefetcher_running ){
+	if( loglevel >= 1 ) logfile << "Tile prefetching enabled with queue size " << prefetch_queue
+				    << ", maximum rate " << prefetch_rate << " tiles/s and "
+				    << prefetch_cache_fill << " of the tile cache for unrequested tiles" << endl << endl;
+      }
+      else{
+	prefetch = false;
+	if( loglevel >= 1 ) logfile << "Unable to start tile prefetcher: disabling" << endl << endl;
       }
+    }
+  }
 
-      /* Display our advertising banner ;-)
-       */
-      writer.printf( response.getAdvert( version ).c_str() );
 
+  // Pre-load our image metadata and tile caches. Tiles are decoded in the background
+  if( !cache_warm_file.empty() ){
+    if( !prefetcher_running && loglevel >= 1 ){
+      logfile << "Unable to start background thread: warming image metadata only" << endl;
     }
+    CacheWarmer warmer( &imageCache, prefetcher_running ? &prefetcher : NULL, &logfile, loglevel );
+    warmer.load( cache_warm_file );
+    if( loglevel >= 1 ) logfile << endl;
+  }
 
 
-    /* Do some cleaning up etc. here after all the potential exceptions
-       have been handled
-     */
-    if( task ){
-      delete task;
-      task = NULL;
-    }
-    delete image;
-    image = NULL;
-    IIPcount ++;
 
-#ifdef DEBUG
-    fclose( f );
+  /*********************************************************
+    Hand requests to our worker threads. The main thread is
+    always one of these
+  *********************************************************/
+
+  ServerContext context;
+  context.http = NULL;
+  context.listen_socket = 0;
+#ifndef DEBUG
+  context.http = http;
+  context.listen_socket = listen_socket;
+#else
+  context.query = argv[1];
+#endif
+  context.imageCache = &imageCache;
+  context.tileCache = &tileCache;
+  context.watermark = &watermark;
+  context.prefetcher = &prefetcher;
+  context.prefetch = prefetch;
+  context.tracer = &tracer;
+  context.tracing = tracing;
+  context.jpeg_quality = jpeg_quality;
+  context.max_CVT = max_CVT;
+  context.max_layers = max_layers;
+  context.cors = cors;
+  context.cache_control = cache_control;
+  context.base_url = base_url;
+  context.version = version;
+  context.log = static_cast<ostream&>( logfile ).rdbuf();
+#ifdef HAVE_MEMCACHED
+  context.memcached_servers = memcached_servers;
+  context.memcached_timeout = memcached_timeout;
 #endif
 
+#ifdef HAVE_PTHREAD
+  // Our main thread supervises our workers, so each worker logs through its own stream,
+  // as does our main thread until they have finished
+  context.shared_log = true;
+  LogBuffer main_log_buffer( context.log );
+  static_cast<ostream&>( logfile ).rdbuf( &main_log_buffer );
+
+  // Leave our signals to our main thread: threads started from here on inherit this mask
+  sigset_t signals, previous;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  sigaddset( &signals, SIGHUP );
+  sigaddset( &signals, SIGTERM );
+  sigaddset( &signals, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &signals, &previous );
+#else
+  // Our HTTP I/O thread needs its own log stream
+  context.shared_log = ( context.http != NULL );
+#endif
 
+#ifndef DEBUG
+  if( http && !http->start() ){
+    logfile << "Unable to start HTTP server: " << http->getError() << endl << endl;
+    if( log_writer ) log_writer->finish();
+    exit(1);
+  }
+#endif
 
-    // How long did this request take?
-    if( loglevel >= 2 ){
-      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
+#ifdef HAVE_PTHREAD
+  vector <pthread_t> threads;
+  for( unsigned int n = 0; n < workers; n++ ){
+    pthread_t thread;
+    if( pthread_create( &thread, NULL, work, &context ) == 0 ){
+      ScopedLock lock( worker_mutex );
+      threads.push_back( thread );
+      active_workers++;
     }
+  }
+  pthread_sigmask( SIG_SETMASK, &previous, NULL );
+  if( loglevel >= 1 && threads.size() > 1 ){
+    logfile << "Started " << threads.size() << " worker threads" << endl << endl;
+  }
 
-
-    if( loglevel >= 2 ){
-      logfile << "image closed and deleted" << endl
-	      << "Server count is " << IIPcount << endl << endl;
+  // Wait until we are signalled or our workers have stopped. Signals interrupt our sleep
+  if( !threads.empty() ){
+    while( !terminate_signal ){
+      {
+	ScopedLock lock( worker_mutex );
+	if( active_workers == 0 ) break;
+      }
+      sleep( 1 );
+    }
+#ifndef DEBUG
+    // Stop accepting requests, so that our workers return once they have finished their current one
+    if( terminate_signal ){
+      if( http ) http->shutdown();
+#ifndef WIN32
+      else shutdown( listen_socket, SHUT_RDWR );
+#endif
     }
+#endif
+    for( unsigned int n = 0; n < threads.size(); n++ ) pthread_join( threads[n], NULL );
+  }
+  else serve( &context );
+
+  // Only our main thread logs from here on
+  static_cast<ostream&>( logfile ).rdbuf( context.log );
+#else
+  serve( &context );
+#endif
 
 
 
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
-  }
 
 
+  // Save our hot tiles for the next run
+  if( !cache_dump_file.empty() ){
+    int n = CacheWarmer::dump( &tileCache, cache_dump_file, cache_dump_size );
+    if( loglevel >= 1 ) logfile << "Dumped " << n << " tile cache keys to '" << cache_dump_file << "'" << endl;
+  }
 
   if( loglevel >= 1 ){
-    logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
+    if( terminate_signal ){
+      // No strsignal on Windows
+#ifdef WIN32
+      int sigstr = terminate_signal;
+#else
+      char *sigstr = strsignal( terminate_signal );
+#endif
+      logfile << endl << "Caught " << sigstr << " signal. "
+	      << "Terminating after " << IIPcount << " accesses" << endl;
+    }
+    else logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
+    logfile << "Tile cache: " << tileCache.getHits() << " hits, " << tileCache.getMisses() << " misses, "
+	    << tileCache.getAdmitted() << " admitted, " << tileCache.getRejected() << " rejected" << endl;
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      logfile << "Tile cache " << Cache::getPoolName( (Cache::PoolType) p ) << " pool: "
+	      << tileCache.getNumElements( (Cache::PoolType) p ) << " tiles using "
+	      << tileCache.getMemorySize( (Cache::PoolType) p ) << " of "
+	      << tileCache.getMaxSize( (Cache::PoolType) p ) << "MB" << endl;
+    }
+    if( tracing ) logfile << "Wrote " << tracer.getWritten() << " traces, dropped "
+			  << tracer.getDropped() << " traces" << endl;
+    if( prefetch ) logfile << "Prefetched " << prefetcher.getPrefetched() << " tiles, dropped "
+			   << prefetcher.getDropped() << " prefetch requests" << endl;
+    if( log_writer && log_writer->getDropped() ){
+      logfile << "Dropped " << log_writer->getDropped() << " log messages" << endl;
+    }
+    if( terminate_signal ){
+      // Reset our time zone environment
+      if(tz) setenv("TZ", tz, 1);
+      else unsetenv("TZ");
+      tzset();
+
+      time_t current_time = time( NULL );
+      char *date = ctime( &current_time );
+      logfile << date << "<----------------------------------->" << endl << endl;
+    }
+    if( log_writer ) log_writer->finish();
     logfile.close();
   }
 
-  return( 0 );
+#ifndef DEBUG
+  delete http;
+#endif
+
+  return( terminate_signal ? 1 : 0 );
 
 }
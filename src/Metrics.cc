@@ -0,0 +1,177 @@
+// Lock-free server metrics
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Metrics.h"
+#include "Cache.h"
+
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+
+using namespace std;
+
+
+Metrics metrics;
+
+
+
+// Commands we count individually. Anything else is counted as "other"
+static const char* command_names[] = {
+  "obj", "fif", "qlt", "sds", "minmax", "cnt", "gam", "wid", "hei", "rgn", "rot",
+  "til", "jtl", "jtls", "mtl", "icc", "cvt", "shd", "cmp", "inv", "zoomify", "spectra",
+  "pfl", "lyr", "deepzoom", "ctw", "iiif", "metrics", "other"
+};
+static const int num_commands = sizeof(command_names) / sizeof(command_names[0]);
+
+
+// Upper bounds of our histogram buckets in microseconds
+static const long bucket_bounds[Metrics::NUM_BUCKETS] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+
+// Metric names and help text
+static const char* counter_names[Metrics::NUM_COUNTERS][2] = {
+  { "iipsrv_tile_requests_total{result=\"hit\"}", "Tile requests by whether found in the tile cache" },
+  { "iipsrv_tile_requests_total{result=\"miss\"}", 0 },
+  { "iipsrv_tile_cache_probes_total{layer=\"memory\",result=\"hit\"}", "Tile cache lookups by cache layer and result" },
+  { "iipsrv_tile_cache_probes_total{layer=\"memory\",result=\"miss\"}", 0 },
+  { "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"hit\"}", 0 },
+  { "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"miss\"}", 0 },
+  { "iipsrv_memcached_requests_total{result=\"hit\"}", "Memcached lookups by result" },
+  { "iipsrv_memcached_requests_total{result=\"miss\"}", 0 },
+  { "iipsrv_bytes_sent_total", "Bytes written to clients" },
+  { "iipsrv_errors_total", "Requests which ended in an error" }
+};
+
+static const char* histogram_names[Metrics::NUM_HISTOGRAMS][2] = {
+  { "iipsrv_request_duration_seconds", "Total request handling time" },
+  { "iipsrv_decode_duration_seconds", "Time taken to decode tiles and regions" },
+  { "iipsrv_encode_duration_seconds", "Time taken for JPEG compression" },
+  { "iipsrv_filter_duration_seconds", "Time taken by image processing filters" }
+};
+
+
+
+Metrics::Metrics(){
+  memset( (void*) counters, 0, sizeof(counters) );
+  memset( (void*) gauges, 0, sizeof(gauges) );
+  memset( (void*) buckets, 0, sizeof(buckets) );
+  memset( (void*) sums, 0, sizeof(sums) );
+  memset( (void*) commands, 0, sizeof(commands) );
+  enabled = false;
+  started = time( NULL );
+}
+
+
+
+int Metrics::commandIndex( const string& command ){
+  string c = command;
+  transform( c.begin(), c.end(), c.begin(), ::tolower );
+  for( int i = 0; i < num_commands-1; i++ ){
+    if( c == command_names[i] ) return i;
+  }
+  return num_commands-1;
+}
+
+
+
+void Metrics::observe( Histogram h, long microseconds ){
+  int b = 0;
+  while( b < NUM_BUCKETS && microseconds > bucket_bounds[b] ) b++;
+  METRIC_ADD( buckets[h][b], 1 );
+  METRIC_ADD( sums[h], microseconds );
+}
+
+
+
+string Metrics::format( Cache* tileCache ){
+
+  ostringstream out;
+
+  out << "# HELP iipsrv_start_time_seconds Time at which this server process started\n"
+      << "# TYPE iipsrv_start_time_seconds gauge\n"
+      << "iipsrv_start_time_seconds " << (long) started << "\n";
+
+  out << "# HELP iipsrv_requests_total Requests by command\n"
+      << "# TYPE iipsrv_requests_total counter\n";
+  for( int i = 0; i < num_commands; i++ ){
+    if( commands[i] ) out << "iipsrv_requests_total{command=\"" << command_names[i] << "\"} " << (long) commands[i] << "\n";
+  }
+
+  // Counters sharing a name with different labels are grouped under one TYPE line
+  string last;
+  for( int i = 0; i < NUM_COUNTERS; i++ ){
+    string name = counter_names[i][0];
+    string base = name.substr( 0, name.find( '{' ) );
+    if( base != last ){
+      if( counter_names[i][1] ) out << "# HELP " << base << " " << counter_names[i][1] << "\n";
+      out << "# TYPE " << base << " counter\n";
+      last = base;
+    }
+    out << name << " " << (long) counters[i] << "\n";
+  }
+
+  out << "# HELP iipsrv_open_files Image files currently open\n"
+      << "# TYPE iipsrv_open_files gauge\n"
+      << "iipsrv_open_files " << (long) gauges[OPEN_FILES] << "\n";
+
+  for( int h = 0; h < NUM_HISTOGRAMS; h++ ){
+    const char* name = histogram_names[h][0];
+    out << "# HELP " << name << " " << histogram_names[h][1] << "\n"
+	<< "# TYPE " << name << " histogram\n";
+    long cumulative = 0;
+    for( int b = 0; b < NUM_BUCKETS; b++ ){
+      cumulative += (long) buckets[h][b];
+      out << name << "_bucket{le=\"" << bucket_bounds[b] / 1000000.0 << "\"} " << cumulative << "\n";
+    }
+    cumulative += (long) buckets[h][NUM_BUCKETS];
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+	<< name << "_sum " << (long) sums[h] / 1000000.0 << "\n"
+	<< name << "_count " << cumulative << "\n";
+  }
+
+  if( tileCache ){
+    out << "# HELP iipsrv_tile_cache_bytes Memory used by each tile cache pool\n"
+	<< "# TYPE iipsrv_tile_cache_bytes gauge\n";
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      out << "iipsrv_tile_cache_bytes{pool=\"" << Cache::getPoolName( (Cache::PoolType) p ) << "\"} "
+	  << (unsigned long) ( tileCache->getMemorySize( (Cache::PoolType) p ) * 1024000.0 ) << "\n";
+    }
+    out << "# HELP iipsrv_tile_cache_max_bytes Memory reserved for each tile cache pool\n"
+	<< "# TYPE iipsrv_tile_cache_max_bytes gauge\n";
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      out << "iipsrv_tile_cache_max_bytes{pool=\"" << Cache::getPoolName( (Cache::PoolType) p ) << "\"} "
+	  << (unsigned long) ( tileCache->getMaxSize( (Cache::PoolType) p ) * 1024000.0 ) << "\n";
+    }
+    out << "# HELP iipsrv_tile_cache_tiles Tiles held in each tile cache pool\n"
+	<< "# TYPE iipsrv_tile_cache_tiles gauge\n";
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      out << "iipsrv_tile_cache_tiles{pool=\"" << Cache::getPoolName( (Cache::PoolType) p ) << "\"} "
+	  << tileCache->getNumElements( (Cache::PoolType) p ) << "\n";
+    }
+  }
+
+  return out.str();
+}
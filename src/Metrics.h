@@ -0,0 +1,155 @@
+// Lock-free server metrics
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+
+#include <string>
+#include <ctime>
+
+
+/* Counters are updated with atomic adds so that they can be shared between
+   our main and prefetch threads without locking
+*/
+#ifdef WIN32
+#include <windows.h>
+typedef volatile LONGLONG metric_t;
+#define METRIC_ADD(m,v) InterlockedExchangeAdd64( &(m), (LONGLONG)(v) )
+#else
+typedef volatile long metric_t;
+#define METRIC_ADD(m,v) __sync_fetch_and_add( &(m), (long)(v) )
+#endif
+
+
+class Cache;
+
+
+
+/// Process-wide counters, gauges and latency histograms
+/** Metrics are always collected, as updating them costs no more than an atomic
+    add, and can be exported in Prometheus text format via the METRICS command.
+    Values are per server process.
+ */
+class Metrics {
+
+ public:
+
+  /// Monotonic counters
+  enum Counter {
+    TILE_HITS,           ///< Tile requests found in the tile cache
+    TILE_MISSES,         ///< Tile requests which required decoding
+    MEMORY_HITS,         ///< Probes of the in-memory tile cache which succeeded
+    MEMORY_MISSES,       ///< Probes of the in-memory tile cache which failed
+    DISK_HITS,           ///< Probes of the on-disk tile cache which succeeded
+    DISK_MISSES,         ///< Probes of the on-disk tile cache which failed
+    MEMCACHED_HITS,      ///< Responses served directly from memcached
+    MEMCACHED_MISSES,    ///< Requests not found in memcached
+    BYTES_SENT,          ///< Bytes written to clients
+    ERRORS,              ///< Requests which ended in an error
+    NUM_COUNTERS
+  };
+
+  /// Gauges which can go up and down
+  enum Gauge {
+    OPEN_FILES,          ///< Image files currently open
+    NUM_GAUGES
+  };
+
+  /// Latency histograms
+  enum Histogram {
+    REQUEST,             ///< Total request time
+    DECODE,              ///< Tile and region decoding
+    ENCODE,              ///< JPEG compression
+    FILTER,              ///< Image processing filters
+    NUM_HISTOGRAMS
+  };
+
+  /// Number of histogram buckets, excluding +Inf
+  static const int NUM_BUCKETS = 16;
+
+
+ private:
+
+  metric_t counters[NUM_COUNTERS];
+  metric_t gauges[NUM_GAUGES];
+  metric_t buckets[NUM_HISTOGRAMS][NUM_BUCKETS+1];
+  metric_t sums[NUM_HISTOGRAMS];
+  metric_t commands[32];
+
+  /// Whether the METRICS command is enabled
+  bool enabled;
+
+  /// Time at which we started
+  time_t started;
+
+  /// Find the index of a command, with unknown commands mapping to the last entry
+  static int commandIndex( const std::string& command );
+
+
+ public:
+
+  /// Constructor
+  Metrics();
+
+  /// Enable or disable export through the METRICS command
+  void setEnabled( bool e ){ enabled = e; };
+
+  /// Whether export is enabled
+  bool isEnabled(){ return enabled; };
+
+  /// Increment a counter
+  /** @param c counter
+      @param v amount by which to increment
+   */
+  void increment( Counter c, long v = 1 ){ METRIC_ADD( counters[c], v ); };
+
+  /// Adjust a gauge
+  /** @param g gauge
+      @param v amount by which to adjust, which may be negative
+   */
+  void adjust( Gauge g, long v ){ METRIC_ADD( gauges[g], v ); };
+
+  /// Record a duration
+  /** @param h histogram
+      @param microseconds duration in microseconds
+   */
+  void observe( Histogram h, long microseconds );
+
+  /// Count a request command
+  /** @param command command name in any case */
+  void countCommand( const std::string& command ){ METRIC_ADD( commands[commandIndex(command)], 1 ); };
+
+  /// Format our metrics in Prometheus text exposition format
+  /** @param tileCache tile cache from which to report memory usage, or NULL
+      @return formatted metrics
+   */
+  std::string format( Cache* tileCache );
+
+};
+
+
+/// Our process-wide metrics, defined in Metrics.cc
+extern Metrics metrics;
+
+
+#endif
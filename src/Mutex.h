@@ -0,0 +1,177 @@
+// Simple thread synchronisation classes
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MUTEX_H
+#define _MUTEX_H
+
+
+/* Thin wrappers around POSIX threads. If we have been built without
+   pthread support, these all become no-ops, which is safe as the server
+   then only ever runs a single thread per process.
+*/
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+
+
+/// Simple mutual exclusion lock
+class Mutex {
+
+  friend class Condition;
+
+ private:
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t mutex;
+#endif
+
+  // Mutexes cannot be copied
+  Mutex( const Mutex& );
+  Mutex& operator = ( const Mutex& );
+
+
+ public:
+
+  /// Constructor
+  Mutex(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init( &mutex, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Mutex(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy( &mutex );
+#endif
+  };
+
+  /// Acquire the lock
+  void lock(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock( &mutex );
+#endif
+  };
+
+  /// Try to acquire the lock without blocking
+  /** @return true if the lock was acquired */
+  bool tryLock(){
+#ifdef HAVE_PTHREAD
+    return ( pthread_mutex_trylock( &mutex ) == 0 );
+#else
+    return true;
+#endif
+  };
+
+  /// Release the lock
+  void unlock(){
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock( &mutex );
+#endif
+  };
+
+};
+
+
+
+/// Lock a mutex for the lifetime of this object
+class ScopedLock {
+
+ private:
+
+  Mutex& m;
+
+  ScopedLock( const ScopedLock& );
+  ScopedLock& operator = ( const ScopedLock& );
+
+
+ public:
+
+  /// Constructor: acquires the lock
+  /** @param mutex Mutex to lock */
+  ScopedLock( Mutex& mutex ) : m( mutex ) { m.lock(); };
+
+  /// Destructor: releases the lock
+  ~ScopedLock(){ m.unlock(); };
+
+};
+
+
+
+/// Condition variable to allow threads to wait for an event
+class Condition {
+
+ private:
+
+#ifdef HAVE_PTHREAD
+  pthread_cond_t cond;
+#endif
+
+  Condition( const Condition& );
+  Condition& operator = ( const Condition& );
+
+
+ public:
+
+  /// Constructor
+  Condition(){
+#ifdef HAVE_PTHREAD
+    pthread_cond_init( &cond, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Condition(){
+#ifdef HAVE_PTHREAD
+    pthread_cond_destroy( &cond );
+#endif
+  };
+
+  /// Wait for a signal. The mutex must already be locked by the caller
+  /** @param m locked mutex, which is released while waiting */
+  void wait( Mutex& m ){
+#ifdef HAVE_PTHREAD
+    pthread_cond_wait( &cond, &m.mutex );
+#endif
+  };
+
+  /// Wake up a single waiting thread
+  void signal(){
+#ifdef HAVE_PTHREAD
+    pthread_cond_signal( &cond );
+#endif
+  };
+
+  /// Wake up all waiting threads
+  void broadcast(){
+#ifdef HAVE_PTHREAD
+    pthread_cond_broadcast( &cond );
+#endif
+  };
+
+};
+
+
+
+#endif
@@ -0,0 +1,744 @@
+/*  IIP OpenJPEG JPEG2000 Class
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "OpenJPEGImage.h"
+#include "J2KHeader.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <list>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+
+#include "Timer.h"
+//#define DEBUG 1
+
+
+using namespace std;
+
+
+// High Throughput JPEG2000 (Part 15) codestreams can be decoded from OpenJPEG 2.5
+#if defined(OPJ_VERSION_MAJOR) && ( OPJ_VERSION_MAJOR > 2 || ( OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 5 ) )
+#define OPENJPEG_HTJ2K
+#endif
+
+
+#ifdef DEBUG
+extern std::ofstream logfile;
+#endif
+
+
+// OpenJPEG starts and joins a new pool of threads for each codec, so only regions
+// covering at least this many of our tiles are decoded with several threads. Single
+// tiles are decoded in the calling thread, with parallelism coming from our workers
+#define THREADED_REGION_TILES 16
+
+
+unsigned int OpenJPEGImage::threads = 0;
+unsigned int OpenJPEGImage::codestreams = 1;
+
+
+
+/// Release an open source
+static void closeSource( OpenJPEGSource* source ){
+  if( source->data ){
+#ifndef WIN32
+    if( source->mapped ) munmap( (void*) source->data, source->length );
+    else
+#endif
+    delete[] source->data;
+  }
+  delete source;
+}
+
+
+
+/// Files kept open by each thread between requests, most recently used first
+struct OpenJPEGThreadState {
+
+  list<OpenJPEGSource*> sources;
+
+  ~OpenJPEGThreadState(){
+    for( list<OpenJPEGSource*>::iterator i = sources.begin(); i != sources.end(); ++i ) closeSource( *i );
+  };
+
+};
+
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t state_key;
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+static void deleteState( void* state ){ delete (OpenJPEGThreadState*) state; }
+static void createStateKey(){ pthread_key_create( &state_key, deleteState ); }
+#endif
+
+
+/// Return the OpenJPEG state of the calling thread
+static OpenJPEGThreadState* getThreadState(){
+#ifdef HAVE_PTHREAD
+  pthread_once( &state_once, createStateKey );
+  OpenJPEGThreadState* state = (OpenJPEGThreadState*) pthread_getspecific( state_key );
+  if( !state ){
+    state = new OpenJPEGThreadState;
+    pthread_setspecific( state_key, state );
+  }
+  return state;
+#else
+  static OpenJPEGThreadState state;
+  return &state;
+#endif
+}
+
+
+
+/// Position within a source read by an OpenJPEG stream
+struct MemoryStream {
+  const unsigned char *data;
+  OPJ_SIZE_T length;
+  OPJ_SIZE_T offset;
+};
+
+static OPJ_SIZE_T readStream( void* buffer, OPJ_SIZE_T n, void* user ){
+  MemoryStream* m = (MemoryStream*) user;
+  if( m->offset >= m->length ) return (OPJ_SIZE_T) -1;
+  if( n > m->length - m->offset ) n = m->length - m->offset;
+  memcpy( buffer, m->data + m->offset, n );
+  m->offset += n;
+  return n;
+}
+
+static OPJ_OFF_T skipStream( OPJ_OFF_T n, void* user ){
+  MemoryStream* m = (MemoryStream*) user;
+  if( n < 0 && (OPJ_SIZE_T) -n > m->offset ) n = -(OPJ_OFF_T) m->offset;
+  else if( n > 0 && (OPJ_SIZE_T) n > m->length - m->offset ) n = m->length - m->offset;
+  m->offset += n;
+  return n;
+}
+
+static OPJ_BOOL seekStream( OPJ_OFF_T n, void* user ){
+  MemoryStream* m = (MemoryStream*) user;
+  if( n < 0 || (OPJ_SIZE_T) n > m->length ) return OPJ_FALSE;
+  m->offset = n;
+  return OPJ_TRUE;
+}
+
+/// Collect OpenJPEG error messages so that they can be passed on in our exceptions
+static void errorHandler( const char* message, void* user ){
+  string* error = (string*) user;
+  if( !error->empty() ) *error += "; ";
+  *error += message;
+  // OpenJPEG messages end with a newline
+  if( !error->empty() && (*error)[error->length()-1] == '\n' ) error->erase( error->length()-1 );
+}
+
+
+
+/// An OpenJPEG codec reading the header of one of our sources. Everything is released on destruction
+class OpenJPEGDecoder {
+
+ public:
+
+  MemoryStream memory;
+  opj_stream_t *stream;
+  opj_codec_t *codec;
+  opj_image_t *image;
+  string error;
+
+  OpenJPEGDecoder(){ stream = NULL; codec = NULL; image = NULL; };
+
+  ~OpenJPEGDecoder(){
+    if( image ) opj_image_destroy( image );
+    if( codec ) opj_destroy_codec( codec );
+    if( stream ) opj_stream_destroy( stream );
+  };
+
+  /// Set up our codec and read the main header
+  /** @param source file to read
+      @param layers number of quality layers to decode, or 0 for all
+      @param threads number of threads with which to decode
+   */
+  void open( const OpenJPEGSource* source, int layers, unsigned int threads ) throw (file_error){
+
+    memory.data = source->data;
+    memory.length = source->length;
+    memory.offset = 0;
+
+    stream = opj_stream_create( OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE );
+    if( !stream ) throw file_error( "OpenJPEG :: Unable to create stream for '" + source->filename + "'" );
+    opj_stream_set_read_function( stream, readStream );
+    opj_stream_set_skip_function( stream, skipStream );
+    opj_stream_set_seek_function( stream, seekStream );
+    opj_stream_set_user_data( stream, &memory, NULL );
+    opj_stream_set_user_data_length( stream, memory.length );
+
+    // Raw codestreams start directly with the SOC and SIZ markers rather than a JP2 signature box
+    static const unsigned char j2k[4] = {0xFF,0x4F,0xFF,0x51};
+    OPJ_CODEC_FORMAT format = ( source->length >= 4 && memcmp( source->data, j2k, 4 ) == 0 ) ? OPJ_CODEC_J2K : OPJ_CODEC_JP2;
+
+    codec = opj_create_decompress( format );
+    if( !codec ) throw file_error( "OpenJPEG :: Unable to create codec for '" + source->filename + "'" );
+    opj_set_error_handler( codec, errorHandler, &error );
+
+    opj_dparameters_t parameters;
+    opj_set_default_decoder_parameters( &parameters );
+    if( layers > 0 ) parameters.cp_layer = layers;
+
+    if( !opj_setup_decoder( codec, &parameters ) ){
+      throw file_error( "OpenJPEG :: Unable to set up decoder for '" + source->filename + "': " + error );
+    }
+
+    // Decode the tiles of large regions in parallel. This fails harmlessly if OpenJPEG was built without thread support
+    if( threads > 1 ) opj_codec_set_threads( codec, threads );
+
+    if( !opj_read_header( stream, codec, &image ) ){
+      throw file_error( "OpenJPEG :: Unable to read header of '" + source->filename + "': " + error );
+    }
+  };
+
+  /// Decode a region of our image
+  /** @param r number of resolutions to discard
+      @param x0 left edge of the region on the full resolution reference grid
+      @param y0 top edge
+      @param x1 right edge
+      @param y1 bottom edge
+   */
+  void decode( unsigned int r, OPJ_INT32 x0, OPJ_INT32 y0, OPJ_INT32 x1, OPJ_INT32 y1 ) throw (file_error){
+    if( !opj_set_decoded_resolution_factor( codec, r ) ||
+	!opj_set_decode_area( codec, image, x0, y0, x1, y1 ) ||
+	!opj_decode( codec, stream, image ) ||
+	!opj_end_decompress( codec, stream ) ){
+      throw file_error( "OpenJPEG :: Unable to decode region: " + error );
+    }
+  };
+
+};
+
+
+
+OpenJPEGSource* OpenJPEGImage::getSource( const string& filename, time_t timestamp ) throw (file_error)
+{
+  OpenJPEGThreadState* state = getThreadState();
+
+  // Look for the file among those already open, reopening it if it has since changed
+  for( list<OpenJPEGSource*>::iterator i = state->sources.begin(); i != state->sources.end(); ++i ){
+    if( (*i)->filename == filename ){
+      OpenJPEGSource* source = *i;
+      state->sources.erase( i );
+      if( source->timestamp == timestamp ){
+	state->sources.push_front( source );
+	return source;
+      }
+      closeSource( source );
+      break;
+    }
+  }
+
+  OpenJPEGSource* source = new OpenJPEGSource;
+  source->filename = filename;
+  source->timestamp = timestamp;
+  source->data = NULL;
+  source->length = 0;
+  source->mapped = false;
+
+#ifndef WIN32
+  // Map the file into memory, so that the parts of it we need are read from disk and kept
+  // in the page cache by the kernel
+  int fd = ::open( filename.c_str(), O_RDONLY );
+  struct stat sb;
+  if( fd < 0 || fstat( fd, &sb ) != 0 || sb.st_size <= 0 ){
+    if( fd >= 0 ) ::close( fd );
+    closeSource( source );
+    throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
+  }
+  void* data = mmap( NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  ::close( fd );
+  if( data == MAP_FAILED ){
+    closeSource( source );
+    throw file_error( "OpenJPEG :: Unable to map '" + filename + "'" );
+  }
+  source->data = (const unsigned char*) data;
+  source->length = sb.st_size;
+  source->mapped = true;
+#else
+  // Otherwise read the whole file
+  FILE* file = fopen( filename.c_str(), "rb" );
+  if( !file ){
+    closeSource( source );
+    throw file_error( "OpenJPEG :: Unable to open '" + filename + "'" );
+  }
+  fseek( file, 0, SEEK_END );
+  long length = ftell( file );
+  fseek( file, 0, SEEK_SET );
+  unsigned char* data = ( length > 0 ) ? new unsigned char[length] : NULL;
+  source->data = data;
+  if( !data || fread( data, 1, length, file ) != (size_t) length ){
+    fclose( file );
+    closeSource( source );
+    throw file_error( "OpenJPEG :: Unable to read '" + filename + "'" );
+  }
+  fclose( file );
+  source->length = length;
+#endif
+
+  // Close our least recently used files if we have too many
+  while( !state->sources.empty() && state->sources.size() >= (codestreams > 0 ? codestreams : 1) ){
+    closeSource( state->sources.back() );
+    state->sources.pop_back();
+  }
+
+  state->sources.push_front( source );
+  return source;
+}
+
+
+
+void OpenJPEGImage::openImage() throw (file_error)
+{
+  string filename = getFileName( currentX, currentY );
+
+  // Update our timestamp
+  updateTimestamp( filename );
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  // Get our file, which is only opened if our thread does not already have it open
+  source = getSource( filename, timestamp );
+
+  // Load our metadata if not already loaded
+  if( bpc == 0 ) loadImageInfo( currentX, currentY );
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: openImage() :: " << timer.getTime() << " microseconds" << endl;
+#endif
+
+}
+
+
+void OpenJPEGImage::loadImageInfo( int seq, int ang ) throw(file_error)
+{
+  if( !source ) throw file_error( "OpenJPEG :: loadImageInfo: image not open" );
+
+  // Check for High Throughput codestreams, which older versions of OpenJPEG would fail to decode
+  if( J2KHeader::isHighThroughput( source->filename ) ){
+#ifndef OPENJPEG_HTJ2K
+    throw file_error( "OpenJPEG :: '" + source->filename + "' is HTJ2K, which requires OpenJPEG 2.5 or later" );
+#endif
+#ifdef DEBUG
+    logfile << "OpenJPEG :: HTJ2K codestream" << endl;
+#endif
+  }
+
+  OpenJPEGDecoder decoder;
+  decoder.open( source, 0, 1 );
+
+  unsigned int x0 = decoder.image->x0;
+  unsigned int y0 = decoder.image->y0;
+  unsigned int w = decoder.image->x1 - x0;
+  unsigned int h = decoder.image->y1 - y0;
+
+  // Get the number of resolutions and quality layers from the default coding parameters
+  opj_codestream_info_v2_t* info = opj_get_cstr_info( decoder.codec );
+  if( !info || !info->m_default_tile_info.tccp_info ){
+    if( info ) opj_destroy_cstr_info( &info );
+    throw file_error( "OpenJPEG :: Unable to read coding parameters of '" + source->filename + "'" );
+  }
+  numResolutions = info->m_default_tile_info.tccp_info[0].numresolutions;
+  quality_layers = info->m_default_tile_info.numlayers;
+  opj_destroy_cstr_info( &info );
+
+  if( numResolutions < 1 ) numResolutions = 1;
+
+  // Palettes and channel definitions are only applied on decoding, so decode a single pixel
+  // at our smallest resolution to find out what our output will actually look like
+  decoder.decode( numResolutions-1, x0, y0, x0+1, y0+1 );
+
+  opj_image_t* image = decoder.image;
+  channels = image->numcomps;
+  bpc = image->comps[0].prec;
+
+  for( unsigned int k=1; k<channels; k++ ){
+    if( image->comps[k].prec != bpc || image->comps[k].dx != image->comps[0].dx || image->comps[k].dy != image->comps[0].dy ){
+      throw file_error( "OpenJPEG :: Components with differing bit depths or subsampling are not supported" );
+    }
+  }
+
+  image_widths.push_back( w );
+  image_heights.push_back( h );
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: Resolutions: " << numResolutions << endl;
+  logfile << "OpenJPEG :: Resolution : " << w << "x" << h << endl;
+#endif
+
+  // Calculate the image dimensions of each resolution ourselves to force a similar
+  // behaviour to TIFF with resolutions at floor(x/2) rather than OpenJPEG's ceil(x/2)
+  for( unsigned int c=1; c<numResolutions; c++ ){
+    w = floor( w/2.0 );
+    h = floor( h/2.0 );
+    image_widths.push_back(w);
+    image_heights.push_back(h);
+#ifdef DEBUG
+    logfile << "OpenJPEG :: Resolution : " << w << "x" << h << endl;
+#endif
+  }
+
+  // If we don't have enough resolutions to fit a whole image into a single tile
+  // we need to generate them ourselves virtually
+  unsigned int n = 1;
+  w = image_widths[0];
+  h = image_heights[0];
+  while( (w>tile_width) || (h>tile_height) ){
+    n++;
+    w = floor( w/2.0 );
+    h = floor( h/2.0 );
+    if( n > numResolutions ){
+      image_widths.push_back(w);
+      image_heights.push_back(h);
+    }
+  }
+
+  if( n > numResolutions ){
+#ifdef DEBUG
+    logfile << "OpenJPEG :: Warning! Insufficient resolution levels in JPEG2000 stream. Will generate " << n-numResolutions << " extra levels dynamically -" << endl
+	    << "OpenJPEG :: However, you are advised to regenerate the file with at least " << n << " levels" << endl;
+#endif
+    virtual_levels = n-numResolutions;
+  }
+  numResolutions = n;
+
+
+  // Set our colour space - sYCC is converted to sRGB as we decode
+  if( channels < 3 || image->color_space == OPJ_CLRSPC_GRAY ) colourspace = GREYSCALE;
+  else colourspace = sRGB;
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: " << bpc << " bit data" << endl
+	  << "OpenJPEG :: " << channels << " channels" << endl
+	  << "OpenJPEG :: colour space: " << image->color_space << endl
+	  << "OpenJPEG :: " << quality_layers << " quality layers detected" << endl;
+#endif
+
+  // Get the max and min values for our data type
+  for( unsigned int i=0; i<channels; i++ ){
+    min.push_back( 0.0 );
+    if( bpc > 8 && bpc <= 16 ) max.push_back( 65535.0 );
+    else max.push_back( 255.0 );
+  }
+
+  isSet = true;
+}
+
+
+// Close our image descriptors
+void OpenJPEGImage::closeImage()
+{
+  // Our file is normally left open for later requests, unless we have been asked to keep none
+  if( source && codestreams == 0 ){
+    getThreadState()->sources.remove( source );
+    closeSource( source );
+  }
+  source = NULL;
+}
+
+
+// Get an invidual tile
+RawTile OpenJPEGImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+{
+
+  // Scale up our output bit depth to the nearest factor of 8
+  unsigned obpc = bpc;
+  if( bpc <= 16 && bpc > 8 ) obpc = 16;
+  else if( bpc <= 8 ) obpc = 8;
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  if( res >= numResolutions ){
+    ostringstream tile_no;
+    tile_no << "OpenJPEG :: Asked for non-existent resolution: " << res;
+    throw file_error( tile_no.str() );
+  }
+
+  int vipsres = ( numResolutions - 1 ) - res;
+
+  unsigned int tw = tile_width;
+  unsigned int th = tile_height;
+
+
+  // Get the width and height for last row and column tiles
+  unsigned int rem_x = image_widths[vipsres] % tile_width;
+  unsigned int rem_y = image_heights[vipsres] % tile_height;
+
+
+  // Calculate the number of tiles in each direction
+  unsigned int ntlx = (image_widths[vipsres] / tw) + (rem_x == 0 ? 0 : 1);
+  unsigned int ntly = (image_heights[vipsres] / th) + (rem_y == 0 ? 0 : 1);
+
+  if( tile >= ntlx*ntly ){
+    ostringstream tile_no;
+    tile_no << "OpenJPEG :: Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+
+  // Alter the tile size if it's in the last column
+  if( ( tile % ntlx == ntlx - 1 ) && ( rem_x != 0 ) ) {
+    tw = rem_x;
+  }
+
+  // Alter the tile size if it's in the bottom row
+  if( ( tile / ntlx == ntly - 1 ) && rem_y != 0 ) {
+    th = rem_y;
+  }
+
+
+  // Calculate the pixel offsets for this tile
+  int xoffset = (tile % ntlx) * tile_width;
+  int yoffset = (unsigned int) floor((double)(tile/ntlx)) * tile_height;
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: Tile size: " << tw << "x" << th << "@" << channels << endl;
+#endif
+
+
+  // Create our Rawtile object and initialize with data
+  RawTile rawtile( tile, res, seq, ang, tw, th, channels, obpc );
+
+
+  // Create our raw tile buffer and initialize some values
+  if( obpc == 16 ) rawtile.data = new unsigned short[tw*th*channels];
+  else if( obpc == 8 ) rawtile.data = new unsigned char[tw*th*channels];
+  else throw file_error( "OpenJPEG :: Unsupported number of bits" );
+
+  rawtile.dataLength = tw*th*channels*obpc/8;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  // Process the tile
+  process( res, layers, xoffset, yoffset, tw, th, rawtile.data );
+
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: getTile() :: " << timer.getTime() << " microseconds" << endl;
+#endif
+
+  return rawtile;
+
+}
+
+
+// Get an entire region and not just a tile
+RawTile OpenJPEGImage::getRegion( int seq, int ang, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h ) throw (file_error)
+{
+  // Scale up our output bit depth to the nearest factor of 8
+  unsigned int obpc = bpc;
+  if( bpc <= 16 && bpc > 8 ) obpc = 16;
+  else if( bpc <= 8 ) obpc = 8;
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+#endif
+
+  RawTile rawtile( 0, res, seq, ang, w, h, channels, obpc );
+
+  if( obpc == 16 ) rawtile.data = new unsigned short[w*h*channels];
+  else if( obpc == 8 ) rawtile.data = new unsigned char[w*h*channels];
+  else throw file_error( "OpenJPEG :: Unsupported number of bits" );
+
+  rawtile.dataLength = w*h*channels*obpc/8;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  process( res, layers, x, y, w, h, rawtile.data );
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: getRegion() :: " << timer.getTime() << " microseconds" << endl;
+#endif
+
+  return rawtile;
+
+}
+
+
+// Main processing function
+void OpenJPEGImage::process( unsigned int res, int layers, int xoffset, int yoffset, unsigned int tw, unsigned int th, void *d ) throw (file_error)
+{
+  // Scale up our output bit depth to the nearest factor of 8
+  unsigned int obpc = bpc;
+  if( bpc <= 16 && bpc > 8 ) obpc = 16;
+  else if( bpc <= 8 ) obpc = 8;
+
+  int vipsres = ( numResolutions - 1 ) - res;
+
+  // Handle virtual resolutions
+  unsigned int factor = 1;
+  if( res < virtual_levels ){
+    factor = 1 << (virtual_levels-res);
+    xoffset *= factor;
+    yoffset *= factor;
+    tw *= factor;
+    th *= factor;
+    vipsres = numResolutions - 1 - virtual_levels;
+#ifdef DEBUG
+  logfile << "OpenJPEG :: using smallest existing resolution " << virtual_levels << endl;
+#endif
+  }
+
+  // Set the number of layers to half of the number of detected layers if we have not set the
+  // layers parameter manually. If layers is set to less than 0, use all layers.
+  if( layers < 0 ) layers = quality_layers;
+  else if( layers == 0 ) layers = ceil( quality_layers/2.0 );
+
+  // Also make sure we have at least 1 layer
+  if( layers < 1 ) layers = 1;
+
+  if( !source ) throw file_error( "OpenJPEG :: image not open" );
+
+  // Only use extra threads where the cost of starting them is worthwhile
+  unsigned int nthreads = ( (size_t) tw * th >= (size_t) THREADED_REGION_TILES * tile_width * tile_height ) ? threads : 1;
+
+#ifdef DEBUG
+  Timer timer;
+  timer.start();
+  logfile << "OpenJPEG :: decoding " << layers << " quality layers with " << (nthreads > 1 ? nthreads : 1) << " threads" << endl;
+#endif
+
+  OpenJPEGDecoder decoder;
+  decoder.open( source, layers, nthreads );
+
+  // Our region on the full resolution reference grid, which OpenJPEG maps onto our resolution
+  opj_image_t* image = decoder.image;
+  unsigned int scale = 1 << vipsres;
+  OPJ_INT32 x0 = image->x0 + xoffset * scale;
+  OPJ_INT32 y0 = image->y0 + yoffset * scale;
+  OPJ_INT32 x1 = image->x0 + (xoffset + tw) * scale;
+  OPJ_INT32 y1 = image->y0 + (yoffset + th) * scale;
+  if( x1 > (OPJ_INT32) image->x1 ) x1 = image->x1;
+  if( y1 > (OPJ_INT32) image->y1 ) y1 = image->y1;
+
+  decoder.decode( vipsres, x0, y0, x1, y1 );
+
+  if( image->numcomps < channels ){
+    throw file_error( "OpenJPEG :: Decoded region has fewer components than expected" );
+  }
+
+#ifdef DEBUG
+  logfile << "OpenJPEG :: decoded region " << image->comps[0].w << "x" << image->comps[0].h
+	  << " in " << timer.getTime() << " microseconds" << endl;
+#endif
+
+  // Decode virtual resolutions into a local buffer before shrinking them into the output
+  void *buffer = d;
+  if( factor > 1 ){
+    if( obpc == 16 ) buffer = new unsigned short[tw*th*channels];
+    else buffer = new unsigned char[tw*th*channels];
+  }
+
+  // Our decoded region may be a pixel larger than our own rounding of the resolution size,
+  // but should never be smaller. Any missing pixels are left black.
+  unsigned int w = image->comps[0].w < tw ? image->comps[0].w : tw;
+  unsigned int h = image->comps[0].h < th ? image->comps[0].h : th;
+  if( w < tw || h < th ) memset( buffer, 0, tw*th*channels*obpc/8 );
+
+  // Convert sYCC to sRGB in place
+  if( image->color_space == OPJ_CLRSPC_SYCC && channels == 3 ){
+    double offset = 1 << (image->comps[0].prec-1);
+    unsigned int np = image->comps[0].w * image->comps[0].h;
+    OPJ_INT32 *c0 = image->comps[0].data, *c1 = image->comps[1].data, *c2 = image->comps[2].data;
+    for( unsigned int n=0; n<np; n++ ){
+      double y = c0[n] + ( image->comps[0].sgnd ? offset : 0 );
+      double cb = c1[n] + ( image->comps[1].sgnd ? offset : 0 ) - offset;
+      double cr = c2[n] + ( image->comps[2].sgnd ? offset : 0 ) - offset;
+      c0[n] = (OPJ_INT32) floor( y + 1.402*cr + 0.5 );
+      c1[n] = (OPJ_INT32) floor( y - 0.344136*cb - 0.714136*cr + 0.5 );
+      c2[n] = (OPJ_INT32) floor( y + 1.772*cb + 0.5 );
+    }
+    for( unsigned int k=0; k<3; k++ ) image->comps[k].sgnd = 0;
+  }
+
+  // Interleave our components, converting them to unsigned 8 or 16 bit values
+  unsigned int output = ( obpc == 16 ) ? 65535 : 255;
+
+  for( unsigned int k=0; k<channels; k++ ){
+
+    const opj_image_comp_t& comp = image->comps[k];
+    int offset = comp.sgnd ? 1 << (comp.prec-1) : 0;
+    int maximum = (1 << comp.prec) - 1;
+    double scale = (double) output / maximum;
+
+    for( unsigned int j=0; j<h; j++ ){
+      const OPJ_INT32* row = &comp.data[j*comp.w];
+      unsigned int index = j*tw*channels + k;
+      for( unsigned int i=0; i<w; i++, index+=channels ){
+	int v = row[i] + offset;
+	if( v < 0 ) v = 0;
+	else if( v > maximum ) v = maximum;
+	if( (unsigned int) maximum != output ) v = (int)( v*scale + 0.5 );
+	if( obpc == 16 ) ((unsigned short*)buffer)[index] = v;
+	else ((unsigned char*)buffer)[index] = v;
+      }
+    }
+  }
+
+
+  // Shrink virtual resolution tiles
+  if( factor > 1 ){
+
+#ifdef DEBUG
+    logfile << "OpenJPEG :: resizing tile to virtual resolution with factor " << factor << endl;
+#endif
+
+    unsigned int n = 0;
+    for( unsigned int j=0; j<th; j+=factor ){
+      for( unsigned int i=0; i<tw; i+=factor ){
+	for( unsigned int k=0; k<channels; k++ ){
+	  // Handle 16 and 8 bit data
+	  if( obpc==16 ){
+	    ((unsigned short*)d)[n++] = ((unsigned short*)buffer)[j*tw*channels + i*channels + k];
+	  }
+	  else if( obpc==8 ){
+	    ((unsigned char*)d)[n++] = ((unsigned char*)buffer)[j*tw*channels + i*channels + k];
+	  }
+	}
+      }
+    }
+
+    if( obpc == 16 ) delete[] (unsigned short*) buffer;
+    else delete[] (unsigned char*) buffer;
+  }
+
+}
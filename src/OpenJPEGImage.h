@@ -0,0 +1,172 @@
+// OpenJPEG JPEG2000 Image class Interface
+
+/*  IIP OpenJPEG JPEG2000 Class
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _OPENJPEGIMAGE_H
+#define _OPENJPEGIMAGE_H
+
+
+#include "IIPImage.h"
+
+#include <openjpeg.h>
+#include <string>
+#include <ctime>
+
+#define TILESIZE 256
+
+
+
+/// A JPEG2000 file held in memory, kept between requests
+/** The file is memory mapped where possible, so that only the parts of the
+    codestream needed for the regions we decode are ever read from disk
+ */
+struct OpenJPEGSource {
+  std::string filename;         ///< File name
+  time_t timestamp;             ///< File timestamp when opened
+  const unsigned char *data;    ///< File contents
+  size_t length;                ///< File size
+  bool mapped;                  ///< Whether data is memory mapped rather than allocated
+};
+
+
+
+
+/// Image class for JPEG2000 Images: Inherits from IIPImage. Uses the open source OpenJPEG library.
+class OpenJPEGImage : public IIPImage {
+
+ private:
+
+  /// Our file, which belongs to the open file cache of our thread
+  OpenJPEGSource *source;
+
+  /// Number of threads with which each of our threads decodes and the number of files it keeps open
+  static unsigned int threads;
+  static unsigned int codestreams;
+
+  /// Main processing function
+  /** @param r resolution
+      @param l number of quality levels to decode
+      @param x x coordinate
+      @param y y coordinate
+      @param w width of region
+      @param h height of region
+      @param d buffer to fill
+   */
+  void process( unsigned int r, int l, int x, int y, unsigned int w, unsigned int h, void* d ) throw (file_error);
+
+  /// Get a file from the cache of the calling thread, opening it if necessary
+  /** @param filename file name
+      @param timestamp current file timestamp: cached files opened before this are reopened
+      @return open source
+   */
+  static OpenJPEGSource* getSource( const std::string& filename, time_t timestamp ) throw (file_error);
+
+
+ public:
+
+  /// Constructor
+  OpenJPEGImage(): IIPImage(){
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
+  };
+
+  /// Constructor
+  /** @param path image path
+   */
+  OpenJPEGImage( const std::string& path ): IIPImage( path ){
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
+  };
+
+  /// Copy Constructor
+  /** @param image OpenJPEG object
+   */
+  OpenJPEGImage( const OpenJPEGImage& image ): IIPImage( image ) { source = NULL; };
+
+  /// Constructor from IIPImage object
+  /** @param image IIPImage object
+   */
+  OpenJPEGImage( const IIPImage& image ): IIPImage( image ){
+    tile_width = TILESIZE; tile_height = TILESIZE; source = NULL;
+  };
+
+  /// Assignment Operator
+  /** @param image OpenJPEGImage object
+   */
+  OpenJPEGImage& operator = ( const OpenJPEGImage& image ){
+    if( this != &image ){
+      closeImage();
+      IIPImage::operator=( image );
+    }
+    return *this;
+  };
+
+  /// Destructor
+  ~OpenJPEGImage() { closeImage(); };
+
+  /// Overloaded function for opening a JPEG2000 image
+  void openImage() throw (file_error);
+
+  /// Overloaded function for loading JPEG2000 image information
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+   */
+  void loadImageInfo( int x, int y ) throw (file_error);
+
+  /// Overloaded function for closing a JPEG2000 image
+  /** Our file is left open in the cache of our thread for use by later requests */
+  void closeImage();
+
+  /// Set up our decoding threads and open file cache
+  /** @param t number of threads with which OpenJPEG decodes the tiles of large regions, including
+               the calling thread. Values of 0 or 1 decode in the calling thread only
+      @param c number of open files to keep per thread
+   */
+  static void configure( unsigned int t, unsigned int c ){ threads = t; codestreams = c; };
+
+  /// Return whether this image type directly handles region decoding
+  bool regionDecoding(){ return true; };
+
+  /// Overloaded function for getting a particular tile
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param l number of quality layers to decode
+      @param t tile number
+   */
+  RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (file_error);
+
+  /// Overloaded function for returning a region for a given angle and resolution
+  /** Return a RawTile object: Overloaded by child class.
+      @param ha horizontal angle
+      @param va vertical angle
+      @param r resolution
+      @param l number of quality layers to decode
+      @param x x coordinate
+      @param y y coordinate
+      @param w width of region
+      @param h height of region
+   */
+  RawTile getRegion( int ha, int va, unsigned int r, int l, int x, int y, unsigned int w, unsigned int h ) throw (file_error);
+
+
+};
+
+
+#endif
@@ -194,8 +194,9 @@ void PFL::run( Session* session, const std::string& argument ){
 	    "Content-Type: application/json\r\n"
 	    "Last-Modified: %s\r\n"
 	    "%s\r\n"
+	    "%s"
 	    "\r\n",
-	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str() );
 
   session->out->printf( (const char*) str );
   session->out->flush();
@@ -0,0 +1,315 @@
+// Background tile prefetcher
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Prefetcher.h"
+#include "TileManager.h"
+#include "JPEGCompressor.h"
+#include "TPTImage.h"
+#include "JPEGImage.h"
+#include "Environment.h"
+
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
+
+#ifdef HAVE_OPENJPEG
+#include "OpenJPEGImage.h"
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <unistd.h>
+#endif
+
+#include <cmath>
+
+
+using namespace std;
+
+
+
+Prefetcher::Prefetcher( Cache* tc, Watermark* w, unsigned int queue, unsigned int r, unsigned int n ){
+  tileCache = tc;
+  watermark = w;
+  maxQueue = (queue > 0) ? queue : 1;
+  rate = r;
+  workers = (n > 0) ? n : 1;
+  active = 0;
+  stop = false;
+  running = false;
+  prefetched = 0;
+  dropped = 0;
+}
+
+
+
+Prefetcher::~Prefetcher(){
+#ifdef HAVE_PTHREAD
+  if( running ){
+    mutex.lock();
+    stop = true;
+    condition.broadcast();
+    mutex.unlock();
+    pthread_join( thread, NULL );
+  }
+#endif
+}
+
+
+
+bool Prefetcher::start(){
+#ifdef HAVE_PTHREAD
+  if( !running && pthread_create( &thread, NULL, Prefetcher::worker, this ) == 0 ){
+    running = true;
+  }
+#endif
+  return running;
+}
+
+
+
+#ifdef HAVE_PTHREAD
+void* Prefetcher::worker( void* p ){
+  ((Prefetcher*) p)->run();
+  return NULL;
+}
+#endif
+
+
+
+IIPImage* Prefetcher::createDecoder( IIPImage& image ){
+
+  ImageFormat format = image.getImageFormat();
+
+  if( format == TIF ) return new TPTImage( image );
+  else if( format == JPG ) return new JPEGImage( image );
+#ifdef HAVE_KAKADU
+  else if( format == JPEG2000 ) return new KakaduImage( image );
+#elif defined(HAVE_OPENJPEG)
+  else if( format == JPEG2000 ) return new OpenJPEGImage( image );
+#endif
+  return NULL;
+}
+
+
+
+void Prefetcher::prefetch( const IIPImage& im, int resolution, int tile, int xangle, int yangle,
+			   int layers, CompressionType c, int quality ){
+
+  if( !running ) return;
+
+  Request request;
+  request.image = im;
+  request.xangle = xangle;
+  request.yangle = yangle;
+  request.layers = layers;
+  request.compression = c;
+  request.quality = (c == JPEG) ? quality : 0;
+
+  IIPImage& image = request.image;
+  int num_res = image.getNumResolutions();
+  unsigned int tw = image.getTileWidth();
+  unsigned int th = image.getTileHeight();
+
+  if( resolution < 0 || resolution >= num_res || tw == 0 || th == 0 ) return;
+
+  // Number of tiles in each direction at a given resolution
+  vector <int> ntlx( num_res ), ntly( num_res );
+  for( int r = 0; r < num_res; r++ ){
+    ntlx[r] = (int) ceil( (double) image.image_widths[num_res-r-1] / tw );
+    ntly[r] = (int) ceil( (double) image.image_heights[num_res-r-1] / th );
+  }
+
+  int x = tile % ntlx[resolution];
+  int y = tile / ntlx[resolution];
+  if( y >= ntly[resolution] ) return;
+
+  // Order by likelihood of being requested next: immediate neighbours
+  // first, followed by the next finer resolution and then the parent
+  int dx[4] = { 1, -1, 0, 0 };
+  int dy[4] = { 0, 0, 1, -1 };
+  for( int i = 0; i < 4; i++ ){
+    int nx = x + dx[i], ny = y + dy[i];
+    if( nx >= 0 && ny >= 0 && nx < ntlx[resolution] && ny < ntly[resolution] ){
+      request.tiles.push_back( make_pair( resolution, ny*ntlx[resolution] + nx ) );
+    }
+  }
+
+  if( resolution+1 < num_res ){
+    int r = resolution+1;
+    for( int j = 0; j < 2; j++ ){
+      for( int i = 0; i < 2; i++ ){
+	int nx = 2*x + i, ny = 2*y + j;
+	if( nx < ntlx[r] && ny < ntly[r] ) request.tiles.push_back( make_pair( r, ny*ntlx[r] + nx ) );
+      }
+    }
+  }
+
+  if( resolution > 0 ){
+    int r = resolution-1;
+    int nx = x/2, ny = y/2;
+    if( nx < ntlx[r] && ny < ntly[r] ) request.tiles.push_back( make_pair( r, ny*ntlx[r] + nx ) );
+  }
+
+
+  // Newest requests go to the front. Drop the oldest if we have too many
+  ScopedLock lock( mutex );
+  queue.push_front( request );
+  while( queue.size() > maxQueue ){
+    queue.pop_back();
+    dropped++;
+  }
+  condition.signal();
+}
+
+
+
+void Prefetcher::warm( const IIPImage& image, int xangle, int yangle, int layers, CompressionType c,
+		       int quality, const list < pair<int,int> >& tiles ){
+
+  if( !running || tiles.empty() ) return;
+
+  Request request;
+  request.image = image;
+  request.xangle = xangle;
+  request.yangle = yangle;
+  request.layers = layers;
+  request.compression = c;
+  request.quality = (c == JPEG) ? quality : 0;
+  request.tiles = tiles;
+
+  ScopedLock lock( mutex );
+  warmQueue.push_back( request );
+  condition.signal();
+}
+
+
+
+void Prefetcher::busy(){
+  ScopedLock lock( mutex );
+  active++;
+}
+
+
+
+void Prefetcher::idle(){
+  ScopedLock lock( mutex );
+  if( active > 0 ) active--;
+  if( active < workers ) condition.signal();
+}
+
+
+
+void Prefetcher::run(){
+
+  IIPImage* decoder = NULL;
+  JPEGCompressor jpeg( JPEG_QUALITY );
+
+  while( true ){
+
+    int resolution, tile, xangle, yangle, layers, quality;
+    CompressionType c;
+    IIPImage* next = NULL;
+    bool reopen = false;
+
+    // Wait until we have something to do and a worker is free
+    mutex.lock();
+    while( !stop && ( (queue.empty() && warmQueue.empty()) || active >= workers ) ) condition.wait( mutex );
+    if( stop ){
+      mutex.unlock();
+      break;
+    }
+
+    // Prefetch requests take priority over cache warming
+    bool warming = queue.empty();
+    list <Request>& source = warming ? warmQueue : queue;
+    Request& request = source.front();
+    resolution = request.tiles.front().first;
+    tile = request.tiles.front().second;
+    request.tiles.pop_front();
+    xangle = request.xangle;
+    yangle = request.yangle;
+    layers = request.layers;
+    c = request.compression;
+    quality = request.quality;
+
+    // Reuse our open image if possible
+    if( !decoder || decoder->getImagePath() != request.image.getImagePath()
+	|| decoder->timestamp != request.image.timestamp ){
+      reopen = true;
+      next = createDecoder( request.image );
+    }
+    string path = request.image.getImagePath();
+
+    if( request.tiles.empty() ) source.pop_front();
+    mutex.unlock();
+
+
+    try{
+
+      if( reopen ){
+	if( decoder ){
+	  decoder->closeImage();
+	  delete decoder;
+	}
+	decoder = next;
+	next = NULL;
+	if( decoder ) decoder->openImage();
+      }
+      if( !decoder ) continue;
+
+      if( tileCache->hasTile( path, resolution, tile, xangle, yangle, c, quality ) ) continue;
+
+      if( c == JPEG ) jpeg.setQuality( quality );
+
+      // Logging is disabled here as our log stream is not thread safe. Warmed tiles
+      // were requested before our last restart, so are cached as normal tiles
+      TileManager tilemanager( tileCache, decoder, watermark, &jpeg, NULL, 0 );
+      tilemanager.setBackground( !warming );
+      tilemanager.getTile( resolution, tile, xangle, yangle, layers, c );
+
+      mutex.lock();
+      prefetched++;
+      mutex.unlock();
+    }
+    catch( ... ){
+      // Errors are not fatal - the tile will simply be decoded on demand
+      delete next;
+      if( decoder ){
+	decoder->closeImage();
+	delete decoder;
+	decoder = NULL;
+      }
+    }
+
+    // Limit our CPU usage
+#ifdef HAVE_PTHREAD
+    if( rate > 0 ) usleep( 1000000 / rate );
+#endif
+
+  }
+
+  if( decoder ){
+    decoder->closeImage();
+    delete decoder;
+  }
+
+}
@@ -0,0 +1,184 @@
+// Background tile prefetcher
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+
+#include <list>
+#include <vector>
+#include <fstream>
+
+#include "IIPImage.h"
+#include "RawTile.h"
+#include "Cache.h"
+#include "Watermark.h"
+#include "Mutex.h"
+
+
+
+/// Class to decode and cache tiles that a client is likely to request next
+/** Tile requests from panning and zooming viewers are strongly spatially correlated.
+    After each tile request, the neighbouring tiles at the same resolution, the parent
+    tile at the next coarser resolution and the children at the next finer resolution
+    are queued. Tiles can also be queued in bulk to warm the cache at startup.
+    A background thread decodes and compresses these into the tile cache
+    whenever at least one worker is idle, subject to a maximum rate. Prefetched tiles
+    are held within the cache's own prefetch budget until requested and are not counted
+    as requests. Only available if built with pthread support, otherwise prefetch()
+    does nothing.
+*/
+class Prefetcher {
+
+ private:
+
+  /// A group of tiles belonging to a single image and view
+  struct Request {
+    IIPImage image;
+    int xangle;
+    int yangle;
+    int layers;
+    CompressionType compression;
+    int quality;
+    std::list < std::pair<int,int> > tiles;   // resolution, tile
+  };
+
+  /// Pending requests: most recent first
+  std::list <Request> queue;
+
+  /// Tiles to be loaded into the cache at startup. Only processed when queue is empty
+  std::list <Request> warmQueue;
+
+  /// Maximum number of pending requests
+  unsigned int maxQueue;
+
+  /// Maximum tiles per second to decode
+  unsigned int rate;
+
+  /// Number of foreground worker threads
+  int workers;
+
+  /// Tile cache shared with the main thread
+  Cache* tileCache;
+
+  /// Watermark applied to tiles
+  Watermark* watermark;
+
+  /// Number of foreground requests currently being processed
+  int active;
+
+  /// Whether our worker should exit
+  bool stop;
+
+  /// Whether the worker thread has been started
+  bool running;
+
+  /// Counters for logging
+  unsigned long prefetched, dropped;
+
+  Mutex mutex;
+  Condition condition;
+
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+
+  /// pthread entry point
+  static void* worker( void* p );
+#endif
+
+  /// Worker loop
+  void run();
+
+  Prefetcher( const Prefetcher& );
+  Prefetcher& operator = ( const Prefetcher& );
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param tc pointer to tile cache object
+   * @param w pointer to watermark object
+   * @param queue maximum number of pending tile requests
+   * @param r maximum number of tiles decoded per second (0 for no limit)
+   * @param n number of foreground worker threads
+   */
+  Prefetcher( Cache* tc, Watermark* w, unsigned int queue, unsigned int r, unsigned int n );
+
+  /// Destructor: stops the worker thread
+  ~Prefetcher();
+
+  /// Start the worker thread
+  /** @return true if the worker thread is running */
+  bool start();
+
+  /// Queue the tiles surrounding a tile that has just been requested
+  /**
+   *  @param image image object from which the tile came
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param c CompressionType
+   *  @param quality compression quality
+   */
+  void prefetch( const IIPImage& image, int resolution, int tile, int xangle, int yangle,
+		 int layers, CompressionType c, int quality );
+
+  /// Queue a list of tiles for cache warming
+  /**
+   *  Warming requests have a lower priority than prefetch requests and are never dropped
+   *  @param image image object
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param c CompressionType
+   *  @param quality compression quality
+   *  @param tiles list of resolution and tile number pairs
+   */
+  void warm( const IIPImage& image, int xangle, int yangle, int layers, CompressionType c,
+	     int quality, const std::list < std::pair<int,int> >& tiles );
+
+  /// Notify the prefetcher that a foreground request has started
+  /** The worker only starts decoding a tile while fewer requests are active than we have workers */
+  void busy();
+
+  /// Notify the prefetcher that a foreground request has finished
+  void idle();
+
+  /// Return the number of tiles prefetched so far
+  unsigned long getPrefetched(){ ScopedLock lock( mutex ); return prefetched; };
+
+  /// Return the number of queued requests dropped because the queue was full
+  unsigned long getDropped(){ ScopedLock lock( mutex ); return dropped; };
+
+  /// Create an image decoder appropriate for the format of an image
+  /** @param image image to decode
+      @return new decoder object or NULL if unsupported
+   */
+  static IIPImage* createDecoder( IIPImage& image );
+
+};
+
+
+#endif
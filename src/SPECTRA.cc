@@ -85,8 +85,9 @@ void SPECTRA::run( Session* session, const std::string& argument ){
 	    "Content-Type: application/xml\r\n"
 	    "Last-Modified: %s\r\n"
 	    "%s\r\n"
+	    "%s"
 	    "\r\n",
-	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str() );
 
   session->out->printf( (const char*) str );
   session->out->flush();
@@ -115,8 +115,9 @@ void TIL::run( Session* session, const std::string& a ){
 	      "Content-Type: application/vnd.netfpx\r\n"
 	      "Last-Modified: %s\r\n"
 	      "%s\r\n"
+	      "%s"
 	      "\r\n",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str() );
 
     session->out->printf( (const char*)str );
   }
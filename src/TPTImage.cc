@@ -22,12 +22,72 @@
 
 
 #include "TPTImage.h"
+#include "Metrics.h"
+#include "Mutex.h"
 #include <sstream>
+#include <cstring>
+#include <list>
 
 
 using namespace std;
 
 
+size_t TPTImage::cache_size = 64*1024*1024;
+
+
+
+/// A band of decoded rows of a striped level, one tile high, kept in our band cache
+struct TIFFBand {
+  string filename;
+  time_t timestamp;
+  int directory;
+  uint32 row;          ///< First row of the band
+  uint32 rows;         ///< Number of rows in the band
+  tsize_t scanline;    ///< Bytes per row
+  unsigned char* data;
+};
+
+/// Our decoded bands shared by all threads, most recently used first
+static list<TIFFBand*> bands;
+static size_t cached = 0;
+static Mutex bands_mutex;
+
+
+/// Find a band in our cache and make it the most recently used. Our lock must be held
+static TIFFBand* findBand( const string& filename, time_t timestamp, int directory, uint32 row ){
+  for( list<TIFFBand*>::iterator i = bands.begin(); i != bands.end(); ++i ){
+    TIFFBand* band = *i;
+    if( band->row == row && band->directory == directory && band->timestamp == timestamp && band->filename == filename ){
+      bands.splice( bands.begin(), bands, i );
+      return band;
+    }
+  }
+  return NULL;
+}
+
+
+/// Add a band to our cache, dropping our least recently used bands if we are full
+static void cacheBand( TIFFBand* band, size_t max ){
+  size_t size = (size_t) band->rows * band->scanline;
+  ScopedLock lock( bands_mutex );
+  // Another thread may have decoded the same band in the meantime
+  if( findBand( band->filename, band->timestamp, band->directory, band->row ) ){
+    delete[] band->data;
+    delete band;
+    return;
+  }
+  while( !bands.empty() && cached + size > max ){
+    TIFFBand* last = bands.back();
+    cached -= (size_t) last->rows * last->scanline;
+    delete[] last->data;
+    delete last;
+    bands.pop_back();
+  }
+  bands.push_front( band );
+  cached += size;
+}
+
+
 void TPTImage::openImage() throw (file_error)
 {
 
@@ -45,13 +105,14 @@ void TPTImage::openImage() throw (file_error)
   if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
     throw file_error( "tiff open failed for: " + filename );
   }
+  metrics.adjust( Metrics::OPEN_FILES, 1 );
 
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
-  // Insist on a tiled image
+  // Insist on a tile size, which we set ourselves for striped images
   if( (tile_width == 0) && (tile_height == 0) ){
-    throw file_error( "TIFF image is not tiled" );
+    throw file_error( "TIFF image has no tile size" );
   }
 
   isSet = true;
@@ -73,9 +134,15 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   currentX = seq;
   currentY = ang;
 
-  // Get the tile and image sizes
-  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
-  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
+  // Get the tile and image sizes. Striped images are divided into virtual tiles of our own
+  if( TIFFIsTiled( tiff ) ){
+    TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
+    TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
+  }
+  else{
+    tile_width = TILESIZE;
+    tile_height = TILESIZE;
+  }
   TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
   TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
   TIFFGetField( tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel );
@@ -93,6 +160,8 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   TIFFSetDirectory( tiff, 0 );
 
   // Store the list of image dimensions available
+  image_widths.clear();
+  image_heights.clear();
   image_widths.push_back( w );
   image_heights.push_back( h );
 
@@ -105,7 +174,18 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   // Reset the TIFF directory
   TIFFSetDirectory( tiff, current_dir );
 
-  numResolutions = count+1;
+  // Add virtual levels until the smallest fits into a single tile. These are generated on
+  // demand from the level above
+  virtual_levels = 0;
+  while( (w > tile_width || h > tile_height) && w > 1 && h > 1 ){
+    w = w/2;
+    h = h/2;
+    image_widths.push_back( w );
+    image_heights.push_back( h );
+    virtual_levels++;
+  }
+
+  numResolutions = count + 1 + virtual_levels;
 
   // Handle various colour spaces
   if( colour == PHOTOMETRIC_CIELAB ) colourspace = CIELAB;
@@ -178,6 +258,7 @@ void TPTImage::closeImage()
   if( tiff != NULL ){
     TIFFClose( tiff );
     tiff = NULL;
+    metrics.adjust( Metrics::OPEN_FILES, -1 );
   }
   if( tile_buf != NULL ){
     _TIFFfree( tile_buf );
@@ -195,12 +276,19 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 
   // Check the resolution exists
-  if( res > numResolutions ){
+  if( res >= numResolutions ){
     ostringstream error;
     error << "TPTImage :: Asked for non-existent resolution: " << res;
     throw file_error( error.str() );
   }
 
+  // Our virtual levels are not in the file
+  if( res < virtual_levels ){
+    ostringstream error;
+    error << "TPTImage :: Resolution " << res << " is not stored in the image and must be generated";
+    throw file_error( error.str() );
+  }
+
 
   // If we are currently working on a different sequence number, then
   //  close and reload the image.
@@ -215,6 +303,7 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
       throw file_error( "tiff open failed for:" + filename );
     }
+    metrics.adjust( Metrics::OPEN_FILES, 1 );
   }
 
 
@@ -236,6 +325,10 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
+  // Striped levels are cut into tiles ourselves
+  if( !TIFFIsTiled( tiff ) ) return getStripedTile( seq, ang, res, tile );
+
+
   // Check that a valid tile number was given  
   if( tile >= TIFFNumberOfTiles( tiff ) ) {
     ostringstream tile_no;
@@ -364,3 +457,190 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+RawTile TPTImage::getStripedTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height, rows_per_strip;
+  uint16 colour, planar;
+
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+
+  if( planar == PLANARCONFIG_SEPARATE && channels > 1 ){
+    throw file_error( "TPTImage :: Striped images with separate colour planes are not supported: " + getFileName( seq, ang ) );
+  }
+  if( rows_per_strip > im_height ) rows_per_strip = im_height;
+
+  // As for tiled images, colourmapped images are returned as their raw indices
+  if( colour == PHOTOMETRIC_PALETTE ){
+    colourspace = GREYSCALE;
+    channels = 1;
+  }
+  else if( colour == PHOTOMETRIC_YCBCR ){
+    TIFFSetField( tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+  }
+
+
+  // Work out the position and size of our tile
+  unsigned int ntlx = (im_width + tile_width - 1) / tile_width;
+  unsigned int ntly = (im_height + tile_height - 1) / tile_height;
+
+  if( tile >= ntlx*ntly ){
+    ostringstream tile_no;
+    tile_no << "Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+
+  uint32 x0 = (tile % ntlx) * tile_width;
+  uint32 y0 = (tile / ntlx) * tile_height;
+  uint32 tw = ( x0 + tile_width > im_width ) ? im_width - x0 : tile_width;
+  uint32 th = ( y0 + tile_height > im_height ) ? im_height - y0 : tile_height;
+
+
+  // 1 bit images are unpacked to 8 bits as for tiles
+  unsigned int out_bpc = ( bpc == 1 ) ? 8 : bpc;
+  unsigned int pixel_bytes = channels * out_bpc / 8;
+  unsigned int n = tw * th * channels;
+
+  RawTile rawtile( tile, res, seq, ang, tw, th, channels, out_bpc );
+  rawtile.sampleType = sampleType;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.dataLength = tw * th * pixel_bytes;
+
+  if( out_bpc == 16 ) rawtile.data = new unsigned short[n];
+  else if( out_bpc == 32 && sampleType == FIXEDPOINT ) rawtile.data = new unsigned int[n];
+  else if( out_bpc == 32 && sampleType == FLOATINGPOINT ) rawtile.data = new float[n];
+  else rawtile.data = new unsigned char[n];
+
+
+  // Our tile is cut from the band of rows of the same height in which it lies
+  string filename = getFileName( seq, ang );
+  int dir = TIFFCurrentDirectory( tiff );
+  tsize_t scanline = TIFFScanlineSize( tiff );
+  unsigned char* data = NULL;
+  TIFFBand* band = NULL;
+
+  // Bands are only cached if several fit into our cache
+  bool caching = ( (size_t) scanline * tile_height <= cache_size / 4 );
+
+  if( caching ){
+    ScopedLock lock( bands_mutex );
+    band = findBand( filename, timestamp, dir, y0 );
+    if( band ){
+      TPTImage::cutTile( band->data, scanline, x0, tw, th, colour, rawtile );
+      return rawtile;
+    }
+  }
+
+
+  // Compressed strips can only be decoded from their start, so we always read from the
+  // start of the strip holding our first row. When caching, any whole bands we pass
+  // through on the way to our own are kept too. Otherwise, those rows are discarded
+  uint32 start = ( y0 / rows_per_strip ) * rows_per_strip;
+  unsigned char* row_buf = NULL;
+
+  try{
+
+    data = new unsigned char[ (size_t) scanline * th ];
+    row_buf = new unsigned char[ scanline ];
+
+    for( uint32 row = start; row < y0 + th; row++ ){
+
+      unsigned char* dst = row_buf;
+
+      if( row >= y0 ) dst = data + (size_t) (row - y0) * scanline;
+      else if( caching ){
+	// Start a new band if it lies wholly before ours and we don't already have it
+	if( row % tile_height == 0 && row + tile_height <= y0 ){
+	  bool found;
+	  {
+	    ScopedLock lock( bands_mutex );
+	    found = ( findBand( filename, timestamp, dir, row ) != NULL );
+	  }
+	  if( !found ){
+	    band = new TIFFBand;
+	    band->filename = filename;
+	    band->timestamp = timestamp;
+	    band->directory = dir;
+	    band->row = row;
+	    band->rows = tile_height;
+	    band->scanline = scanline;
+	    band->data = new unsigned char[ (size_t) scanline * tile_height ];
+	  }
+	}
+	if( band ) dst = band->data + (size_t) (row - band->row) * scanline;
+      }
+
+      if( TIFFReadScanline( tiff, dst, row, 0 ) == -1 ){
+	throw file_error( "TIFFReadScanline failed for " + filename );
+      }
+
+      if( band && row == band->row + band->rows - 1 ){
+	cacheBand( band, cache_size );
+	band = NULL;
+      }
+    }
+
+  }
+  catch( const file_error& ){
+    if( band ){
+      delete[] band->data;
+      delete band;
+    }
+    delete[] row_buf;
+    delete[] data;
+    throw;
+  }
+
+  delete[] row_buf;
+
+  TPTImage::cutTile( data, scanline, x0, tw, th, colour, rawtile );
+
+  if( caching ){
+    band = new TIFFBand;
+    band->filename = filename;
+    band->timestamp = timestamp;
+    band->directory = dir;
+    band->row = y0;
+    band->rows = th;
+    band->scanline = scanline;
+    band->data = data;
+    cacheBand( band, cache_size );
+  }
+  else delete[] data;
+
+  return rawtile;
+
+}
+
+
+
+void TPTImage::cutTile( const unsigned char* data, tsize_t scanline, uint32 x0, uint32 tw, uint32 th,
+			uint16 colour, RawTile& rawtile )
+{
+  unsigned int out_bpc = ( bpc == 1 ) ? 8 : bpc;
+  unsigned int pixel_bytes = channels * out_bpc / 8;
+
+  // Photometric interpretation 0 has white as zero
+  unsigned char black = ( colour == 0 ) ? 255 : 0;
+  unsigned char white = ( colour == 0 ) ? 0 : 255;
+
+  for( uint32 j=0; j<th; j++ ){
+    const unsigned char* src = data + (size_t) j * scanline;
+    unsigned char* dst = (unsigned char*) rawtile.data + j * tw * pixel_bytes;
+
+    if( bpc == 1 ){
+      // Count bits from the most significant as TIFF is usually MSB2LSB
+      for( uint32 i=0; i<tw; i++ ){
+	uint32 x = x0 + i;
+	dst[i] = ( src[x >> 3] & (0x80 >> (x & 7)) ) ? white : black;
+      }
+    }
+    else memcpy( dst, src + x0 * pixel_bytes, tw * pixel_bytes );
+  }
+}
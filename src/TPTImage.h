@@ -28,10 +28,18 @@
 #include <tiff.h>
 #include <tiffio.h>
 
+#define TILESIZE 256
 
 
 
 /// Image class for Tiled Pyramidal Images: Inherits from IIPImage. Uses libtiff
+/** Striped (untiled) images and levels are also supported: they are divided into
+    virtual tiles of TILESIZE, which are cut from bands of rows of the same height.
+    Decoded bands are kept in a band cache shared by all threads, as are any whole
+    bands decoded on the way to another within a compressed strip. Images
+    without enough levels for the smallest to fit into a single tile get virtual
+    levels, whose tiles are generated by TileManager from the level above.
+ */
 class TPTImage : public IIPImage {
 
  private:
@@ -42,6 +50,29 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Maximum size in bytes of our decoded band cache
+  static size_t cache_size;
+
+  /// Get a virtual tile from a striped level
+  /** @param seq horizontal sequence angle
+      @param ang vertical sequence angle
+      @param res resolution
+      @param tile tile number
+   */
+  RawTile getStripedTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error);
+
+  /// Cut a virtual tile out of a band of decoded rows
+  /** @param data first row of our tile within the band
+      @param scanline bytes per row
+      @param x0 left edge of our tile
+      @param tw tile width
+      @param th tile height
+      @param colour photometric interpretation
+      @param rawtile tile to fill
+   */
+  void cutTile( const unsigned char* data, tsize_t scanline, uint32 x0, uint32 tw, uint32 th,
+		uint16 colour, RawTile& rawtile );
+
 
  public:
 
@@ -93,6 +124,13 @@ class TPTImage : public IIPImage {
   /// Overloaded function for closing a TIFF image
   void closeImage();
 
+  /// Set the maximum size of the decoded band cache shared by all striped TIFF images
+  /** @param size size in bytes: 0 disables the cache */
+  static void setCacheSize( size_t size ){ cache_size = size; };
+
+  /// Return the number of our smallest resolutions which are not stored in the file
+  unsigned int getSynthesizedLevels(){ return virtual_levels; };
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -23,6 +23,7 @@
 #include "Tokenizer.h"
 #include <cstdlib>
 #include <algorithm>
+#include <sys/stat.h>
 
 
 using namespace std;
@@ -52,6 +53,7 @@ Task* Task::factory( const string& t ){
 //  else if( type == "ptl" ) return new PTL;
   else if( type == "jtl" ) return new JTL;
   else if( type == "jtls" ) return new JTLS;
+  else if( type == "mtl" ) return new MTL;
   else if( type == "icc" ) return new ICC;
   else if( type == "cvt" ) return new CVT;
   else if( type == "shd" ) return new SHD;
@@ -64,6 +66,7 @@ Task* Task::factory( const string& t ){
   else if( type == "deepzoom" ) return new DeepZoom;
   else if( type == "ctw" ) return new CTW;
   else if( type == "iiif" ) return new IIIF;
+  else if( type == "metrics" ) return new METRICS;
   else return NULL;
 
 }
@@ -78,6 +81,67 @@ void Task::checkImage(){
 
 
 
+/// Key for our descriptor cache. As well as the query, this includes the headers from which
+/// an IIIF info.json builds its @id
+static string descriptorKey( Session* session ){
+  return session->headers["QUERY_STRING"] + "\n" + session->headers["BASE_URL"] + "\n"
+    + session->headers["HTTP_HOST"] + "\n" + session->headers["REQUEST_URI"] + "\n"
+    + session->headers["HTTPS"];
+}
+
+
+bool Task::sendDescriptor( Session* session ){
+
+  if( !session->descriptorCache ) return false;
+
+  descriptorCacheMapType::iterator it = session->descriptorCache->find( descriptorKey( session ) );
+  if( it == session->descriptorCache->end() ) return false;
+
+  // Make sure our image has not changed since we generated our response
+  const Descriptor& descriptor = it->second;
+  struct stat sb;
+  if( stat( descriptor.path.c_str(), &sb ) == -1 || sb.st_mtime != descriptor.timestamp ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "Descriptor cache entry out of date" << endl;
+    session->descriptorCache->erase( it );
+    return false;
+  }
+
+  session->response->setETag( descriptor.etag );
+
+  if( FIF::notModified( session, descriptor.timestamp, descriptor.etag ) ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "Descriptor cache hit: unmodified content" << endl;
+    throw( 304 );
+  }
+
+  session->out->putStr( descriptor.response.c_str(), descriptor.response.length() );
+  session->response->setImageSent();
+
+  if( session->loglevel >= 2 ) *(session->logfile) << "Descriptor cache hit" << endl;
+
+  return true;
+}
+
+
+void Task::storeDescriptor( Session* session, const string& response ){
+
+  session->out->putStr( response.c_str(), response.length() );
+  session->response->setImageSent();
+
+  if( !session->descriptorCache ) return;
+
+  // Limit our cache to the same size as our image metadata cache
+  if( session->descriptorCache->size() >= MAXIMAGECACHE ) session->descriptorCache->erase( session->descriptorCache->begin() );
+
+  IIPImage* image = *(session->image);
+  Descriptor& descriptor = (*session->descriptorCache)[ descriptorKey( session ) ];
+  descriptor.path = image->getFileName( image->currentX, image->currentY );
+  descriptor.timestamp = image->timestamp;
+  descriptor.etag = session->response->getEntityTag();
+  descriptor.response = response;
+}
+
+
+
 void QLT::run( Session* session, const string& argument ){
 
   if( argument.length() ){
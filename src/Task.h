@@ -32,9 +32,12 @@
 #include "View.h"
 #include "TileManager.h"
 #include "Timer.h"
+#include "Metrics.h"
 #include "Writer.h"
 #include "Cache.h"
 #include "Watermark.h"
+#include "Prefetcher.h"
+#include "Tracer.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
 #endif
@@ -43,6 +46,12 @@
 // Define our http header cache max age (24 hours)
 #define MAX_AGE 86400
 
+// Max number of items in image cache
+#define MAXIMAGECACHE 1000
+
+// Max number of tiles in a single MTL request
+#define MAX_BATCH_TILES 256
+
 
 
 #ifdef HAVE_EXT_POOL_ALLOCATOR
@@ -57,6 +66,18 @@ typedef HASHMAP <std::string,IIPImage> imageCacheMapType;
 #endif
 
 
+/// Complete response for an image descriptor such as an IIIF info.json, DeepZoom DZI
+/// or Zoomify ImageProperties.xml, cached so that it can be sent without opening the image
+struct Descriptor {
+  std::string path;       ///< Image file, which must be unchanged for our response to be used
+  time_t timestamp;       ///< Timestamp of the image file when the response was generated
+  std::string etag;       ///< Entity tag of our response
+  std::string response;   ///< Response headers and body
+};
+
+typedef HASHMAP <std::string,Descriptor> descriptorCacheMapType;
+
+
 
 
 
@@ -76,13 +97,12 @@ struct Session {
   std::map <const std::string, std::string> headers;
 
   imageCacheMapType *imageCache;
+  descriptorCacheMapType *descriptorCache;
   Cache* tileCache;
+  Prefetcher* prefetcher;
+  Trace* trace;
 
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
-#endif
+  Writer* out;
 
 };
 
@@ -119,6 +139,19 @@ class Task {
   /// Check image
   void checkImage();
 
+  /// Send our cached descriptor response for this request if the image is unchanged
+  /** Conditional requests for unchanged descriptors are answered with 304 Not Modified
+      @param session our current session
+      @return true if the response was sent from our cache
+   */
+  static bool sendDescriptor( Session* session );
+
+  /// Send a newly generated descriptor response and keep it for use by sendDescriptor()
+  /** @param session our current session, with the image already opened by FIF
+      @param response response headers and body
+   */
+  static void storeDescriptor( Session* session, const std::string& response );
+
 };
 
 
@@ -213,6 +246,21 @@ class ROT : public Task {
 class FIF : public Task {
  public:
   void run( Session* session, const std::string& argument );
+
+  /// Generate an entity tag for a request
+  /** @param timestamp image timestamp
+      @param query full request query, which determines the response as a whole. Parameters
+             given in a different order or case produce the same tag
+      @param weak whether to generate a weak tag for responses which are only equivalent
+   */
+  static std::string entityTag( time_t timestamp, const std::string& query, bool weak = false );
+
+  /// Check whether a conditional request can be answered with 304 Not Modified
+  /** @param session our current session
+      @param timestamp image timestamp
+      @param etag entity tag of our response
+   */
+  static bool notModified( Session* session, time_t timestamp, const std::string& etag );
 };
 
 
@@ -234,6 +282,24 @@ class JTL : public Task {
       @param tile requested tile index
    */
   void send( Session* session, int resolution, int tile );
+
+  /// Get a tile as JPEG, applying any processing requested
+  /** @param session our current session
+      @param tilemanager tile manager for our image
+      @param resolution requested image resolution
+      @param tile requested tile index
+      @param prefetch whether to queue up the neighbouring tiles for prefetching
+      @return JPEG compressed tile
+   */
+  RawTile getTile( Session* session, TileManager& tilemanager, int resolution, int tile, bool prefetch );
+};
+
+
+/// Multiple JPEG Tile Export Command
+/** Sends several tiles from the same image as a single multipart/mixed response */
+class MTL : public Task {
+ public:
+  void run( Session* session, const std::string& argument );
 };
 
 
@@ -329,6 +395,13 @@ class IIIF : public Task {
 };
 
 
+/// Metrics Command
+class METRICS : public Task {
+ public:
+  void run( Session* session, const std::string& argument );
+};
+
+
 /// Color Twist Command
 class CTW : public Task {
  public:
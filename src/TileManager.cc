@@ -24,29 +24,169 @@
 
 
 #include <cmath>
+#include <sstream>
+#include <algorithm>
 #include "TileManager.h"
+#include "Prefetcher.h"
 
 
 using namespace std;
 
 
 
+/* Tiles currently being decoded. Concurrent misses for the same tile wait for the
+   first request to finish rather than decoding and compressing the tile again
+*/
+struct TileFlight {
+  bool done;          // Decoding and compression have finished
+  bool failed;        // Leader was unable to produce the tile
+  int references;     // Number of requests (leader + waiters) using this object
+  RawTile tile;       // The finished tile
+  TileFlight(): done( false ), failed( false ), references( 1 ) {};
+};
+
+static HASHMAP <std::string, TileFlight*> tileFlights;
+static Mutex flightMutex;
+static Condition flightCondition;
+
+
+
+/* Halve a block of pixels by averaging each 2x2 group. S is the type in which
+   we sum our four samples and r a rounding term
+*/
+template <class T, class S> static void halve( const T* in, unsigned int in_width, T* out, unsigned int out_width,
+					       unsigned int w, unsigned int h, unsigned int channels, S r ){
+  for( unsigned int j=0; j<h; j++ ){
+    const T* a = &in[2*j*in_width*channels];
+    const T* b = a + in_width*channels;
+    T* o = &out[j*out_width*channels];
+    for( unsigned int i=0; i<w; i++ ){
+      for( unsigned int k=0; k<channels; k++ ){
+	o[k] = (T) ( ( (S)a[k] + (S)a[k+channels] + (S)b[k] + (S)b[k+channels] + r ) / 4 );
+      }
+      a += 2*channels;
+      b += 2*channels;
+      o += channels;
+    }
+  }
+}
+
+
+
 RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
+  int quality = (c == JPEG) ? jpeg->getQuality() : 0;
+  string key = tileCache->getIndex( image->getImagePath(), resolution, tile, xangle, yangle, c, quality );
+
+  TileFlight* flight = NULL;
+  bool leader = false;
+
+  // Either join an existing in-flight decode for this tile or register ourselves as the leader
+  {
+    ScopedLock lock( flightMutex );
+    HASHMAP <std::string, TileFlight*>::iterator f = tileFlights.find( key );
+    if( f != tileFlights.end() ){
+      flight = f->second;
+      flight->references++;
+    }
+    else{
+      flight = new TileFlight;
+      tileFlights[key] = flight;
+      leader = true;
+    }
+  }
+
+
+  // Wait for the leader to finish and take a copy of its tile
+  if( !leader ){
+
+    if( loglevel >= 2 ) *logfile << "TileManager :: Waiting for in-flight decode of resolution: "
+				 << resolution << ", tile: " << tile << endl;
+
+    flightMutex.lock();
+    while( !flight->done ) flightCondition.wait( flightMutex );
+    bool success = !flight->failed;
+    RawTile ttt;
+    if( success ) ttt = flight->tile;
+    if( --flight->references == 0 ) delete flight;
+    flightMutex.unlock();
+
+    if( success ) return ttt;
+
+    // The leader failed, so try ourselves - the error will be reported to us directly if it recurs
+    if( loglevel >= 2 ) *logfile << "TileManager :: In-flight decode failed: decoding ourselves" << endl;
+    return this->decodeTile( resolution, tile, xangle, yangle, layers, c );
+  }
+
+
+  // We are the leader: do the actual work and publish the result to any waiting requests
+  try{
+    RawTile ttt = this->decodeTile( resolution, tile, xangle, yangle, layers, c );
+    {
+      ScopedLock lock( flightMutex );
+      tileFlights.erase( key );
+      // Only copy our tile if somebody is actually waiting for it
+      if( flight->references > 1 ) flight->tile = ttt;
+      flight->done = true;
+      if( --flight->references == 0 ) delete flight;
+      flightCondition.broadcast();
+    }
+    return ttt;
+  }
+  catch( ... ){
+    {
+      ScopedLock lock( flightMutex );
+      tileFlights.erase( key );
+      flight->failed = true;
+      flight->done = true;
+      if( --flight->references == 0 ) delete flight;
+      flightCondition.broadcast();
+    }
+    throw;
+  }
+
+}
+
+
+
+RawTile TileManager::decodeTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Miss for resolution: " << resolution << ", tile: " << tile << endl
 			       << "TileManager :: Cache Size: " << tileCache->getNumElements()
 			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
 
+  if( loglevel >= 3 ){
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      *logfile << "TileManager :: Cache Pool " << Cache::getPoolName( (Cache::PoolType) p ) << ": "
+	       << tileCache->getNumElements( (Cache::PoolType) p ) << " tiles, "
+	       << tileCache->getMemorySize( (Cache::PoolType) p ) << " of "
+	       << tileCache->getMaxSize( (Cache::PoolType) p ) << " MB" << endl;
+    }
+  }
+
 
   RawTile ttt;
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Generate tiles of resolutions missing from the image file from the resolution above
+  bool synthesized = ( resolution < (int) image->getSynthesizedLevels() );
+  if( synthesized ){
+    ttt = this->synthesizeTile( resolution, tile, xangle, yangle, layers );
+  }
+  else{
+    // Get our raw tile from the IIPImage image object
+    Timer decode_timer;
+    decode_timer.start();
+    ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+    long decode_time = decode_timer.getTime();
+    if( !background ) metrics.observe( Metrics::DECODE, decode_time );
+    if( trace ) trace->add( "decode", trace->now() - decode_time, decode_time );
+  }
 
 
   // Apply the watermark if we have one.
-  // Do this before inserting into cache so that we cache watermarked tiles
-  if( watermark && watermark->isSet() ){
+  // Do this before inserting into cache so that we cache watermarked tiles.
+  // Synthesized tiles are made from tiles which already carry the watermark
+  if( watermark && watermark->isSet() && !synthesized ){
 
     if( loglevel >= 2 ) insert_timer.start();
     unsigned int tw = ttt.padded? image->getTileWidth() : ttt.width;
@@ -69,7 +209,7 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   if( c == UNCOMPRESSED ){
     // Add to our tile cache
     if( loglevel >= 2 ) insert_timer.start();
-    tileCache->insert( ttt );
+    tileCache->insert( ttt, prefetched );
     if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				 << " microseconds" << endl;
     return ttt;
@@ -82,8 +222,11 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
     // Do our JPEG compression iff we have an 8 bit per channel image
     if( ttt.bpc == 8 && (ttt.channels==1 || ttt.channels==3) ){
-      if( loglevel >=2 ) compression_timer.start();
+      compression_timer.start();
       jpeg->Compress( ttt );
+      long compression_time = compression_timer.getTime();
+      if( !background ) metrics.observe( Metrics::ENCODE, compression_time );
+      if( trace ) trace->add( "encode", trace->now() - compression_time, compression_time );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl;
     }
@@ -106,7 +249,7 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   // Add to our tile cache
   if( loglevel >= 2 ) insert_timer.start();
-  tileCache->insert( ttt );
+  tileCache->insert( ttt, prefetched );
   if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
 
@@ -117,6 +260,105 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
 
+void TileManager::prefetch( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+
+  if( !prefetcher ) return;
+
+  int quality = (c == JPEG) ? jpeg->getQuality() : 0;
+  prefetcher->prefetch( *image, resolution, tile, xangle, yangle, layers, c, quality );
+
+  if( loglevel >= 3 ) *logfile << "TileManager :: Queued neighbours of resolution: "
+			       << resolution << ", tile: " << tile << " for prefetching" << endl;
+}
+
+
+
+RawTile TileManager::synthesizeTile( int resolution, int tile, int xangle, int yangle, int layers ){
+
+  int num_res = image->getNumResolutions();
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+
+  // The size of our resolution and of the one above from which we generate it
+  unsigned int im_width = image->image_widths[num_res-resolution-1];
+  unsigned int im_height = image->image_heights[num_res-resolution-1];
+  unsigned int parent_width = image->image_widths[num_res-resolution-2];
+  unsigned int parent_height = image->image_heights[num_res-resolution-2];
+
+  unsigned int ntlx = (im_width + tw - 1) / tw;
+  unsigned int ntly = (im_height + th - 1) / th;
+  unsigned int parent_ntlx = (parent_width + tw - 1) / tw;
+  unsigned int parent_ntly = (parent_height + th - 1) / th;
+
+  if( tile < 0 || (unsigned int) tile >= ntlx*ntly ){
+    ostringstream error;
+    error << "TileManager :: Asked for non-existent tile: " << tile;
+    throw file_error( error.str() );
+  }
+
+  unsigned int x = tile % ntlx;
+  unsigned int y = tile / ntlx;
+  unsigned int width = ( (x+1)*tw > im_width ) ? im_width - x*tw : tw;
+  unsigned int height = ( (y+1)*th > im_height ) ? im_height - y*th : th;
+
+  if( loglevel >= 3 ) *logfile << "TileManager :: Generating resolution: " << resolution << ", tile: " << tile
+			       << " from resolution: " << resolution+1 << endl;
+
+  RawTile rawtile( tile, resolution, xangle, yangle, width, height, 0, 0 );
+  rawtile.filename = image->getImagePath();
+  rawtile.timestamp = image->timestamp;
+
+  for( unsigned int j=0; j<2; j++ ){
+    for( unsigned int i=0; i<2; i++ ){
+
+      // The position of this quarter within our tile and the tile above it covers
+      unsigned int xoffset = i*tw/2;
+      unsigned int yoffset = j*th/2;
+      unsigned int px = 2*x + i;
+      unsigned int py = 2*y + j;
+      if( xoffset >= width || yoffset >= height || px >= parent_ntlx || py >= parent_ntly ) continue;
+
+      RawTile parent = this->getTile( resolution+1, py*parent_ntlx + px, xangle, yangle, layers, UNCOMPRESSED );
+
+      // Take our format from the first tile, as the image may unpack or expand its samples
+      if( !rawtile.data ){
+	unsigned int n = width * height * parent.channels;
+	rawtile.channels = parent.channels;
+	rawtile.bpc = parent.bpc;
+	rawtile.sampleType = parent.sampleType;
+	rawtile.dataLength = n * parent.bpc/8;
+	if( parent.bpc == 16 ) rawtile.data = new unsigned short[n];
+	else if( parent.bpc == 32 && parent.sampleType == FIXEDPOINT ) rawtile.data = new unsigned int[n];
+	else if( parent.bpc == 32 && parent.sampleType == FLOATINGPOINT ) rawtile.data = new float[n];
+	else rawtile.data = new unsigned char[n];
+      }
+
+      unsigned int in_width = parent.padded ? tw : parent.width;
+      unsigned int w = std::min( tw/2, width - xoffset );
+      unsigned int h = std::min( th/2, height - yoffset );
+      unsigned int c = rawtile.channels;
+      unsigned int offset = (yoffset*width + xoffset) * c;
+
+      if( rawtile.bpc == 16 ){
+	halve( (unsigned short*) parent.data, in_width, (unsigned short*) rawtile.data + offset, width, w, h, c, 2U );
+      }
+      else if( rawtile.bpc == 32 && rawtile.sampleType == FIXEDPOINT ){
+	halve( (unsigned int*) parent.data, in_width, (unsigned int*) rawtile.data + offset, width, w, h, c, 2.0 );
+      }
+      else if( rawtile.bpc == 32 && rawtile.sampleType == FLOATINGPOINT ){
+	halve( (float*) parent.data, in_width, (float*) rawtile.data + offset, width, w, h, c, 0.0f );
+      }
+      else{
+	halve( (unsigned char*) parent.data, in_width, (unsigned char*) rawtile.data + offset, width, w, h, c, 2U );
+      }
+    }
+  }
+
+  return rawtile;
+}
+
+
+
 void TileManager::crop( RawTile *ttt ){
 
   int tw = image->getTileWidth();
@@ -157,7 +399,8 @@ void TileManager::crop( RawTile *ttt ){
 
 RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
-  RawTile* rawtile = NULL;
+  RawTile rawtile;
+  bool found = false;
   string tileCompression;
   string compName;
 
@@ -169,32 +412,34 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   /* Try to get this tile from our cache first as a JPEG, then uncompressed
      Otherwise decode one from the source image and add it to the cache
    */
+  long lookup_start = trace ? trace->now() : 0;
+
   switch( c )
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, JPEG, jpeg->getQuality(), rawtile, !background )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, DEFLATE, 0, rawtile, !background )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile, !background )) ) break;
       break;
 
 
     case DEFLATE:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, DEFLATE, 0, rawtile, !background )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile, !background )) ) break;
       break;
 
 
     case UNCOMPRESSED:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile, !background )) ) break;
       break;
 
 
@@ -204,12 +449,19 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
     }
 
 
+  if( !background ){
+    tileCache->countLookup( found );
+    metrics.increment( found ? Metrics::TILE_HITS : Metrics::TILE_MISSES );
+  }
+  if( trace ) trace->end( "cache", lookup_start );
+
+
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  if( !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
@@ -222,7 +474,7 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
 
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -232,31 +484,39 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Hit for resolution: " << resolution
 			       << ", tile: " << tile
 			       << ", compression: " << compName << endl
-			       << "TileManager :: Cache Size: "
-			       << tileCache->getNumElements() << " tiles, "
-			       << tileCache->getMemorySize() << " MB" << endl;
+			       << "TileManager :: Cache Size: " << tileCache->getNumElements()
+			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
+
+  if( loglevel >= 3 ){
+    for( int p = 0; p < Cache::NUM_POOLS; p++ ){
+      *logfile << "TileManager :: Cache Pool " << Cache::getPoolName( (Cache::PoolType) p ) << ": "
+	       << tileCache->getNumElements( (Cache::PoolType) p ) << " tiles, "
+	       << tileCache->getMemorySize( (Cache::PoolType) p ) << " of "
+	       << tileCache->getMaxSize( (Cache::PoolType) p ) << " MB" << endl;
+    }
+  }
 
 
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
-
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile.bpc==8 && (rawtile.channels==1 || rawtile.channels==3) ){
 
       // Crop if this is an edge tile
-      if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
+      if( ( (rawtile.width != image->getTileWidth()) || (rawtile.height != image->getTileHeight()) ) && rawtile.padded ){
 	if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-	this->crop( &ttt );
+	this->crop( &rawtile );
       }
 
-      if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
+      compression_timer.start();
+      unsigned int oldlen = rawtile.dataLength;
+      unsigned int newlen = jpeg->Compress( rawtile );
+      long compression_time = compression_timer.getTime();
+      if( !background ) metrics.observe( Metrics::ENCODE, compression_time );
+      if( trace ) trace->add( "encode", trace->now() - compression_time, compression_time );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -265,20 +525,16 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
+      tileCache->insert( rawtile, prefetched );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
-
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
     }
   }
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
+  return rawtile;
 
 
 }
@@ -291,7 +547,13 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
     if( loglevel >= 3 ){
       *logfile << "TileManager getRegion :: requesting region directly from image" << endl;
     }
-    return image->getRegion( seq, ang, res, layers, x, y, width, height );
+    Timer decode_timer;
+    decode_timer.start();
+    RawTile region = image->getRegion( seq, ang, res, layers, x, y, width, height );
+    long decode_time = decode_timer.getTime();
+    metrics.observe( Metrics::DECODE, decode_time );
+    if( trace ) trace->add( "decode", trace->now() - decode_time, decode_time );
+    return region;
   }
 
   // Otherwise do the compositing ourselves
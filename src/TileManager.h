@@ -31,9 +31,14 @@
 #include "JPEGCompressor.h"
 #include "Cache.h"
 #include "Timer.h"
+#include "Metrics.h"
+#include "Tracer.h"
 #include "Watermark.h"
 
 
+class Prefetcher;
+
+
 
 /// Class to manage access to the tile cache and tile cropping
 
@@ -46,15 +51,19 @@ class TileManager{
   JPEGCompressor* jpeg;
   IIPImage* image;
   Watermark* watermark;
+  Prefetcher* prefetcher;
+  Trace* trace;
+  bool background;
+  bool prefetched;
   std::ofstream* logfile;
   int loglevel;
   Timer compression_timer, tile_timer, insert_timer;
 
   /// Get a new tile from the image file
   /**
-   *  If the JPEG tile already exists in the cache, use that, otherwise check for
-   *  an uncompressed tile. If that does not exist either, extract a tile from the
-   *  image. If this is an edge tile, crop it.
+   *  Concurrent requests for the same tile are coalesced: only the first request
+   *  decodes and compresses the tile via decodeTile(). Any others wait for it
+   *  to finish and receive a copy of its result.
    *  @param resolution resolution number
    *  @param tile tile number
    *  @param xangle horizontal sequence number
@@ -66,6 +75,36 @@ class TileManager{
   RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Decode a tile from the image file, compress it and add it to the cache
+  /**
+   *  Extract a tile from the image. If this is an edge tile, crop it.
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param number of quality layers within image to decode
+   *  @param c CompressionType
+   *  @return RawTile
+   */
+  RawTile decodeTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+
+
+  /// Generate a tile of a resolution missing from the image file from the resolution above
+  /**
+   *  Each quarter of the tile is a half size version of one of the four tiles it
+   *  covers at the next resolution up. These are obtained via getTile() and are
+   *  therefore taken from and added to our cache as uncompressed tiles. As these
+   *  are already watermarked, the watermark is not applied again to our tile.
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return RawTile
+   */
+  RawTile synthesizeTile( int resolution, int tile, int xangle, int yangle, int layers );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop
    */
@@ -88,6 +127,10 @@ class TileManager{
     tileCache = tc; 
     image = im;
     watermark = w;
+    prefetcher = NULL;
+    trace = NULL;
+    background = false;
+    prefetched = false;
     jpeg = j;
     logfile = s ;
     loglevel = l;
@@ -95,6 +138,39 @@ class TileManager{
 
 
 
+  /// Attach a background prefetcher
+  /** @param p pointer to Prefetcher object or NULL to disable prefetching */
+  void setPrefetcher( Prefetcher* p ){ prefetcher = p; };
+
+
+  /// Record stage timings for the current request
+  /** @param t pointer to Trace object or NULL to disable tracing */
+  void setTrace( Trace* t ){ trace = t; };
+
+
+  /// Work on behalf of the background prefetcher rather than a client
+  /** Our cache lookups, decoding and compression are then not counted in the cache's
+      access frequencies or in our metrics
+      @param p whether to add new tiles to the cache as prefetched rather than requested tiles
+   */
+  void setBackground( bool p ){ background = true; prefetched = p; };
+
+
+
+  /// Queue the tiles a client is likely to request after this one for prefetching
+  /**
+   *  Does nothing if no prefetcher has been attached
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param c CompressionType
+   */
+  void prefetch( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+
+
+
   /// Get a tile from the cache
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -0,0 +1,228 @@
+// Sampled per-request tracing
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Tracer.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+void Trace::start(){
+  timer.start();
+  struct timeval tv;
+  timestamp = ( gettimeofday( &tv, NULL ) == 0 ) ? tv.tv_sec + tv.tv_usec/1000000.0 : 0;
+  total = 0;
+  error = false;
+  numSpans = 0;
+  query[0] = '\0';
+}
+
+
+
+void Trace::setQuery( const string& q ){
+  size_t n = ( q.size() < (size_t) MAX_QUERY ) ? q.size() : MAX_QUERY-1;
+  memcpy( query, q.c_str(), n );
+  query[n] = '\0';
+}
+
+
+
+void Trace::add( const char* name, long start, long duration ){
+
+  // Add to an existing span of the same name if we have one
+  for( int i = 0; i < numSpans; i++ ){
+    if( strncmp( spans[i].name, name, MAX_NAME-1 ) == 0 ){
+      spans[i].duration += duration;
+      spans[i].count++;
+      return;
+    }
+  }
+
+  if( numSpans == MAX_SPANS ) return;
+
+  Span& span = spans[numSpans++];
+  strncpy( span.name, name, MAX_NAME-1 );
+  span.name[MAX_NAME-1] = '\0';
+  span.start = start;
+  span.duration = duration;
+  span.count = 1;
+}
+
+
+
+Tracer::Tracer( const string& f, float rate, unsigned int slow, unsigned int size ){
+  filename = f;
+  sampleRate = rate;
+  slowThreshold = (long) slow * 1000;
+  ring.resize( size > 0 ? size : 1 );
+  head = count = 0;
+  dropped = written = 0;
+  file = NULL;
+  pid = (int) getpid();
+  stop = false;
+  running = false;
+}
+
+
+
+Tracer::~Tracer(){
+#ifdef HAVE_PTHREAD
+  if( running ){
+    mutex.lock();
+    stop = true;
+    condition.broadcast();
+    mutex.unlock();
+    pthread_join( thread, NULL );
+  }
+#endif
+  if( file ) fclose( file );
+}
+
+
+
+bool Tracer::start(){
+
+  if( !file ) file = fopen( filename.c_str(), "a" );
+  if( !file ) return false;
+
+#ifdef HAVE_PTHREAD
+  if( !running && pthread_create( &thread, NULL, Tracer::worker, this ) == 0 ){
+    running = true;
+  }
+#endif
+
+  return true;
+}
+
+
+
+#ifdef HAVE_PTHREAD
+void* Tracer::worker( void* t ){
+  ((Tracer*) t)->run();
+  return NULL;
+}
+#endif
+
+
+
+bool Tracer::sample(){
+  if( sampleRate <= 0 ) return false;
+  if( sampleRate >= 1 ) return true;
+  return ( rand() < sampleRate * RAND_MAX );
+}
+
+
+
+void Tracer::submit( const Trace& trace, bool sampled ){
+
+  if( !file ) return;
+  if( !sampled && ( slowThreshold <= 0 || trace.total < slowThreshold ) ) return;
+
+  // Without a writer thread, write out directly
+  if( !running ){
+    this->write( trace );
+    fflush( file );
+    return;
+  }
+
+  // The writer thread only holds our lock briefly, never while writing. Drop the
+  // trace rather than wait for it to catch up if we have no room
+  ScopedLock lock( mutex );
+  if( count == ring.size() ) dropped++;
+  else{
+    ring[ (head + count) % ring.size() ] = trace;
+    count++;
+    condition.signal();
+  }
+}
+
+
+
+void Tracer::run(){
+
+  while( true ){
+
+    mutex.lock();
+    while( !stop && count == 0 ) condition.wait( mutex );
+    if( count == 0 ){
+      mutex.unlock();
+      break;
+    }
+
+    // Write out everything we have in one batch. Only the writer thread advances
+    // head, so the slots we are reading cannot be overwritten until we release them
+    unsigned int n = count;
+    unsigned int first = head;
+    mutex.unlock();
+
+    for( unsigned int i = 0; i < n; i++ ) this->write( ring[ (first + i) % ring.size() ] );
+    fflush( file );
+
+    mutex.lock();
+    head = ( head + n ) % ring.size();
+    count -= n;
+    mutex.unlock();
+  }
+}
+
+
+
+void Tracer::write( const Trace& trace ){
+
+  // Escape our query string for JSON
+  string query;
+  for( const char* c = trace.query; *c; c++ ){
+    if( *c == '"' || *c == '\\' ){
+      query += '\\';
+      query += *c;
+    }
+    else if( (unsigned char) *c < 0x20 ){
+      char hex[8];
+      snprintf( hex, 8, "\\u%04x", (unsigned char) *c );
+      query += hex;
+    }
+    else query += *c;
+  }
+
+  fprintf( file, "{\"time\":%.3f,\"pid\":%d,\"query\":\"%s\",\"error\":%s,\"total\":%ld,\"spans\":[",
+	   trace.timestamp, pid, query.c_str(), trace.error ? "true" : "false", trace.total );
+
+  for( int i = 0; i < trace.numSpans; i++ ){
+    const Trace::Span& span = trace.spans[i];
+    fprintf( file, "%s{\"name\":\"%s\",\"start\":%ld,\"duration\":%ld,\"count\":%u}",
+	     (i > 0) ? "," : "", span.name, span.start, span.duration, span.count );
+  }
+
+  fprintf( file, "]}\n" );
+  written++;
+}
@@ -0,0 +1,191 @@
+// Sampled per-request tracing
+
+/*  IIP Image Server
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TRACER_H
+#define _TRACER_H
+
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "Timer.h"
+#include "Mutex.h"
+
+
+
+/// Stage timings for a single request
+/** Spans are aggregated by name, so that stages which occur many times within a
+    request, such as the decoding of each tile of a CVT region, are recorded as a
+    single span with a count, a total duration and the start time of the first
+    occurrence. All storage is fixed size so that recording never allocates.
+ */
+class Trace {
+
+  friend class Tracer;
+
+ public:
+
+  /// Maximum number of distinct spans per request
+  static const int MAX_SPANS = 24;
+
+  /// Maximum length of span names and of the stored query
+  static const int MAX_NAME = 16;
+  static const int MAX_QUERY = 512;
+
+
+ private:
+
+  struct Span {
+    char name[MAX_NAME];
+    long start;
+    long duration;
+    unsigned int count;
+  };
+
+  Timer timer;
+  double timestamp;
+  long total;
+  bool error;
+  int numSpans;
+  Span spans[MAX_SPANS];
+  char query[MAX_QUERY];
+
+
+ public:
+
+  /// Constructor
+  Trace(){ this->start(); };
+
+  /// Reset and start timing a new request
+  void start();
+
+  /// Set the query string of this request
+  /** @param q request query string, which is truncated if too long */
+  void setQuery( const std::string& q );
+
+  /// Return the time in microseconds since the request started
+  long now(){ return timer.getTime(); };
+
+  /// Record a completed stage
+  /** @param name stage name
+      @param start time at which the stage started as returned by now()
+   */
+  void end( const char* name, long start ){ this->add( name, start, this->now() - start ); };
+
+  /// Record a stage with a known duration
+  /** @param name stage name
+      @param start time at which the stage started as returned by now()
+      @param duration duration in microseconds
+   */
+  void add( const char* name, long start, long duration );
+
+  /// Mark this request as having failed
+  void setError(){ error = true; };
+
+  /// Finish timing the request
+  /** @return total request time in microseconds */
+  long finish(){ total = this->now(); return total; };
+
+};
+
+
+
+/// Collects sampled traces and writes them out as JSON lines from a background thread
+/** Completed traces are copied into a preallocated ring buffer. If the writer thread
+    falls behind and the buffer is full, new traces are dropped rather than making the
+    request wait. Without pthread support, traces are written directly on submission.
+ */
+class Tracer {
+
+ private:
+
+  std::vector <Trace> ring;
+  unsigned int head, count;
+  unsigned long dropped, written;
+
+  float sampleRate;
+  long slowThreshold;
+  std::string filename;
+  FILE* file;
+  int pid;
+
+  bool stop;
+  bool running;
+  Mutex mutex;
+  Condition condition;
+
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+
+  /// pthread entry point
+  static void* worker( void* t );
+#endif
+
+  /// Write out queued traces until asked to stop
+  void run();
+
+  /// Format a trace as a JSON line
+  void write( const Trace& trace );
+
+  Tracer( const Tracer& );
+  Tracer& operator = ( const Tracer& );
+
+
+ public:
+
+  /// Constructor
+  /**
+   * @param f file to which traces are appended
+   * @param rate fraction of requests to trace between 0 and 1
+   * @param slow requests taking at least this many milliseconds are always traced.
+   *        Zero disables this
+   * @param size number of traces that can be buffered
+   */
+  Tracer( const std::string& f, float rate, unsigned int slow, unsigned int size );
+
+  /// Destructor: writes out any remaining traces
+  ~Tracer();
+
+  /// Open our file and start the writer thread
+  /** @return false if the file could not be opened */
+  bool start();
+
+  /// Decide whether a request should be traced before it starts
+  bool sample();
+
+  /// Queue a completed trace
+  /** @param trace completed trace
+      @param sampled whether this request was selected by sample()
+   */
+  void submit( const Trace& trace, bool sampled );
+
+  /// Return the number of traces dropped because the buffer was full
+  unsigned long getDropped(){ ScopedLock lock( mutex ); return dropped; };
+
+  /// Return the number of traces written
+  unsigned long getWritten(){ return written; };
+
+};
+
+
+#endif
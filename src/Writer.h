@@ -25,14 +25,58 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 
 /// Virtual base class for various writers
 class Writer {
 
+ protected:
+
+  static const unsigned int bufsize = 65536;
+
+  /// Allocated size of our buffer
+  size_t capacity;
+
+  /// Make sure our buffer can hold at least n bytes, growing it geometrically so
+  /// that large responses written in many pieces are not reallocated on every write
+  bool reserve( size_t n ){
+    if( n <= capacity ) return true;
+    size_t c = (capacity > 0) ? capacity : bufsize;
+    while( c < n ) c *= 2;
+    char* b = (char*) realloc( buffer, c );
+    if( !b ) return false;
+    buffer = b;
+    capacity = c;
+    return true;
+  };
+
+  /// Add the message to our buffer
+  void cpy2buf( const char* msg, size_t len ){
+    if( !reserve( sz+len ) ) return;
+    memcpy( &buffer[sz], msg, len );
+    sz += len;
+  };
+
+
  public:
 
-  virtual ~Writer() = 0;
+  /// Copy of our output if the writer keeps one and its size
+  char* buffer;
+  size_t sz;
+
+  /// Total number of bytes written, whether or not a copy is kept
+  size_t written;
+
+  /// Constructor
+  Writer(){
+    buffer = NULL;
+    sz = capacity = written = 0;
+  };
+
+  /// Destructor
+  virtual ~Writer(){ if(buffer) free(buffer); };
 
   /// Write out a binary string
   /** \param msg message string
@@ -40,6 +84,20 @@ class Writer {
   */
   virtual int putStr( const char* msg, int len ) = 0;
 
+  /// Write out a header followed by a binary payload in a single call
+  /** Lets writers send both parts together without first joining them together
+      \param header header string
+      \param hlen header length
+      \param data payload
+      \param len payload length
+      \return total number of bytes written or -1 on error
+  */
+  virtual int putV( const char* header, int hlen, const char* data, int len ){
+    if( hlen > 0 && putStr( header, hlen ) != hlen ) return -1;
+    if( putStr( data, len ) != len ) return -1;
+    return hlen + len;
+  };
+
   /// Write out a string
   /** \param msg message string */
   virtual int putS( const char* msg ) = 0;
@@ -56,53 +114,90 @@ class Writer {
 
 
 /// FCGI Writer Class
-class FCGIWriter {
+/** Output goes straight to the FastCGI stream. A copy is only kept in our buffer
+    if requested, for example so that the complete response can be stored in
+    memcached, which then takes it directly from the buffer.
+ */
+class FCGIWriter : public Writer {
 
  private:
 
-  
   FCGX_Stream *out;
-  static const unsigned int bufsize = 65536;
 
-  /// Add the message to our buffer
-  void cpy2buf( const char* msg, size_t len ){
-    if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
-    if( buffer ){
-      memcpy( &buffer[sz], msg, len );
-      sz += len;
-    }
-  };
+  /// Whether to keep a copy of our output
+  bool keep;
 
 
  public:
 
-  char* buffer;
-  size_t sz;
-
   /// Constructor
-  FCGIWriter( FCGX_Stream* o ){
+  /** \param o FCGI output stream: if NULL, the writer is unused
+      \param k whether to keep a copy of all output in our buffer
+   */
+  FCGIWriter( FCGX_Stream* o, bool k = false ){
     out = o;
+    keep = k;
+  };
+
+  int putStr( const char* msg, int len ){
+    if( keep ) cpy2buf( msg, len );
+    int n = FCGX_PutStr( msg, len, out );
+    if( n > 0 ) written += n;
+    return n;
+  };
+  int putS( const char* msg ){
+    return putStr( msg, strlen(msg) );
+  }
+  int printf( const char* msg ){
+    return putStr( msg, strlen(msg) );
+  };
+  int flush(){
+    return FCGX_FFlush( out );
+  };
+
+};
+
+
+
+/// HTTP Writer Class
+/** Used by our built-in HTTP server: the complete CGI style response is held in our
+    buffer and only sent once the request has been handled, so that the server can add
+    a Content-Length header and keep the connection alive.
+ */
+class HTTPWriter : public Writer {
+
+ public:
+
+  /// Constructor
+  HTTPWriter(){
     buffer = (char*) malloc(bufsize);
-    sz = 0;
+    if( buffer ) capacity = bufsize;
   };
 
-  /// Destructor
-  ~FCGIWriter(){ if(buffer) free(buffer); };
+  /// Empty our buffer ready for a new response
+  void reset(){ sz = written = 0; };
 
   int putStr( const char* msg, int len ){
     cpy2buf( msg, len );
-    return FCGX_PutStr( msg, len, out );
+    written += len;
+    return len;
+  };
+  int putV( const char* header, int hlen, const char* data, int len ){
+    // Grow our buffer once for both parts
+    if( !reserve( sz+hlen+len ) ) return -1;
+    cpy2buf( header, hlen );
+    cpy2buf( data, len );
+    written += hlen + len;
+    return hlen + len;
   };
   int putS( const char* msg ){
-    cpy2buf( msg, strlen(msg) );
-    return FCGX_PutS( msg, out );
+    return putStr( msg, strlen(msg) );
   }
   int printf( const char* msg ){
-    cpy2buf( msg, strlen(msg) );
-    return FCGX_FPrintF( out, msg );
+    return putS( msg );
   };
   int flush(){
-    return FCGX_FFlush( out );
+    return 0;
   };
 
 };
@@ -110,7 +205,7 @@ class FCGIWriter {
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 
@@ -121,13 +216,15 @@ class FileWriter {
   FileWriter( FILE* o ){ out = o; };
 
   int putStr( const char* msg, int len ){
-    return fwrite( (void*) msg, sizeof(char), len, out );
+    int n = fwrite( (void*) msg, sizeof(char), len, out );
+    written += n;
+    return n;
   };
   int putS( const char* msg ){
-    return fputs( msg, out );
+    return putStr( msg, strlen(msg) );
   }
   int printf( const char* msg ){
-    return fprintf( out, "%s", msg );
+    return putStr( msg, strlen(msg) );
   };
   int flush(){
     return fflush( out );
@@ -54,6 +54,10 @@ void Zoomify::run( Session* session, const std::string& argument ){
     prefix = argument.substr( 0, argument.find( "TileGroup" )-1 );
 
 
+  // Our ImageProperties.xml is sent from our descriptor cache if we have already generated it for this image
+  if( suffix == "ImageProperties.xml" && sendDescriptor( session ) ) return;
+
+
   // As we don't have an independent FIF request, we need to run it now
   FIF fif;
   fif.run( session, prefix );
@@ -109,12 +113,12 @@ void Zoomify::run( Session* session, const std::string& argument ){
 	      "Content-Type: application/xml\r\n"
 	      "Last-Modified: %s\r\n"
 	      "%s\r\n"
+	      "%s"
 	      "\r\n"
 	      "<IMAGE_PROPERTIES WIDTH=\"%d\" HEIGHT=\"%d\" NUMTILES=\"%d\" NUMIMAGES=\"1\" VERSION=\"1.8\" TILESIZE=\"%d\" />",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), width, height, ntiles, tw );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), session->response->getETag().c_str(), width, height, ntiles, tw );
 
-    session->out->printf( (const char*) str );
-    session->response->setImageSent();
+    storeDescriptor( session, str );
 
     return;
   }
@@ -0,0 +1,653 @@
+/*
+    IIP Server: FastCGI load generator and request log replay tool
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Replays a list of requests directly against an iipsrv.fcgi process started
+   with --bind, without the need for a web server in front. Requests are read
+   from a file with one request per line. Each line may be a bare query string,
+   a URL or an access log line containing a GET request: the query string is
+   taken from after the first '?' in the URL. Lines beginning with # are ignored.
+
+   Usage: iipload [options] <socket> <request file>
+
+   <socket> is either host:port or the path to a unix domain socket as given to
+   iipsrv.fcgi --bind
+
+   -c <n>    number of concurrent connections (default 1)
+   -r <n>    send requests at a fixed rate of n per second rather than as fast as
+             possible. Latency is measured from when each request was due to be sent
+   -n <n>    total number of requests to send, cycling through the file (default:
+             each request in the file once)
+   -d <s>    run for this many seconds, cycling through the file
+   -s        shuffle the order of requests
+   -j        print results as JSON rather than as text
+
+   If the server has METRICS_ENABLED set, tile cache hit ratios are reported from
+   the difference in the server's metrics before and after the run. Note that
+   metrics are per server process.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+
+using namespace std;
+
+
+
+// FastCGI protocol constants
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+
+
+
+/// Time in microseconds since the epoch
+static double now(){
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+
+
+/// Result of a single request
+struct Response {
+  int status;          ///< HTTP status or 0 on connection failure
+  unsigned long bytes; ///< Bytes of response body
+  double latency;      ///< Latency in microseconds
+};
+
+
+
+/// Statistics for a group of requests
+struct Stats {
+  vector<double> latencies;
+  unsigned long errors;
+  unsigned long failures;
+  unsigned long long bytes;
+
+  Stats() : errors( 0 ), failures( 0 ), bytes( 0 ) {};
+
+  void add( const Response& r ){
+    latencies.push_back( r.latency );
+    bytes += r.bytes;
+    if( r.status == 0 ) failures++;
+    else if( r.status >= 400 ) errors++;
+  };
+
+  void merge( const Stats& s ){
+    latencies.insert( latencies.end(), s.latencies.begin(), s.latencies.end() );
+    errors += s.errors;
+    failures += s.failures;
+    bytes += s.bytes;
+  };
+
+  double percentile( double p ) const {
+    if( latencies.empty() ) return 0;
+    return latencies[ (size_t)( p * (latencies.size()-1) + 0.5 ) ];
+  };
+
+  double mean() const {
+    double sum = 0;
+    for( vector<double>::const_iterator i = latencies.begin(); i != latencies.end(); ++i ) sum += *i;
+    return latencies.empty() ? 0 : sum / latencies.size();
+  };
+};
+
+
+
+/// A request to be replayed
+struct Request {
+  string query;
+  string command;
+};
+
+
+
+/// Our run settings and shared state
+struct Run {
+  string socket;
+  vector<Request> requests;
+  unsigned long total;     ///< Number of requests to send, or 0 if limited by duration
+  double duration;         ///< Duration in microseconds, or 0
+  double rate;             ///< Requests per second, or 0 for closed loop
+  double start;            ///< Start time
+  volatile unsigned long next;  ///< Index of the next request to send
+};
+
+
+
+/// Per connection worker state
+struct Worker {
+  Run* run;
+  map<string,Stats> stats;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+#endif
+};
+
+
+
+/// Open a connection to our server
+static int connectTo( const string& address ){
+
+  int fd = -1;
+
+  // Unix domain socket
+  if( address.find( ':' ) == string::npos ){
+    struct sockaddr_un sa;
+    memset( &sa, 0, sizeof(sa) );
+    sa.sun_family = AF_UNIX;
+    strncpy( sa.sun_path, address.c_str(), sizeof(sa.sun_path)-1 );
+    fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 ) return -1;
+    if( connect( fd, (struct sockaddr*) &sa, sizeof(sa) ) != 0 ){
+      close( fd );
+      return -1;
+    }
+    return fd;
+  }
+
+  // TCP: host:port, with an empty host meaning localhost
+  size_t colon = address.rfind( ':' );
+  string host = address.substr( 0, colon );
+  string port = address.substr( colon+1 );
+  if( host.empty() ) host = "127.0.0.1";
+
+  struct addrinfo hints, *res;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if( getaddrinfo( host.c_str(), port.c_str(), &hints, &res ) != 0 ) return -1;
+
+  for( struct addrinfo* ai = res; ai; ai = ai->ai_next ){
+    fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+    if( fd < 0 ) continue;
+    if( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ) break;
+    close( fd );
+    fd = -1;
+  }
+  freeaddrinfo( res );
+
+  if( fd >= 0 ){
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+  }
+  return fd;
+}
+
+
+
+/// Append a FastCGI record header
+static void addHeader( string& out, int type, unsigned int length ){
+  out += (char) FCGI_VERSION_1;
+  out += (char) type;
+  out += (char) 0;   // Request ID 1
+  out += (char) 1;
+  out += (char) ( (length >> 8) & 0xff );
+  out += (char) ( length & 0xff );
+  out += (char) 0;   // No padding
+  out += (char) 0;
+}
+
+
+
+/// Append a FastCGI name-value pair length
+static void addLength( string& out, size_t length ){
+  if( length < 128 ) out += (char) length;
+  else{
+    out += (char) ( ((length >> 24) & 0x7f) | 0x80 );
+    out += (char) ( (length >> 16) & 0xff );
+    out += (char) ( (length >> 8) & 0xff );
+    out += (char) ( length & 0xff );
+  }
+}
+
+
+
+/// Append a FastCGI parameter
+static void addParam( string& params, const string& name, const string& value ){
+  addLength( params, name.size() );
+  addLength( params, value.size() );
+  params += name;
+  params += value;
+}
+
+
+
+/// Read exactly n bytes
+static bool readFully( int fd, unsigned char* buffer, size_t n ){
+  size_t got = 0;
+  while( got < n ){
+    ssize_t r = read( fd, buffer + got, n - got );
+    if( r < 0 && errno == EINTR ) continue;
+    if( r <= 0 ) return false;
+    got += r;
+  }
+  return true;
+}
+
+
+
+/// Send a single request and wait for the complete response
+/** @param address server socket
+    @param query query string
+    @param body if not NULL, filled with the response body
+    @return response with status 0 if the request could not be completed
+ */
+static Response fetch( const string& address, const string& query, string* body = NULL ){
+
+  Response response;
+  response.status = 0;
+  response.bytes = 0;
+  response.latency = 0;
+
+  int fd = connectTo( address );
+  if( fd < 0 ) return response;
+
+  // Begin request as a responder without keeping the connection open
+  string out;
+  addHeader( out, FCGI_BEGIN_REQUEST, 8 );
+  out += (char) 0;
+  out += (char) FCGI_RESPONDER;
+  out.append( 6, (char) 0 );
+
+  string params;
+  addParam( params, "QUERY_STRING", query );
+  addParam( params, "REQUEST_METHOD", "GET" );
+  addParam( params, "SCRIPT_NAME", "/fcgi-bin/iipsrv.fcgi" );
+  addParam( params, "REQUEST_URI", "/fcgi-bin/iipsrv.fcgi?" + query );
+  addParam( params, "SERVER_NAME", "localhost" );
+  addParam( params, "SERVER_PORT", "80" );
+  addParam( params, "HTTP_HOST", "localhost" );
+  addParam( params, "SERVER_PROTOCOL", "HTTP/1.1" );
+
+  // Our parameters always fit in a single record
+  addHeader( out, FCGI_PARAMS, params.size() );
+  out += params;
+  addHeader( out, FCGI_PARAMS, 0 );
+  addHeader( out, FCGI_STDIN, 0 );
+
+  size_t sent = 0;
+  while( sent < out.size() ){
+    ssize_t w = write( fd, out.data() + sent, out.size() - sent );
+    if( w < 0 && errno == EINTR ) continue;
+    if( w <= 0 ){
+      close( fd );
+      return response;
+    }
+    sent += w;
+  }
+
+  // Read records until the end of the request
+  string headers;
+  bool inBody = false;
+  unsigned char header[8];
+  vector<unsigned char> content( 65536 + 256 );
+
+  while( readFully( fd, header, 8 ) ){
+
+    unsigned int length = (header[4] << 8) | header[5];
+    unsigned int padding = header[6];
+    if( !readFully( fd, &content[0], length + padding ) ) break;
+
+    if( header[1] == FCGI_STDOUT ){
+      // Separate our HTTP headers from the body
+      if( !inBody ){
+	headers.append( (char*) &content[0], length );
+	size_t end = headers.find( "\r\n\r\n" );
+	if( end != string::npos ){
+	  inBody = true;
+	  response.bytes = headers.size() - end - 4;
+	  if( body ) body->assign( headers, end + 4, string::npos );
+	  headers.resize( end );
+	}
+      }
+      else{
+	response.bytes += length;
+	if( body ) body->append( (char*) &content[0], length );
+      }
+    }
+    else if( header[1] == FCGI_END_REQUEST ){
+      response.status = 200;
+      size_t s = headers.find( "Status:" );
+      if( s != string::npos ) response.status = atoi( headers.c_str() + s + 7 );
+      break;
+    }
+  }
+
+  close( fd );
+  return response;
+}
+
+
+
+/// Classify a request by its protocol or command
+static string classify( const string& query ){
+
+  // Check each parameter name in turn
+  const char* commands[] = { "iiif", "deepzoom", "zoomify", "jtl", "cvt", "til", "obj", "metrics" };
+  string q = query;
+  transform( q.begin(), q.end(), q.begin(), ::tolower );
+
+  size_t start = 0;
+  string found = "other";
+  while( start < q.size() ){
+    size_t end = q.find( '&', start );
+    if( end == string::npos ) end = q.size();
+    size_t equals = q.find( '=', start );
+    string name = q.substr( start, ( equals < end ? equals : end ) - start );
+    for( unsigned int i = 0; i < sizeof(commands)/sizeof(commands[0]); i++ ){
+      // The first matching command determines the type, except that OBJ is only used
+      // if nothing else is found
+      if( name == commands[i] && ( found == "other" || found == "obj" ) ) found = commands[i];
+    }
+    start = end + 1;
+  }
+  return found;
+}
+
+
+
+/// Extract the query string from a request log line
+static string parseLine( const string& line ){
+
+  // Access log lines contain a quoted request line: use the URL within it
+  string url = line;
+  size_t get = line.find( "GET " );
+  if( get != string::npos ){
+    size_t end = line.find( ' ', get + 4 );
+    url = line.substr( get + 4, ( end == string::npos ) ? string::npos : end - get - 4 );
+  }
+
+  size_t q = url.find( '?' );
+  if( q != string::npos ) return url.substr( q + 1 );
+  return url;
+}
+
+
+
+/// Main loop of each connection
+static void* work( void* w ){
+
+  Worker* worker = (Worker*) w;
+  Run* run = worker->run;
+
+  while( true ){
+
+    unsigned long n = __sync_fetch_and_add( &run->next, 1 );
+    if( run->total > 0 && n >= run->total ) break;
+    if( run->duration > 0 && now() - run->start >= run->duration ) break;
+
+    const Request& request = run->requests[ n % run->requests.size() ];
+
+    // When sending at a fixed rate, wait until this request is due and measure its
+    // latency from that time, so that queueing behind slow requests is included
+    double due = now();
+    if( run->rate > 0 ){
+      due = run->start + n * 1000000.0 / run->rate;
+      double wait = due - now();
+      if( wait > 0 ) usleep( (useconds_t) wait );
+    }
+
+    Response response = fetch( run->socket, request.query );
+    response.latency = now() - due;
+    worker->stats[ request.command ].add( response );
+  }
+
+  return NULL;
+}
+
+
+
+/// Get the server's tile cache counters from its metrics
+/** @return false if metrics are not available */
+static bool getCacheCounters( const string& address, map<string,double>& values ){
+
+  string body;
+  Response response = fetch( address, "METRICS=1", &body );
+  if( response.status != 200 ) return false;
+
+  const char* names[] = {
+    "iipsrv_tile_requests_total{result=\"hit\"}",
+    "iipsrv_tile_requests_total{result=\"miss\"}",
+    "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"hit\"}",
+    "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"miss\"}",
+    "iipsrv_memcached_requests_total{result=\"hit\"}",
+    "iipsrv_memcached_requests_total{result=\"miss\"}"
+  };
+
+  for( unsigned int i = 0; i < sizeof(names)/sizeof(names[0]); i++ ){
+    size_t p = body.find( string( names[i] ) + " " );
+    values[ names[i] ] = ( p == string::npos ) ? 0 : atof( body.c_str() + p + strlen(names[i]) + 1 );
+  }
+  return true;
+}
+
+
+
+/// Calculate a hit ratio from the change in a pair of counters
+static double ratio( map<string,double>& before, map<string,double>& after, const string& hit, const string& miss ){
+  double h = after[hit] - before[hit];
+  double m = after[miss] - before[miss];
+  return ( h + m > 0 ) ? h / ( h + m ) : -1;
+}
+
+
+
+static void usage(){
+  fprintf( stderr, "Usage: iipload [-c connections] [-r rate] [-n requests] [-d seconds] [-s] [-j] <socket> <request file>\n" );
+}
+
+
+
+int main( int argc, char* argv[] ){
+
+  Run run;
+  run.total = 0;
+  run.duration = 0;
+  run.rate = 0;
+  run.next = 0;
+
+  int connections = 1;
+  bool shuffle = false;
+  bool json = false;
+  vector<string> args;
+
+  for( int i = 1; i < argc; i++ ){
+    string arg = argv[i];
+    if( arg == "-c" && i+1 < argc ) connections = atoi( argv[++i] );
+    else if( arg == "-r" && i+1 < argc ) run.rate = atof( argv[++i] );
+    else if( arg == "-n" && i+1 < argc ) run.total = strtoul( argv[++i], NULL, 10 );
+    else if( arg == "-d" && i+1 < argc ) run.duration = atof( argv[++i] ) * 1000000.0;
+    else if( arg == "-s" ) shuffle = true;
+    else if( arg == "-j" ) json = true;
+    else if( arg.size() > 1 && arg[0] == '-' ){
+      usage();
+      return 1;
+    }
+    else args.push_back( arg );
+  }
+
+  if( args.size() != 2 || connections < 1 ){
+    usage();
+    return 1;
+  }
+
+#ifndef HAVE_PTHREAD
+  if( connections > 1 ){
+    fprintf( stderr, "iipload: built without thread support: using a single connection\n" );
+    connections = 1;
+  }
+#endif
+
+  run.socket = args[0];
+
+  // Load our requests
+  ifstream file( args[1].c_str() );
+  if( !file ){
+    fprintf( stderr, "iipload: unable to open request file '%s'\n", args[1].c_str() );
+    return 1;
+  }
+  string line;
+  while( getline( file, line ) ){
+    if( !line.empty() && line[line.size()-1] == '\r' ) line.resize( line.size()-1 );
+    if( line.empty() || line[0] == '#' ) continue;
+    Request request;
+    request.query = parseLine( line );
+    request.command = classify( request.query );
+    run.requests.push_back( request );
+  }
+  if( run.requests.empty() ){
+    fprintf( stderr, "iipload: no requests found in '%s'\n", args[1].c_str() );
+    return 1;
+  }
+  if( shuffle ){
+    srand( 1 );
+    random_shuffle( run.requests.begin(), run.requests.end() );
+  }
+  if( run.total == 0 && run.duration == 0 ) run.total = run.requests.size();
+
+  // Check that our server is there and take a snapshot of its metrics
+  map<string,double> before, after;
+  int fd = connectTo( run.socket );
+  if( fd < 0 ){
+    fprintf( stderr, "iipload: unable to connect to '%s': %s\n", run.socket.c_str(), strerror( errno ) );
+    return 1;
+  }
+  close( fd );
+  bool metrics = getCacheCounters( run.socket, before );
+
+  vector<Worker> workers( connections );
+  run.start = now();
+
+#ifdef HAVE_PTHREAD
+  for( int i = 0; i < connections; i++ ){
+    workers[i].run = &run;
+    if( pthread_create( &workers[i].thread, NULL, work, &workers[i] ) != 0 ){
+      fprintf( stderr, "iipload: unable to create thread\n" );
+      return 1;
+    }
+  }
+  for( int i = 0; i < connections; i++ ) pthread_join( workers[i].thread, NULL );
+#else
+  workers[0].run = &run;
+  work( &workers[0] );
+#endif
+
+  double elapsed = ( now() - run.start ) / 1000000.0;
+  if( metrics ) metrics = getCacheCounters( run.socket, after );
+
+  // Merge our per connection statistics
+  map<string,Stats> commands;
+  Stats all;
+  for( int i = 0; i < connections; i++ ){
+    for( map<string,Stats>::const_iterator s = workers[i].stats.begin(); s != workers[i].stats.end(); ++s ){
+      commands[s->first].merge( s->second );
+      all.merge( s->second );
+    }
+  }
+  commands["all"] = all;
+  for( map<string,Stats>::iterator s = commands.begin(); s != commands.end(); ++s ){
+    sort( s->second.latencies.begin(), s->second.latencies.end() );
+  }
+
+  double tileHits = -1, diskHits = -1, memcachedHits = -1;
+  if( metrics ){
+    tileHits = ratio( before, after, "iipsrv_tile_requests_total{result=\"hit\"}", "iipsrv_tile_requests_total{result=\"miss\"}" );
+    diskHits = ratio( before, after, "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"hit\"}",
+		      "iipsrv_tile_cache_probes_total{layer=\"disk\",result=\"miss\"}" );
+    memcachedHits = ratio( before, after, "iipsrv_memcached_requests_total{result=\"hit\"}",
+			   "iipsrv_memcached_requests_total{result=\"miss\"}" );
+  }
+
+  // Output our results with "all" first
+  vector<string> order;
+  order.push_back( "all" );
+  for( map<string,Stats>::const_iterator s = commands.begin(); s != commands.end(); ++s ){
+    if( s->first != "all" ) order.push_back( s->first );
+  }
+
+  if( json ){
+    printf( "{\"seconds\":%.3f,\"connections\":%d,\"rate\":%.1f", elapsed, connections, run.rate );
+    if( metrics ) printf( ",\"tile_cache_hit_ratio\":%.4f,\"disk_cache_hit_ratio\":%.4f,\"memcached_hit_ratio\":%.4f",
+			  tileHits, diskHits, memcachedHits );
+    printf( ",\"commands\":{" );
+    for( unsigned int i = 0; i < order.size(); i++ ){
+      const Stats& s = commands[order[i]];
+      printf( "%s\"%s\":{\"requests\":%lu,\"errors\":%lu,\"failures\":%lu,\"requests_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+	      "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+	      (i > 0) ? "," : "", order[i].c_str(), (unsigned long) s.latencies.size(), s.errors, s.failures,
+	      s.latencies.size() / elapsed, s.bytes / elapsed / 1048576.0, s.mean() / 1000.0,
+	      s.percentile( 0.5 ) / 1000.0, s.percentile( 0.9 ) / 1000.0, s.percentile( 0.99 ) / 1000.0,
+	      s.percentile( 1.0 ) / 1000.0 );
+    }
+    printf( "}}\n" );
+  }
+  else{
+    printf( "%lu requests in %.2fs using %d connections", (unsigned long) all.latencies.size(), elapsed, connections );
+    if( run.rate > 0 ) printf( " at %.1f requests/s", run.rate );
+    printf( "\n\n%-10s %9s %7s %7s %10s %9s %9s %9s %9s %9s %9s\n", "command", "requests", "errors", "failed",
+	    "req/s", "MB/s", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms" );
+    for( unsigned int i = 0; i < order.size(); i++ ){
+      const Stats& s = commands[order[i]];
+      printf( "%-10s %9lu %7lu %7lu %10.1f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", order[i].c_str(),
+	      (unsigned long) s.latencies.size(), s.errors, s.failures, s.latencies.size() / elapsed,
+	      s.bytes / elapsed / 1048576.0, s.mean() / 1000.0, s.percentile( 0.5 ) / 1000.0,
+	      s.percentile( 0.9 ) / 1000.0, s.percentile( 0.99 ) / 1000.0, s.percentile( 1.0 ) / 1000.0 );
+    }
+    printf( "\n" );
+    if( metrics ){
+      if( tileHits >= 0 ) printf( "Tile cache hit ratio: %.1f%%\n", tileHits * 100 );
+      if( diskHits >= 0 ) printf( "Disk tile cache hit ratio: %.1f%%\n", diskHits * 100 );
+      if( memcachedHits >= 0 ) printf( "Memcached hit ratio: %.1f%%\n", memcachedHits * 100 );
+    }
+    else printf( "Cache hit ratios unavailable: start iipsrv with METRICS_ENABLED=1 to report these\n" );
+  }
+
+  return 0;
+}
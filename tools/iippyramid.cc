@@ -0,0 +1,459 @@
+/*
+    IIP Server: synthetic tiled pyramidal TIFF generator
+
+    Copyright (C) 2016 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/* Generates tiled multi-resolution TIFF images with deterministic synthetic
+   content for benchmarking and regression testing, so that no external test
+   images are needed. The same options always produce identical pixel data.
+   Each resolution is half the size of the previous one, down to a single tile,
+   unless fewer levels are requested. Images can also be written in strips.
+
+   Usage: iippyramid [options] <output.tif>
+          iippyramid -S <directory>
+
+   -W <n>      image width (default 4000)
+   -H <n>      image height (default 3000)
+   -t <n>      tile size, a multiple of 16 (default 256)
+   -r <n>      write strips of n rows rather than tiles
+   -l <n>      write at most n resolution levels (default all)
+   -c <n>      number of channels (default 3)
+   -b <n>      bits per sample: 1, 8, 16 or 32 (default 8)
+   -f          32 bit floating point rather than integer samples
+   -z <type>   compression: none, deflate, lzw or jpeg (default none)
+   -q <n>      JPEG quality (default 75)
+   -p <type>   photometric interpretation: rgb, minisblack, miniswhite, cielab,
+               ycbcr or palette (default rgb for 3 or more channels and
+               minisblack otherwise)
+   -8          write a BigTIFF
+   -m          add metadata: artist, copyright, description, XMP and sample ranges
+   -s <n>      seed for the synthetic content (default 1)
+
+   -S <dir>    write a standard suite of images into a directory covering each
+               image type handled by TPTImage
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <tiffio.h>
+
+
+using namespace std;
+
+
+
+/// Options for one image
+struct Options {
+  unsigned int width, height, tile, strip, levels;
+  unsigned int channels, bits;
+  bool floating;
+  string compression;
+  int quality;
+  string photometric;
+  bool bigtiff;
+  bool metadata;
+  unsigned int seed;
+
+  Options() : width( 4000 ), height( 3000 ), tile( 256 ), strip( 0 ), levels( 0 ), channels( 3 ), bits( 8 ), floating( false ),
+	      compression( "none" ), quality( 75 ), bigtiff( false ), metadata( false ), seed( 1 ) {};
+};
+
+
+
+/// Deterministic hash of a pixel position used for noise
+static unsigned int pixel_hash( unsigned int x, unsigned int y, unsigned int k, unsigned int seed ){
+  unsigned int h = seed * 0x9E3779B1u;
+  h ^= x * 0x85EBCA77u;
+  h = (h << 13) | (h >> 19);
+  h ^= y * 0xC2B2AE3Du;
+  h = (h << 17) | (h >> 15);
+  h ^= k * 0x27D4EB2Fu;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  return h;
+}
+
+
+
+/// Synthetic content in the range [0,1] at a normalized position in the image
+/** The pattern is defined in terms of the position within the full image so that each
+    resolution looks like a reduced version of the one above. Noise is added so that
+    compression ratios are realistic.
+ */
+static double value( double fx, double fy, unsigned int x, unsigned int y, unsigned int k, unsigned int seed ){
+  double v = 0.35 + 0.3 * (fx + fy) / 2.0
+    + 0.2 * sin( 2.0 * M_PI * ( fx * (4 + k) + seed * 0.1 ) ) * cos( 2.0 * M_PI * fy * (3 + k) )
+    + 0.1 * sin( 40.0 * M_PI * sqrt( (fx-0.5)*(fx-0.5) + (fy-0.5)*(fy-0.5) ) );
+  v += 0.05 * ( pixel_hash( x, y, k, seed ) / 4294967295.0 - 0.5 );
+  return ( v < 0.0 ) ? 0.0 : ( v > 1.0 ) ? 1.0 : v;
+}
+
+
+
+/// Fill a tile or strip buffer of size bw x bh for a given resolution
+static void fillTile( const Options& o, unsigned char* buffer, unsigned int level_width, unsigned int level_height,
+		      unsigned int tx, unsigned int ty, unsigned int bw, unsigned int bh ){
+
+  unsigned int ts = bw;
+  unsigned int bytes = o.bits / 8;
+
+  for( unsigned int j = 0; j < bh; j++ ){
+
+    unsigned int y = ty + j;
+    double fy = (double) y / level_height;
+
+    // Bilevel images are packed 8 pixels per byte with each row starting on a new byte
+    if( o.bits == 1 ){
+      unsigned char* row = buffer + j * ( (ts + 7) / 8 );
+      memset( row, 0, (ts + 7) / 8 );
+      for( unsigned int i = 0; i < ts; i++ ){
+	unsigned int x = tx + i;
+	double v = value( (double) x / level_width, fy, x, y, 0, o.seed );
+	if( v > 0.5 ) row[i/8] |= (unsigned char)( 0x80 >> (i % 8) );
+      }
+      continue;
+    }
+
+    for( unsigned int i = 0; i < ts; i++ ){
+
+      unsigned int x = tx + i;
+      double fx = (double) x / level_width;
+
+      for( unsigned int k = 0; k < o.channels; k++ ){
+
+	double v = value( fx, fy, x, y, k, o.seed );
+	size_t n = ( (size_t) j * ts + i ) * o.channels + k;
+
+	// CIELAB stores a signed a and b
+	if( o.photometric == "cielab" && k > 0 && k < 3 ) v = ( v - 0.5 ) * 0.8;
+
+	if( bytes == 1 ) buffer[n] = (unsigned char)(signed char)( v * 255.0 );
+	else if( bytes == 2 ) ((unsigned short*) buffer)[n] = (unsigned short)( v * 65535.0 );
+	else if( o.floating ) ((float*) buffer)[n] = (float) v;
+	else ((unsigned int*) buffer)[n] = (unsigned int)( v * 4294967295.0 );
+      }
+    }
+  }
+}
+
+
+
+/// Write a pyramid to a file
+/** @return true on success */
+static bool writePyramid( const Options& o, const string& filename ){
+
+  // Check our options
+  if( o.tile == 0 || o.tile % 16 != 0 ){
+    fprintf( stderr, "iippyramid: tile size must be a multiple of 16\n" );
+    return false;
+  }
+  if( o.bits != 1 && o.bits != 8 && o.bits != 16 && o.bits != 32 ){
+    fprintf( stderr, "iippyramid: bits per sample must be 1, 8, 16 or 32\n" );
+    return false;
+  }
+  if( o.bits == 1 && o.channels != 1 ){
+    fprintf( stderr, "iippyramid: bilevel images must have a single channel\n" );
+    return false;
+  }
+  if( o.floating && o.bits != 32 ){
+    fprintf( stderr, "iippyramid: floating point images must be 32 bit\n" );
+    return false;
+  }
+  if( o.compression == "jpeg" && o.bits != 8 ){
+    fprintf( stderr, "iippyramid: JPEG compression requires 8 bit data\n" );
+    return false;
+  }
+
+  string photometric = o.photometric;
+  if( photometric.empty() ) photometric = ( o.channels >= 3 ) ? "rgb" : "minisblack";
+  if( ( photometric == "rgb" || photometric == "cielab" || photometric == "ycbcr" ) && o.channels < 3 ){
+    fprintf( stderr, "iippyramid: %s images need at least 3 channels\n", photometric.c_str() );
+    return false;
+  }
+  if( photometric == "palette" && ( o.channels != 1 || o.bits != 8 ) ){
+    fprintf( stderr, "iippyramid: palette images must be 8 bit with a single channel\n" );
+    return false;
+  }
+  if( photometric == "ycbcr" && ( o.compression != "jpeg" || o.channels != 3 ) ){
+    fprintf( stderr, "iippyramid: YCbCr is only supported for 3 channel JPEG compressed images\n" );
+    return false;
+  }
+
+  uint16 photo;
+  if( photometric == "rgb" ) photo = PHOTOMETRIC_RGB;
+  else if( photometric == "minisblack" ) photo = PHOTOMETRIC_MINISBLACK;
+  else if( photometric == "miniswhite" ) photo = PHOTOMETRIC_MINISWHITE;
+  else if( photometric == "cielab" ) photo = PHOTOMETRIC_CIELAB;
+  else if( photometric == "ycbcr" ) photo = PHOTOMETRIC_YCBCR;
+  else if( photometric == "palette" ) photo = PHOTOMETRIC_PALETTE;
+  else{
+    fprintf( stderr, "iippyramid: unknown photometric interpretation '%s'\n", photometric.c_str() );
+    return false;
+  }
+
+  uint16 compression;
+  if( o.compression == "none" ) compression = COMPRESSION_NONE;
+  else if( o.compression == "deflate" ) compression = COMPRESSION_ADOBE_DEFLATE;
+  else if( o.compression == "lzw" ) compression = COMPRESSION_LZW;
+  else if( o.compression == "jpeg" ) compression = COMPRESSION_JPEG;
+  else{
+    fprintf( stderr, "iippyramid: unknown compression '%s'\n", o.compression.c_str() );
+    return false;
+  }
+
+  TIFF* tiff = TIFFOpen( filename.c_str(), o.bigtiff ? "w8" : "w" );
+  if( !tiff ){
+    fprintf( stderr, "iippyramid: unable to open '%s' for writing\n", filename.c_str() );
+    return false;
+  }
+
+  // Number of channels beyond those implied by the photometric interpretation
+  unsigned int base = ( photo == PHOTOMETRIC_RGB || photo == PHOTOMETRIC_CIELAB || photo == PHOTOMETRIC_YCBCR ) ? 3 : 1;
+  vector<uint16> extra( o.channels - base, (uint16) EXTRASAMPLE_UNSPECIFIED );
+  if( base == 3 && o.channels == 4 ) extra[0] = EXTRASAMPLE_UNASSALPHA;
+
+  // A simple greyscale ramp for palette images
+  vector<uint16> colormap( 3 * 256 );
+  for( unsigned int i = 0; i < 256; i++ ){
+    colormap[i] = (uint16)( i * 257 );
+    colormap[256+i] = (uint16)( (255 - i) * 257 );
+    colormap[512+i] = (uint16)( ( (i * 3) % 256 ) * 257 );
+  }
+
+  // Tiles are o.tile square and strips as wide as the full resolution image
+  unsigned int bw = o.strip ? o.width : o.tile;
+  unsigned int bh = o.strip ? o.strip : o.tile;
+  size_t row_bytes = ( o.bits == 1 ) ? (bw + 7) / 8 : (size_t) bw * o.channels * o.bits / 8;
+  vector<unsigned char> buffer( row_bytes * bh );
+
+  unsigned int w = o.width, h = o.height;
+  unsigned int level = 0;
+
+  while( true ){
+
+    TIFFSetField( tiff, TIFFTAG_SUBFILETYPE, (level > 0) ? FILETYPE_REDUCEDIMAGE : 0 );
+    TIFFSetField( tiff, TIFFTAG_IMAGEWIDTH, w );
+    TIFFSetField( tiff, TIFFTAG_IMAGELENGTH, h );
+    if( o.strip ) TIFFSetField( tiff, TIFFTAG_ROWSPERSTRIP, o.strip );
+    else{
+      TIFFSetField( tiff, TIFFTAG_TILEWIDTH, o.tile );
+      TIFFSetField( tiff, TIFFTAG_TILELENGTH, o.tile );
+    }
+    TIFFSetField( tiff, TIFFTAG_SAMPLESPERPIXEL, o.channels );
+    TIFFSetField( tiff, TIFFTAG_BITSPERSAMPLE, o.bits );
+    TIFFSetField( tiff, TIFFTAG_SAMPLEFORMAT, o.floating ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT );
+    TIFFSetField( tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+    TIFFSetField( tiff, TIFFTAG_PHOTOMETRIC, photo );
+    TIFFSetField( tiff, TIFFTAG_COMPRESSION, compression );
+    TIFFSetField( tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT );
+    if( !extra.empty() ) TIFFSetField( tiff, TIFFTAG_EXTRASAMPLES, (uint16) extra.size(), &extra[0] );
+    if( photo == PHOTOMETRIC_PALETTE ) TIFFSetField( tiff, TIFFTAG_COLORMAP, &colormap[0], &colormap[256], &colormap[512] );
+
+    if( compression == COMPRESSION_JPEG ){
+      TIFFSetField( tiff, TIFFTAG_JPEGQUALITY, o.quality );
+      if( photo == PHOTOMETRIC_YCBCR ) TIFFSetField( tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+    }
+    else if( compression != COMPRESSION_NONE && o.bits >= 8 ){
+      TIFFSetField( tiff, TIFFTAG_PREDICTOR, o.floating ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL );
+    }
+
+    if( level == 0 ){
+      TIFFSetField( tiff, TIFFTAG_SOFTWARE, "iippyramid" );
+      if( o.metadata ){
+	const char* xmp = "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\"/></x:xmpmeta>";
+	TIFFSetField( tiff, TIFFTAG_ARTIST, "IIPImage" );
+	TIFFSetField( tiff, TIFFTAG_COPYRIGHT, "Synthetic test image" );
+	TIFFSetField( tiff, TIFFTAG_IMAGEDESCRIPTION, "Synthetic pyramid generated by iippyramid" );
+	TIFFSetField( tiff, TIFFTAG_DATETIME, "2016:01:01 00:00:00" );
+	TIFFSetField( tiff, TIFFTAG_XMLPACKET, (uint32) strlen( xmp ), xmp );
+      }
+    }
+
+    // Sample ranges are needed to normalize floating point data
+    if( o.floating || o.metadata ){
+      double max = o.floating ? 1.0 : ( o.bits == 1 ) ? 1.0 : pow( 2.0, (double) o.bits ) - 1.0;
+      TIFFSetField( tiff, TIFFTAG_SMINSAMPLEVALUE, 0.0 );
+      TIFFSetField( tiff, TIFFTAG_SMAXSAMPLEVALUE, max );
+    }
+
+    // Write each strip or tile in turn
+    if( o.strip ){
+      tstrip_t s = 0;
+      size_t level_row_bytes = ( o.bits == 1 ) ? (w + 7) / 8 : (size_t) w * o.channels * o.bits / 8;
+      for( unsigned int sy = 0; sy < h; sy += o.strip ){
+	unsigned int rows = ( sy + o.strip > h ) ? h - sy : o.strip;
+	fillTile( o, &buffer[0], w, h, 0, sy, w, rows );
+	if( TIFFWriteEncodedStrip( tiff, s++, &buffer[0], level_row_bytes * rows ) < 0 ){
+	  fprintf( stderr, "iippyramid: error writing strip to '%s'\n", filename.c_str() );
+	  TIFFClose( tiff );
+	  return false;
+	}
+      }
+    }
+    else{
+      ttile_t t = 0;
+      for( unsigned int ty = 0; ty < h; ty += o.tile ){
+	for( unsigned int tx = 0; tx < w; tx += o.tile ){
+	  fillTile( o, &buffer[0], w, h, tx, ty, o.tile, o.tile );
+	  if( TIFFWriteEncodedTile( tiff, t++, &buffer[0], buffer.size() ) < 0 ){
+	    fprintf( stderr, "iippyramid: error writing tile to '%s'\n", filename.c_str() );
+	    TIFFClose( tiff );
+	    return false;
+	  }
+	}
+      }
+    }
+
+    if( !TIFFWriteDirectory( tiff ) ){
+      fprintf( stderr, "iippyramid: error writing directory to '%s'\n", filename.c_str() );
+      TIFFClose( tiff );
+      return false;
+    }
+
+    // Stop once a resolution fits within a single tile or we have enough levels
+    if( w <= o.tile && h <= o.tile ) break;
+    if( o.levels && level + 1 >= o.levels ) break;
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+    level++;
+  }
+
+  TIFFClose( tiff );
+  return true;
+}
+
+
+
+/// Write our standard suite of test images
+static bool writeSuite( const string& directory ){
+
+  struct Entry {
+    const char* name;
+    unsigned int channels, bits;
+    bool floating;
+    const char* compression;
+    const char* photometric;
+    bool bigtiff, metadata;
+    unsigned int strip, levels;   // Rows per strip or 0 for tiles, and levels to write or 0 for all
+  };
+
+  const Entry suite[] = {
+    { "rgb8_jpeg",          3,  8, false, "jpeg",    "ycbcr",      false, true,  0,    0 },
+    { "rgb8_jpeg_rgb",      3,  8, false, "jpeg",    "rgb",        false, false, 0,    0 },
+    { "grey8_jpeg",         1,  8, false, "jpeg",    "minisblack", false, false, 0,    0 },
+    { "rgb8_deflate",       3,  8, false, "deflate", "rgb",        false, false, 0,    0 },
+    { "rgb8_raw",           3,  8, false, "none",    "rgb",        false, false, 0,    0 },
+    { "rgba8_deflate",      4,  8, false, "deflate", "rgb",        false, false, 0,    0 },
+    { "grey8_raw",          1,  8, false, "none",    "minisblack", false, false, 0,    0 },
+    { "grey16_deflate",     1, 16, false, "deflate", "minisblack", false, true,  0,    0 },
+    { "rgb16_lzw",          3, 16, false, "lzw",     "rgb",        false, false, 0,    0 },
+    { "grey32_raw",         1, 32, false, "none",    "minisblack", false, false, 0,    0 },
+    { "grey32f_raw",        1, 32, true,  "none",    "minisblack", false, false, 0,    0 },
+    { "rgb32f_deflate",     3, 32, true,  "deflate", "rgb",        false, false, 0,    0 },
+    { "multiband16_deflate",6, 16, false, "deflate", "minisblack", false, false, 0,    0 },
+    { "cielab8_raw",        3,  8, false, "none",    "cielab",     false, false, 0,    0 },
+    { "bilevel_black",      1,  1, false, "none",    "minisblack", false, false, 0,    0 },
+    { "bilevel_white",      1,  1, false, "deflate", "miniswhite", false, false, 0,    0 },
+    { "palette8_deflate",   1,  8, false, "deflate", "palette",    false, false, 0,    0 },
+    { "rgb8_jpeg_bigtiff",  3,  8, false, "jpeg",    "ycbcr",      true,  false, 0,    0 },
+    { "rgb8_striped",       3,  8, false, "deflate", "rgb",        false, false, 16,   1 },
+    { "grey16_striped",     1, 16, false, "none",    "minisblack", false, false, 1500, 1 },
+    { "bilevel_striped",    1,  1, false, "none",    "minisblack", false, false, 7,    1 },
+    { "rgb8_jpeg_2levels",  3,  8, false, "jpeg",    "ycbcr",      false, false, 0,    2 }
+  };
+
+  bool ok = true;
+  for( unsigned int i = 0; i < sizeof(suite)/sizeof(suite[0]); i++ ){
+    Options o;
+    // Sizes which are not a multiple of the tile size so that edge tiles are covered
+    o.width = 2000;
+    o.height = 1500;
+    o.channels = suite[i].channels;
+    o.bits = suite[i].bits;
+    o.floating = suite[i].floating;
+    o.compression = suite[i].compression;
+    o.photometric = suite[i].photometric;
+    o.bigtiff = suite[i].bigtiff;
+    o.metadata = suite[i].metadata;
+    o.strip = suite[i].strip;
+    o.levels = suite[i].levels;
+    string filename = directory + "/" + suite[i].name + ".tif";
+    if( writePyramid( o, filename ) ) printf( "%s\n", filename.c_str() );
+    else ok = false;
+  }
+  return ok;
+}
+
+
+
+static void usage(){
+  fprintf( stderr, "Usage: iippyramid [-W width] [-H height] [-t tile] [-r rows] [-l levels] [-c channels] [-b bits]\n"
+	   "                  [-f] [-z compression] [-q quality] [-p photometric] [-8] [-m] [-s seed] <output.tif>\n"
+	   "       iippyramid -S <directory>\n" );
+}
+
+
+
+int main( int argc, char* argv[] ){
+
+  Options o;
+  string suite;
+  vector<string> args;
+
+  for( int i = 1; i < argc; i++ ){
+    string arg = argv[i];
+    bool value = ( i+1 < argc );
+    if( arg == "-W" && value ) o.width = atoi( argv[++i] );
+    else if( arg == "-H" && value ) o.height = atoi( argv[++i] );
+    else if( arg == "-t" && value ) o.tile = atoi( argv[++i] );
+    else if( arg == "-r" && value ) o.strip = atoi( argv[++i] );
+    else if( arg == "-l" && value ) o.levels = atoi( argv[++i] );
+    else if( arg == "-c" && value ) o.channels = atoi( argv[++i] );
+    else if( arg == "-b" && value ) o.bits = atoi( argv[++i] );
+    else if( arg == "-f" ) o.floating = true;
+    else if( arg == "-z" && value ) o.compression = argv[++i];
+    else if( arg == "-q" && value ) o.quality = atoi( argv[++i] );
+    else if( arg == "-p" && value ) o.photometric = argv[++i];
+    else if( arg == "-8" ) o.bigtiff = true;
+    else if( arg == "-m" ) o.metadata = true;
+    else if( arg == "-s" && value ) o.seed = atoi( argv[++i] );
+    else if( arg == "-S" && value ) suite = argv[++i];
+    else if( arg.size() > 1 && arg[0] == '-' ){
+      usage();
+      return 1;
+    }
+    else args.push_back( arg );
+  }
+
+  if( !suite.empty() ) return writeSuite( suite ) ? 0 : 1;
+
+  if( args.size() != 1 || o.width == 0 || o.height == 0 || o.channels == 0 ){
+    usage();
+    return 1;
+  }
+
+  return writePyramid( o, args[0] ) ? 0 : 1;
+}